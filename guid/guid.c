@@ -3,6 +3,7 @@
 #include <windows.h>
 #include <audioclient.h>
 #include <dsound.h>
+#include <ksmedia.h>
 #include <mmdeviceapi.h>
 #include <mmreg.h>
 
@@ -0,0 +1,370 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apicap.h"
+#include "config.h"
+#include "trace.h"
+
+#define APICAP_STDIO_BUFSIZE (1 << 20)
+#define APICAP_MIN_NSLOTS 1024
+
+/*  Everything but the enabled flag is under the lock, which every recorded
+    call takes once. hashes is an open-addressed set of the data written so
+    far, with zero marking an empty slot; it outlives the file, so that data
+    is not written again when the engine restarts. */
+
+struct apicap {
+    SRWLOCK lock;
+    FILE *f;
+    char *stdio_buf;
+    int64_t t_start;
+    uint64_t *hashes;
+    size_t nslots;
+    size_t nhashes;
+};
+
+static struct apicap apicap_instance = {
+    .lock = SRWLOCK_INIT,
+};
+
+static atomic_bool apicap_enabled;
+
+/*  Outlives the file, like hashes, since a restarted capture carries on the
+    same timeline. */
+
+static atomic_ullong apicap_seq;
+
+static bool apicap_write(
+        struct apicap *cap,
+        const struct apicap_record *rec,
+        const void *a,
+        size_t na,
+        const void *b,
+        size_t nb);
+static void apicap_close(struct apicap *cap);
+static uint64_t apicap_hash(const void *bytes, size_t nbytes);
+static bool apicap_has(const struct apicap *cap, uint64_t hash);
+static void apicap_insert(struct apicap *cap, uint64_t hash);
+
+HRESULT apicap_start(void)
+{
+    struct apicap *cap;
+    struct apicap_header header;
+    LARGE_INTEGER now;
+    LARGE_INTEGER freq;
+    char path[MAX_PATH];
+    const char *mode;
+    HRESULT hr;
+
+    cap = &apicap_instance;
+
+    if (!config_get_string("API_CAPTURE", path, sizeof(path))) {
+        return S_FALSE;
+    }
+
+    AcquireSRWLockExclusive(&cap->lock);
+
+    assert(cap->f == NULL);
+
+    /*  Only the first start in a process writes a header. After that the
+        timeline carries on from the same t_start. */
+
+    mode = cap->t_start == 0 ? "wb" : "ab";
+
+    if (cap->stdio_buf == NULL) {
+        cap->stdio_buf = malloc(APICAP_STDIO_BUFSIZE);
+
+        if (cap->stdio_buf == NULL) {
+            hr = E_OUTOFMEMORY;
+
+            goto end;
+        }
+    }
+
+    if (fopen_s(&cap->f, path, mode) != 0) {
+        cap->f = NULL;
+        hr = E_FAIL;
+        trace("Could not open \"%s\" for writing", path);
+
+        goto end;
+    }
+
+    setvbuf(cap->f, cap->stdio_buf, _IOFBF, APICAP_STDIO_BUFSIZE);
+
+    if (cap->t_start == 0) {
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&freq);
+
+        memset(&header, 0, sizeof(header));
+        header.magic = APICAP_MAGIC;
+        header.version = APICAP_VERSION;
+        header.freq = freq.QuadPart;
+        header.t_start = now.QuadPart;
+        header.pid = GetCurrentProcessId();
+
+        if (fwrite(&header, sizeof(header), 1, cap->f) != 1) {
+            hr = E_FAIL;
+            trace("Could not write capture header to \"%s\"", path);
+            apicap_close(cap);
+
+            goto end;
+        }
+
+        cap->t_start = now.QuadPart;
+    }
+
+    trace("Capturing API calls to \"%s\"", path);
+    atomic_store(&apicap_enabled, true);
+    hr = S_OK;
+
+end:
+    ReleaseSRWLockExclusive(&cap->lock);
+
+    return hr;
+}
+
+void apicap_stop(void)
+{
+    struct apicap *cap;
+
+    cap = &apicap_instance;
+
+    AcquireSRWLockExclusive(&cap->lock);
+
+    if (cap->f != NULL) {
+        apicap_close(cap);
+    }
+
+    ReleaseSRWLockExclusive(&cap->lock);
+}
+
+bool apicap_is_enabled(void)
+{
+    return atomic_load_explicit(&apicap_enabled, memory_order_relaxed);
+}
+
+uint64_t apicap_reserve_seq(void)
+{
+    return atomic_fetch_add(&apicap_seq, 1) + 1;
+}
+
+void apicap_record(
+        uint8_t kind,
+        uint8_t method,
+        const void *object,
+        uint64_t seq,
+        int64_t t_start,
+        uint32_t result,
+        const void *payload,
+        size_t nbytes,
+        const void *extra,
+        size_t nextra)
+{
+    struct apicap *cap;
+    struct apicap_record rec;
+    LARGE_INTEGER now;
+    int64_t ticks;
+
+    assert(payload != NULL || nbytes == 0);
+    assert(extra != NULL || nextra == 0);
+
+    cap = &apicap_instance;
+    QueryPerformanceCounter(&now);
+    ticks = now.QuadPart - t_start;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.object = (uintptr_t) object;
+    rec.ticks = ticks < UINT32_MAX ? (uint32_t) ticks : UINT32_MAX;
+    rec.thread = GetCurrentThreadId();
+    rec.result = result;
+    rec.nbytes = nbytes + nextra;
+    rec.type = APICAP_TYPE_CALL;
+    rec.kind = kind;
+    rec.method = method;
+
+    AcquireSRWLockExclusive(&cap->lock);
+
+    /*  Taking the place under the lock keeps the file in order, apart from
+        the places reserved ahead of time. */
+
+    if (cap->f != NULL) {
+        rec.seq = seq != 0 ? seq : apicap_reserve_seq();
+        rec.t = t_start > cap->t_start ? t_start - cap->t_start : 0;
+        apicap_write(cap, &rec, payload, nbytes, extra, nextra);
+    }
+
+    ReleaseSRWLockExclusive(&cap->lock);
+}
+
+uint64_t apicap_add_data(const void *bytes, size_t nbytes)
+{
+    struct apicap *cap;
+    struct apicap_record rec;
+    LARGE_INTEGER now;
+    uint64_t hash;
+
+    if (bytes == NULL || nbytes == 0) {
+        return 0;
+    }
+
+    /*  Hash outside the lock, it is the expensive part */
+
+    cap = &apicap_instance;
+    hash = apicap_hash(bytes, nbytes);
+    QueryPerformanceCounter(&now);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.object = hash;
+    rec.nbytes = nbytes;
+    rec.type = APICAP_TYPE_DATA;
+
+    AcquireSRWLockExclusive(&cap->lock);
+
+    if (cap->f != NULL && !apicap_has(cap, hash)) {
+        rec.seq = apicap_reserve_seq();
+        rec.t = now.QuadPart - cap->t_start;
+
+        if (apicap_write(cap, &rec, bytes, nbytes, NULL, 0)) {
+            apicap_insert(cap, hash);
+        }
+    }
+
+    ReleaseSRWLockExclusive(&cap->lock);
+
+    return hash;
+}
+
+static bool apicap_write(
+        struct apicap *cap,
+        const struct apicap_record *rec,
+        const void *a,
+        size_t na,
+        const void *b,
+        size_t nb)
+{
+    bool ok;
+
+    ok = fwrite(rec, sizeof(*rec), 1, cap->f) == 1;
+
+    if (ok && na > 0) {
+        ok = fwrite(a, na, 1, cap->f) == 1;
+    }
+
+    if (ok && nb > 0) {
+        ok = fwrite(b, nb, 1, cap->f) == 1;
+    }
+
+    /*  A capture with a hole in it cannot be replayed, so give up */
+
+    if (!ok) {
+        trace("Could not write API capture, stopping it");
+        apicap_close(cap);
+    }
+
+    return ok;
+}
+
+static void apicap_close(struct apicap *cap)
+{
+    atomic_store(&apicap_enabled, false);
+
+    if (fclose(cap->f) != 0) {
+        trace("Could not finish writing API capture");
+    }
+
+    cap->f = NULL;
+}
+
+static uint64_t apicap_hash(const void *bytes, size_t nbytes)
+{
+    const uint8_t *pos;
+    uint64_t hash;
+    size_t i;
+
+    /*  FNV-1a, with zero kept for "no data" */
+
+    pos = bytes;
+    hash = 0xcbf29ce484222325ULL;
+
+    for (i = 0 ; i < nbytes ; i++) {
+        hash ^= pos[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash != 0 ? hash : 1;
+}
+
+static bool apicap_has(const struct apicap *cap, uint64_t hash)
+{
+    size_t i;
+
+    if (cap->nslots == 0) {
+        return false;
+    }
+
+    i = hash & (cap->nslots - 1);
+
+    while (cap->hashes[i] != 0) {
+        if (cap->hashes[i] == hash) {
+            return true;
+        }
+
+        i = (i + 1) & (cap->nslots - 1);
+    }
+
+    return false;
+}
+
+static void apicap_insert(struct apicap *cap, uint64_t hash)
+{
+    uint64_t *hashes;
+    size_t nslots;
+    size_t i;
+    size_t j;
+
+    /*  Keep it at most half full. If it cannot grow, the data just gets
+        written again the next time it comes round. */
+
+    if ((cap->nhashes + 1) * 2 > cap->nslots) {
+        nslots = cap->nslots > 0 ? cap->nslots * 2 : APICAP_MIN_NSLOTS;
+        hashes = calloc(nslots, sizeof(*hashes));
+
+        if (hashes == NULL) {
+            return;
+        }
+
+        for (i = 0 ; i < cap->nslots ; i++) {
+            if (cap->hashes[i] == 0) {
+                continue;
+            }
+
+            j = cap->hashes[i] & (nslots - 1);
+
+            while (hashes[j] != 0) {
+                j = (j + 1) & (nslots - 1);
+            }
+
+            hashes[j] = cap->hashes[i];
+        }
+
+        free(cap->hashes);
+        cap->hashes = hashes;
+        cap->nslots = nslots;
+    }
+
+    i = hash & (cap->nslots - 1);
+
+    while (cap->hashes[i] != 0) {
+        i = (i + 1) & (cap->nslots - 1);
+    }
+
+    cap->hashes[i] = hash;
+    cap->nhashes++;
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*  Optional capture of every call into the DirectSound interfaces, for
+    replaying a real session's workload against the engine later on. The
+    API profile's wrappers do the recording, so this only sees objects
+    created while capturing. This header is all a reader needs.
+
+    A capture file is an apicap_header followed by records, each an
+    apicap_record followed by nbytes of payload. Records are written as
+    calls return, but must be read in order of seq, which is unique across
+    the capture. A call takes its place when it returns, except for Release,
+    which takes it on the way in: that is where the object can go, and
+    another thread can be handed the same address for a new one before the
+    Release has been written out. Times are in QPC ticks since t_start, at
+    freq per second.
+
+    The bytes handed over by Unlock are written once each, as a data record
+    keyed by a hash of them, ahead of the first call that uses them. A
+    later upload of the same bytes only refers back to it. */
+
+#define APICAP_MAGIC 0x50435348 /* "HSCP" */
+#define APICAP_VERSION 2
+
+enum apicap_type {
+    APICAP_TYPE_CALL = 1,
+    APICAP_TYPE_DATA,
+};
+
+struct apicap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t freq;
+    uint64_t t_start;
+    uint32_t pid;
+    uint32_t reserved;
+};
+
+/*  For a call, object is the interface pointer it was made on, kind and
+    method are an enum apiprof_kind and enum apiprof_method, and result is
+    the HRESULT or reference count it returned. For data, object is the
+    hash of the payload, and nothing else but t is set. */
+
+struct apicap_record {
+    uint64_t object;
+    uint64_t seq;
+    uint64_t t;
+    uint32_t ticks;
+    uint32_t thread;
+    uint32_t result;
+    uint32_t nbytes;
+    uint16_t type;
+    uint8_t kind;
+    uint8_t method;
+    uint32_t reserved;
+};
+
+/*  Payloads, by method. Anything not listed has none.
+
+    CreateSoundBuffer, and a buffer's Initialize: apicap_desc, then the
+        wave format if there was one. For Initialize, out is the
+        IDirectSound it was given.
+    DuplicateSoundBuffer: apicap_duplicate.
+    QueryInterface: apicap_query.
+    IDirectSound8 Initialize: the driver GUID, if there was one.
+    Lock: apicap_lock.
+    Unlock: apicap_unlock.
+    GetCurrentPosition: apicap_position, as returned.
+    SetFormat: the wave format.
+    Everything else that takes or returns one number: a uint32_t. That is
+        the value set or got, the flags for Play, the level for
+        SetCooperativeLevel, dwSize for GetCaps and the size asked for by
+        GetFormat, where zero means the format pointer was NULL. */
+
+struct apicap_desc {
+    uint64_t out;
+    uint32_t size;
+    uint32_t flags;
+    uint32_t nbytes;
+    uint32_t reserved;
+    GUID algorithm;
+};
+
+struct apicap_duplicate {
+    uint64_t src;
+    uint64_t out;
+};
+
+struct apicap_query {
+    uint64_t out;
+    IID iid;
+};
+
+struct apicap_lock {
+    uint32_t pos;
+    uint32_t nbytes;
+    uint32_t flags;
+    uint32_t nlocked;
+};
+
+/*  data is the hash of each part, or zero where there was none */
+
+struct apicap_unlock {
+    uint64_t data[2];
+    uint32_t nbytes[2];
+};
+
+struct apicap_position {
+    uint32_t play;
+    uint32_t write;
+};
+
+/*  Capturing starts and stops with the engine. A process that stops and
+    starts it again carries on writing the same file. */
+
+HRESULT apicap_start(void);
+void apicap_stop(void);
+bool apicap_is_enabled(void);
+
+/*  Take a place in the order of the capture ahead of the call's return,
+    for a call that lets another one go ahead and reuse its object. Places
+    start at 1. */
+
+uint64_t apicap_reserve_seq(void);
+
+/*  Write out one call, started at QPC time t_start and over by now, in the
+    place reserved for it, or if seq is zero, in the next one. */
+
+void apicap_record(
+        uint8_t kind,
+        uint8_t method,
+        const void *object,
+        uint64_t seq,
+        int64_t t_start,
+        uint32_t result,
+        const void *payload,
+        size_t nbytes,
+        const void *extra,
+        size_t nextra);
+
+/*  Write out the given bytes unless the capture already has them, and
+    return the hash to refer to them by. */
+
+uint64_t apicap_add_data(const void *bytes, size_t nbytes);
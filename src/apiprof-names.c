@@ -0,0 +1,42 @@
+#include <windows.h>
+#include <dsound.h>
+
+#include "apiprof.h"
+
+const char *const apiprof_kind_names[APIPROF_NKINDS] = {
+    [APIPROF_KIND_API]          = "IDirectSound8",
+    [APIPROF_KIND_BUFFER]       = "buffer",
+    [APIPROF_KIND_CONVERTED]    = "converted buffer",
+    [APIPROF_KIND_PRIMARY]      = "primary buffer",
+};
+
+const char *const apiprof_method_names[APIPROF_NMETHODS] = {
+    [APIPROF_QUERY_INTERFACE]           = "QueryInterface",
+    [APIPROF_ADD_REF]                   = "AddRef",
+    [APIPROF_RELEASE]                   = "Release",
+    [APIPROF_COMPACT]                   = "Compact",
+    [APIPROF_CREATE_SOUND_BUFFER]       = "CreateSoundBuffer",
+    [APIPROF_DUPLICATE_SOUND_BUFFER]    = "DuplicateSoundBuffer",
+    [APIPROF_GET_CAPS]                  = "GetCaps",
+    [APIPROF_GET_SPEAKER_CONFIG]        = "GetSpeakerConfig",
+    [APIPROF_INITIALIZE]                = "Initialize",
+    [APIPROF_SET_COOPERATIVE_LEVEL]     = "SetCooperativeLevel",
+    [APIPROF_SET_SPEAKER_CONFIG]        = "SetSpeakerConfig",
+    [APIPROF_VERIFY_CERTIFICATION]      = "VerifyCertification",
+    [APIPROF_GET_CURRENT_POSITION]      = "GetCurrentPosition",
+    [APIPROF_GET_FORMAT]                = "GetFormat",
+    [APIPROF_GET_FREQUENCY]             = "GetFrequency",
+    [APIPROF_GET_PAN]                   = "GetPan",
+    [APIPROF_GET_STATUS]                = "GetStatus",
+    [APIPROF_GET_VOLUME]                = "GetVolume",
+    [APIPROF_LOCK]                      = "Lock",
+    [APIPROF_PLAY]                      = "Play",
+    [APIPROF_RESTORE]                   = "Restore",
+    [APIPROF_SET_CURRENT_POSITION]      = "SetCurrentPosition",
+    [APIPROF_SET_FORMAT]                = "SetFormat",
+    [APIPROF_SET_FREQUENCY]             = "SetFrequency",
+    [APIPROF_SET_PAN]                   = "SetPan",
+    [APIPROF_SET_VOLUME]                = "SetVolume",
+    [APIPROF_STOP]                      = "Stop",
+    [APIPROF_UNLOCK]                    = "Unlock",
+};
@@ -0,0 +1,1666 @@
+#include <windows.h>
+#include <dsound.h>
+
+#include <assert.h>
+#include <process.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apicap.h"
+#include "apiprof.h"
+#include "config.h"
+#include "defs.h"
+#include "hr.h"
+#include "trace.h"
+
+/*  Latency histogram buckets: bucket 0 is anything under 128 ns, and each
+    one after that is twice as wide as the last. */
+
+#define APIPROF_NBUCKETS 24
+#define APIPROF_BUCKET0_NS 128
+
+/*  Only ever written by the thread that owns it. The atomics are there so
+    that a dump from another thread reads whole values, not for ordering. */
+
+struct apiprof_counter {
+    atomic_ullong ncalls;
+    atomic_ullong ticks;
+    atomic_ullong ticks_max;
+    atomic_ullong nbytes;
+    atomic_ullong hist[APIPROF_NBUCKETS];
+};
+
+struct apiprof_thread {
+    struct apiprof_thread *next;
+    DWORD id;
+    struct apiprof_counter counters[APIPROF_NKINDS][APIPROF_NMETHODS];
+};
+
+struct apiprof_total {
+    enum apiprof_kind kind;
+    enum apiprof_method method;
+    uint64_t ncalls;
+    uint64_t ticks;
+    uint64_t ticks_max;
+    uint64_t nbytes;
+    uint64_t hist[APIPROF_NBUCKETS];
+};
+
+struct apiprof_api_vtbl {
+    IDirectSound8Vtbl vtbl;
+    IDirectSound8Vtbl *real;
+};
+
+struct apiprof_buffer_vtbl {
+    IDirectSoundBufferVtbl vtbl;
+    IDirectSoundBufferVtbl *real;
+    enum apiprof_kind kind;
+};
+
+static SRWLOCK apiprof_lock = SRWLOCK_INIT;
+static atomic_bool apiprof_enabled;
+static atomic_bool apiprof_profiling;
+static int64_t apiprof_freq;
+static HANDLE apiprof_event;
+static HANDLE apiprof_stop_event;
+static HANDLE apiprof_watcher;
+static _Atomic(struct apiprof_thread *) apiprof_threads;
+static _Thread_local struct apiprof_thread *apiprof_self;
+static _Thread_local void *apiprof_caller;
+static struct apiprof_api_vtbl apiprof_api;
+static struct apiprof_buffer_vtbl apiprof_buffers[APIPROF_NKINDS];
+
+static unsigned int __stdcall apiprof_thread_main(void *ctx);
+static int64_t apiprof_begin(void);
+static void apiprof_end(
+        enum apiprof_kind kind,
+        enum apiprof_method method,
+        int64_t t_start,
+        uint64_t nbytes);
+static void apiprof_add(atomic_ullong *counter, uint64_t value);
+static void apiprof_capture(
+        enum apiprof_kind kind,
+        enum apiprof_method method,
+        const void *com,
+        int64_t t_start,
+        uint32_t result,
+        const void *payload,
+        size_t nbytes);
+static void apiprof_capture_value(
+        enum apiprof_kind kind,
+        enum apiprof_method method,
+        const void *com,
+        int64_t t_start,
+        uint32_t result,
+        uint32_t value);
+static void apiprof_capture_desc(
+        enum apiprof_kind kind,
+        enum apiprof_method method,
+        const void *com,
+        int64_t t_start,
+        uint32_t result,
+        const DSBUFFERDESC *desc,
+        const void *out);
+static uint64_t apiprof_capture_reserve(void);
+static void apiprof_capture_release(
+        enum apiprof_kind kind,
+        const void *com,
+        uint64_t seq,
+        int64_t t_start,
+        uint32_t result);
+static size_t apiprof_format_nbytes(const WAVEFORMATEX *wfx);
+static int apiprof_compare(const void *a, const void *b);
+static void apiprof_write(FILE *f, const char *line);
+static double apiprof_percentile(
+        const struct apiprof_total *total,
+        unsigned int pct);
+static void apiprof_fill_api(struct apiprof_api_vtbl *w);
+static void apiprof_fill_buffer(struct apiprof_buffer_vtbl *w);
+static struct apiprof_api_vtbl *apiprof_api_of(IDirectSound8 *com);
+static struct apiprof_buffer_vtbl *apiprof_buffer_of(IDirectSoundBuffer *com);
+static __stdcall HRESULT apiprof_api_query_interface(
+        IDirectSound8 *com,
+        const IID *iid,
+        void **out);
+static __stdcall ULONG apiprof_api_add_ref(IDirectSound8 *com);
+static __stdcall ULONG apiprof_api_release(IDirectSound8 *com);
+static __stdcall HRESULT apiprof_api_compact(IDirectSound8 *com);
+static __stdcall HRESULT apiprof_api_create_sound_buffer(
+        IDirectSound8 *com,
+        const DSBUFFERDESC *desc,
+        IDirectSoundBuffer **out,
+        IUnknown *outer);
+static __stdcall HRESULT apiprof_api_duplicate_sound_buffer(
+        IDirectSound8 *com,
+        IDirectSoundBuffer *src,
+        IDirectSoundBuffer **out);
+static __stdcall HRESULT apiprof_api_get_caps(
+        IDirectSound8 *com,
+        DSCAPS *caps);
+static __stdcall HRESULT apiprof_api_get_speaker_config(
+        IDirectSound8 *com,
+        DWORD *config);
+static __stdcall HRESULT apiprof_api_initialize(
+        IDirectSound8 *com,
+        const GUID *driver_id);
+static __stdcall HRESULT apiprof_api_set_cooperative_level(
+        IDirectSound8 *com,
+        HWND hwnd,
+        DWORD level);
+static __stdcall HRESULT apiprof_api_set_speaker_config(
+        IDirectSound8 *com,
+        DWORD config);
+static __stdcall HRESULT apiprof_api_verify_certification(
+        IDirectSound8 *com,
+        DWORD *certified);
+static __stdcall HRESULT apiprof_buffer_query_interface(
+        IDirectSoundBuffer *com,
+        const IID *iid,
+        void **out);
+static __stdcall ULONG apiprof_buffer_add_ref(IDirectSoundBuffer *com);
+static __stdcall ULONG apiprof_buffer_release(IDirectSoundBuffer *com);
+static __stdcall HRESULT apiprof_buffer_get_caps(
+        IDirectSoundBuffer *com,
+        DSBCAPS *out);
+static __stdcall HRESULT apiprof_buffer_get_current_position(
+        IDirectSoundBuffer *com,
+        DWORD *play,
+        DWORD *write);
+static __stdcall HRESULT apiprof_buffer_get_format(
+        IDirectSoundBuffer *com,
+        WAVEFORMATEX *out,
+        DWORD nbytes,
+        DWORD *nbytes_out);
+static __stdcall HRESULT apiprof_buffer_get_frequency(
+        IDirectSoundBuffer *com,
+        DWORD *out);
+static __stdcall HRESULT apiprof_buffer_get_pan(
+        IDirectSoundBuffer *com,
+        LONG *out);
+static __stdcall HRESULT apiprof_buffer_get_status(
+        IDirectSoundBuffer *com,
+        DWORD *out);
+static __stdcall HRESULT apiprof_buffer_get_volume(
+        IDirectSoundBuffer *com,
+        LONG *out);
+static __stdcall HRESULT apiprof_buffer_initialize(
+        IDirectSoundBuffer *com,
+        IDirectSound *api,
+        const DSBUFFERDESC *desc);
+static __stdcall HRESULT apiprof_buffer_lock(
+        IDirectSoundBuffer *com,
+        DWORD pos,
+        DWORD nbytes,
+        void **ptr,
+        DWORD *out_nbytes,
+        void **ptr2,
+        DWORD *out_nbytes2,
+        DWORD flags);
+static __stdcall HRESULT apiprof_buffer_play(
+        IDirectSoundBuffer *com,
+        DWORD reserved1,
+        DWORD reserved2,
+        DWORD flags);
+static __stdcall HRESULT apiprof_buffer_restore(IDirectSoundBuffer *com);
+static __stdcall HRESULT apiprof_buffer_set_current_position(
+        IDirectSoundBuffer *com,
+        DWORD pos);
+static __stdcall HRESULT apiprof_buffer_set_format(
+        IDirectSoundBuffer *com,
+        const WAVEFORMATEX *format);
+static __stdcall HRESULT apiprof_buffer_set_frequency(
+        IDirectSoundBuffer *com,
+        DWORD freq);
+static __stdcall HRESULT apiprof_buffer_set_pan(
+        IDirectSoundBuffer *com,
+        LONG pan);
+static __stdcall HRESULT apiprof_buffer_set_volume(
+        IDirectSoundBuffer *com,
+        LONG millibels);
+static __stdcall HRESULT apiprof_buffer_stop(IDirectSoundBuffer *com);
+static __stdcall HRESULT apiprof_buffer_unlock(
+        IDirectSoundBuffer *com,
+        void *bytes,
+        DWORD nbytes,
+        void *bytes2,
+        DWORD nbytes2);
+
+HRESULT apiprof_start(void)
+{
+    LARGE_INTEGER freq;
+    char name[64];
+    HRESULT hr;
+
+    assert(apiprof_watcher == NULL);
+
+    /*  Capturing API calls needs the wrappers but not the profile */
+
+    if (config_get_uint("API_PROFILE", 0) == 0) {
+        if (!apicap_is_enabled()) {
+            return S_FALSE;
+        }
+
+        atomic_store(&apiprof_enabled, true);
+
+        return S_OK;
+    }
+
+    QueryPerformanceFrequency(&freq);
+    apiprof_freq = freq.QuadPart;
+
+    _snprintf_s(
+            name,
+            sizeof(name),
+            sizeof(name) - 1,
+            APIPROF_EVENT_NAME_FORMAT,
+            (unsigned long) GetCurrentProcessId());
+
+    apiprof_event = CreateEventA(NULL, FALSE, FALSE, name);
+
+    if (apiprof_event == NULL) {
+        hr = hr_from_win32();
+        hr_trace("CreateEventA", hr);
+
+        goto fail;
+    }
+
+    apiprof_stop_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    if (apiprof_stop_event == NULL) {
+        hr = hr_from_win32();
+        hr_trace("CreateEvent", hr);
+
+        goto fail;
+    }
+
+    apiprof_watcher = (HANDLE) _beginthreadex(
+            NULL,
+            0,
+            apiprof_thread_main,
+            NULL,
+            0,
+            NULL);
+
+    if (apiprof_watcher == NULL) {
+        hr = hr_from_win32();
+        hr_trace("_beginthreadex", hr);
+
+        goto fail;
+    }
+
+    trace("Profiling API calls, signal %s to dump", name);
+    atomic_store(&apiprof_profiling, true);
+    atomic_store(&apiprof_enabled, true);
+
+    return S_OK;
+
+fail:
+    if (apiprof_stop_event != NULL) {
+        CloseHandle(apiprof_stop_event);
+        apiprof_stop_event = NULL;
+    }
+
+    if (apiprof_event != NULL) {
+        CloseHandle(apiprof_event);
+        apiprof_event = NULL;
+    }
+
+    return hr;
+}
+
+void apiprof_stop(void)
+{
+    DWORD result;
+
+    /*  Objects created from here on get the real vtbls. Any that are still
+        around keep counting, and show up in the next profile if there is
+        one. */
+
+    atomic_store(&apiprof_enabled, false);
+
+    if (apiprof_watcher == NULL) {
+        return;
+    }
+
+    SetEvent(apiprof_stop_event);
+    result = WaitForSingleObject(apiprof_watcher, INFINITE);
+
+    if (result != WAIT_OBJECT_0) {
+        hr_trace("WaitForSingleObject", hr_from_win32());
+        abort();
+    }
+
+    CloseHandle(apiprof_watcher);
+    CloseHandle(apiprof_stop_event);
+    CloseHandle(apiprof_event);
+    apiprof_watcher = NULL;
+    apiprof_stop_event = NULL;
+    apiprof_event = NULL;
+
+    apiprof_dump();
+}
+
+static unsigned int __stdcall apiprof_thread_main(void *ctx)
+{
+    HANDLE handles[2];
+    DWORD result;
+
+    handles[0] = apiprof_stop_event;
+    handles[1] = apiprof_event;
+
+    for (;;) {
+        result = WaitForMultipleObjects(
+                lengthof(handles),
+                handles,
+                FALSE,
+                INFINITE);
+
+        if (result != WAIT_OBJECT_0 + 1) {
+            break;
+        }
+
+        apiprof_dump();
+    }
+
+    return 0;
+}
+
+void apiprof_dump(void)
+{
+    struct apiprof_counter *counter;
+    struct apiprof_thread *thread;
+    struct apiprof_total *totals;
+    struct apiprof_total *total;
+    unsigned int nthreads;
+    uint64_t ticks_max;
+    size_t ntotals;
+    size_t i;
+    size_t j;
+    size_t k;
+    char path[MAX_PATH];
+    char line[256];
+    FILE *f;
+
+    totals = calloc(APIPROF_NKINDS * APIPROF_NMETHODS, sizeof(*totals));
+
+    if (totals == NULL) {
+        return;
+    }
+
+    /*  Threads are only ever added at the head, so whatever we see from
+        here on is a consistent list, if not a complete one. */
+
+    nthreads = 0;
+
+    for (   thread = atomic_load(&apiprof_threads) ;
+            thread != NULL ;
+            thread = thread->next) {
+        nthreads++;
+
+        for (i = 0 ; i < APIPROF_NKINDS ; i++) {
+            for (j = 0 ; j < APIPROF_NMETHODS ; j++) {
+                counter = &thread->counters[i][j];
+                total = &totals[i * APIPROF_NMETHODS + j];
+                total->kind = i;
+                total->method = j;
+                total->ncalls += atomic_load_explicit(
+                        &counter->ncalls,
+                        memory_order_relaxed);
+                total->ticks += atomic_load_explicit(
+                        &counter->ticks,
+                        memory_order_relaxed);
+                total->nbytes += atomic_load_explicit(
+                        &counter->nbytes,
+                        memory_order_relaxed);
+
+                ticks_max = atomic_load_explicit(
+                        &counter->ticks_max,
+                        memory_order_relaxed);
+
+                if (total->ticks_max < ticks_max) {
+                    total->ticks_max = ticks_max;
+                }
+
+                for (k = 0 ; k < APIPROF_NBUCKETS ; k++) {
+                    total->hist[k] += atomic_load_explicit(
+                            &counter->hist[k],
+                            memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    /*  Most expensive first, in total time spent */
+
+    ntotals = APIPROF_NKINDS * APIPROF_NMETHODS;
+    qsort(totals, ntotals, sizeof(*totals), apiprof_compare);
+
+    f = NULL;
+
+    if (config_get_string("API_PROFILE_PATH", path, sizeof(path))) {
+        if (fopen_s(&f, path, "a") != 0) {
+            trace("Could not open %s, writing profile to the debugger", path);
+            f = NULL;
+        }
+    }
+
+    _snprintf_s(
+            line,
+            sizeof(line),
+            sizeof(line) - 1,
+            "API profile, %u threads:\n"
+            "%-18s %-20s %10s %10s %9s %9s %10s %12s\n",
+            nthreads,
+            "object",
+            "method",
+            "calls",
+            "total ms",
+            "p50 us",
+            "p99 us",
+            "max us",
+            "bytes");
+    apiprof_write(f, line);
+
+    for (i = 0 ; i < ntotals && totals[i].ncalls > 0 ; i++) {
+        total = &totals[i];
+        _snprintf_s(
+                line,
+                sizeof(line),
+                sizeof(line) - 1,
+                "%-18s %-20s %10llu %10.3f %9.1f %9.1f %10.1f %12llu\n",
+                apiprof_kind_names[total->kind],
+                apiprof_method_names[total->method],
+                (unsigned long long) total->ncalls,
+                total->ticks * 1000.0 / apiprof_freq,
+                apiprof_percentile(total, 50),
+                apiprof_percentile(total, 99),
+                total->ticks_max * 1e6 / apiprof_freq,
+                (unsigned long long) total->nbytes);
+        apiprof_write(f, line);
+    }
+
+    if (f != NULL) {
+        fclose(f);
+    }
+
+    free(totals);
+}
+
+static int apiprof_compare(const void *a, const void *b)
+{
+    const struct apiprof_total *lhs;
+    const struct apiprof_total *rhs;
+
+    lhs = a;
+    rhs = b;
+
+    if (lhs->ticks != rhs->ticks) {
+        return lhs->ticks > rhs->ticks ? -1 : 1;
+    }
+
+    if (lhs->ncalls != rhs->ncalls) {
+        return lhs->ncalls > rhs->ncalls ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static void apiprof_write(FILE *f, const char *line)
+{
+    if (f != NULL) {
+        fputs(line, f);
+    } else {
+        OutputDebugStringA(line);
+    }
+}
+
+static double apiprof_percentile(
+        const struct apiprof_total *total,
+        unsigned int pct)
+{
+    uint64_t target;
+    uint64_t n;
+    size_t i;
+
+    /*  The upper edge of the bucket it falls in, in microseconds, which
+        makes it an upper bound to within a factor of two. The last bucket
+        has no upper edge, so that is a lower bound instead. */
+
+    target = (total->ncalls * pct + 99) / 100;
+    n = 0;
+
+    for (i = 0 ; i < APIPROF_NBUCKETS - 1 ; i++) {
+        n += total->hist[i];
+
+        if (n >= target) {
+            break;
+        }
+    }
+
+    return ((uint64_t) APIPROF_BUCKET0_NS << i) / 1000.0;
+}
+
+static int64_t apiprof_begin(void)
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+
+    return now.QuadPart;
+}
+
+static void apiprof_end(
+        enum apiprof_kind kind,
+        enum apiprof_method method,
+        int64_t t_start,
+        uint64_t nbytes)
+{
+    struct apiprof_counter *counter;
+    struct apiprof_thread *thread;
+    LARGE_INTEGER now;
+    uint64_t ticks;
+    uint64_t ns;
+    size_t bucket;
+
+    if (!atomic_load_explicit(&apiprof_profiling, memory_order_relaxed)) {
+        return;
+    }
+
+    QueryPerformanceCounter(&now);
+    ticks = now.QuadPart - t_start;
+    thread = apiprof_self;
+
+    /*  First call from this thread. The counters are never freed, so that
+        calls made from threads that have since exited still count. */
+
+    if (thread == NULL) {
+        thread = calloc(1, sizeof(*thread));
+
+        if (thread == NULL) {
+            return;
+        }
+
+        thread->id = GetCurrentThreadId();
+        thread->next = atomic_load(&apiprof_threads);
+
+        while (!atomic_compare_exchange_weak(
+                &apiprof_threads,
+                &thread->next,
+                thread));
+
+        apiprof_self = thread;
+    }
+
+    counter = &thread->counters[kind][method];
+    ns = (uint64_t) (ticks * (1e9 / apiprof_freq));
+    bucket = 0;
+
+    while (bucket < APIPROF_NBUCKETS - 1 &&
+            ns >= ((uint64_t) APIPROF_BUCKET0_NS << bucket)) {
+        bucket++;
+    }
+
+    apiprof_add(&counter->ncalls, 1);
+    apiprof_add(&counter->ticks, ticks);
+    apiprof_add(&counter->nbytes, nbytes);
+    apiprof_add(&counter->hist[bucket], 1);
+
+    if (ticks > atomic_load_explicit(
+            &counter->ticks_max,
+            memory_order_relaxed)) {
+        atomic_store_explicit(
+                &counter->ticks_max,
+                ticks,
+                memory_order_relaxed);
+    }
+}
+
+static void apiprof_add(atomic_ullong *counter, uint64_t value)
+{
+    /*  Single writer, so no need for an interlocked add */
+
+    atomic_store_explicit(
+            counter,
+            atomic_load_explicit(counter, memory_order_relaxed) + value,
+            memory_order_relaxed);
+}
+
+static void apiprof_capture(
+        enum apiprof_kind kind,
+        enum apiprof_method method,
+        const void *com,
+        int64_t t_start,
+        uint32_t result,
+        const void *payload,
+        size_t nbytes)
+{
+    if (!apicap_is_enabled()) {
+        return;
+    }
+
+    apicap_record(
+            kind,
+            method,
+            com,
+            0,
+            t_start,
+            result,
+            payload,
+            nbytes,
+            NULL,
+            0);
+}
+
+static void apiprof_capture_value(
+        enum apiprof_kind kind,
+        enum apiprof_method method,
+        const void *com,
+        int64_t t_start,
+        uint32_t result,
+        uint32_t value)
+{
+    apiprof_capture(kind, method, com, t_start, result, &value, sizeof(value));
+}
+
+static void apiprof_capture_desc(
+        enum apiprof_kind kind,
+        enum apiprof_method method,
+        const void *com,
+        int64_t t_start,
+        uint32_t result,
+        const DSBUFFERDESC *desc,
+        const void *out)
+{
+    struct apicap_desc payload;
+    const WAVEFORMATEX *wfx;
+
+    if (!apicap_is_enabled()) {
+        return;
+    }
+
+    /*  Only read as much of the description as its size says is there */
+
+    memset(&payload, 0, sizeof(payload));
+    payload.out = (uintptr_t) out;
+    wfx = NULL;
+
+    if (desc != NULL && desc->dwSize >= sizeof(DSBUFFERDESC1)) {
+        payload.size = desc->dwSize;
+        payload.flags = desc->dwFlags;
+        payload.nbytes = desc->dwBufferBytes;
+        wfx = desc->lpwfxFormat;
+    }
+
+    if (desc != NULL && desc->dwSize >= sizeof(DSBUFFERDESC)) {
+        payload.algorithm = desc->guid3DAlgorithm;
+    }
+
+    apicap_record(
+            kind,
+            method,
+            com,
+            0,
+            t_start,
+            result,
+            &payload,
+            sizeof(payload),
+            wfx,
+            apiprof_format_nbytes(wfx));
+}
+
+static uint64_t apiprof_capture_reserve(void)
+{
+    if (!apicap_is_enabled()) {
+        return 0;
+    }
+
+    return apicap_reserve_seq();
+}
+
+static void apiprof_capture_release(
+        enum apiprof_kind kind,
+        const void *com,
+        uint64_t seq,
+        int64_t t_start,
+        uint32_t result)
+{
+    /*  Capturing may have started during the call, in which case the
+        Release just takes its place late like any other call. */
+
+    if (!apicap_is_enabled()) {
+        return;
+    }
+
+    apicap_record(
+            kind,
+            APIPROF_RELEASE,
+            com,
+            seq,
+            t_start,
+            result,
+            NULL,
+            0,
+            NULL,
+            0);
+}
+
+static size_t apiprof_format_nbytes(const WAVEFORMATEX *wfx)
+{
+    size_t nbytes;
+
+    /*  cbSize means nothing for PCM, and it is only trusted as far as the
+        largest format we understand anyway */
+
+    if (wfx == NULL) {
+        return 0;
+    }
+
+    if (wfx->wFormatTag == WAVE_FORMAT_PCM) {
+        return sizeof(*wfx);
+    }
+
+    nbytes = sizeof(*wfx) + wfx->cbSize;
+
+    if (nbytes > sizeof(WAVEFORMATEXTENSIBLE)) {
+        nbytes = sizeof(WAVEFORMATEXTENSIBLE);
+    }
+
+    return nbytes;
+}
+
+void *apiprof_get_caller(void)
+{
+    return apiprof_caller;
+}
+
+IDirectSound8Vtbl *apiprof_wrap_api(IDirectSound8Vtbl *vtbl)
+{
+    assert(vtbl != NULL);
+
+    if (!atomic_load(&apiprof_enabled)) {
+        return vtbl;
+    }
+
+    AcquireSRWLockExclusive(&apiprof_lock);
+
+    if (apiprof_api.real == NULL) {
+        apiprof_api.real = vtbl;
+        apiprof_fill_api(&apiprof_api);
+    }
+
+    ReleaseSRWLockExclusive(&apiprof_lock);
+
+    assert(apiprof_api.real == vtbl);
+
+    return &apiprof_api.vtbl;
+}
+
+IDirectSoundBufferVtbl *apiprof_wrap_buffer(
+        IDirectSoundBufferVtbl *vtbl,
+        enum apiprof_kind kind)
+{
+    struct apiprof_buffer_vtbl *w;
+
+    assert(vtbl != NULL);
+    assert(kind != APIPROF_KIND_API && kind < APIPROF_NKINDS);
+
+    if (!atomic_load(&apiprof_enabled)) {
+        return vtbl;
+    }
+
+    w = &apiprof_buffers[kind];
+    AcquireSRWLockExclusive(&apiprof_lock);
+
+    if (w->real == NULL) {
+        w->real = vtbl;
+        w->kind = kind;
+        apiprof_fill_buffer(w);
+    }
+
+    ReleaseSRWLockExclusive(&apiprof_lock);
+
+    assert(w->real == vtbl);
+
+    return &w->vtbl;
+}
+
+static struct apiprof_api_vtbl *apiprof_api_of(IDirectSound8 *com)
+{
+    return containerof(com->lpVtbl, struct apiprof_api_vtbl, vtbl);
+}
+
+static struct apiprof_buffer_vtbl *apiprof_buffer_of(IDirectSoundBuffer *com)
+{
+    return containerof(com->lpVtbl, struct apiprof_buffer_vtbl, vtbl);
+}
+
+static __stdcall HRESULT apiprof_api_query_interface(
+        IDirectSound8 *com,
+        const IID *iid,
+        void **out)
+{
+    struct apicap_query payload;
+    struct apiprof_api_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_api_of(com);
+    t = apiprof_begin();
+    hr = w->real->QueryInterface(com, iid, out);
+    apiprof_end(APIPROF_KIND_API, APIPROF_QUERY_INTERFACE, t, 0);
+
+    memset(&payload, 0, sizeof(payload));
+
+    if (SUCCEEDED(hr) && out != NULL) {
+        payload.out = (uintptr_t) *out;
+    }
+
+    if (iid != NULL) {
+        payload.iid = *iid;
+    }
+
+    apiprof_capture(
+            APIPROF_KIND_API,
+            APIPROF_QUERY_INTERFACE,
+            com,
+            t,
+            hr,
+            &payload,
+            sizeof(payload));
+
+    return hr;
+}
+
+static __stdcall ULONG apiprof_api_add_ref(IDirectSound8 *com)
+{
+    struct apiprof_api_vtbl *w;
+    int64_t t;
+    ULONG r;
+
+    w = apiprof_api_of(com);
+    t = apiprof_begin();
+    r = w->real->AddRef(com);
+    apiprof_end(APIPROF_KIND_API, APIPROF_ADD_REF, t, 0);
+    apiprof_capture(APIPROF_KIND_API, APIPROF_ADD_REF, com, t, r, NULL, 0);
+
+    return r;
+}
+
+static __stdcall ULONG apiprof_api_release(IDirectSound8 *com)
+{
+    struct apiprof_api_vtbl *w;
+    uint64_t seq;
+    int64_t t;
+    ULONG r;
+
+    w = apiprof_api_of(com);
+    t = apiprof_begin();
+    seq = apiprof_capture_reserve();
+    r = w->real->Release(com);
+    apiprof_end(APIPROF_KIND_API, APIPROF_RELEASE, t, 0);
+    apiprof_capture_release(APIPROF_KIND_API, com, seq, t, r);
+
+    return r;
+}
+
+static __stdcall HRESULT apiprof_api_compact(IDirectSound8 *com)
+{
+    struct apiprof_api_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_api_of(com);
+    t = apiprof_begin();
+    hr = w->real->Compact(com);
+    apiprof_end(APIPROF_KIND_API, APIPROF_COMPACT, t, 0);
+    apiprof_capture(APIPROF_KIND_API, APIPROF_COMPACT, com, t, hr, NULL, 0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_api_create_sound_buffer(
+        IDirectSound8 *com,
+        const DSBUFFERDESC *desc,
+        IDirectSoundBuffer **out,
+        IUnknown *outer)
+{
+    struct apiprof_api_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_api_of(com);
+    t = apiprof_begin();
+    apiprof_caller = __builtin_return_address(0);
+    hr = w->real->CreateSoundBuffer(com, desc, out, outer);
+    apiprof_caller = NULL;
+    apiprof_end(APIPROF_KIND_API, APIPROF_CREATE_SOUND_BUFFER, t, 0);
+    apiprof_capture_desc(
+            APIPROF_KIND_API,
+            APIPROF_CREATE_SOUND_BUFFER,
+            com,
+            t,
+            hr,
+            desc,
+            SUCCEEDED(hr) && out != NULL ? *out : NULL);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_api_duplicate_sound_buffer(
+        IDirectSound8 *com,
+        IDirectSoundBuffer *src,
+        IDirectSoundBuffer **out)
+{
+    struct apicap_duplicate payload;
+    struct apiprof_api_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_api_of(com);
+    t = apiprof_begin();
+    apiprof_caller = __builtin_return_address(0);
+    hr = w->real->DuplicateSoundBuffer(com, src, out);
+    apiprof_caller = NULL;
+    apiprof_end(APIPROF_KIND_API, APIPROF_DUPLICATE_SOUND_BUFFER, t, 0);
+
+    payload.src = (uintptr_t) src;
+    payload.out = (uintptr_t) (SUCCEEDED(hr) && out != NULL ? *out : NULL);
+    apiprof_capture(
+            APIPROF_KIND_API,
+            APIPROF_DUPLICATE_SOUND_BUFFER,
+            com,
+            t,
+            hr,
+            &payload,
+            sizeof(payload));
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_api_get_caps(
+        IDirectSound8 *com,
+        DSCAPS *caps)
+{
+    struct apiprof_api_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_api_of(com);
+    t = apiprof_begin();
+    hr = w->real->GetCaps(com, caps);
+    apiprof_end(APIPROF_KIND_API, APIPROF_GET_CAPS, t, 0);
+    apiprof_capture_value(
+            APIPROF_KIND_API,
+            APIPROF_GET_CAPS,
+            com,
+            t,
+            hr,
+            caps != NULL ? caps->dwSize : 0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_api_get_speaker_config(
+        IDirectSound8 *com,
+        DWORD *config)
+{
+    struct apiprof_api_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_api_of(com);
+    t = apiprof_begin();
+    hr = w->real->GetSpeakerConfig(com, config);
+    apiprof_end(APIPROF_KIND_API, APIPROF_GET_SPEAKER_CONFIG, t, 0);
+    apiprof_capture_value(
+            APIPROF_KIND_API,
+            APIPROF_GET_SPEAKER_CONFIG,
+            com,
+            t,
+            hr,
+            SUCCEEDED(hr) && config != NULL ? *config : 0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_api_initialize(
+        IDirectSound8 *com,
+        const GUID *driver_id)
+{
+    struct apiprof_api_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_api_of(com);
+    t = apiprof_begin();
+    hr = w->real->Initialize(com, driver_id);
+    apiprof_end(APIPROF_KIND_API, APIPROF_INITIALIZE, t, 0);
+    apiprof_capture(
+            APIPROF_KIND_API,
+            APIPROF_INITIALIZE,
+            com,
+            t,
+            hr,
+            driver_id,
+            driver_id != NULL ? sizeof(*driver_id) : 0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_api_set_cooperative_level(
+        IDirectSound8 *com,
+        HWND hwnd,
+        DWORD level)
+{
+    struct apiprof_api_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_api_of(com);
+    t = apiprof_begin();
+    hr = w->real->SetCooperativeLevel(com, hwnd, level);
+    apiprof_end(APIPROF_KIND_API, APIPROF_SET_COOPERATIVE_LEVEL, t, 0);
+    apiprof_capture_value(
+            APIPROF_KIND_API,
+            APIPROF_SET_COOPERATIVE_LEVEL,
+            com,
+            t,
+            hr,
+            level);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_api_set_speaker_config(
+        IDirectSound8 *com,
+        DWORD config)
+{
+    struct apiprof_api_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_api_of(com);
+    t = apiprof_begin();
+    hr = w->real->SetSpeakerConfig(com, config);
+    apiprof_end(APIPROF_KIND_API, APIPROF_SET_SPEAKER_CONFIG, t, 0);
+    apiprof_capture_value(
+            APIPROF_KIND_API,
+            APIPROF_SET_SPEAKER_CONFIG,
+            com,
+            t,
+            hr,
+            config);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_api_verify_certification(
+        IDirectSound8 *com,
+        DWORD *certified)
+{
+    struct apiprof_api_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_api_of(com);
+    t = apiprof_begin();
+    hr = w->real->VerifyCertification(com, certified);
+    apiprof_end(APIPROF_KIND_API, APIPROF_VERIFY_CERTIFICATION, t, 0);
+    apiprof_capture(
+            APIPROF_KIND_API,
+            APIPROF_VERIFY_CERTIFICATION,
+            com,
+            t,
+            hr,
+            NULL,
+            0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_query_interface(
+        IDirectSoundBuffer *com,
+        const IID *iid,
+        void **out)
+{
+    struct apicap_query payload;
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->QueryInterface(com, iid, out);
+    apiprof_end(w->kind, APIPROF_QUERY_INTERFACE, t, 0);
+
+    memset(&payload, 0, sizeof(payload));
+
+    if (SUCCEEDED(hr) && out != NULL) {
+        payload.out = (uintptr_t) *out;
+    }
+
+    if (iid != NULL) {
+        payload.iid = *iid;
+    }
+
+    apiprof_capture(
+            w->kind,
+            APIPROF_QUERY_INTERFACE,
+            com,
+            t,
+            hr,
+            &payload,
+            sizeof(payload));
+
+    return hr;
+}
+
+static __stdcall ULONG apiprof_buffer_add_ref(IDirectSoundBuffer *com)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    ULONG r;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    r = w->real->AddRef(com);
+    apiprof_end(w->kind, APIPROF_ADD_REF, t, 0);
+    apiprof_capture(w->kind, APIPROF_ADD_REF, com, t, r, NULL, 0);
+
+    return r;
+}
+
+static __stdcall ULONG apiprof_buffer_release(IDirectSoundBuffer *com)
+{
+    struct apiprof_buffer_vtbl *w;
+    uint64_t seq;
+    int64_t t;
+    ULONG r;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    seq = apiprof_capture_reserve();
+    r = w->real->Release(com);
+    apiprof_end(w->kind, APIPROF_RELEASE, t, 0);
+    apiprof_capture_release(w->kind, com, seq, t, r);
+
+    return r;
+}
+
+static __stdcall HRESULT apiprof_buffer_get_caps(
+        IDirectSoundBuffer *com,
+        DSBCAPS *out)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->GetCaps(com, out);
+    apiprof_end(w->kind, APIPROF_GET_CAPS, t, 0);
+    apiprof_capture_value(
+            w->kind,
+            APIPROF_GET_CAPS,
+            com,
+            t,
+            hr,
+            out != NULL ? out->dwSize : 0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_get_current_position(
+        IDirectSoundBuffer *com,
+        DWORD *play,
+        DWORD *write)
+{
+    struct apicap_position payload;
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->GetCurrentPosition(com, play, write);
+    apiprof_end(w->kind, APIPROF_GET_CURRENT_POSITION, t, 0);
+
+    payload.play = SUCCEEDED(hr) && play != NULL ? *play : 0;
+    payload.write = SUCCEEDED(hr) && write != NULL ? *write : 0;
+    apiprof_capture(
+            w->kind,
+            APIPROF_GET_CURRENT_POSITION,
+            com,
+            t,
+            hr,
+            &payload,
+            sizeof(payload));
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_get_format(
+        IDirectSoundBuffer *com,
+        WAVEFORMATEX *out,
+        DWORD nbytes,
+        DWORD *nbytes_out)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->GetFormat(com, out, nbytes, nbytes_out);
+    apiprof_end(w->kind, APIPROF_GET_FORMAT, t, 0);
+    apiprof_capture_value(
+            w->kind,
+            APIPROF_GET_FORMAT,
+            com,
+            t,
+            hr,
+            out != NULL ? nbytes : 0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_get_frequency(
+        IDirectSoundBuffer *com,
+        DWORD *out)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->GetFrequency(com, out);
+    apiprof_end(w->kind, APIPROF_GET_FREQUENCY, t, 0);
+    apiprof_capture_value(
+            w->kind,
+            APIPROF_GET_FREQUENCY,
+            com,
+            t,
+            hr,
+            SUCCEEDED(hr) && out != NULL ? *out : 0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_get_pan(
+        IDirectSoundBuffer *com,
+        LONG *out)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->GetPan(com, out);
+    apiprof_end(w->kind, APIPROF_GET_PAN, t, 0);
+    apiprof_capture_value(
+            w->kind,
+            APIPROF_GET_PAN,
+            com,
+            t,
+            hr,
+            SUCCEEDED(hr) && out != NULL ? *out : 0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_get_status(
+        IDirectSoundBuffer *com,
+        DWORD *out)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->GetStatus(com, out);
+    apiprof_end(w->kind, APIPROF_GET_STATUS, t, 0);
+    apiprof_capture_value(
+            w->kind,
+            APIPROF_GET_STATUS,
+            com,
+            t,
+            hr,
+            SUCCEEDED(hr) && out != NULL ? *out : 0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_get_volume(
+        IDirectSoundBuffer *com,
+        LONG *out)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->GetVolume(com, out);
+    apiprof_end(w->kind, APIPROF_GET_VOLUME, t, 0);
+    apiprof_capture_value(
+            w->kind,
+            APIPROF_GET_VOLUME,
+            com,
+            t,
+            hr,
+            SUCCEEDED(hr) && out != NULL ? *out : 0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_initialize(
+        IDirectSoundBuffer *com,
+        IDirectSound *api,
+        const DSBUFFERDESC *desc)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->Initialize(com, api, desc);
+    apiprof_end(w->kind, APIPROF_INITIALIZE, t, 0);
+    apiprof_capture_desc(w->kind, APIPROF_INITIALIZE, com, t, hr, desc, api);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_lock(
+        IDirectSoundBuffer *com,
+        DWORD pos,
+        DWORD nbytes,
+        void **ptr,
+        DWORD *out_nbytes,
+        void **ptr2,
+        DWORD *out_nbytes2,
+        DWORD flags)
+{
+    struct apicap_lock payload;
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    uint64_t nmoved;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->Lock(
+            com,
+            pos,
+            nbytes,
+            ptr,
+            out_nbytes,
+            ptr2,
+            out_nbytes2,
+            flags);
+
+    /*  Only what was actually handed over counts */
+
+    nmoved = 0;
+
+    if (SUCCEEDED(hr) && out_nbytes != NULL) {
+        nmoved += *out_nbytes;
+    }
+
+    if (SUCCEEDED(hr) && out_nbytes2 != NULL) {
+        nmoved += *out_nbytes2;
+    }
+
+    apiprof_end(w->kind, APIPROF_LOCK, t, nmoved);
+
+    payload.pos = pos;
+    payload.nbytes = nbytes;
+    payload.flags = flags;
+    payload.nlocked = nmoved;
+    apiprof_capture(
+            w->kind,
+            APIPROF_LOCK,
+            com,
+            t,
+            hr,
+            &payload,
+            sizeof(payload));
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_play(
+        IDirectSoundBuffer *com,
+        DWORD reserved1,
+        DWORD reserved2,
+        DWORD flags)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->Play(com, reserved1, reserved2, flags);
+    apiprof_end(w->kind, APIPROF_PLAY, t, 0);
+    apiprof_capture_value(w->kind, APIPROF_PLAY, com, t, hr, flags);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_restore(IDirectSoundBuffer *com)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->Restore(com);
+    apiprof_end(w->kind, APIPROF_RESTORE, t, 0);
+    apiprof_capture(w->kind, APIPROF_RESTORE, com, t, hr, NULL, 0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_set_current_position(
+        IDirectSoundBuffer *com,
+        DWORD pos)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->SetCurrentPosition(com, pos);
+    apiprof_end(w->kind, APIPROF_SET_CURRENT_POSITION, t, 0);
+    apiprof_capture_value(
+            w->kind,
+            APIPROF_SET_CURRENT_POSITION,
+            com,
+            t,
+            hr,
+            pos);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_set_format(
+        IDirectSoundBuffer *com,
+        const WAVEFORMATEX *format)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->SetFormat(com, format);
+    apiprof_end(w->kind, APIPROF_SET_FORMAT, t, 0);
+    apiprof_capture(
+            w->kind,
+            APIPROF_SET_FORMAT,
+            com,
+            t,
+            hr,
+            format,
+            apiprof_format_nbytes(format));
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_set_frequency(
+        IDirectSoundBuffer *com,
+        DWORD freq)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->SetFrequency(com, freq);
+    apiprof_end(w->kind, APIPROF_SET_FREQUENCY, t, 0);
+    apiprof_capture_value(w->kind, APIPROF_SET_FREQUENCY, com, t, hr, freq);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_set_pan(
+        IDirectSoundBuffer *com,
+        LONG pan)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->SetPan(com, pan);
+    apiprof_end(w->kind, APIPROF_SET_PAN, t, 0);
+    apiprof_capture_value(w->kind, APIPROF_SET_PAN, com, t, hr, pan);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_set_volume(
+        IDirectSoundBuffer *com,
+        LONG millibels)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->SetVolume(com, millibels);
+    apiprof_end(w->kind, APIPROF_SET_VOLUME, t, 0);
+    apiprof_capture_value(w->kind, APIPROF_SET_VOLUME, com, t, hr, millibels);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_stop(IDirectSoundBuffer *com)
+{
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+    t = apiprof_begin();
+    hr = w->real->Stop(com);
+    apiprof_end(w->kind, APIPROF_STOP, t, 0);
+    apiprof_capture(w->kind, APIPROF_STOP, com, t, hr, NULL, 0);
+
+    return hr;
+}
+
+static __stdcall HRESULT apiprof_buffer_unlock(
+        IDirectSoundBuffer *com,
+        void *bytes,
+        DWORD nbytes,
+        void *bytes2,
+        DWORD nbytes2)
+{
+    struct apicap_unlock payload;
+    struct apiprof_buffer_vtbl *w;
+    int64_t t;
+    HRESULT hr;
+
+    w = apiprof_buffer_of(com);
+
+    /*  Hash what is handed over while it is still there, and before the
+        call is timed */
+
+    memset(&payload, 0, sizeof(payload));
+
+    if (apicap_is_enabled()) {
+        payload.data[0] = apicap_add_data(bytes, nbytes);
+        payload.data[1] = apicap_add_data(bytes2, nbytes2);
+        payload.nbytes[0] = nbytes;
+        payload.nbytes[1] = nbytes2;
+    }
+
+    t = apiprof_begin();
+    hr = w->real->Unlock(com, bytes, nbytes, bytes2, nbytes2);
+    apiprof_end(w->kind, APIPROF_UNLOCK, t, (uint64_t) nbytes + nbytes2);
+    apiprof_capture(
+            w->kind,
+            APIPROF_UNLOCK,
+            com,
+            t,
+            hr,
+            &payload,
+            sizeof(payload));
+
+    return hr;
+}
+
+static void apiprof_fill_api(struct apiprof_api_vtbl *w)
+{
+    w->vtbl.QueryInterface = apiprof_api_query_interface;
+    w->vtbl.AddRef = apiprof_api_add_ref;
+    w->vtbl.Release = apiprof_api_release;
+    w->vtbl.Compact = apiprof_api_compact;
+    w->vtbl.CreateSoundBuffer = apiprof_api_create_sound_buffer;
+    w->vtbl.DuplicateSoundBuffer = apiprof_api_duplicate_sound_buffer;
+    w->vtbl.GetCaps = apiprof_api_get_caps;
+    w->vtbl.GetSpeakerConfig = apiprof_api_get_speaker_config;
+    w->vtbl.Initialize = apiprof_api_initialize;
+    w->vtbl.SetCooperativeLevel = apiprof_api_set_cooperative_level;
+    w->vtbl.SetSpeakerConfig = apiprof_api_set_speaker_config;
+    w->vtbl.VerifyCertification = apiprof_api_verify_certification;
+}
+
+static void apiprof_fill_buffer(struct apiprof_buffer_vtbl *w)
+{
+    w->vtbl.QueryInterface = apiprof_buffer_query_interface;
+    w->vtbl.AddRef = apiprof_buffer_add_ref;
+    w->vtbl.Release = apiprof_buffer_release;
+    w->vtbl.GetCaps = apiprof_buffer_get_caps;
+    w->vtbl.GetCurrentPosition = apiprof_buffer_get_current_position;
+    w->vtbl.GetFormat = apiprof_buffer_get_format;
+    w->vtbl.GetFrequency = apiprof_buffer_get_frequency;
+    w->vtbl.GetPan = apiprof_buffer_get_pan;
+    w->vtbl.GetStatus = apiprof_buffer_get_status;
+    w->vtbl.GetVolume = apiprof_buffer_get_volume;
+    w->vtbl.Initialize = apiprof_buffer_initialize;
+    w->vtbl.Lock = apiprof_buffer_lock;
+    w->vtbl.Play = apiprof_buffer_play;
+    w->vtbl.Restore = apiprof_buffer_restore;
+    w->vtbl.SetCurrentPosition = apiprof_buffer_set_current_position;
+    w->vtbl.SetFormat = apiprof_buffer_set_format;
+    w->vtbl.SetFrequency = apiprof_buffer_set_frequency;
+    w->vtbl.SetPan = apiprof_buffer_set_pan;
+    w->vtbl.SetVolume = apiprof_buffer_set_volume;
+    w->vtbl.Stop = apiprof_buffer_stop;
+    w->vtbl.Unlock = apiprof_buffer_unlock;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <windows.h>
+#include <dsound.h>
+
+/*  Optional per-method profile of the DirectSound API. When enabled, objects
+    get a vtbl of wrappers that time each call into the real one and count
+    the bytes that Lock and Unlock hand over. Each calling thread keeps its
+    own counters, so recording takes no locks; they are only added up when
+    the profile is written out. That happens when the engine shuts down, and
+    whenever the named event Local\hypersonik-apiprof-<pid> is signalled.
+    Capturing API calls, see apicap.h, uses the same wrappers. */
+
+enum apiprof_kind {
+    APIPROF_KIND_API,
+    APIPROF_KIND_BUFFER,
+    APIPROF_KIND_CONVERTED,
+    APIPROF_KIND_PRIMARY,
+    APIPROF_NKINDS,
+};
+
+/*  API captures store these, so new ones only ever go at the end */
+
+enum apiprof_method {
+    APIPROF_QUERY_INTERFACE,
+    APIPROF_ADD_REF,
+    APIPROF_RELEASE,
+    APIPROF_COMPACT,
+    APIPROF_CREATE_SOUND_BUFFER,
+    APIPROF_DUPLICATE_SOUND_BUFFER,
+    APIPROF_GET_CAPS,
+    APIPROF_GET_SPEAKER_CONFIG,
+    APIPROF_INITIALIZE,
+    APIPROF_SET_COOPERATIVE_LEVEL,
+    APIPROF_SET_SPEAKER_CONFIG,
+    APIPROF_VERIFY_CERTIFICATION,
+    APIPROF_GET_CURRENT_POSITION,
+    APIPROF_GET_FORMAT,
+    APIPROF_GET_FREQUENCY,
+    APIPROF_GET_PAN,
+    APIPROF_GET_STATUS,
+    APIPROF_GET_VOLUME,
+    APIPROF_LOCK,
+    APIPROF_PLAY,
+    APIPROF_RESTORE,
+    APIPROF_SET_CURRENT_POSITION,
+    APIPROF_SET_FORMAT,
+    APIPROF_SET_FREQUENCY,
+    APIPROF_SET_PAN,
+    APIPROF_SET_VOLUME,
+    APIPROF_STOP,
+    APIPROF_UNLOCK,
+    APIPROF_NMETHODS,
+};
+
+/*  What the profile calls each kind and method. The replay tool reads
+    captures with these too, so they live on their own. */
+
+extern const char *const apiprof_kind_names[APIPROF_NKINDS];
+extern const char *const apiprof_method_names[APIPROF_NMETHODS];
+
+#define APIPROF_EVENT_NAME_FORMAT "Local\\hypersonik-apiprof-%lu"
+
+HRESULT apiprof_start(void);
+void apiprof_stop(void);
+void apiprof_dump(void);
+
+/*  Return the vtbl an object of the given kind should get: the one passed
+    in, or if profiling or capturing is on, the wrappers around it. */
+
+IDirectSound8Vtbl *apiprof_wrap_api(IDirectSound8Vtbl *vtbl);
+
+/*  Inside a wrapped call that creates a buffer, where the application
+    called it from, since the real method only sees the wrapper as its
+    caller. NULL anywhere else. */
+
+void *apiprof_get_caller(void);
+IDirectSoundBufferVtbl *apiprof_wrap_buffer(
+        IDirectSoundBufferVtbl *vtbl,
+        enum apiprof_kind kind);
@@ -0,0 +1,255 @@
+#include <windows.h>
+#include <mmreg.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "backend.h"
+#include "defs.h"
+#include "hr.h"
+#include "memstat.h"
+#include "trace.h"
+
+/*  Discards the mixer's output. When paced, periods come at the rate a real
+    device would consume them; when not, the engine runs flat out, which is
+    what we want for measuring mixer throughput. */
+
+struct backend_null {
+    struct backend base;
+    struct backend_clock clk;
+    void *frames;
+    bool paced;
+    size_t nframes_pending;
+    uint64_t nframes_total;
+    int64_t nticks_running;
+    LARGE_INTEGER t_start;
+    bool running;
+};
+
+static struct backend_null *backend_null_downcast(struct backend *be);
+static void backend_null_free(struct backend *be);
+static HRESULT backend_null_start(struct backend *be);
+static void backend_null_stop(struct backend *be);
+static HRESULT backend_null_wait(struct backend *be, HANDLE stop);
+static HRESULT backend_null_get_avail(struct backend *be, size_t *nframes);
+static HRESULT backend_null_get_buffer(
+        struct backend *be,
+        void **frames,
+        size_t nframes);
+static HRESULT backend_null_release_buffer(struct backend *be);
+static HRESULT backend_null_set_rate(struct backend *be, unsigned int rate);
+
+static const struct backend_vtbl backend_null_vtbl = {
+    .free           = backend_null_free,
+    .start          = backend_null_start,
+    .stop           = backend_null_stop,
+    .wait           = backend_null_wait,
+    .get_avail      = backend_null_get_avail,
+    .get_buffer     = backend_null_get_buffer,
+    .release_buffer = backend_null_release_buffer,
+    .set_rate       = backend_null_set_rate,
+};
+
+HRESULT backend_null_alloc(
+        struct backend **out,
+        const WAVEFORMATEX *wfx,
+        size_t nframes,
+        bool paced)
+{
+    struct backend_null *self;
+    HRESULT hr;
+
+    assert(out != NULL);
+    assert(wfx != NULL);
+    assert(nframes > 0);
+
+    *out = NULL;
+    self = memstat_calloc(1, sizeof(*self));
+
+    if (self == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    self->base.vtbl = &backend_null_vtbl;
+    self->base.name = paced ? "null" : "benchmark";
+    self->base.nframes = nframes;
+    self->base.period = nframes;
+    self->base.max_period = nframes;
+    self->base.nlevels = 1;
+    self->base.nchannels = wfx->nChannels;
+    self->base.rate = wfx->nSamplesPerSec;
+    self->base.format = SND_FORMAT_S16;
+    self->paced = paced;
+    self->frames = memstat_calloc(nframes, wfx->nBlockAlign);
+
+    if (self->frames == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    if (paced) {
+        hr = backend_clock_init(&self->clk, nframes, wfx->nSamplesPerSec);
+
+        if (FAILED(hr)) {
+            goto end;
+        }
+    }
+
+    *out = &self->base;
+    self = NULL;
+    hr = S_OK;
+
+end:
+    if (self != NULL) {
+        backend_null_free(&self->base);
+    }
+
+    return hr;
+}
+
+static struct backend_null *backend_null_downcast(struct backend *be)
+{
+    assert(be != NULL);
+    assert(be->vtbl == &backend_null_vtbl);
+
+    return containerof(be, struct backend_null, base);
+}
+
+static void backend_null_free(struct backend *be)
+{
+    struct backend_null *self;
+    LARGE_INTEGER freq;
+    double elapsed;
+    double audio;
+
+    self = backend_null_downcast(be);
+
+    /*  Only time spent running counts, so that the engine sitting idle
+        does not drag the real-time factor down. */
+
+    if (self->nticks_running > 0) {
+        QueryPerformanceFrequency(&freq);
+        elapsed = self->nticks_running / (double) freq.QuadPart;
+        audio = self->nframes_total / (double) self->base.rate;
+
+        trace(  "%s backend rendered %.3f sec of audio in %.3f sec (%.1fx)",
+                self->base.name,
+                audio,
+                elapsed,
+                elapsed > 0 ? audio / elapsed : 0.0);
+    }
+
+    backend_clock_fini(&self->clk);
+    free(self->frames);
+    free(self);
+}
+
+static HRESULT backend_null_start(struct backend *be)
+{
+    struct backend_null *self;
+
+    self = backend_null_downcast(be);
+
+    if (self->paced) {
+        backend_clock_start(&self->clk);
+    }
+
+    QueryPerformanceCounter(&self->t_start);
+    self->running = true;
+
+    return S_OK;
+}
+
+static void backend_null_stop(struct backend *be)
+{
+    struct backend_null *self;
+    LARGE_INTEGER t_stop;
+
+    self = backend_null_downcast(be);
+
+    if (!self->running) {
+        return;
+    }
+
+    QueryPerformanceCounter(&t_stop);
+    self->nticks_running += t_stop.QuadPart - self->t_start.QuadPart;
+    self->running = false;
+}
+
+static HRESULT backend_null_wait(struct backend *be, HANDLE stop)
+{
+    struct backend_null *self;
+    uint32_t wait_result;
+    HRESULT hr;
+
+    self = backend_null_downcast(be);
+
+    if (self->paced) {
+        return backend_clock_wait(&self->clk, stop);
+    }
+
+    wait_result = WaitForSingleObject(stop, 0);
+
+    if (wait_result == WAIT_OBJECT_0) {
+        return S_FALSE;
+    } else if (wait_result == WAIT_TIMEOUT) {
+        return S_OK;
+    } else {
+        hr = hr_from_win32();
+        hr_trace("WaitForSingleObject", hr);
+
+        return hr;
+    }
+}
+
+static HRESULT backend_null_get_avail(struct backend *be, size_t *nframes)
+{
+    *nframes = be->nframes;
+
+    return S_OK;
+}
+
+static HRESULT backend_null_get_buffer(
+        struct backend *be,
+        void **frames,
+        size_t nframes)
+{
+    struct backend_null *self;
+
+    self = backend_null_downcast(be);
+    *frames = self->frames;
+    self->nframes_pending = nframes;
+
+    return S_OK;
+}
+
+static HRESULT backend_null_release_buffer(struct backend *be)
+{
+    struct backend_null *self;
+
+    self = backend_null_downcast(be);
+    self->nframes_total += self->nframes_pending;
+
+    return S_OK;
+}
+
+static HRESULT backend_null_set_rate(struct backend *be, unsigned int rate)
+{
+    struct backend_null *self;
+
+    self = backend_null_downcast(be);
+
+    /*  The period stays the same number of frames, so the frame buffer
+        still fits. Throughput is reported against the latest rate. */
+
+    self->base.rate = rate;
+    self->clk.rate = rate;
+
+    return S_OK;
+}
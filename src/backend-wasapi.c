@@ -0,0 +1,1264 @@
+#include <windows.h>
+
+#include <audioclient.h>
+#include <ksmedia.h>
+#include <mmdeviceapi.h>
+#include <mmreg.h>
+#include <objbase.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend.h"
+#include "defs.h"
+#include "hr.h"
+#include "memstat.h"
+#include "snd-mixer.h"
+#include "trace.h"
+
+/*  Room for the device format, the shared-mode mix format, and our own
+    suggestions at up to two sample rates. */
+
+#define BACKEND_WASAPI_MAX_CANDIDATES 10
+
+/*  Most latency levels we offer: the minimum period, the default one, and
+    successive doublings of the default. */
+
+#define BACKEND_WASAPI_MAX_LEVELS 4
+
+/*  Event-driven WASAPI output, in one of two flavours.
+
+    In exclusive mode the device signals an event each time it has consumed
+    a buffer's worth of frames, and we hand it a whole buffer every time.
+
+    In shared mode we feed the system audio engine, ideally through
+    IAudioClient3 at the smallest period it allows. The buffer is larger than
+    a period, so each time around we top it up with however many frames the
+    engine has already consumed.
+
+    Once the format and mode are settled, the stream can be rebuilt at any
+    of the periods in the ladder. A period of zero in shared mode means the
+    engine's default, when IAudioClient3 is not there to choose another. */
+
+struct backend_wasapi {
+    struct backend base;
+    IMMDevice *dev;
+    IAudioClient *ac;
+    IAudioRenderClient *rc;
+    HANDLE event;
+    WAVEFORMATEXTENSIBLE wfx;
+    bool shared;
+    uint32_t periods[BACKEND_WASAPI_MAX_LEVELS];
+    unsigned int default_level;
+    size_t nframes_pending;
+};
+
+static struct backend_wasapi *backend_wasapi_downcast(struct backend *be);
+static void backend_wasapi_free(struct backend *be);
+static HRESULT backend_wasapi_start(struct backend *be);
+static void backend_wasapi_stop(struct backend *be);
+static HRESULT backend_wasapi_wait(struct backend *be, HANDLE stop);
+static HRESULT backend_wasapi_get_avail(
+        struct backend *be,
+        size_t *nframes);
+static HRESULT backend_wasapi_get_buffer(
+        struct backend *be,
+        void **frames,
+        size_t nframes);
+static HRESULT backend_wasapi_release_buffer(struct backend *be);
+static HRESULT backend_wasapi_set_level(
+        struct backend *be,
+        unsigned int level);
+static HRESULT backend_wasapi_set_rate(
+        struct backend *be,
+        unsigned int rate);
+static HRESULT backend_wasapi_setup(
+        struct backend_wasapi *self,
+        const WAVEFORMATEX *pref,
+        enum backend_share_mode mode);
+static HRESULT backend_wasapi_probe_exclusive(
+        struct backend_wasapi *self,
+        const WAVEFORMATEX *pref);
+static HRESULT backend_wasapi_probe_shared(struct backend_wasapi *self);
+static void backend_wasapi_build_ladder(
+        struct backend_wasapi *self,
+        uint32_t min_period,
+        uint32_t default_period,
+        uint32_t max_period);
+static HRESULT backend_wasapi_open(
+        struct backend_wasapi *self,
+        unsigned int level);
+static void backend_wasapi_close(struct backend_wasapi *self);
+static void backend_wasapi_trace_latency(const struct backend_wasapi *self);
+static HRESULT backend_wasapi_choose_format(
+        IMMDevice *dev,
+        IAudioClient *ac,
+        const WAVEFORMATEX *pref,
+        WAVEFORMATEXTENSIBLE *out,
+        enum snd_format *format_out);
+static size_t backend_wasapi_get_native_formats(
+        IMMDevice *dev,
+        IAudioClient *ac,
+        WAVEFORMATEXTENSIBLE *out);
+static void backend_wasapi_copy_format(
+        WAVEFORMATEXTENSIBLE *dest,
+        const WAVEFORMATEX *src,
+        size_t nbytes);
+static void backend_wasapi_make_format(
+        WAVEFORMATEXTENSIBLE *out,
+        unsigned int rate,
+        enum snd_format format);
+static bool backend_wasapi_parse_format(
+        const WAVEFORMATEXTENSIBLE *wfx,
+        enum snd_format *out);
+static HRESULT backend_wasapi_renegotiate_buffer(
+        IMMDevice *dev,
+        IAudioClient **ac_ref,
+        const WAVEFORMATEX *wfx);
+
+static const struct backend_vtbl backend_wasapi_vtbl = {
+    .free           = backend_wasapi_free,
+    .start          = backend_wasapi_start,
+    .stop           = backend_wasapi_stop,
+    .wait           = backend_wasapi_wait,
+    .get_avail      = backend_wasapi_get_avail,
+    .get_buffer     = backend_wasapi_get_buffer,
+    .release_buffer = backend_wasapi_release_buffer,
+    .set_level      = backend_wasapi_set_level,
+    .set_rate       = backend_wasapi_set_rate,
+};
+
+HRESULT backend_wasapi_alloc(
+        struct backend **out,
+        const WAVEFORMATEX *wfx,
+        enum backend_share_mode mode)
+{
+    struct backend_wasapi *self;
+    HRESULT hr;
+
+    assert(out != NULL);
+    assert(wfx != NULL);
+
+    *out = NULL;
+    self = memstat_calloc(1, sizeof(*self));
+
+    if (self == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    self->base.vtbl = &backend_wasapi_vtbl;
+    self->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    if (self->event == NULL) {
+        hr = hr_from_win32();
+        hr_trace("WASAPI signal CreateEvent", hr);
+
+        goto end;
+    }
+
+    hr = backend_wasapi_setup(self, wfx, mode);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    *out = &self->base;
+    self = NULL;
+
+end:
+    if (self != NULL) {
+        backend_wasapi_free(&self->base);
+    }
+
+    return hr;
+}
+
+static struct backend_wasapi *backend_wasapi_downcast(struct backend *be)
+{
+    assert(be != NULL);
+    assert(be->vtbl == &backend_wasapi_vtbl);
+
+    return containerof(be, struct backend_wasapi, base);
+}
+
+static void backend_wasapi_free(struct backend *be)
+{
+    struct backend_wasapi *self;
+    BOOL ok;
+
+    self = backend_wasapi_downcast(be);
+    backend_wasapi_close(self);
+
+    if (self->dev != NULL) {
+        IMMDevice_Release(self->dev);
+    }
+
+    if (self->event != NULL) {
+        ok = CloseHandle(self->event);
+
+        if (!ok) {
+            hr_trace("CloseHandle(WASAPI Event)", hr_from_win32());
+        }
+    }
+
+    free(self);
+}
+
+static HRESULT backend_wasapi_start(struct backend *be)
+{
+    struct backend_wasapi *self;
+    HRESULT hr;
+
+    self = backend_wasapi_downcast(be);
+    hr = IAudioClient_Start(self->ac);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioClient::Start", hr);
+    }
+
+    return hr;
+}
+
+static void backend_wasapi_stop(struct backend *be)
+{
+    struct backend_wasapi *self;
+
+    self = backend_wasapi_downcast(be);
+
+    if (self->ac != NULL) {
+        IAudioClient_Stop(self->ac);
+        IAudioClient_Reset(self->ac);
+    }
+}
+
+static HRESULT backend_wasapi_wait(struct backend *be, HANDLE stop)
+{
+    struct backend_wasapi *self;
+    HANDLE events[2];
+    uint32_t wait_result;
+    HRESULT hr;
+
+    self = backend_wasapi_downcast(be);
+    events[0] = stop;
+    events[1] = self->event;
+
+    wait_result = WaitForMultipleObjects(
+            lengthof(events),
+            events,
+            FALSE,
+            INFINITE);
+
+    if (wait_result == 0) {
+        /* Thread was commanded to stop */
+
+        return S_FALSE;
+    } else if (wait_result == 1) {
+        /* DMA buffer is available */
+
+        return S_OK;
+    } else {
+        /* Something went wrong */
+
+        hr = hr_from_win32();
+        hr_trace("WaitForMultipleObjects", hr);
+
+        return hr;
+    }
+}
+
+static HRESULT backend_wasapi_get_avail(
+        struct backend *be,
+        size_t *nframes)
+{
+    struct backend_wasapi *self;
+    UINT32 padding;
+    HRESULT hr;
+
+    self = backend_wasapi_downcast(be);
+
+    /*  In shared mode only the part of the buffer that the engine has already
+        consumed is ours to write. */
+
+    if (!self->shared) {
+        *nframes = self->base.nframes;
+
+        return S_OK;
+    }
+
+    hr = IAudioClient_GetCurrentPadding(self->ac, &padding);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioClient::GetCurrentPadding", hr);
+        *nframes = 0;
+
+        return hr;
+    }
+
+    *nframes = self->base.nframes - padding;
+
+    return S_OK;
+}
+
+static HRESULT backend_wasapi_get_buffer(
+        struct backend *be,
+        void **frames,
+        size_t nframes)
+{
+    struct backend_wasapi *self;
+    HRESULT hr;
+
+    self = backend_wasapi_downcast(be);
+    *frames = NULL;
+    hr = IAudioRenderClient_GetBuffer(self->rc, nframes, (BYTE **) frames);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioRenderClient::GetBuffer", hr);
+        self->nframes_pending = 0;
+
+        return hr;
+    }
+
+    self->nframes_pending = nframes;
+
+    return S_OK;
+}
+
+static HRESULT backend_wasapi_release_buffer(struct backend *be)
+{
+    struct backend_wasapi *self;
+    HRESULT hr;
+
+    self = backend_wasapi_downcast(be);
+    hr = IAudioRenderClient_ReleaseBuffer(
+            self->rc,
+            self->nframes_pending,
+            0);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioRenderClient::ReleaseBuffer", hr);
+    }
+
+    return hr;
+}
+
+static HRESULT backend_wasapi_set_level(
+        struct backend *be,
+        unsigned int level)
+{
+    struct backend_wasapi *self;
+
+    self = backend_wasapi_downcast(be);
+
+    /*  A client cannot be initialized twice, so tear the stream down and
+        build a new one on the same device, in the same format. */
+
+    backend_wasapi_close(self);
+
+    return backend_wasapi_open(self, level);
+}
+
+static HRESULT backend_wasapi_set_rate(
+        struct backend *be,
+        unsigned int rate)
+{
+    struct backend_wasapi *self;
+    WAVEFORMATEXTENSIBLE wfx;
+    REFERENCE_TIME default_period;
+    REFERENCE_TIME min_period;
+    IAudioClient *ac;
+    unsigned int level;
+    HRESULT hr;
+
+    self = backend_wasapi_downcast(be);
+
+    /*  A failed attempt below leaves no stream, and then the caller asks
+        for the old rate back, which does have to open one. */
+
+    if (self->ac != NULL && rate == self->base.rate) {
+        return S_OK;
+    }
+
+    /*  The shared-mode engine runs at whatever rate the control panel says,
+        and resampling to that is its business, not ours. */
+
+    if (self->shared) {
+        return S_FALSE;
+    }
+
+    backend_wasapi_close(self);
+
+    hr = IMMDevice_Activate(
+            self->dev,
+            &IID_IAudioClient,
+            CLSCTX_ALL,
+            NULL,
+            (void **) &ac);
+
+    if (FAILED(hr)) {
+        hr_trace("IMMDevice::Activate", hr);
+
+        return hr;
+    }
+
+    /*  Same sample format and channels, only the rate differs. The periods
+        are in frames, so the ladder has to be worked out again. */
+
+    wfx = self->wfx;
+    wfx.Format.nSamplesPerSec = rate;
+    wfx.Format.nAvgBytesPerSec = rate * wfx.Format.nBlockAlign;
+
+    hr = IAudioClient_IsFormatSupported(
+            ac,
+            AUDCLNT_SHAREMODE_EXCLUSIVE,
+            &wfx.Format,
+            NULL);
+
+    if (hr != S_OK) {
+        trace("Device cannot run at %u Hz", rate);
+        hr = AUDCLNT_E_UNSUPPORTED_FORMAT;
+
+        goto end;
+    }
+
+    hr = IAudioClient_GetDevicePeriod(ac, &default_period, &min_period);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioClient::GetDevicePeriod", hr);
+
+        goto end;
+    }
+
+    self->wfx = wfx;
+    self->base.rate = rate;
+    backend_wasapi_build_ladder(
+            self,
+            (uint32_t) ((min_period * rate + 9999999) / 10000000),
+            (uint32_t) ((default_period * rate + 9999999) / 10000000),
+            UINT32_MAX);
+
+    level = self->base.level < self->base.nlevels
+            ? self->base.level
+            : self->base.nlevels - 1;
+    hr = backend_wasapi_open(self, level);
+
+end:
+    IAudioClient_Release(ac);
+
+    return hr;
+}
+
+static HRESULT backend_wasapi_setup(
+        struct backend_wasapi *self,
+        const WAVEFORMATEX *pref,
+        enum backend_share_mode mode)
+{
+    IMMDeviceEnumerator *mmde;
+    void *frames;
+    HRESULT hr;
+
+    trace("Searching for audio output device");
+
+    mmde = NULL;
+
+    hr = CoCreateInstance(
+            &CLSID_MMDeviceEnumerator,
+            NULL,
+            CLSCTX_ALL,
+            &IID_IMMDeviceEnumerator,
+            (void **) &mmde);
+
+    if (FAILED(hr)) {
+        hr_trace("CoCreateInstance(CLSID_MMDeviceEnumerator)", hr);
+
+        goto end;
+    }
+
+    hr = IMMDeviceEnumerator_GetDefaultAudioEndpoint(
+            mmde,
+            eRender,
+            eConsole,
+            &self->dev);
+
+    if (FAILED(hr)) {
+        hr_trace("IMMDeviceEnumerator::GetDefaultAudioEndpoint", hr);
+
+        goto end;
+    }
+
+    trace("Performing WASAPI startup bureaucracy");
+
+    /*  Exclusive mode gets us the lowest latency, but fails if anyone else is
+        using the device (and locks everyone else out if it succeeds). Unless
+        told otherwise, we try it first and fall back to shared mode. Either
+        way we start out at the device's default period, which the latency
+        controller can then bring down if the machine keeps up. */
+
+    hr = E_FAIL;
+
+    if (mode != BACKEND_SHARE_SHARED) {
+        hr = backend_wasapi_probe_exclusive(self, pref);
+
+        if (SUCCEEDED(hr)) {
+            hr = backend_wasapi_open(self, self->default_level);
+        }
+
+        if (FAILED(hr) && mode == BACKEND_SHARE_AUTO) {
+            trace("Exclusive mode unavailable, falling back to shared mode");
+        }
+    }
+
+    if (FAILED(hr) && mode != BACKEND_SHARE_EXCLUSIVE) {
+        self->shared = true;
+        hr = backend_wasapi_probe_shared(self);
+
+        if (SUCCEEDED(hr)) {
+            hr = backend_wasapi_open(self, self->default_level);
+        }
+    }
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    trace("Pre-rolling silence period");
+
+    hr = IAudioRenderClient_GetBuffer(
+            self->rc,
+            self->base.nframes,
+            (BYTE **) &frames);
+
+    if (FAILED(hr)) {
+        hr_trace("Preroll IAudioRenderClient::GetBuffer", hr);
+
+        goto end;
+    }
+
+    hr = IAudioRenderClient_ReleaseBuffer(
+            self->rc,
+            self->base.nframes,
+            AUDCLNT_BUFFERFLAGS_SILENT);
+
+    if (FAILED(hr)) {
+        hr_trace("Preroll IAudioRenderClient::ReleaseBuffer", hr);
+
+        goto end;
+    }
+
+    self->base.name = self->shared ? "WASAPI shared" : "WASAPI exclusive";
+    self->base.nchannels = self->wfx.Format.nChannels;
+    self->base.rate = self->wfx.Format.nSamplesPerSec;
+
+    backend_wasapi_trace_latency(self);
+
+end:
+    if (mmde != NULL) {
+        IMMDeviceEnumerator_Release(mmde);
+    }
+
+    return hr;
+}
+
+static HRESULT backend_wasapi_probe_exclusive(
+        struct backend_wasapi *self,
+        const WAVEFORMATEX *pref)
+{
+    REFERENCE_TIME default_period;
+    REFERENCE_TIME min_period;
+    IAudioClient *ac;
+    unsigned int rate;
+    HRESULT hr;
+
+    hr = IMMDevice_Activate(
+            self->dev,
+            &IID_IAudioClient,
+            CLSCTX_ALL,
+            NULL,
+            (void **) &ac);
+
+    if (FAILED(hr)) {
+        hr_trace("IMMDevice::Activate", hr);
+
+        return hr;
+    }
+
+    hr = IAudioClient_GetDevicePeriod(
+            ac,
+            &default_period,
+            &min_period);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioClient::GetDevicePeriod", hr);
+
+        goto end;
+    }
+
+    hr = backend_wasapi_choose_format(
+            self->dev,
+            ac,
+            pref,
+            &self->wfx,
+            &self->base.format);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    /*  From the minimum period, up through the default one, to a few times
+        that for machines that cannot keep up even with the default. */
+
+    rate = self->wfx.Format.nSamplesPerSec;
+    backend_wasapi_build_ladder(
+            self,
+            (uint32_t) ((min_period * rate + 9999999) / 10000000),
+            (uint32_t) ((default_period * rate + 9999999) / 10000000),
+            UINT32_MAX);
+
+end:
+    IAudioClient_Release(ac);
+
+    return hr;
+}
+
+static HRESULT backend_wasapi_probe_shared(struct backend_wasapi *self)
+{
+    IAudioClient3 *ac3;
+    IAudioClient *ac;
+    WAVEFORMATEX *mix;
+    UINT32 default_period;
+    UINT32 fundamental_period;
+    UINT32 min_period;
+    UINT32 max_period;
+    HRESULT hr;
+
+    ac3 = NULL;
+    ac = NULL;
+    mix = NULL;
+
+    /*  The engine dictates the format in shared mode, so all we can do is
+        check that it is one we know how to produce. */
+
+    hr = IMMDevice_Activate(
+            self->dev,
+            &IID_IAudioClient,
+            CLSCTX_ALL,
+            NULL,
+            (void **) &ac);
+
+    if (FAILED(hr)) {
+        hr_trace("IMMDevice::Activate", hr);
+
+        goto end;
+    }
+
+    hr = IAudioClient_GetMixFormat(ac, &mix);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioClient::GetMixFormat", hr);
+
+        goto end;
+    }
+
+    backend_wasapi_copy_format(&self->wfx, mix, sizeof(*mix) + mix->cbSize);
+
+    if (!backend_wasapi_parse_format(&self->wfx, &self->base.format)) {
+        trace("Shared mode mix format is not one we can produce");
+        hr = AUDCLNT_E_UNSUPPORTED_FORMAT;
+
+        goto end;
+    }
+
+    /*  IAudioClient3 (Windows 10 onwards) lets us pick the engine period, in
+        multiples of its fundamental period. Without it, we take the default
+        and that is the only level there is. */
+
+    hr = IAudioClient_QueryInterface(ac, &IID_IAudioClient3, (void **) &ac3);
+
+    if (FAILED(hr)) {
+        trace("IAudioClient3 unavailable, using the default engine period");
+        self->periods[0] = 0;
+        self->default_level = 0;
+        self->base.nlevels = 1;
+        hr = S_OK;
+
+        goto end;
+    }
+
+    hr = IAudioClient3_GetSharedModeEnginePeriod(
+            ac3,
+            mix,
+            &default_period,
+            &fundamental_period,
+            &min_period,
+            &max_period);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioClient3::GetSharedModeEnginePeriod", hr);
+
+        goto end;
+    }
+
+    backend_wasapi_build_ladder(self, min_period, default_period, max_period);
+
+end:
+    if (ac3 != NULL) {
+        IAudioClient3_Release(ac3);
+    }
+
+    if (ac != NULL) {
+        IAudioClient_Release(ac);
+    }
+
+    CoTaskMemFree(mix);
+
+    return hr;
+}
+
+static void backend_wasapi_build_ladder(
+        struct backend_wasapi *self,
+        uint32_t min_period,
+        uint32_t default_period,
+        uint32_t max_period)
+{
+    uint32_t period;
+    unsigned int n;
+
+    /*  Doubling the default period keeps every rung a whole multiple of the
+        shared engine's fundamental period. */
+
+    n = 0;
+    self->periods[n++] = min_period;
+
+    for (   period = default_period ;
+            n < BACKEND_WASAPI_MAX_LEVELS && period <= max_period ;
+            period *= 2) {
+        if (period > self->periods[n - 1]) {
+            self->periods[n++] = period;
+        }
+    }
+
+    /*  The default period is the second rung, unless it is the minimum */
+
+    self->default_level = n > 1 && self->periods[1] == default_period ? 1 : 0;
+    self->base.nlevels = n;
+    self->base.max_period = self->periods[n - 1];
+
+    trace(  "%u latency levels, periods from %u to %u frames",
+            n,
+            (unsigned int) self->periods[0],
+            (unsigned int) self->periods[n - 1]);
+}
+
+static HRESULT backend_wasapi_open(
+        struct backend_wasapi *self,
+        unsigned int level)
+{
+    REFERENCE_TIME period_hns;
+    IAudioClient3 *ac3;
+    IAudioClient *ac;
+    IAudioRenderClient *rc;
+    UINT32 nframes;
+    size_t period;
+    unsigned int rate;
+    HRESULT hr;
+
+    assert(self->ac == NULL);
+    assert(level < self->base.nlevels);
+
+    ac3 = NULL;
+    ac = NULL;
+    rc = NULL;
+    rate = self->wfx.Format.nSamplesPerSec;
+    period = self->periods[level];
+
+    hr = IMMDevice_Activate(
+            self->dev,
+            &IID_IAudioClient,
+            CLSCTX_ALL,
+            NULL,
+            (void **) &ac);
+
+    if (FAILED(hr)) {
+        hr_trace("IMMDevice::Activate", hr);
+
+        goto end;
+    }
+
+    if (!self->shared) {
+        period_hns = ((REFERENCE_TIME) period * 10000000 + rate - 1) / rate;
+        hr = IAudioClient_Initialize(
+                ac,
+                AUDCLNT_SHAREMODE_EXCLUSIVE,
+                AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+                period_hns,
+                period_hns,
+                &self->wfx.Format,
+                NULL);
+
+        if (hr == AUDCLNT_E_BUFFER_SIZE_NOT_ALIGNED) {
+            hr = backend_wasapi_renegotiate_buffer(
+                    self->dev,
+                    &ac,
+                    &self->wfx.Format);
+        }
+
+        if (FAILED(hr)) {
+            hr_trace("IAudioClient::Initialize", hr);
+
+            goto end;
+        }
+    } else if (period != 0) {
+        hr = IAudioClient_QueryInterface(
+                ac,
+                &IID_IAudioClient3,
+                (void **) &ac3);
+
+        if (FAILED(hr)) {
+            hr_trace("IAudioClient::QueryInterface(IAudioClient3)", hr);
+
+            goto end;
+        }
+
+        hr = IAudioClient3_InitializeSharedAudioStream(
+                ac3,
+                AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+                (UINT32) period,
+                &self->wfx.Format,
+                NULL);
+
+        if (FAILED(hr)) {
+            hr_trace("IAudioClient3::InitializeSharedAudioStream", hr);
+
+            goto end;
+        }
+    } else {
+        hr = IAudioClient_Initialize(
+                ac,
+                AUDCLNT_SHAREMODE_SHARED,
+                AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+                0,
+                0,
+                &self->wfx.Format,
+                NULL);
+
+        if (FAILED(hr)) {
+            hr_trace("IAudioClient::Initialize", hr);
+
+            goto end;
+        }
+
+        hr = IAudioClient_GetDevicePeriod(ac, &period_hns, NULL);
+
+        if (FAILED(hr)) {
+            hr_trace("IAudioClient::GetDevicePeriod", hr);
+
+            goto end;
+        }
+
+        period = (size_t) (period_hns * rate / 10000000);
+        self->base.max_period = period;
+    }
+
+    hr = IAudioClient_SetEventHandle(
+            ac,
+            self->event);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioClient::SetEventHandle", hr);
+
+        goto end;
+    }
+
+    hr = IAudioClient_GetBufferSize(
+            ac,
+            &nframes);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioClient::GetBufferSize", hr);
+
+        goto end;
+    }
+
+    hr = IAudioClient_GetService(
+            ac,
+            &IID_IAudioRenderClient,
+            (void **) &rc);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioClient::GetService(IID_IAudioRenderClient)", hr);
+
+        goto end;
+    }
+
+    /*  In exclusive mode the buffer is the period, give or take whatever
+        the alignment dance did to it. */
+
+    self->ac = ac;
+    self->rc = rc;
+    ac = NULL;
+    rc = NULL;
+
+    self->base.nframes = nframes;
+    self->base.period = self->shared ? period : nframes;
+    self->base.level = level;
+
+    if (self->base.period > self->base.max_period) {
+        self->base.max_period = self->base.period;
+    }
+
+end:
+    if (rc != NULL) {
+        IAudioRenderClient_Release(rc);
+    }
+
+    if (ac3 != NULL) {
+        IAudioClient3_Release(ac3);
+    }
+
+    if (ac != NULL) {
+        IAudioClient_Release(ac);
+    }
+
+    return hr;
+}
+
+static void backend_wasapi_close(struct backend_wasapi *self)
+{
+    if (self->rc != NULL) {
+        IAudioRenderClient_Release(self->rc);
+        self->rc = NULL;
+    }
+
+    if (self->ac != NULL) {
+        IAudioClient_Release(self->ac);
+        self->ac = NULL;
+    }
+}
+
+static void backend_wasapi_trace_latency(const struct backend_wasapi *self)
+{
+    REFERENCE_TIME latency;
+    double rate;
+    HRESULT hr;
+
+    rate = self->base.rate;
+    latency = 0;
+    hr = IAudioClient_GetStreamLatency(self->ac, &latency);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioClient::GetStreamLatency", hr);
+    }
+
+    trace(  "%s: period %u frames (%.2f ms), buffer %u frames (%.2f ms), "
+                "stream latency %.2f ms",
+            self->base.name,
+            (unsigned int) self->base.period,
+            self->base.period * 1000.0 / rate,
+            (unsigned int) self->base.nframes,
+            self->base.nframes * 1000.0 / rate,
+            latency / 10000.0);
+}
+
+static HRESULT backend_wasapi_renegotiate_buffer(
+        IMMDevice *dev,
+        IAudioClient **ac_ref,
+        const WAVEFORMATEX *wfx)
+{
+    // https://blogs.msdn.microsoft.com/matthew_van_eerde/2009/04/03/sample-wasapi-exclusive-mode-event-driven-playback-app-including-the-hd-audio-alignment-dance/
+    // Microsoft's API design is certainly ... something.
+
+    IAudioClient *ac;
+    REFERENCE_TIME period;
+    UINT32 nframes;
+    HRESULT hr;
+
+    ac = *ac_ref;
+    hr = IAudioClient_GetBufferSize(
+            ac,
+            &nframes);
+
+    if (FAILED(hr)) {
+        hr_trace("IAudioClient::GetBufferSize", hr);
+
+        return hr;
+    }
+
+    IAudioClient_Release(ac);
+    *ac_ref = NULL;
+
+    period = (REFERENCE_TIME) (
+            10000.0 *           // (hns / ms) *
+            1000 *              // (ms / s) *
+            nframes /           // frames /
+            wfx->nSamplesPerSec // (frames / s)
+            + 0.5               // rounding
+    );
+
+    trace("WASAPI tentative buffer size was %i frames", nframes);
+    trace("Need a 'period' of %i usec", (int) (period / 10));
+
+    hr = IMMDevice_Activate(
+            dev,
+            &IID_IAudioClient,
+            CLSCTX_ALL,
+            NULL,
+            (void **) &ac);
+
+    if (FAILED(hr)) {
+        hr_trace("IMMDevice::Activate", hr);
+
+        return hr;
+    }
+
+    *ac_ref = ac;
+
+    return IAudioClient_Initialize(
+            ac,
+            AUDCLNT_SHAREMODE_EXCLUSIVE,
+            AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+            period,
+            period,
+            wfx,
+            NULL);
+}
+
+static HRESULT backend_wasapi_choose_format(
+        IMMDevice *dev,
+        IAudioClient *ac,
+        const WAVEFORMATEX *pref,
+        WAVEFORMATEXTENSIBLE *out,
+        enum snd_format *format_out)
+{
+    static const enum snd_format formats[] = {
+        SND_FORMAT_F32,
+        SND_FORMAT_S32,
+        SND_FORMAT_S24_32,
+        SND_FORMAT_S16,
+    };
+
+    WAVEFORMATEXTENSIBLE cands[BACKEND_WASAPI_MAX_CANDIDATES];
+    unsigned int rates[2];
+    enum snd_format format;
+    size_t ncands;
+    size_t nrates;
+    size_t i;
+    size_t j;
+    HRESULT hr;
+
+    /*  Whatever the endpoint runs at natively comes first, since that is what
+        it will accept without resampling or requantizing behind our back.
+        After that we try our own stereo formats, highest precision first, at
+        the native rate and then at the rate we were asked for. */
+
+    ncands = backend_wasapi_get_native_formats(dev, ac, cands);
+
+    rates[0] = ncands > 0 ? cands[0].Format.nSamplesPerSec
+                          : pref->nSamplesPerSec;
+    rates[1] = pref->nSamplesPerSec;
+    nrates = rates[0] != rates[1] ? 2 : 1;
+
+    for (i = 0 ; i < nrates ; i++) {
+        for (j = 0 ; j < lengthof(formats) ; j++) {
+            assert(ncands < lengthof(cands));
+            backend_wasapi_make_format(&cands[ncands++], rates[i], formats[j]);
+        }
+    }
+
+    for (i = 0 ; i < ncands ; i++) {
+        if (!backend_wasapi_parse_format(&cands[i], &format)) {
+            continue;
+        }
+
+        hr = IAudioClient_IsFormatSupported(
+                ac,
+                AUDCLNT_SHAREMODE_EXCLUSIVE,
+                &cands[i].Format,
+                NULL);
+
+        if (hr == S_OK) {
+            trace(  "Selected %u Hz %u channel %s output",
+                    (unsigned int) cands[i].Format.nSamplesPerSec,
+                    (unsigned int) cands[i].Format.nChannels,
+                    snd_format_name(format));
+
+            *out = cands[i];
+            *format_out = format;
+
+            return S_OK;
+        }
+    }
+
+    trace("Device does not support any format we can produce");
+
+    return AUDCLNT_E_UNSUPPORTED_FORMAT;
+}
+
+static size_t backend_wasapi_get_native_formats(
+        IMMDevice *dev,
+        IAudioClient *ac,
+        WAVEFORMATEXTENSIBLE *out)
+{
+    IPropertyStore *props;
+    PROPVARIANT var;
+    WAVEFORMATEX *mix;
+    size_t n;
+    HRESULT hr;
+
+    n = 0;
+    props = NULL;
+    PropVariantInit(&var);
+
+    /* The format the endpoint is configured for in the control panel */
+
+    hr = IMMDevice_OpenPropertyStore(dev, STGM_READ, &props);
+
+    if (SUCCEEDED(hr)) {
+        hr = IPropertyStore_GetValue(
+                props,
+                &PKEY_AudioEngine_DeviceFormat,
+                &var);
+
+        if (    SUCCEEDED(hr) &&
+                var.vt == VT_BLOB &&
+                var.blob.cbSize >= sizeof(WAVEFORMATEX)) {
+            backend_wasapi_copy_format(
+                    &out[n++],
+                    (const WAVEFORMATEX *) var.blob.pBlobData,
+                    var.blob.cbSize);
+        }
+
+        PropVariantClear(&var);
+        IPropertyStore_Release(props);
+    } else {
+        hr_trace("IMMDevice::OpenPropertyStore", hr);
+    }
+
+    /* The shared-mode engine's format, which is usually the same rate */
+
+    mix = NULL;
+    hr = IAudioClient_GetMixFormat(ac, &mix);
+
+    if (SUCCEEDED(hr)) {
+        backend_wasapi_copy_format(
+                &out[n++],
+                mix,
+                sizeof(*mix) + mix->cbSize);
+        CoTaskMemFree(mix);
+    } else {
+        hr_trace("IAudioClient::GetMixFormat", hr);
+    }
+
+    return n;
+}
+
+static void backend_wasapi_copy_format(
+        WAVEFORMATEXTENSIBLE *dest,
+        const WAVEFORMATEX *src,
+        size_t nbytes)
+{
+    memset(dest, 0, sizeof(*dest));
+
+    if (    src->wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+            nbytes >= sizeof(*dest)) {
+        memcpy(dest, src, sizeof(*dest));
+    } else {
+        memcpy(&dest->Format, src, sizeof(dest->Format));
+        dest->Format.cbSize = 0;
+    }
+}
+
+static void backend_wasapi_make_format(
+        WAVEFORMATEXTENSIBLE *out,
+        unsigned int rate,
+        enum snd_format format)
+{
+    size_t nbytes;
+
+    nbytes = snd_format_sample_size(format);
+
+    memset(out, 0, sizeof(*out));
+    out->Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+    out->Format.nChannels = 2;
+    out->Format.nSamplesPerSec = rate;
+    out->Format.wBitsPerSample = nbytes * 8;
+    out->Format.nBlockAlign = nbytes * 2;
+    out->Format.nAvgBytesPerSec = rate * nbytes * 2;
+    out->Format.cbSize = sizeof(*out) - sizeof(out->Format);
+    out->Samples.wValidBitsPerSample =
+            format == SND_FORMAT_S24_32 ? 24 : nbytes * 8;
+    out->dwChannelMask = KSAUDIO_SPEAKER_STEREO;
+    out->SubFormat = format == SND_FORMAT_F32
+            ? KSDATAFORMAT_SUBTYPE_IEEE_FLOAT
+            : KSDATAFORMAT_SUBTYPE_PCM;
+}
+
+static bool backend_wasapi_parse_format(
+        const WAVEFORMATEXTENSIBLE *wfx,
+        enum snd_format *out)
+{
+    unsigned int bits;
+    unsigned int valid;
+    bool is_float;
+
+    if (wfx->Format.nChannels < 2) {
+        return false;
+    }
+
+    bits = wfx->Format.wBitsPerSample;
+    valid = bits;
+
+    switch (wfx->Format.wFormatTag) {
+    case WAVE_FORMAT_PCM:
+        is_float = false;
+
+        break;
+
+    case WAVE_FORMAT_IEEE_FLOAT:
+        is_float = true;
+
+        break;
+
+    case WAVE_FORMAT_EXTENSIBLE:
+        if (IsEqualGUID(&wfx->SubFormat, &KSDATAFORMAT_SUBTYPE_PCM)) {
+            is_float = false;
+        } else if (IsEqualGUID(
+                    &wfx->SubFormat,
+                    &KSDATAFORMAT_SUBTYPE_IEEE_FLOAT)) {
+            is_float = true;
+        } else {
+            return false;
+        }
+
+        if (wfx->Samples.wValidBitsPerSample != 0) {
+            valid = wfx->Samples.wValidBitsPerSample;
+        }
+
+        break;
+
+    default:
+        return false;
+    }
+
+    if (is_float) {
+        if (bits != 32 || valid != 32) {
+            return false;
+        }
+
+        *out = SND_FORMAT_F32;
+    } else if (bits == 16 && valid == 16) {
+        *out = SND_FORMAT_S16;
+    } else if (bits == 32 && valid == 24) {
+        *out = SND_FORMAT_S24_32;
+    } else if (bits == 32 && valid == 32) {
+        *out = SND_FORMAT_S32;
+    } else {
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,326 @@
+#include <windows.h>
+#include <mmreg.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend.h"
+#include "defs.h"
+#include "hr.h"
+#include "memstat.h"
+#include "trace.h"
+
+/*  Captures the mixer's output to a WAV file, paced in real time as though a
+    device were consuming it. The RIFF sizes are patched in when the backend
+    is freed. */
+
+#define BACKEND_WAV_HEADER_SIZE 44
+
+/* Large enough that stdio does not hit the disk every period */
+
+#define BACKEND_WAV_STDIO_BUFSIZE 65536
+
+struct backend_wav {
+    struct backend base;
+    struct backend_clock clk;
+    WAVEFORMATEX wfx;
+    FILE *f;
+    char *stdio_buf;
+    void *frames;
+    size_t nbytes_pending;
+    uint32_t nbytes_data;
+    bool failed;
+};
+
+static struct backend_wav *backend_wav_downcast(struct backend *be);
+static void backend_wav_free(struct backend *be);
+static HRESULT backend_wav_start(struct backend *be);
+static void backend_wav_stop(struct backend *be);
+static HRESULT backend_wav_wait(struct backend *be, HANDLE stop);
+static HRESULT backend_wav_get_avail(struct backend *be, size_t *nframes);
+static HRESULT backend_wav_get_buffer(
+        struct backend *be,
+        void **frames,
+        size_t nframes);
+static HRESULT backend_wav_release_buffer(struct backend *be);
+static HRESULT backend_wav_set_rate(struct backend *be, unsigned int rate);
+static void backend_wav_write_header(
+        uint8_t *bytes,
+        const WAVEFORMATEX *wfx,
+        uint32_t nbytes_data);
+static void backend_wav_put_u16(uint8_t *bytes, uint16_t val);
+static void backend_wav_put_u32(uint8_t *bytes, uint32_t val);
+
+static const struct backend_vtbl backend_wav_vtbl = {
+    .free           = backend_wav_free,
+    .start          = backend_wav_start,
+    .stop           = backend_wav_stop,
+    .wait           = backend_wav_wait,
+    .get_avail      = backend_wav_get_avail,
+    .get_buffer     = backend_wav_get_buffer,
+    .release_buffer = backend_wav_release_buffer,
+    .set_rate       = backend_wav_set_rate,
+};
+
+HRESULT backend_wav_alloc(
+        struct backend **out,
+        const WAVEFORMATEX *wfx,
+        size_t nframes,
+        const char *path)
+{
+    struct backend_wav *self;
+    uint8_t header[BACKEND_WAV_HEADER_SIZE];
+    HRESULT hr;
+
+    assert(out != NULL);
+    assert(wfx != NULL);
+    assert(nframes > 0);
+    assert(path != NULL);
+
+    *out = NULL;
+    self = memstat_calloc(1, sizeof(*self));
+
+    if (self == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    self->base.vtbl = &backend_wav_vtbl;
+    self->base.name = "WAV file";
+    self->base.nframes = nframes;
+    self->base.period = nframes;
+    self->base.max_period = nframes;
+    self->base.nlevels = 1;
+    self->base.nchannels = wfx->nChannels;
+    self->base.rate = wfx->nSamplesPerSec;
+    self->base.format = SND_FORMAT_S16;
+    self->wfx = *wfx;
+    self->frames = memstat_calloc(nframes, wfx->nBlockAlign);
+    self->stdio_buf = memstat_malloc(BACKEND_WAV_STDIO_BUFSIZE);
+
+    if (self->frames == NULL || self->stdio_buf == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    hr = backend_clock_init(&self->clk, nframes, wfx->nSamplesPerSec);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    if (fopen_s(&self->f, path, "wb") != 0) {
+        self->f = NULL;
+        hr = E_FAIL;
+        trace("Could not open \"%s\" for writing", path);
+
+        goto end;
+    }
+
+    /* Supply our own buffer so that the audio thread never allocates */
+
+    setvbuf(self->f, self->stdio_buf, _IOFBF, BACKEND_WAV_STDIO_BUFSIZE);
+
+    /* Write a placeholder header now, we fix up the sizes at the end */
+
+    backend_wav_write_header(header, &self->wfx, 0);
+
+    if (fwrite(header, sizeof(header), 1, self->f) != 1) {
+        hr = E_FAIL;
+        trace("Could not write WAV header to \"%s\"", path);
+
+        goto end;
+    }
+
+    trace("Capturing output to \"%s\"", path);
+
+    *out = &self->base;
+    self = NULL;
+    hr = S_OK;
+
+end:
+    if (self != NULL) {
+        backend_wav_free(&self->base);
+    }
+
+    return hr;
+}
+
+static struct backend_wav *backend_wav_downcast(struct backend *be)
+{
+    assert(be != NULL);
+    assert(be->vtbl == &backend_wav_vtbl);
+
+    return containerof(be, struct backend_wav, base);
+}
+
+static void backend_wav_free(struct backend *be)
+{
+    struct backend_wav *self;
+    uint8_t header[BACKEND_WAV_HEADER_SIZE];
+
+    self = backend_wav_downcast(be);
+
+    if (self->f != NULL) {
+        trace(  "Captured %u bytes of audio%s",
+                (unsigned int) self->nbytes_data,
+                self->failed ? " (truncated by a write error)" : "");
+
+        /* Rewrite the header now that the sizes are known */
+
+        backend_wav_write_header(header, &self->wfx, self->nbytes_data);
+
+        if (    fseek(self->f, 0, SEEK_SET) != 0 ||
+                fwrite(header, sizeof(header), 1, self->f) != 1) {
+            trace("Error finalizing WAV capture file header");
+        }
+
+        if (fclose(self->f) != 0) {
+            trace("Error closing WAV capture file");
+        }
+    }
+
+    backend_clock_fini(&self->clk);
+    free(self->stdio_buf);
+    free(self->frames);
+    free(self);
+}
+
+static HRESULT backend_wav_start(struct backend *be)
+{
+    struct backend_wav *self;
+
+    self = backend_wav_downcast(be);
+    backend_clock_start(&self->clk);
+
+    return S_OK;
+}
+
+static void backend_wav_stop(struct backend *be)
+{
+    /*  Nothing is queued: each period goes to the file as soon as it is
+        released. Time spent stopped simply does not appear in the capture. */
+}
+
+static HRESULT backend_wav_wait(struct backend *be, HANDLE stop)
+{
+    struct backend_wav *self;
+
+    self = backend_wav_downcast(be);
+
+    return backend_clock_wait(&self->clk, stop);
+}
+
+static HRESULT backend_wav_get_avail(struct backend *be, size_t *nframes)
+{
+    *nframes = be->nframes;
+
+    return S_OK;
+}
+
+static HRESULT backend_wav_get_buffer(
+        struct backend *be,
+        void **frames,
+        size_t nframes)
+{
+    struct backend_wav *self;
+
+    self = backend_wav_downcast(be);
+    *frames = self->frames;
+    self->nbytes_pending = nframes * self->wfx.nBlockAlign;
+
+    return S_OK;
+}
+
+static HRESULT backend_wav_release_buffer(struct backend *be)
+{
+    struct backend_wav *self;
+
+    self = backend_wav_downcast(be);
+
+    /*  A full disk should not take the audio down with it: stop capturing,
+        but keep the engine running. RIFF sizes top out at 4 GiB too. */
+
+    if (    self->failed ||
+            self->nbytes_data > UINT32_MAX - BACKEND_WAV_HEADER_SIZE
+                    - self->nbytes_pending) {
+        return S_OK;
+    }
+
+    if (    self->nbytes_pending > 0 &&
+            fwrite(self->frames, self->nbytes_pending, 1, self->f) != 1) {
+        self->failed = true;
+
+        return S_OK;
+    }
+
+    self->nbytes_data += (uint32_t) self->nbytes_pending;
+
+    return S_OK;
+}
+
+static HRESULT backend_wav_set_rate(struct backend *be, unsigned int rate)
+{
+    struct backend_wav *self;
+
+    self = backend_wav_downcast(be);
+
+    /*  A WAV file only has the one rate, so this is only possible up until
+        the first frame has been written. The header is rewritten with the
+        right rate when we are freed. */
+
+    if (rate == self->base.rate) {
+        return S_OK;
+    }
+
+    if (self->nbytes_data > 0) {
+        return S_FALSE;
+    }
+
+    self->base.rate = rate;
+    self->clk.rate = rate;
+    self->wfx.nSamplesPerSec = rate;
+    self->wfx.nAvgBytesPerSec = rate * self->wfx.nBlockAlign;
+
+    return S_OK;
+}
+
+static void backend_wav_write_header(
+        uint8_t *bytes,
+        const WAVEFORMATEX *wfx,
+        uint32_t nbytes_data)
+{
+    memcpy(&bytes[0], "RIFF", 4);
+    backend_wav_put_u32(&bytes[4], BACKEND_WAV_HEADER_SIZE - 8 + nbytes_data);
+    memcpy(&bytes[8], "WAVE", 4);
+    memcpy(&bytes[12], "fmt ", 4);
+    backend_wav_put_u32(&bytes[16], 16);
+    backend_wav_put_u16(&bytes[20], WAVE_FORMAT_PCM);
+    backend_wav_put_u16(&bytes[22], wfx->nChannels);
+    backend_wav_put_u32(&bytes[24], wfx->nSamplesPerSec);
+    backend_wav_put_u32(&bytes[28], wfx->nAvgBytesPerSec);
+    backend_wav_put_u16(&bytes[32], wfx->nBlockAlign);
+    backend_wav_put_u16(&bytes[34], wfx->wBitsPerSample);
+    memcpy(&bytes[36], "data", 4);
+    backend_wav_put_u32(&bytes[40], nbytes_data);
+}
+
+static void backend_wav_put_u16(uint8_t *bytes, uint16_t val)
+{
+    bytes[0] = (uint8_t) val;
+    bytes[1] = (uint8_t) (val >> 8);
+}
+
+static void backend_wav_put_u32(uint8_t *bytes, uint32_t val)
+{
+    bytes[0] = (uint8_t) val;
+    bytes[1] = (uint8_t) (val >> 8);
+    bytes[2] = (uint8_t) (val >> 16);
+    bytes[3] = (uint8_t) (val >> 24);
+}
@@ -0,0 +1,264 @@
+#include <windows.h>
+#include <mmreg.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "backend.h"
+#include "config.h"
+#include "defs.h"
+#include "hr.h"
+#include "trace.h"
+
+/* Period used by the backends that are not tied to a device, in frames */
+
+#define BACKEND_DEFAULT_PERIOD 441
+
+HRESULT backend_alloc(struct backend **out, const WAVEFORMATEX *wfx)
+{
+    enum backend_share_mode mode;
+    char name[16];
+    char share[16];
+    char path[MAX_PATH];
+    size_t nframes;
+    HRESULT hr;
+
+    assert(out != NULL);
+    assert(wfx != NULL);
+
+    *out = NULL;
+
+    if (!config_get_string("BACKEND", name, sizeof(name))) {
+        strcpy(name, "wasapi");
+    }
+
+    nframes = config_get_uint("PERIOD", BACKEND_DEFAULT_PERIOD);
+
+    if (nframes == 0) {
+        nframes = BACKEND_DEFAULT_PERIOD;
+    }
+
+    if (!config_get_string("SHARE_MODE", share, sizeof(share))) {
+        strcpy(share, "auto");
+    }
+
+    if (strcmp(share, "exclusive") == 0) {
+        mode = BACKEND_SHARE_EXCLUSIVE;
+    } else if (strcmp(share, "shared") == 0) {
+        mode = BACKEND_SHARE_SHARED;
+    } else {
+        mode = BACKEND_SHARE_AUTO;
+    }
+
+    if (strcmp(name, "wasapi") == 0) {
+        hr = backend_wasapi_alloc(out, wfx, mode);
+    } else if (strcmp(name, "null") == 0) {
+        hr = backend_null_alloc(out, wfx, nframes, true);
+    } else if (strcmp(name, "bench") == 0) {
+        hr = backend_null_alloc(out, wfx, nframes, false);
+    } else if (strcmp(name, "wav") == 0) {
+        if (!config_get_string("WAV_PATH", path, sizeof(path))) {
+            strcpy(path, "hypersonik.wav");
+        }
+
+        hr = backend_wav_alloc(out, wfx, nframes, path);
+    } else {
+        trace("Unknown backend \"%s\"", name);
+        hr = E_INVALIDARG;
+    }
+
+    /*  An application that finds no device where it expected one often
+        gives up on sound entirely, or worse. Carry on in silence instead,
+        at the same pace a device would keep. */
+
+    if (FAILED(hr) && strcmp(name, "null") != 0) {
+        trace("Backend \"%s\" failed, falling back to null output", name);
+        hr = backend_null_alloc(out, wfx, nframes, true);
+    }
+
+    if (SUCCEEDED(hr)) {
+        trace(  "Using %s backend, %u frames per period",
+                (*out)->name,
+                (unsigned int) (*out)->period);
+    }
+
+    return hr;
+}
+
+void backend_free(struct backend *be)
+{
+    if (be == NULL) {
+        return;
+    }
+
+    be->vtbl->free(be);
+}
+
+HRESULT backend_start(struct backend *be)
+{
+    assert(be != NULL);
+
+    return be->vtbl->start(be);
+}
+
+void backend_stop(struct backend *be)
+{
+    assert(be != NULL);
+
+    be->vtbl->stop(be);
+}
+
+HRESULT backend_wait(struct backend *be, HANDLE stop)
+{
+    assert(be != NULL);
+
+    return be->vtbl->wait(be, stop);
+}
+
+HRESULT backend_get_avail(struct backend *be, size_t *nframes)
+{
+    assert(be != NULL);
+    assert(nframes != NULL);
+
+    return be->vtbl->get_avail(be, nframes);
+}
+
+HRESULT backend_get_buffer(
+        struct backend *be,
+        void **frames,
+        size_t nframes)
+{
+    assert(be != NULL);
+    assert(frames != NULL);
+    assert(nframes <= be->nframes);
+
+    return be->vtbl->get_buffer(be, frames, nframes);
+}
+
+HRESULT backend_release_buffer(struct backend *be)
+{
+    assert(be != NULL);
+
+    return be->vtbl->release_buffer(be);
+}
+
+HRESULT backend_set_level(struct backend *be, unsigned int level)
+{
+    assert(be != NULL);
+    assert(level < be->nlevels);
+    assert(be->vtbl->set_level != NULL);
+
+    return be->vtbl->set_level(be, level);
+}
+
+HRESULT backend_set_rate(struct backend *be, unsigned int rate)
+{
+    assert(be != NULL);
+    assert(rate > 0);
+
+    if (be->vtbl->set_rate == NULL) {
+        return rate == be->rate ? S_OK : S_FALSE;
+    }
+
+    return be->vtbl->set_rate(be, rate);
+}
+
+HRESULT backend_clock_init(
+        struct backend_clock *clk,
+        size_t nframes,
+        unsigned int rate)
+{
+    HRESULT hr;
+
+    assert(clk != NULL);
+    assert(nframes > 0);
+    assert(rate > 0);
+
+    memset(clk, 0, sizeof(*clk));
+    clk->nframes = nframes;
+    clk->rate = rate;
+    clk->timer = CreateWaitableTimer(NULL, FALSE, NULL);
+
+    if (clk->timer == NULL) {
+        hr = hr_from_win32();
+        hr_trace("CreateWaitableTimer", hr);
+
+        return hr;
+    }
+
+    return S_OK;
+}
+
+void backend_clock_fini(struct backend_clock *clk)
+{
+    BOOL ok;
+
+    assert(clk != NULL);
+
+    if (clk->timer != NULL) {
+        ok = CloseHandle(clk->timer);
+
+        if (!ok) {
+            hr_trace("CloseHandle(clk->timer)", hr_from_win32());
+        }
+    }
+}
+
+void backend_clock_start(struct backend_clock *clk)
+{
+    FILETIME now;
+
+    assert(clk != NULL);
+
+    GetSystemTimeAsFileTime(&now);
+    clk->start = ((uint64_t) now.dwHighDateTime << 32) | now.dwLowDateTime;
+    clk->nperiods = 0;
+}
+
+HRESULT backend_clock_wait(struct backend_clock *clk, HANDLE stop)
+{
+    LARGE_INTEGER due;
+    HANDLE events[2];
+    uint32_t wait_result;
+    HRESULT hr;
+    BOOL ok;
+
+    assert(clk != NULL);
+
+    /*  Absolute due times are in 100ns units. If we have fallen behind, the
+        timer fires straight away and we catch up. */
+
+    clk->nperiods++;
+    due.QuadPart = (LONGLONG) (clk->start +
+            clk->nperiods * clk->nframes * 10000000 / clk->rate);
+
+    ok = SetWaitableTimer(clk->timer, &due, 0, NULL, NULL, FALSE);
+
+    if (!ok) {
+        hr = hr_from_win32();
+        hr_trace("SetWaitableTimer", hr);
+
+        return hr;
+    }
+
+    events[0] = stop;
+    events[1] = clk->timer;
+
+    wait_result = WaitForMultipleObjects(
+            lengthof(events),
+            events,
+            FALSE,
+            INFINITE);
+
+    if (wait_result == 0) {
+        return S_FALSE;
+    } else if (wait_result == 1) {
+        return S_OK;
+    } else {
+        hr = hr_from_win32();
+        hr_trace("WaitForMultipleObjects", hr);
+
+        return hr;
+    }
+}
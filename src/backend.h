@@ -0,0 +1,134 @@
+#pragma once
+
+#include <windows.h>
+#include <mmreg.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "snd-mixer.h"
+
+/*  An output backend is whatever consumes the mixer's output and paces the
+    engine's cycle. Backends are created, driven and destroyed on the engine
+    thread only. The format a backend is created with is a preference; the
+    one it actually settled on is reported in the base struct. */
+
+struct backend;
+
+enum backend_share_mode {
+    BACKEND_SHARE_AUTO,
+    BACKEND_SHARE_EXCLUSIVE,
+    BACKEND_SHARE_SHARED,
+};
+
+struct backend_vtbl {
+    void (*free)(struct backend *be);
+
+    /*  A backend can be stopped and started again any number of times.
+        Stopping discards whatever was still queued for output, so the
+        buffer is empty and ready to be filled before the next start. */
+
+    HRESULT (*start)(struct backend *be);
+    void (*stop)(struct backend *be);
+
+    /*  Block until the next period is due. Returns S_FALSE if the stop event
+        was signalled first. */
+
+    HRESULT (*wait)(struct backend *be, HANDLE stop);
+
+    /*  How many frames the backend can take this cycle. That is at most
+        nframes, but may vary from one cycle to the next. */
+
+    HRESULT (*get_avail)(struct backend *be, size_t *nframes);
+
+    /*  Get somewhere to write nframes frames to, which must be no more than
+        get_avail reported. This may happen more than once per cycle. */
+
+    HRESULT (*get_buffer)(struct backend *be, void **frames, size_t nframes);
+    HRESULT (*release_buffer)(struct backend *be);
+
+    /*  Switch to another latency level while stopped. On success the
+        backend is left stopped, with an empty buffer and nframes and period
+        updated. On failure it is left with no stream at all, and the caller
+        should switch back. Only needed if the backend has several levels. */
+
+    HRESULT (*set_level)(struct backend *be, unsigned int level);
+
+    /*  Switch to another sample rate while stopped, rebuilding the latency
+        ladder to suit. Success and failure leave things as for set_level.
+        A backend that turns the rate down without touching its stream
+        returns S_FALSE instead, and carries on at the rate it had. Asking
+        for the current rate while a stream is up does nothing. Optional:
+        without it, every other rate is turned down. */
+
+    HRESULT (*set_rate)(struct backend *be, unsigned int rate);
+};
+
+/*  Latency levels, if a backend offers more than one, are a ladder of
+    periods from smallest to largest. max_period bounds the period at every
+    level. Format and channel count never change; the rate only changes
+    through set_rate. */
+
+struct backend {
+    const struct backend_vtbl *vtbl;
+    const char *name;
+    size_t nframes;
+    size_t period;
+    size_t max_period;
+    size_t nchannels;
+    unsigned int rate;
+    unsigned int level;
+    unsigned int nlevels;
+    enum snd_format format;
+};
+
+/*  Drift-free period clock for backends that are not paced by a device.
+    Each deadline is computed from the start time rather than from the
+    previous deadline, so rounding errors do not accumulate. */
+
+struct backend_clock {
+    HANDLE timer;
+    uint64_t start;
+    uint64_t nperiods;
+    size_t nframes;
+    unsigned int rate;
+};
+
+HRESULT backend_alloc(struct backend **out, const WAVEFORMATEX *wfx);
+
+HRESULT backend_wasapi_alloc(
+        struct backend **out,
+        const WAVEFORMATEX *wfx,
+        enum backend_share_mode mode);
+HRESULT backend_null_alloc(
+        struct backend **out,
+        const WAVEFORMATEX *wfx,
+        size_t nframes,
+        bool paced);
+HRESULT backend_wav_alloc(
+        struct backend **out,
+        const WAVEFORMATEX *wfx,
+        size_t nframes,
+        const char *path);
+
+void backend_free(struct backend *be);
+HRESULT backend_start(struct backend *be);
+void backend_stop(struct backend *be);
+HRESULT backend_wait(struct backend *be, HANDLE stop);
+HRESULT backend_get_avail(struct backend *be, size_t *nframes);
+HRESULT backend_get_buffer(
+        struct backend *be,
+        void **frames,
+        size_t nframes);
+HRESULT backend_release_buffer(struct backend *be);
+HRESULT backend_set_level(struct backend *be, unsigned int level);
+HRESULT backend_set_rate(struct backend *be, unsigned int rate);
+
+HRESULT backend_clock_init(
+        struct backend_clock *clk,
+        size_t nframes,
+        unsigned int rate);
+void backend_clock_fini(struct backend_clock *clk);
+void backend_clock_start(struct backend_clock *clk);
+HRESULT backend_clock_wait(struct backend_clock *clk, HANDLE stop);
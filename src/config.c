@@ -0,0 +1,62 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "trace.h"
+
+unsigned int config_get_uint(const char *name, unsigned int def)
+{
+    unsigned long value;
+    char str[32];
+    char *end;
+
+    assert(name != NULL);
+
+    if (!config_get_string(name, str, sizeof(str))) {
+        return def;
+    }
+
+    value = strtoul(str, &end, 0);
+
+    if (end == str || *end != '\0') {
+        trace("Ignoring malformed HYPERSONIK_%s value \"%s\"", name, str);
+
+        return def;
+    }
+
+    trace("Config: HYPERSONIK_%s = %lu", name, value);
+
+    return value;
+}
+
+bool config_get_string(const char *name, char *buf, size_t nbytes)
+{
+    char var[64];
+    DWORD result;
+    int r;
+
+    assert(name != NULL);
+    assert(buf != NULL);
+    assert(nbytes > 0);
+
+    buf[0] = '\0';
+    r = _snprintf_s(var, sizeof(var), sizeof(var) - 1, "HYPERSONIK_%s", name);
+
+    if (r < 0) {
+        return false;
+    }
+
+    result = GetEnvironmentVariableA(var, buf, nbytes);
+
+    if (result == 0 || result >= nbytes) {
+        buf[0] = '\0';
+
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*  Deployment tunables. Each setting is read from an environment variable
+    named HYPERSONIK_<NAME>; unset or malformed values yield the default. */
+
+unsigned int config_get_uint(const char *name, unsigned int def);
+bool config_get_string(const char *name, char *buf, size_t nbytes);
@@ -3,11 +3,13 @@
 #include <msacm.h>
 
 #include <assert.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 #include "converter.h"
+#include "memstat.h"
 #include "trace.h"
 
 struct converter {
@@ -15,6 +17,9 @@ struct converter {
     ACMSTREAMHEADER header;
 };
 
+static atomic_ullong converter_nconversions;
+static atomic_ullong converter_ticks;
+
 HRESULT converter_calculate_dest_nbytes(
         const WAVEFORMATEX *src,
         const WAVEFORMATEX *dest,
@@ -99,7 +104,7 @@ HRESULT converter_alloc(
     *out = NULL;
     conv = NULL;
 
-    conv = calloc(sizeof(*conv), 1);
+    conv = memstat_calloc(sizeof(*conv), 1);
 
     if (conv == NULL) {
         hr = E_OUTOFMEMORY;
@@ -199,6 +204,8 @@ HRESULT converter_convert(
         size_t *src_nprocessed,
         size_t *dest_nprocessed)
 {
+    LARGE_INTEGER t_start;
+    LARGE_INTEGER t_end;
     MMRESULT mmr;
 
     assert(conv != NULL);
@@ -211,7 +218,18 @@ HRESULT converter_convert(
         *dest_nprocessed = 0;
     }
 
+    QueryPerformanceCounter(&t_start);
     mmr = acmStreamConvert(conv->acm, &conv->header, 0);
+    QueryPerformanceCounter(&t_end);
+
+    atomic_fetch_add_explicit(
+            &converter_nconversions,
+            1,
+            memory_order_relaxed);
+    atomic_fetch_add_explicit(
+            &converter_ticks,
+            t_end.QuadPart - t_start.QuadPart,
+            memory_order_relaxed);
 
     if (mmr != 0) {
         trace("acmStreamConvert failed: %i", mmr);
@@ -229,3 +247,18 @@ HRESULT converter_convert(
 
     return S_OK;
 }
+
+void converter_get_stats(struct converter_stats *out)
+{
+    LARGE_INTEGER freq;
+    uint64_t ticks;
+
+    assert(out != NULL);
+
+    QueryPerformanceFrequency(&freq);
+    ticks = atomic_load_explicit(&converter_ticks, memory_order_relaxed);
+    out->nconversions = atomic_load_explicit(
+            &converter_nconversions,
+            memory_order_relaxed);
+    out->ns = (uint64_t) (ticks * (1e9 / freq.QuadPart));
+}
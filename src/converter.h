@@ -4,9 +4,17 @@
 #include <mmreg.h>
 
 #include <stddef.h>
+#include <stdint.h>
 
 struct converter;
 
+/*  Totals across all converters, for statistics */
+
+struct converter_stats {
+    uint64_t nconversions;
+    uint64_t ns;
+};
+
 HRESULT converter_calculate_dest_nbytes(
         const WAVEFORMATEX *src,
         const WAVEFORMATEX *dest,
@@ -28,3 +36,4 @@ HRESULT converter_convert(
         struct converter *conv,
         size_t *src_nprocessed,
         size_t *dest_nprocessed);
+void converter_get_stats(struct converter_stats *out);
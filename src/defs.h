@@ -6,3 +6,6 @@
 #define containerof(ptr, outer_t, member) \
         ((void *) (((uint8_t *) ptr) - offsetof(outer_t, member)))
 #define lengthof(x) (sizeof(x) / sizeof(x[0]))
+
+/* Padding granularity for data that is shared between threads */
+#define CACHE_LINE_SIZE 64
@@ -2,23 +2,30 @@
 #include <dsound.h>
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "apiprof.h"
 #include "defs.h"
 #include "ds-buffer.h"
 #include "ds-buffer-pri.h"
-#include "reaper.h"
+#include "engine.h"
+#include "memstat.h"
 #include "refcount.h"
 #include "trace.h"
-#include "wasapi.h"
+
+/*  Every DirectSound object shares the one engine, but keeps its own
+    cooperative level. Its sound buffers each hold a reference to it, so it
+    only lets go of the engine once all of them are gone. */
 
 struct ds_api {
     IDirectSound8 com;
     refcount_t rc;
     CRITICAL_SECTION lock; /* TODO implement locking */
-    struct wasapi *wasapi;
-    struct reaper *reaper;
+    struct engine *engine;
+    HWND hwnd;
+    DWORD coop_level;
 };
 
 static HRESULT ds_api_alloc(struct ds_api **out);
@@ -27,28 +34,28 @@ static IDirectSound8 *ds_api_upcast(struct ds_api *self);
 static struct ds_api *ds_api_ref(struct ds_api *self);
 static struct ds_api *ds_api_unref(struct ds_api *self);
 static void ds_api_unref_notify(void *ptr);
-static HRESULT ds_api_start(struct ds_api *self);
-static HRESULT ds_api_create_sound_buffer_pri(IDirectSoundBuffer **out);
+static void ds_api_buffer_gone(void *ptr);
+static HRESULT ds_api_create_sound_buffer_pri(
+        struct ds_api *self,
+        IDirectSoundBuffer **out);
 static HRESULT ds_api_create_sound_buffer_sec(
         struct ds_api *self,
         const DSBUFFERDESC *desc,
-        IDirectSoundBuffer **out);
+        IDirectSoundBuffer **out,
+        void *caller);
 
 static struct IDirectSound8Vtbl ds_api_vtbl;
 
 static HRESULT ds_api_alloc(struct ds_api **out)
 {
     struct ds_api *self;
-    struct snd_client *cli;
     HRESULT hr;
 
     trace_enter();
     assert(out != NULL);
 
     *out = NULL;
-    cli = NULL;
-
-    self = calloc(sizeof(*self), 1);
+    self = memstat_calloc(sizeof(*self), 1);
 
     if (self == NULL) {
         hr = E_OUTOFMEMORY;
@@ -56,33 +63,23 @@ static HRESULT ds_api_alloc(struct ds_api **out)
         goto end;
     }
 
-    self->com.lpVtbl = &ds_api_vtbl;
     self->rc = 1;
+    self->coop_level = DSSCL_NORMAL;
 
-    hr = wasapi_alloc(&self->wasapi);
+    hr = engine_acquire(&self->engine);
 
     if (FAILED(hr)) {
         goto end;
     }
 
-    hr = wasapi_snd_client_alloc(self->wasapi, &cli);
+    /*  Starting the engine decides whether API calls are profiled */
 
-    if (FAILED(hr)) {
-        goto end;
-    }
-
-    hr = reaper_alloc(&self->reaper, cli);
-
-    if (FAILED(hr)) {
-        goto end;
-    }
+    self->com.lpVtbl = apiprof_wrap_api(&ds_api_vtbl);
 
-    cli = NULL; /* Release ownership of client to the reaper */
     *out = ds_api_ref(self);
 
 end:
     ds_api_unref(self);
-    snd_client_free(cli);
     trace_exit();
 
     return hr;
@@ -120,13 +117,13 @@ static struct ds_api *ds_api_unref(struct ds_api *self)
         return NULL;
     }
 
-    trace("Hypersonik is shutting down");
+    trace("DirectSound object %p is shutting down", self);
 
-    reaper_free(self->reaper);
-    wasapi_free(self->wasapi);
+    engine_release(self->engine);
     free(self);
 
-    trace("Hypersonik shutdown complete");
+    memstat_trace();
+    trace("DirectSound object shutdown complete");
 
     return NULL;
 }
@@ -136,19 +133,13 @@ static void ds_api_unref_notify(void *ptr)
     ds_api_unref(ptr);
 }
 
-static HRESULT ds_api_start(struct ds_api *self)
+static void ds_api_buffer_gone(void *ptr)
 {
-    HRESULT hr;
-
-    assert(self != NULL);
-
-    hr = reaper_start(self->reaper);
-
-    if (FAILED(hr)) {
-        return hr;
-    }
+    struct ds_api *self;
 
-    return wasapi_start(self->wasapi);
+    self = ptr;
+    engine_remove_buffer(self->engine);
+    ds_api_unref(self);
 }
 
 static __stdcall HRESULT ds_api_query_interface(
@@ -204,6 +195,7 @@ static __stdcall HRESULT ds_api_create_sound_buffer(
         IUnknown *outer)
 {
     struct ds_api *self;
+    void *caller;
 
     self = ds_api_downcast(com);
 
@@ -218,32 +210,66 @@ static __stdcall HRESULT ds_api_create_sound_buffer(
     }
 
     if (desc->dwFlags & DSBCAPS_PRIMARYBUFFER) {
-        return ds_api_create_sound_buffer_pri(out);
+        return ds_api_create_sound_buffer_pri(self, out);
     } else {
-        return ds_api_create_sound_buffer_sec(self, desc, out);
+        /*  What the buffer costs to mix is put down to the caller. With
+            the API profiled, that is the wrapper's caller, not the
+            wrapper. */
+
+        caller = apiprof_get_caller();
+
+        if (caller == NULL) {
+            caller = __builtin_return_address(0);
+        }
+
+        return ds_api_create_sound_buffer_sec(self, desc, out, caller);
     }
 }
 
-static HRESULT ds_api_create_sound_buffer_pri(IDirectSoundBuffer **out)
+static HRESULT ds_api_create_sound_buffer_pri(
+        struct ds_api *self,
+        IDirectSoundBuffer **out)
 {
+    struct snd_client *cli;
     struct ds_buffer_pri *child;
     HRESULT hr;
 
-    hr = ds_buffer_pri_alloc(&child);
+    child = NULL;
+    cli = NULL;
+
+    hr = engine_snd_client_alloc(self->engine, &cli);
 
     if (FAILED(hr)) {
-        return hr;
+        goto end;
     }
 
+    hr = ds_buffer_pri_alloc(
+            &child,
+            ds_api_unref_notify,
+            ds_api_ref(self),
+            &self->coop_level,
+            self->engine,
+            cli);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    cli = NULL; /* ds_buffer_pri has taken ownership */
     *out = ds_buffer_pri_upcast(ds_buffer_pri_ref(child));
 
-    return S_OK;
+end:
+    ds_buffer_pri_unref(child);
+    snd_client_free(cli);
+
+    return hr;
 }
 
 static HRESULT ds_api_create_sound_buffer_sec(
         struct ds_api *self,
         const DSBUFFERDESC *desc,
-        IDirectSoundBuffer **out)
+        IDirectSoundBuffer **out,
+        void *caller)
 {
     struct snd_client *cli;
     struct ds_buffer *child;
@@ -252,22 +278,28 @@ static HRESULT ds_api_create_sound_buffer_sec(
     child = NULL;
     cli = NULL;
 
-    hr = wasapi_snd_client_alloc(self->wasapi, &cli);
+    hr = engine_snd_client_alloc(self->engine, &cli);
 
     if (FAILED(hr)) {
         goto end;
     }
 
+    /*  Counted in before the format is read, so that the mix rate cannot
+        change underneath the conversion. */
+
+    engine_add_buffer(self->engine);
     hr = ds_buffer_alloc(
             &child,
-            ds_api_unref_notify,
+            ds_api_buffer_gone,
             ds_api_ref(self),
-            self->reaper,
+            engine_get_reaper(self->engine),
+            engine_get_notifier(self->engine),
             cli,
             NULL,
             desc->lpwfxFormat,
-            wasapi_get_sys_format(self->wasapi),
-            desc->dwBufferBytes);
+            engine_get_sys_format(self->engine),
+            desc->dwBufferBytes,
+            (uintptr_t) caller);
 
     if (FAILED(hr)) {
         goto end;
@@ -314,7 +346,7 @@ static __stdcall HRESULT ds_api_duplicate_sound_buffer(
         goto end;
     }
 
-    hr = wasapi_snd_client_alloc(self->wasapi, &cli);
+    hr = engine_snd_client_alloc(self->engine, &cli);
 
     if (FAILED(hr)) {
         goto end;
@@ -324,12 +356,14 @@ static __stdcall HRESULT ds_api_duplicate_sound_buffer(
             &dest,
             ds_buffer_unref_notify,
             ds_buffer_ref(src),
-            self->reaper,
+            engine_get_reaper(self->engine),
+            engine_get_notifier(self->engine),
             cli,
             ds_buffer_get_snd_buffer(src),
             ds_buffer_get_format_(src),
-            wasapi_get_sys_format(self->wasapi),
-            ds_buffer_get_nbytes(src));
+            engine_get_sys_format(self->engine),
+            ds_buffer_get_nbytes(src),
+            ds_buffer_get_tag(src));
 
     if (FAILED(hr)) {
         goto end;
@@ -386,8 +420,22 @@ static __stdcall HRESULT ds_api_set_cooperative_level(
         HWND hwnd,
         DWORD level)
 {
+    struct ds_api *self;
+
     trace("%s(%p, %08x)", __func__, hwnd, level);
 
+    self = ds_api_downcast(com);
+
+    if (level < DSSCL_NORMAL || level > DSSCL_WRITEPRIMARY) {
+        return DSERR_INVALIDPARAM;
+    }
+
+    /*  This only concerns the object it is set on: other DirectSound
+        objects in the process keep their own level. */
+
+    self->hwnd = hwnd;
+    self->coop_level = level;
+
     return S_OK;
 }
 
@@ -449,7 +497,7 @@ HRESULT __stdcall ds_api_create(
         return E_NOTIMPL;
     }
 
-    trace("Initializing Hypersonik: Allocating system resources");
+    trace("Initializing Hypersonik");
 
     *out = NULL;
     hr = ds_api_alloc(&api);
@@ -458,14 +506,6 @@ HRESULT __stdcall ds_api_create(
         goto end;
     }
 
-    trace("Initializing Hypersonik: Launching realtime audio thread");
-
-    hr = ds_api_start(api);
-
-    if (FAILED(hr)) {
-        goto end;
-    }
-
     *out = ds_api_upcast(ds_api_ref(api));
 
 end:
@@ -2,36 +2,83 @@
 #include <dsound.h>
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "apiprof.h"
 #include "defs.h"
 #include "ds-buffer-pri.h"
+#include "engine.h"
+#include "hr.h"
+#include "memstat.h"
 #include "refcount.h"
+#include "snd-primary.h"
+#include "snd-service.h"
 #include "trace.h"
 
+/*  Applications can only get at the primary buffer's contents under
+    DSSCL_WRITEPRIMARY, in which case Lock hands out pointers straight into
+    the ring that the engine copies to the device. Otherwise it is just a
+    handle on the output format, and playing it does nothing. */
+
 struct ds_buffer_pri {
     IDirectSoundBuffer com;
     refcount_t rc;
+    dtor_notify_t dtor_notify;
+    void *dtor_notify_ctx;
+    const DWORD *coop_level;
+    struct engine *engine;
+    struct snd_client *cli;
+    struct snd_primary *primary;
+    WAVEFORMATEX format;
+    bool playing;
 };
 
+static bool ds_buffer_pri_is_writable(const struct ds_buffer_pri *self);
+static HRESULT ds_buffer_pri_submit(struct ds_buffer_pri *self, bool play);
+
 static IDirectSoundBufferVtbl ds_buffer_pri_vtbl;
 
-HRESULT ds_buffer_pri_alloc(struct ds_buffer_pri **out)
+HRESULT ds_buffer_pri_alloc(
+        struct ds_buffer_pri **out,
+        dtor_notify_t dtor_notify,
+        void *dtor_notify_ctx,
+        const DWORD *coop_level,
+        struct engine *engine,
+        struct snd_client *cli)
 {
     struct ds_buffer_pri *self;
 
     assert(out != NULL);
+    assert(coop_level != NULL);
+    assert(engine != NULL);
+    assert(cli != NULL);
 
     *out = NULL;
-    self = calloc(sizeof(*self), 1);
+    self = memstat_calloc(sizeof(*self), 1);
 
     if (self == NULL) {
+        if (dtor_notify != NULL) {
+            dtor_notify(dtor_notify_ctx);
+        }
+
         return E_OUTOFMEMORY;
     }
 
-    self->com.lpVtbl = &ds_buffer_pri_vtbl;
+    /*  Take ownership of the client and the destructor notification */
+
+    self->com.lpVtbl = apiprof_wrap_buffer(
+            &ds_buffer_pri_vtbl,
+            APIPROF_KIND_PRIMARY);
     self->rc = 1;
+    self->dtor_notify = dtor_notify;
+    self->dtor_notify_ctx = dtor_notify_ctx;
+    self->coop_level = coop_level;
+    self->engine = engine;
+    self->cli = cli;
+    self->primary = engine_get_primary(engine);
+    self->format = *engine_get_sys_format(engine);
 
     *out = self;
 
@@ -70,11 +117,52 @@ struct ds_buffer_pri *ds_buffer_pri_unref(struct ds_buffer_pri *self)
         return NULL;
     }
 
+    /*  The ring belongs to the engine, so there is nothing to wait for, but
+        it should not carry on looping once nobody can write to it. */
+
+    if (self->playing) {
+        ds_buffer_pri_submit(self, false);
+    }
+
+    snd_client_free(self->cli);
+
+    if (self->dtor_notify != NULL) {
+        self->dtor_notify(self->dtor_notify_ctx);
+    }
+
     free(self);
 
     return NULL;
 }
 
+static bool ds_buffer_pri_is_writable(const struct ds_buffer_pri *self)
+{
+    return *self->coop_level == DSSCL_WRITEPRIMARY && self->primary != NULL;
+}
+
+static HRESULT ds_buffer_pri_submit(struct ds_buffer_pri *self, bool play)
+{
+    struct snd_command *cmd;
+    int r;
+
+    r = snd_client_cmd_alloc(self->cli, &cmd);
+
+    if (r < 0) {
+        return hr_from_errno(r);
+    }
+
+    if (play) {
+        snd_command_play_primary(cmd, self->primary);
+    } else {
+        snd_command_stop_primary(cmd);
+    }
+
+    snd_client_cmd_submit(self->cli, cmd);
+    self->playing = play;
+
+    return S_OK;
+}
+
 static __stdcall HRESULT ds_buffer_pri_query_interface(
         IDirectSoundBuffer *com,
         const IID *iid,
@@ -115,16 +203,292 @@ static __stdcall ULONG ds_buffer_pri_release(IDirectSoundBuffer *com)
     return 0;
 }
 
+static __stdcall HRESULT ds_buffer_pri_get_caps(
+        IDirectSoundBuffer *com,
+        DSBCAPS *out)
+{
+    struct ds_buffer_pri *self;
+
+    if (out == NULL) {
+        return E_POINTER;
+    }
+
+    if (out->dwSize != sizeof(*out)) {
+        trace("%s: unexpected out param size: %i", __func__, out->dwSize);
+        return E_INVALIDARG;
+    }
+
+    self = ds_buffer_pri_downcast(com);
+    out->dwFlags = DSBCAPS_PRIMARYBUFFER;
+    out->dwBufferBytes = self->primary != NULL
+            ? snd_primary_nframes(self->primary) * self->format.nBlockAlign
+            : 0;
+    out->dwUnlockTransferRate = 100000000;
+    out->dwPlayCpuOverhead = 0;
+
+    return S_OK;
+}
+
+static __stdcall HRESULT ds_buffer_pri_get_current_position(
+        IDirectSoundBuffer *com,
+        DWORD *cur_play_byte_no,
+        DWORD *cur_write_byte_no)
+{
+    struct ds_buffer_pri *self;
+    size_t nframes;
+    size_t pos;
+
+    self = ds_buffer_pri_downcast(com);
+
+    if (self->primary == NULL) {
+        return DSERR_PRIOLEVELNEEDED;
+    }
+
+    nframes = snd_primary_nframes(self->primary);
+    pos = snd_primary_get_position(self->primary);
+
+    if (cur_play_byte_no != NULL) {
+        *cur_play_byte_no = pos * self->format.nBlockAlign;
+    }
+
+    if (cur_write_byte_no != NULL) {
+        pos = (pos + snd_primary_get_guard(self->primary)) % nframes;
+        *cur_write_byte_no = pos * self->format.nBlockAlign;
+    }
+
+    return S_OK;
+}
+
+static __stdcall HRESULT ds_buffer_pri_get_format(
+        IDirectSoundBuffer *com,
+        WAVEFORMATEX *out,
+        DWORD nbytes,
+        DWORD *nbytes_out)
+{
+    struct ds_buffer_pri *self;
+
+    if (out != NULL) {
+        self = ds_buffer_pri_downcast(com);
+        nbytes = nbytes < sizeof(*out) ? nbytes : sizeof(*out);
+        memcpy(out, &self->format, nbytes);
+
+        if (nbytes_out != NULL) {
+            *nbytes_out = nbytes;
+        }
+    } else if (nbytes_out != NULL) {
+        *nbytes_out = sizeof(*out);
+    } else {
+        return E_INVALIDARG;
+    }
+
+    return S_OK;
+}
+
+static __stdcall HRESULT ds_buffer_pri_get_status(
+        IDirectSoundBuffer *com,
+        DWORD *out)
+{
+    struct ds_buffer_pri *self;
+
+    if (out == NULL) {
+        return E_POINTER;
+    }
+
+    self = ds_buffer_pri_downcast(com);
+    *out = self->playing ? DSBSTATUS_PLAYING | DSBSTATUS_LOOPING : 0;
+
+    return S_OK;
+}
+
+static __stdcall HRESULT ds_buffer_pri_lock(
+        IDirectSoundBuffer *com,
+        DWORD in_pos,
+        DWORD in_nbytes,
+        void **out_ptr,
+        DWORD *out_nbytes,
+        void **out_ptr2,
+        DWORD *out_nbytes2,
+        DWORD flags)
+{
+    struct ds_buffer_pri *self;
+    uint8_t *buf_bytes;
+    size_t buf_nbytes;
+    size_t align;
+    size_t nbytes;
+    DWORD write_pos;
+
+    self = ds_buffer_pri_downcast(com);
+
+    if (out_ptr == NULL || out_nbytes == NULL) {
+        return E_POINTER;
+    }
+
+    *out_ptr = NULL;
+    *out_nbytes = 0;
+
+    if (out_ptr2 != NULL) {
+        *out_ptr2 = NULL;
+    }
+
+    if (out_nbytes2 != NULL) {
+        *out_nbytes2 = 0;
+    }
+
+    if (!ds_buffer_pri_is_writable(self)) {
+        return DSERR_PRIOLEVELNEEDED;
+    }
+
+    /*  Nothing gets copied here or on unlock: the application writes the
+        same memory that the engine thread reads from. */
+
+    align = self->format.nBlockAlign;
+    buf_bytes = (uint8_t *) snd_primary_samples_rw(self->primary);
+    buf_nbytes = snd_primary_nframes(self->primary) * align;
+
+    if (flags & DSBLOCK_FROMWRITECURSOR) {
+        ds_buffer_pri_get_current_position(com, NULL, &write_pos);
+        in_pos = write_pos;
+    }
+
+    if (flags & DSBLOCK_ENTIREBUFFER) {
+        in_nbytes = buf_nbytes;
+    }
+
+    if (in_pos >= buf_nbytes || in_nbytes > buf_nbytes) {
+        return DSERR_INVALIDPARAM;
+    }
+
+    in_pos -= in_pos % align;
+    nbytes = in_nbytes - in_nbytes % align;
+
+    /* Split the span where it wraps around the end of the ring */
+
+    *out_ptr = buf_bytes + in_pos;
+
+    if (in_pos + nbytes <= buf_nbytes) {
+        *out_nbytes = nbytes;
+    } else if (out_ptr2 != NULL && out_nbytes2 != NULL) {
+        *out_nbytes = buf_nbytes - in_pos;
+        *out_ptr2 = buf_bytes;
+        *out_nbytes2 = nbytes - *out_nbytes;
+    } else {
+        trace("%s: Span wraps but no second pointer given", __func__);
+        *out_nbytes = buf_nbytes - in_pos;
+    }
+
+    return S_OK;
+}
+
+static __stdcall HRESULT ds_buffer_pri_play(
+        IDirectSoundBuffer *com,
+        DWORD reserved1,
+        DWORD reserved2,
+        DWORD flags)
+{
+    struct ds_buffer_pri *self;
+    enum memstat_site site;
+    HRESULT hr;
+
+    self = ds_buffer_pri_downcast(com);
+
+    if (!(flags & DSBPLAY_LOOPING)) {
+        return DSERR_INVALIDPARAM;
+    }
+
+    /*  Otherwise the primary buffer plays whenever any secondary buffer
+        does, which the engine takes care of by itself. */
+
+    if (!ds_buffer_pri_is_writable(self) || self->playing) {
+        return S_OK;
+    }
+
+    site = memstat_enter(MEMSTAT_SITE_PLAY);
+    hr = ds_buffer_pri_submit(self, true);
+    memstat_leave(site);
+
+    return hr;
+}
+
 static __stdcall HRESULT ds_buffer_pri_set_format(
         IDirectSoundBuffer *com,
         const WAVEFORMATEX *format)
 {
-    trace("%s(%p) [stub]", __func__, format);
+    struct ds_buffer_pri *self;
+    HRESULT hr;
 
     if (format == NULL) {
         return E_POINTER;
     }
 
+    trace(  "%s(%u Hz, %u channels, %u bits)",
+            __func__,
+            (unsigned int) format->nSamplesPerSec,
+            (unsigned int) format->nChannels,
+            (unsigned int) format->wBitsPerSample);
+
+    self = ds_buffer_pri_downcast(com);
+
+    if (*self->coop_level < DSSCL_PRIORITY) {
+        return DSERR_PRIOLEVELNEEDED;
+    }
+
+    if (    format->nSamplesPerSec < DSBFREQUENCY_MIN ||
+            format->nSamplesPerSec > DSBFREQUENCY_MAX) {
+        return DSERR_INVALIDPARAM;
+    }
+
+    /*  Only the rate is taken up: we always mix in 16-bit stereo. If the
+        device cannot match it, the mix gets resampled for the device
+        instead. It may still be too late for a new rate, so GetFormat says
+        what we ended up with, as DirectSound has always done. */
+
+    hr = engine_set_mix_format(self->engine, format);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    self->format = *engine_get_sys_format(self->engine);
+
+    return S_OK;
+}
+
+static __stdcall HRESULT ds_buffer_pri_stop(IDirectSoundBuffer *com)
+{
+    struct ds_buffer_pri *self;
+    enum memstat_site site;
+    HRESULT hr;
+
+    self = ds_buffer_pri_downcast(com);
+
+    if (!self->playing) {
+        return S_OK;
+    }
+
+    site = memstat_enter(MEMSTAT_SITE_STOP);
+    hr = ds_buffer_pri_submit(self, false);
+    memstat_leave(site);
+
+    return hr;
+}
+
+static __stdcall HRESULT ds_buffer_pri_unlock(
+        IDirectSoundBuffer *com,
+        void *bytes,
+        DWORD nbytes,
+        void *bytes2,
+        DWORD nbytes2)
+{
+    struct ds_buffer_pri *self;
+
+    self = ds_buffer_pri_downcast(com);
+
+    if (!ds_buffer_pri_is_writable(self)) {
+        return DSERR_PRIOLEVELNEEDED;
+    }
+
+    snd_primary_commit(self->primary);
+
     return S_OK;
 }
 
@@ -132,5 +496,13 @@ static struct IDirectSoundBufferVtbl ds_buffer_pri_vtbl = {
     .QueryInterface     = ds_buffer_pri_query_interface,
     .AddRef             = ds_buffer_pri_add_ref,
     .Release            = ds_buffer_pri_release,
+    .GetCaps            = ds_buffer_pri_get_caps,
+    .GetCurrentPosition = ds_buffer_pri_get_current_position,
+    .GetFormat          = ds_buffer_pri_get_format,
+    .GetStatus          = ds_buffer_pri_get_status,
+    .Lock               = ds_buffer_pri_lock,
+    .Play               = ds_buffer_pri_play,
     .SetFormat          = ds_buffer_pri_set_format,
+    .Stop               = ds_buffer_pri_stop,
+    .Unlock             = ds_buffer_pri_unlock,
 };
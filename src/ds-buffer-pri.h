@@ -3,9 +3,22 @@
 #include <windows.h>
 #include <dsound.h>
 
+#include "engine.h"
+#include "refcount.h"
+#include "snd-service.h"
+
 struct ds_buffer_pri;
 
-HRESULT ds_buffer_pri_alloc(struct ds_buffer_pri **out);
+/*  coop_level points at the owning DirectSound object's cooperative level,
+    which the destructor notification keeps alive, along with the engine. */
+
+HRESULT ds_buffer_pri_alloc(
+        struct ds_buffer_pri **out,
+        dtor_notify_t dtor_notify,
+        void *dtor_notify_ctx,
+        const DWORD *coop_level,
+        struct engine *engine,
+        struct snd_client *cli);
 struct ds_buffer_pri *ds_buffer_pri_downcast(IDirectSoundBuffer *com);
 IDirectSoundBuffer *ds_buffer_pri_upcast(struct ds_buffer_pri *self);
 struct ds_buffer_pri *ds_buffer_pri_ref(struct ds_buffer_pri *self);
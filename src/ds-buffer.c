@@ -8,10 +8,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "apiprof.h"
 #include "converter.h"
 #include "defs.h"
 #include "ds-buffer.h"
+#include "ds-notify.h"
 #include "hr.h"
+#include "memstat.h"
+#include "notifier.h"
 #include "reaper.h"
 #include "refcount.h"
 #include "snd-buffer.h"
@@ -23,6 +27,7 @@
 
 struct ds_buffer {
     IDirectSoundBuffer com;
+    IDirectSoundNotify notify_com;
     refcount_t rc;
     CRITICAL_SECTION lock; /* TODO implement locking */
     dtor_notify_t dtor_notify;
@@ -32,11 +37,16 @@ struct ds_buffer {
     size_t conv_nbytes;
     struct reaper *reaper;
     struct reaper_task *rtask;
+    struct notifier *notifier;
+    struct ds_notify *notify;
     struct snd_buffer *buf;
     struct snd_stream *stm;
     struct snd_client *cli;
     WAVEFORMATEX format;
     WAVEFORMATEX format_sys;
+    LONG volume;
+    LONG pan;
+    unsigned int serial;
     bool buf_owned;
     bool playing;
     bool looping;
@@ -44,19 +54,32 @@ struct ds_buffer {
 
 static bool ds_buffer_requires_conversion(const struct ds_buffer *self);
 static HRESULT ds_buffer_prepare_conversion(struct ds_buffer *self);
+static HRESULT ds_buffer_submit_volume(struct ds_buffer *self);
+static void ds_buffer_read_state(
+        struct ds_buffer *self,
+        struct snd_stream_state *state);
+static uint16_t ds_buffer_linear_volume(LONG millibels);
+static struct ds_buffer *ds_buffer_notify_downcast(IDirectSoundNotify *com);
+static HRESULT ds_buffer_convert_mark(
+        const struct ds_buffer *self,
+        const DSBPOSITIONNOTIFY *in,
+        struct ds_notify_mark *out);
 
 static IDirectSoundBufferVtbl ds_buffer_vtbl;
+static IDirectSoundNotifyVtbl ds_buffer_notify_vtbl;
 
 HRESULT ds_buffer_alloc(
         struct ds_buffer **out,
         dtor_notify_t dtor_notify,
         void *dtor_notify_ctx,
         struct reaper *reaper,
+        struct notifier *notifier,
         struct snd_client *cli,
         struct snd_buffer *buf,
         const WAVEFORMATEX *format,
         const WAVEFORMATEX *format_sys,
-        size_t nbytes)
+        size_t nbytes,
+        uintptr_t tag)
 {
     struct ds_buffer *self;
     size_t sys_nbytes;
@@ -66,6 +89,7 @@ HRESULT ds_buffer_alloc(
     assert(out != NULL);
     assert(cli != NULL);
     assert(reaper != NULL);
+    assert(notifier != NULL);
     assert(format != NULL);
     assert(format_sys != NULL);
 
@@ -79,7 +103,7 @@ HRESULT ds_buffer_alloc(
         return hr;
     }
 
-    self = calloc(sizeof(*self), 1);
+    self = memstat_calloc(sizeof(*self), 1);
 
     if (self == NULL) {
         hr = E_OUTOFMEMORY;
@@ -87,10 +111,16 @@ HRESULT ds_buffer_alloc(
         goto end;
     }
 
-    self->com.lpVtbl = &ds_buffer_vtbl;
     self->rc = 1;
     memcpy(&self->format, format, sizeof(*format));
     memcpy(&self->format_sys, format_sys, sizeof(*format_sys));
+    self->com.lpVtbl = apiprof_wrap_buffer(
+            &ds_buffer_vtbl,
+            ds_buffer_requires_conversion(self)
+                    ? APIPROF_KIND_CONVERTED
+                    : APIPROF_KIND_BUFFER);
+    self->notify_com.lpVtbl = &ds_buffer_notify_vtbl;
+    self->notifier = notifier;
 
     self->conv_nbytes = nbytes;
 
@@ -128,12 +158,15 @@ HRESULT ds_buffer_alloc(
         goto end;
     }
 
+    snd_stream_set_tag(self->stm, tag);
+
     /* Pre-allocate a reaper task to clean up this object */
 
     self->reaper = reaper;
     hr = reaper_alloc_task(
             reaper,
             &self->rtask,
+            cli,
             self->stm,
             self->buf_owned ? self->buf : NULL);
 
@@ -257,6 +290,15 @@ size_t ds_buffer_get_nbytes(const struct ds_buffer *self)
     return self->conv_nbytes;
 }
 
+uintptr_t ds_buffer_get_tag(const struct ds_buffer *self)
+{
+    assert(self != NULL);
+
+    /*  Never changes once the stream has been handed to the mixer */
+
+    return snd_stream_get_tag(self->stm);
+}
+
 static bool ds_buffer_requires_conversion(const struct ds_buffer *self)
 {
     assert(self != NULL);
@@ -278,7 +320,7 @@ static HRESULT ds_buffer_prepare_conversion(struct ds_buffer *self)
 
     assert(self->conv_bytes == NULL);
 
-    self->conv_bytes = calloc(self->conv_nbytes, 1);
+    self->conv_bytes = memstat_calloc(self->conv_nbytes, 1);
 
     if (self->conv_bytes == NULL) {
         hr = E_OUTOFMEMORY;
@@ -308,6 +350,70 @@ fail:
     return hr;
 }
 
+static void ds_buffer_read_state(
+        struct ds_buffer *self,
+        struct snd_stream_state *state)
+{
+    assert(self != NULL);
+    assert(state != NULL);
+
+    snd_stream_read_state(self->stm, state);
+
+    /*  If our most recent Play or Stop has not reached the mixer yet then
+        report what the application asked for, not what the mixer is doing.
+        A pending Play rewinds the stream, a pending Stop leaves it be. */
+
+    if (state->serial != self->serial) {
+        state->flags = 0;
+
+        if (self->playing) {
+            state->flags |= SND_STREAM_PLAYING;
+            state->pos = 0;
+
+            if (self->looping) {
+                state->flags |= SND_STREAM_LOOPING;
+            }
+        }
+    }
+}
+
+static HRESULT ds_buffer_submit_volume(struct ds_buffer *self)
+{
+    struct snd_command *cmd;
+    LONG left;
+    LONG right;
+    int r;
+
+    assert(self != NULL);
+
+    /*  DirectSound pans by attenuating the opposite channel, so a positive
+        (rightward) pan turns the left channel down and vice versa. */
+
+    left = self->volume - (self->pan > 0 ? self->pan : 0);
+    right = self->volume + (self->pan < 0 ? self->pan : 0);
+
+    r = snd_client_cmd_alloc(self->cli, &cmd);
+
+    if (r < 0) {
+        return hr_from_errno(r);
+    }
+
+    snd_command_set_volume(cmd, self->stm, 0, ds_buffer_linear_volume(left));
+    snd_command_set_volume(cmd, self->stm, 1, ds_buffer_linear_volume(right));
+    snd_client_cmd_submit(self->cli, cmd);
+
+    return S_OK;
+}
+
+static uint16_t ds_buffer_linear_volume(LONG millibels)
+{
+    if (millibels <= DSBVOLUME_MIN) {
+        return 0;
+    }
+
+    return 256.0 * pow(10.0, millibels / 2000.0);
+}
+
 static __stdcall HRESULT ds_buffer_query_interface(
         IDirectSoundBuffer *com,
         const IID *iid,
@@ -332,6 +438,11 @@ static __stdcall HRESULT ds_buffer_query_interface(
         ds_buffer_ref(self);
         *out = com;
 
+        return S_OK;
+    } else if (memcmp(iid, &IID_IDirectSoundNotify, sizeof(*iid)) == 0) {
+        ds_buffer_ref(self);
+        *out = &self->notify_com;
+
         return S_OK;
     } else {
         return E_NOINTERFACE;
@@ -382,8 +493,8 @@ static __stdcall HRESULT ds_buffer_get_current_position(
         DWORD *cur_play_byte_no,
         DWORD *cur_write_byte_no)
 {
+    struct snd_stream_state state;
     struct ds_buffer *self;
-    size_t sys_frame_pos;
     size_t sys_byte_pos;
     size_t tmp;
     HRESULT hr;
@@ -391,8 +502,8 @@ static __stdcall HRESULT ds_buffer_get_current_position(
     self = ds_buffer_downcast(com);
 
     if (cur_play_byte_no != NULL) {
-        sys_frame_pos = snd_stream_peek_position(self->stm);
-        sys_byte_pos = sys_frame_pos
+        ds_buffer_read_state(self, &state);
+        sys_byte_pos = state.pos
                 * (self->format_sys.wBitsPerSample / 8)
                 * self->format_sys.nChannels;
 
@@ -465,15 +576,23 @@ static __stdcall HRESULT ds_buffer_get_pan(
         IDirectSoundBuffer *com,
         LONG *out)
 {
-    trace("%s(%p) [stub]", __func__, out);
+    struct ds_buffer *self;
 
-    return E_NOTIMPL;
+    if (out == NULL) {
+        return E_POINTER;
+    }
+
+    self = ds_buffer_downcast(com);
+    *out = self->pan;
+
+    return S_OK;
 }
 
 static __stdcall HRESULT ds_buffer_get_status(
         IDirectSoundBuffer *com,
         DWORD *out)
 {
+    struct snd_stream_state state;
     struct ds_buffer *self;
     DWORD status;
 
@@ -482,20 +601,14 @@ static __stdcall HRESULT ds_buffer_get_status(
     }
 
     self = ds_buffer_downcast(com);
-
-    /* Make sure self->playing is up to date */
-
-    if (self->playing && snd_stream_is_finished(self->stm)) {
-        self->playing = false;
-    }
-
+    ds_buffer_read_state(self, &state);
     status = 0;
 
-    if (self->playing) {
+    if (state.flags & SND_STREAM_PLAYING) {
         status |= DSBSTATUS_PLAYING;
     }
 
-    if (self->looping) {
+    if (state.flags & SND_STREAM_LOOPING) {
         status |= DSBSTATUS_LOOPING;
     }
 
@@ -508,9 +621,16 @@ static __stdcall HRESULT ds_buffer_get_volume(
         IDirectSoundBuffer *com,
         LONG *out)
 {
-    trace("%s(%p)", __func__, out);
+    struct ds_buffer *self;
 
-    return E_NOTIMPL;
+    if (out == NULL) {
+        return E_POINTER;
+    }
+
+    self = ds_buffer_downcast(com);
+    *out = self->volume;
+
+    return S_OK;
 }
 
 static __stdcall HRESULT ds_buffer_initialize(
@@ -623,9 +743,12 @@ static __stdcall HRESULT ds_buffer_play(
 {
     struct ds_buffer *self;
     struct snd_command *cmd;
+    enum memstat_site site;
+    HRESULT hr;
     int r;
 
     self = ds_buffer_downcast(com);
+    site = memstat_enter(MEMSTAT_SITE_PLAY);
 
     /*  Why only two reserved parameters? Why not ten?
         You know, just to be sure. Fucking Microsoft. */
@@ -633,16 +756,23 @@ static __stdcall HRESULT ds_buffer_play(
     r = snd_client_cmd_alloc(self->cli, &cmd);
 
     if (r < 0) {
-        return hr_from_errno(r);
+        hr = hr_from_errno(r);
+
+        goto end;
     }
 
     self->playing = true;
     self->looping = flags & DSBPLAY_LOOPING;
 
     snd_command_play(cmd, self->stm, self->looping);
+    snd_command_set_serial(cmd, ++self->serial);
     snd_client_cmd_submit(self->cli, cmd);
+    hr = S_OK;
 
-    return S_OK;
+end:
+    memstat_leave(site);
+
+    return hr;
 }
 
 static __stdcall HRESULT ds_buffer_restore(IDirectSoundBuffer *com)
@@ -694,9 +824,25 @@ static __stdcall HRESULT ds_buffer_set_pan(
         IDirectSoundBuffer *com,
         LONG pan)
 {
-    // stub
+    struct ds_buffer *self;
+    enum memstat_site site;
+    HRESULT hr;
 
-    return S_OK;
+    if (pan < DSBPAN_LEFT || pan > DSBPAN_RIGHT) {
+        trace("%s: Pan param out of range: %li", __func__, pan);
+
+        return E_INVALIDARG;
+    }
+
+    self = ds_buffer_downcast(com);
+    site = memstat_enter(MEMSTAT_SITE_SET_PAN);
+
+    self->pan = pan;
+    hr = ds_buffer_submit_volume(self);
+
+    memstat_leave(site);
+
+    return hr;
 }
 
 static __stdcall HRESULT ds_buffer_set_volume(
@@ -704,53 +850,57 @@ static __stdcall HRESULT ds_buffer_set_volume(
         LONG millibels)
 {
     struct ds_buffer *self;
-    struct snd_command *cmd;
-    int16_t linear_vol;
-    int r;
+    enum memstat_site site;
+    HRESULT hr;
 
-    if (millibels < -10000 || millibels > 0) {
-        trace("%s: Attenutation param out of range: %li", millibels);
+    if (millibels < DSBVOLUME_MIN || millibels > DSBVOLUME_MAX) {
+        trace("%s: Attenutation param out of range: %li", __func__, millibels);
 
         return E_INVALIDARG;
     }
 
     self = ds_buffer_downcast(com);
-    linear_vol = 256.0 * pow(10.0, millibels / 2000.0);
-
-    r = snd_client_cmd_alloc(self->cli, &cmd);
+    site = memstat_enter(MEMSTAT_SITE_SET_VOLUME);
 
-    if (r < 0) {
-        return hr_from_errno(r);
-    }
+    self->volume = millibels;
+    hr = ds_buffer_submit_volume(self);
 
-    snd_command_set_volume(cmd, self->stm, 0, linear_vol);
-    snd_command_set_volume(cmd, self->stm, 1, linear_vol);
-    snd_client_cmd_submit(self->cli, cmd);
+    memstat_leave(site);
 
-    return S_OK;
+    return hr;
 }
 
 static __stdcall HRESULT ds_buffer_stop(IDirectSoundBuffer *com)
 {
     struct ds_buffer *self;
     struct snd_command *cmd;
+    enum memstat_site site;
+    HRESULT hr;
     int r;
 
     self = ds_buffer_downcast(com);
+    site = memstat_enter(MEMSTAT_SITE_STOP);
 
     r = snd_client_cmd_alloc(self->cli, &cmd);
 
     if (r < 0) {
-        return hr_from_errno(r);
+        hr = hr_from_errno(r);
+
+        goto end;
     }
 
     snd_command_stop(cmd, self->stm);
+    snd_command_set_serial(cmd, ++self->serial);
     snd_client_cmd_submit(self->cli, cmd);
 
     self->playing = false;
     self->looping = false;
+    hr = S_OK;
 
-    return S_OK;
+end:
+    memstat_leave(site);
+
+    return hr;
 }
 
 static __stdcall HRESULT ds_buffer_unlock(
@@ -794,3 +944,155 @@ static struct IDirectSoundBufferVtbl ds_buffer_vtbl = {
     .Stop               = ds_buffer_stop,
     .Unlock             = ds_buffer_unlock,
 };
+
+static struct ds_buffer *ds_buffer_notify_downcast(IDirectSoundNotify *com)
+{
+    assert(com != NULL);
+
+    return containerof(com, struct ds_buffer, notify_com);
+}
+
+static HRESULT ds_buffer_convert_mark(
+        const struct ds_buffer *self,
+        const DSBPOSITIONNOTIFY *in,
+        struct ds_notify_mark *out)
+{
+    size_t sys_nbytes;
+    HRESULT hr;
+
+    if (in->hEventNotify == NULL) {
+        return DSERR_INVALIDPARAM;
+    }
+
+    out->event = in->hEventNotify;
+
+    if (in->dwOffset == DSBPN_OFFSETSTOP) {
+        out->frame = DS_NOTIFY_STOP;
+
+        return S_OK;
+    }
+
+    if (in->dwOffset >= self->conv_nbytes) {
+        trace(  "%s: Offset %u is past the end of the buffer",
+                __func__,
+                (unsigned int) in->dwOffset);
+
+        return DSERR_INVALIDPARAM;
+    }
+
+    /*  The offset is in the application's format, the stream in ours */
+
+    hr = converter_calculate_dest_nbytes(
+            &self->format,
+            &self->format_sys,
+            in->dwOffset,
+            &sys_nbytes);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    out->frame = sys_nbytes / self->format_sys.nBlockAlign;
+
+    return S_OK;
+}
+
+static __stdcall HRESULT ds_buffer_notify_query_interface(
+        IDirectSoundNotify *com,
+        const IID *iid,
+        void **out)
+{
+    struct ds_buffer *self;
+
+    self = ds_buffer_notify_downcast(com);
+
+    return IDirectSoundBuffer_QueryInterface(&self->com, iid, out);
+}
+
+static __stdcall ULONG ds_buffer_notify_add_ref(IDirectSoundNotify *com)
+{
+    ds_buffer_ref(ds_buffer_notify_downcast(com));
+
+    return 0;
+}
+
+static __stdcall ULONG ds_buffer_notify_release(IDirectSoundNotify *com)
+{
+    ds_buffer_unref(ds_buffer_notify_downcast(com));
+
+    return 0;
+}
+
+static __stdcall HRESULT ds_buffer_notify_set_positions(
+        IDirectSoundNotify *com,
+        DWORD nmarks,
+        const DSBPOSITIONNOTIFY *in)
+{
+    struct snd_stream_state state;
+    struct ds_notify_mark *marks;
+    struct ds_buffer *self;
+    DWORD i;
+    HRESULT hr;
+
+    self = ds_buffer_notify_downcast(com);
+    marks = NULL;
+
+    if (nmarks > DSBNOTIFICATIONS_MAX || (nmarks > 0 && in == NULL)) {
+        return DSERR_INVALIDPARAM;
+    }
+
+    ds_buffer_read_state(self, &state);
+
+    if (state.flags & SND_STREAM_PLAYING) {
+        trace("%s: Buffer is playing", __func__);
+
+        return DSERR_INVALIDCALL;
+    }
+
+    if (nmarks > 0) {
+        marks = memstat_calloc(nmarks, sizeof(*marks));
+
+        if (marks == NULL) {
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    for (i = 0 ; i < nmarks ; i++) {
+        hr = ds_buffer_convert_mark(self, &in[i], &marks[i]);
+
+        if (FAILED(hr)) {
+            goto end;
+        }
+    }
+
+    /*  Streams only start posting notices once they have a handler, and
+        then carry on until they are freed, which is when the reaper frees
+        the handler's state too. */
+
+    if (self->notify == NULL) {
+        hr = ds_notify_alloc(&self->notify, self->notifier);
+
+        if (FAILED(hr)) {
+            goto end;
+        }
+
+        reaper_task_set_dtor(self->rtask, ds_notify_free_notify, self->notify);
+        snd_stream_set_notify(self->stm, ds_notify_handle, self->notify);
+    }
+
+    ds_notify_set_marks(self->notify, marks, nmarks);
+    marks = NULL;
+    hr = S_OK;
+
+end:
+    free(marks);
+
+    return hr;
+}
+
+static IDirectSoundNotifyVtbl ds_buffer_notify_vtbl = {
+    .QueryInterface             = ds_buffer_notify_query_interface,
+    .AddRef                     = ds_buffer_notify_add_ref,
+    .Release                    = ds_buffer_notify_release,
+    .SetNotificationPositions   = ds_buffer_notify_set_positions,
+};
@@ -3,6 +3,9 @@
 #include <windows.h>
 #include <dsound.h>
 
+#include <stdint.h>
+
+#include "notifier.h"
 #include "reaper.h"
 #include "refcount.h"
 #include "snd-buffer.h"
@@ -15,11 +18,13 @@ HRESULT ds_buffer_alloc(
         dtor_notify_t dtor_notify,
         void *dtor_notify_ctx,
         struct reaper *reaper,
+        struct notifier *notifier,
         struct snd_client *cli,
         struct snd_buffer *buf,
         const WAVEFORMATEX *format,
         const WAVEFORMATEX *format_sys,
-        size_t nbytes);
+        size_t nbytes,
+        uintptr_t tag);
 struct ds_buffer *ds_buffer_downcast(IDirectSoundBuffer *com);
 IDirectSoundBuffer *ds_buffer_upcast(struct ds_buffer *self);
 struct ds_buffer *ds_buffer_ref(struct ds_buffer *self);
@@ -29,3 +34,4 @@ void ds_buffer_unref_notify(void *ptr);
 struct snd_buffer *ds_buffer_get_snd_buffer(struct ds_buffer *self);
 const WAVEFORMATEX *ds_buffer_get_format_(const struct ds_buffer *self);
 size_t ds_buffer_get_nbytes(const struct ds_buffer *self);
+uintptr_t ds_buffer_get_tag(const struct ds_buffer *self);
@@ -0,0 +1,130 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ds-notify.h"
+#include "hr.h"
+#include "memstat.h"
+#include "notifier.h"
+#include "snd-notice.h"
+
+/*  The marks are read by the notifier thread and replaced by whichever
+    thread the application calls us on, hence the lock. The audio thread
+    never comes near this. */
+
+struct ds_notify {
+    CRITICAL_SECTION lock;
+    struct notifier *notifier;
+    struct ds_notify_mark *marks;
+    size_t nmarks;
+};
+
+static bool ds_notify_is_due(
+        const struct ds_notify_mark *mark,
+        const struct snd_notice *n);
+
+HRESULT ds_notify_alloc(struct ds_notify **out, struct notifier *notifier)
+{
+    struct ds_notify *notify;
+
+    assert(out != NULL);
+    assert(notifier != NULL);
+
+    *out = NULL;
+    notify = memstat_calloc(1, sizeof(*notify));
+
+    if (notify == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    InitializeCriticalSection(&notify->lock);
+    notify->notifier = notifier;
+    notifier_arm(notifier);
+
+    *out = notify;
+
+    return S_OK;
+}
+
+void ds_notify_free(struct ds_notify *notify)
+{
+    if (notify == NULL) {
+        return;
+    }
+
+    notifier_disarm(notify->notifier);
+    DeleteCriticalSection(&notify->lock);
+    free(notify->marks);
+    free(notify);
+}
+
+void ds_notify_free_notify(void *ptr)
+{
+    ds_notify_free(ptr);
+}
+
+void ds_notify_set_marks(
+        struct ds_notify *notify,
+        struct ds_notify_mark *marks,
+        size_t nmarks)
+{
+    struct ds_notify_mark *old;
+
+    assert(notify != NULL);
+    assert(marks != NULL || nmarks == 0);
+
+    EnterCriticalSection(&notify->lock);
+    old = notify->marks;
+    notify->marks = marks;
+    notify->nmarks = nmarks;
+    LeaveCriticalSection(&notify->lock);
+
+    free(old);
+}
+
+void ds_notify_handle(void *ctx, const struct snd_notice *n)
+{
+    struct ds_notify *notify;
+    size_t i;
+    BOOL ok;
+
+    assert(ctx != NULL);
+    assert(n != NULL);
+
+    notify = ctx;
+
+    EnterCriticalSection(&notify->lock);
+
+    for (i = 0 ; i < notify->nmarks ; i++) {
+        if (!ds_notify_is_due(&notify->marks[i], n)) {
+            continue;
+        }
+
+        ok = SetEvent(notify->marks[i].event);
+
+        if (!ok) {
+            hr_trace("SetEvent", hr_from_win32());
+        }
+    }
+
+    LeaveCriticalSection(&notify->lock);
+}
+
+static bool ds_notify_is_due(
+        const struct ds_notify_mark *mark,
+        const struct snd_notice *n)
+{
+    if (mark->frame == DS_NOTIFY_STOP) {
+        return n->flags & SND_NOTICE_STOPPED;
+    }
+
+    if (n->flags & SND_NOTICE_WRAPPED) {
+        return mark->frame >= n->from || mark->frame < n->to;
+    } else {
+        return mark->frame >= n->from && mark->frame < n->to;
+    }
+}
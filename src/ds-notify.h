@@ -0,0 +1,37 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "notifier.h"
+#include "snd-notice.h"
+
+/*  The events a sound buffer's IDirectSoundNotify has been asked to signal,
+    and the handler that signals them from the stream's notices. Positions
+    are frames of the stream, which is in the mix format; DS_NOTIFY_STOP
+    stands for DSBPN_OFFSETSTOP. */
+
+#define DS_NOTIFY_STOP UINT32_MAX
+
+struct ds_notify;
+
+struct ds_notify_mark {
+    uint32_t frame;
+    HANDLE event;
+};
+
+/*  The notifier is kept armed for as long as this exists */
+
+HRESULT ds_notify_alloc(struct ds_notify **out, struct notifier *notifier);
+void ds_notify_free(struct ds_notify *notify);
+void ds_notify_free_notify(void *ptr);
+
+/*  Replace the marks, taking ownership of the array */
+
+void ds_notify_set_marks(
+        struct ds_notify *notify,
+        struct ds_notify_mark *marks,
+        size_t nmarks);
+void ds_notify_handle(void *ctx, const struct snd_notice *n);
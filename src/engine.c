@@ -0,0 +1,1700 @@
+#include <windows.h>
+
+#include <avrt.h>
+#include <dsound.h>
+#include <mmreg.h>
+#include <objbase.h>
+#include <process.h>
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "apicap.h"
+#include "apiprof.h"
+#include "backend.h"
+#include "config.h"
+#include "converter.h"
+#include "defs.h"
+#include "engine.h"
+#include "hr.h"
+#include "latency-ctl.h"
+#include "memstat.h"
+#include "notifier.h"
+#include "perfstat.h"
+#include "reaper.h"
+#include "rt-trace.h"
+#include "snd-buffer.h"
+#include "snd-cost.h"
+#include "snd-mixer.h"
+#include "snd-primary.h"
+#include "snd-service.h"
+#include "trace.h"
+
+/*  Number of periods the mixer renders ahead of the device by default. Zero
+    renders each period just in time, as the device asks for it. */
+
+#define ENGINE_DEFAULT_LOOKAHEAD 0
+
+/*  Silence, in milliseconds, after which the device stream is stopped and
+    the engine thread parks until the next command. Zero never suspends. */
+
+#define ENGINE_DEFAULT_IDLE_MSEC 2000
+
+/*  Cycles the engine keeps ticking over after being woken from idle by a
+    command that started nothing, so the epochs that the reaper waits on
+    move along before it parks again. */
+
+#define ENGINE_IDLE_NTICKS 2
+
+/*  How often, in milliseconds, stream notices are handled until the device
+    is up and the period is known. */
+
+#define ENGINE_DEFAULT_NOTIFY_MSEC 10
+
+/*  Mixer blocks per block in which each voice is timed, and how many
+    distinct call sites the tally keeps apart before lumping the rest
+    together. */
+
+#define ENGINE_DEFAULT_COST_INTERVAL 16
+#define ENGINE_COST_NENTRIES 256
+
+/*  There is one engine per process, however many DirectSound objects the
+    application creates: there is only one device to open, after all. Each
+    DirectSound object holds a reference, and the last one out tears the
+    engine down. */
+
+struct engine {
+    unsigned int nrefs;
+    struct reaper *reaper;
+    struct notifier *notifier;
+    HANDLE thread;
+    HANDLE started;
+    HANDLE stop;
+    HANDLE resume;
+
+    /*  When the command that woke us from idle was submitted */
+
+    atomic_llong t_resume;
+    struct snd_service *svc;
+
+    /*  Written to directly by applications that do their own mixing. It is
+        sized for the device, so it only exists once that is up. */
+
+    struct snd_primary *primary;
+
+    /*  Startup timeline: engine created, device running, first block with
+        anything playing in it handed to the device. */
+
+    int64_t t_create;
+    int64_t t_live;
+    int64_t t_audible;
+
+    /*  Mix rate asked for through the primary buffer, which the engine
+        thread picks up and acknowledges through rate_done, having set
+        rate_hr to how it went. Only honoured while there are no sound
+        buffers, since those have already been converted to the current
+        rate. format_lock covers both nbuffers and the whole exchange. */
+
+    SRWLOCK format_lock;
+    unsigned int nbuffers;
+    atomic_uint rate_request;
+    HANDLE rate_done;
+    HRESULT rate_hr;
+
+    /*  Owned by the engine thread while it runs */
+
+    struct latency_ctl latency;
+    bool adaptive;
+    unsigned int nrate_changes;
+    unsigned int nrate_resampled;
+    unsigned int nsuspends;
+    unsigned int nresumes;
+    int64_t resume_ticks_total;
+    int64_t resume_ticks_max;
+
+    /*  Counters for outside monitoring, if enabled. Written by the engine
+        thread only. */
+
+    struct perfstat *perfstat;
+
+    /*  Format that sound buffers are converted to for mixing: always 16-bit
+        stereo, at the mix rate. That is the device's rate unless configured
+        or asked for otherwise, in which case the mixer resamples its output
+        to suit the device. */
+
+    WAVEFORMATEX sys_wfx;
+};
+
+static HRESULT engine_alloc(struct engine **out);
+static void engine_free(struct engine *engine);
+static HRESULT engine_start(struct engine *engine);
+static HRESULT engine_stop(struct engine *engine);
+static unsigned int __stdcall engine_thread_main(void *ctx);
+static bool engine_wait_started(const struct engine *engine);
+static void engine_trace_latency(const struct engine *engine);
+static void engine_resume_hook(void *ctx);
+static unsigned int engine_get_mix_rate(const struct backend *be);
+static void engine_set_guard(
+        struct engine *engine,
+        const struct backend *be,
+        size_t nblocks);
+static void engine_set_notify_period(
+        struct engine *engine,
+        const struct backend *be);
+static void engine_publish(
+        struct engine *engine,
+        const struct backend *be,
+        const struct snd_mixer *mixer,
+        int64_t intake_ticks,
+        int64_t mix_ticks,
+        int64_t freq,
+        unsigned int load_pct);
+static void engine_publish_suspended(struct engine *engine, bool value);
+static void engine_publish_costs(
+        struct engine *engine,
+        struct snd_cost *cost,
+        unsigned int interval,
+        int64_t window_ticks,
+        int64_t freq);
+static uint64_t engine_clock(void);
+static int engine_configure(
+        const struct backend *be,
+        struct snd_mixer *mixer,
+        size_t lookahead,
+        size_t *nblocks_out);
+static HRESULT engine_set_level(
+        struct engine *engine,
+        struct backend *be,
+        struct snd_mixer *mixer,
+        unsigned int level,
+        size_t lookahead,
+        size_t *nblocks);
+static HRESULT engine_set_rate(
+        struct engine *engine,
+        struct backend *be,
+        struct snd_mixer *mixer,
+        unsigned int rate,
+        size_t lookahead,
+        size_t *nblocks);
+static HRESULT engine_suspend(
+        struct engine *engine,
+        struct backend *be,
+        struct snd_mixer *mixer,
+        size_t lookahead,
+        size_t nblocks);
+static HRESULT engine_prefill(
+        struct backend *be,
+        struct snd_mixer *mixer,
+        size_t lookahead,
+        size_t nblocks);
+static HRESULT engine_write(
+        struct backend *be,
+        struct snd_mixer *mixer,
+        size_t nblocks);
+
+static const WAVEFORMATEX engine_default_wfx = {
+    .wFormatTag         = WAVE_FORMAT_PCM,
+    .nChannels          = 2,
+    .nSamplesPerSec     = 44100,
+    .wBitsPerSample     = 16,
+    .nBlockAlign        = 4,
+    .nAvgBytesPerSec    = 176400,
+    .cbSize             = 0,
+};
+
+static SRWLOCK engine_lock = SRWLOCK_INIT;
+static struct engine *engine_instance;
+
+HRESULT engine_acquire(struct engine **out)
+{
+    struct engine *engine;
+    HRESULT hr;
+
+    assert(out != NULL);
+
+    *out = NULL;
+    engine = NULL;
+    AcquireSRWLockExclusive(&engine_lock);
+
+    if (engine_instance != NULL) {
+        engine_instance->nrefs++;
+        *out = engine_instance;
+        hr = S_OK;
+
+        goto end;
+    }
+
+    trace("Starting the process-wide audio engine");
+
+    hr = engine_alloc(&engine);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    hr = engine_start(engine);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    engine->nrefs = 1;
+    engine_instance = engine;
+    *out = engine;
+    engine = NULL;
+
+end:
+    engine_free(engine);
+    ReleaseSRWLockExclusive(&engine_lock);
+
+    return hr;
+}
+
+void engine_release(struct engine *engine)
+{
+    if (engine == NULL) {
+        return;
+    }
+
+    /*  Tear down under the lock, so that a DirectSound object created in the
+        meantime waits for the device to be let go of rather than finding it
+        still open. */
+
+    AcquireSRWLockExclusive(&engine_lock);
+    assert(engine == engine_instance);
+    assert(engine->nrefs > 0);
+
+    if (--engine->nrefs == 0) {
+        trace("Last user gone, stopping the audio engine");
+        engine_instance = NULL;
+        engine_free(engine);
+    }
+
+    ReleaseSRWLockExclusive(&engine_lock);
+}
+
+static HRESULT engine_alloc(struct engine **out)
+{
+    struct engine *engine;
+    struct snd_client *cli;
+    LARGE_INTEGER t_create;
+    HRESULT hr;
+    int r;
+
+    trace_enter();
+    assert(out != NULL);
+
+    *out = NULL;
+    cli = NULL;
+    engine = memstat_calloc(sizeof(*engine), 1);
+
+    if (engine == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    QueryPerformanceCounter(&t_create);
+    engine->t_create = t_create.QuadPart;
+    engine->sys_wfx = engine_default_wfx;
+    engine->started = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    if (engine->started == NULL) {
+        hr = hr_from_win32();
+        hr_trace("CreateEvent", hr);
+
+        goto end;
+    }
+
+    engine->stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    if (engine->stop == NULL) {
+        hr = hr_from_win32();
+        hr_trace("CreateEvent", hr);
+
+        goto end;
+    }
+
+    engine->resume = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    if (engine->resume == NULL) {
+        hr = hr_from_win32();
+        hr_trace("CreateEvent", hr);
+
+        goto end;
+    }
+
+    engine->rate_done = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    if (engine->rate_done == NULL) {
+        hr = hr_from_win32();
+        hr_trace("CreateEvent", hr);
+
+        goto end;
+    }
+
+    InitializeSRWLock(&engine->format_lock);
+
+    r = snd_service_alloc(&engine->svc);
+
+    if (r < 0) {
+        hr = hr_from_errno(r);
+
+        goto end;
+    }
+
+    snd_service_set_pool_limits(
+            engine->svc,
+            config_get_uint("CMD_POOL", SND_CLIENT_POOL_NPREALLOC),
+            config_get_uint("CMD_POOL_HWM", SND_CLIENT_POOL_HWM));
+    snd_service_set_intake_budget(
+            engine->svc,
+            config_get_uint("INTAKE_BUDGET", SND_SERVICE_INTAKE_BUDGET));
+    snd_service_set_resume_hook(engine->svc, engine_resume_hook, engine);
+
+    r = snd_client_alloc(&cli, engine->svc);
+
+    if (r < 0) {
+        hr = hr_from_errno(r);
+
+        goto end;
+    }
+
+    hr = reaper_alloc(&engine->reaper, cli);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    cli = NULL; /* Release ownership of client to the reaper */
+
+    hr = notifier_alloc(
+            &engine->notifier,
+            engine->svc,
+            ENGINE_DEFAULT_NOTIFY_MSEC);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    /*  Monitoring is optional, so carry on without it if need be */
+
+    if (config_get_uint("PERFSTAT", 1) != 0) {
+        hr = perfstat_alloc(&engine->perfstat);
+
+        if (FAILED(hr)) {
+            hr_trace("perfstat_alloc", hr);
+        }
+    }
+
+    *out = engine;
+    engine = NULL;
+    hr = S_OK;
+
+end:
+    snd_client_free(cli);
+    engine_free(engine);
+    trace_exit();
+
+    return hr;
+}
+
+static void engine_free(struct engine *engine)
+{
+    struct snd_service_stats stats;
+    HRESULT hr;
+    BOOL ok;
+
+    if (engine == NULL) {
+        return;
+    }
+
+    /*  The engine thread may have exited long ago, and with it the epochs
+        that the reaper waits on. So make sure it has, and then the reaper
+        can free whatever is left without waiting. If the thread might still
+        be running, it might still be reading any of this, so it is all
+        better leaked. */
+
+    hr = engine_stop(engine);
+
+    if (FAILED(hr)) {
+        trace("engine_stop failed, leaking the engine");
+
+        return;
+    }
+
+    /*  The reaper frees the notice handlers of whatever it has left, so
+        the notifier that they are armed on has to outlive it. */
+
+    reaper_free(engine->reaper);
+    notifier_free(engine->notifier);
+
+    if (engine->svc != NULL) {
+        snd_service_get_stats(engine->svc, &stats);
+        trace("Commands: %u applied (%u fast-tracked), "
+                "%u spilled over %u cycles, max backlog %u, "
+                "%u queue retries, %u notices dropped",
+                stats.ncmds,
+                stats.ncmds_priority,
+                stats.ncmds_spilled,
+                stats.ncycles_spilled,
+                stats.backlog_max,
+                stats.nretries,
+                stats.nnotices_dropped);
+    }
+
+    engine_trace_latency(engine);
+    perfstat_free(engine->perfstat);
+    snd_service_free(engine->svc);
+    snd_primary_free(engine->primary);
+
+    if (engine->rate_done != NULL) {
+        ok = CloseHandle(engine->rate_done);
+
+        if (!ok) {
+            hr_trace("CloseHandle(engine->rate_done)", hr_from_win32());
+        }
+    }
+
+    if (engine->resume != NULL) {
+        ok = CloseHandle(engine->resume);
+
+        if (!ok) {
+            hr_trace("CloseHandle(engine->resume)", hr_from_win32());
+        }
+    }
+
+    if (engine->stop != NULL) {
+        ok = CloseHandle(engine->stop);
+
+        if (!ok) {
+            hr_trace("CloseHandle(engine->stop)", hr_from_win32());
+        }
+    }
+
+    if (engine->started != NULL) {
+        ok = CloseHandle(engine->started);
+
+        if (!ok) {
+            hr_trace("CloseHandle(engine->started)", hr_from_win32());
+        }
+    }
+
+    if (engine->thread != NULL) {
+        ok = CloseHandle(engine->thread);
+
+        if (!ok) {
+            hr_trace("CloseHandle(engine->thread)", hr_from_win32());
+        }
+    }
+
+    free(engine);
+}
+
+static void engine_trace_latency(const struct engine *engine)
+{
+    const struct latency_ctl_transition *t;
+    struct latency_ctl_stats stats;
+    LARGE_INTEGER freq;
+    unsigned int first;
+    unsigned int i;
+
+    QueryPerformanceFrequency(&freq);
+
+    if (engine->t_live != 0) {
+        trace(  "Startup: device live after %.2f ms",
+                (engine->t_live - engine->t_create) * 1000.0
+                        / freq.QuadPart);
+    }
+
+    if (engine->t_audible != 0) {
+        trace(  "Startup: first sound handed to the device after %.2f ms",
+                (engine->t_audible - engine->t_create) * 1000.0
+                        / freq.QuadPart);
+    }
+
+    if (engine->nrate_changes > 0 || engine->nrate_resampled > 0) {
+        trace(  "Mix rate: %u changes, %u resampled for the device",
+                engine->nrate_changes,
+                engine->nrate_resampled);
+    }
+
+    trace(  "Idle: %u suspends, %u resumes, "
+                "resume latency mean %.2f ms, max %.2f ms",
+            engine->nsuspends,
+            engine->nresumes,
+            engine->nresumes > 0
+                    ? engine->resume_ticks_total * 1000.0
+                            / freq.QuadPart / engine->nresumes
+                    : 0.0,
+            engine->resume_ticks_max * 1000.0 / freq.QuadPart);
+
+    latency_ctl_get_stats(&engine->latency, &stats);
+    trace("Latency: level %u, %u glitches, %u near misses, "
+                "%u steps up, %u down, %u refused, peak load %u%%",
+            stats.level,
+            stats.nglitches,
+            stats.nnear_misses,
+            stats.nsteps_up,
+            stats.nsteps_down,
+            stats.nrejected,
+            stats.load_max);
+
+    first = stats.ntransitions > LATENCY_CTL_NLOG
+            ? stats.ntransitions - LATENCY_CTL_NLOG
+            : 0;
+
+    for (i = first ; i < stats.ntransitions ; i++) {
+        t = &stats.log[i % LATENCY_CTL_NLOG];
+        trace(  "Latency transition at frame %llu: %u -> %u frames (%s)",
+                (unsigned long long) t->frame,
+                (unsigned int) t->period_from,
+                (unsigned int) t->period_to,
+                latency_ctl_reason_name(t->reason));
+    }
+}
+
+static void engine_resume_hook(void *ctx)
+{
+    struct engine *engine;
+    LARGE_INTEGER now;
+
+    engine = ctx;
+    QueryPerformanceCounter(&now);
+    atomic_store(&engine->t_resume, now.QuadPart);
+    SetEvent(engine->resume);
+}
+
+static HRESULT engine_start(struct engine *engine)
+{
+    HRESULT hr;
+
+    assert(engine != NULL);
+    assert(engine->thread == NULL);
+
+    hr = reaper_start(engine->reaper);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    hr = notifier_start(engine->notifier);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    /*  Tracing, profiling and capturing are only aids, so the engine runs
+        without them if need be. Capturing goes first, as it decides whether
+        objects get the profile's wrappers. */
+
+    hr = rt_trace_start();
+
+    if (FAILED(hr)) {
+        hr_trace("rt_trace_start", hr);
+    }
+
+    hr = apicap_start();
+
+    if (FAILED(hr)) {
+        hr_trace("apicap_start", hr);
+    }
+
+    hr = apiprof_start();
+
+    if (FAILED(hr)) {
+        hr_trace("apiprof_start", hr);
+    }
+
+    /*  Don't wait for the device: bringing it up can take a while, and
+        commands submitted in the meantime just queue up until the mixer
+        is there to apply them. */
+
+    engine->thread = (HANDLE) _beginthreadex(
+            NULL,
+            0,
+            engine_thread_main,
+            engine,
+            0,
+            NULL);
+
+    if (engine->thread == NULL) {
+        hr = hr_from_win32();
+        hr_trace("_beginthreadex", hr);
+
+        return hr;
+    }
+
+    return S_OK;
+}
+
+HRESULT engine_snd_client_alloc(
+        struct engine *engine,
+        struct snd_client **out)
+{
+    int r;
+
+    assert(engine != NULL);
+
+    r = snd_client_alloc(out, engine->svc);
+
+    return hr_from_errno(r);
+}
+
+struct reaper *engine_get_reaper(const struct engine *engine)
+{
+    assert(engine != NULL);
+
+    return engine->reaper;
+}
+
+struct notifier *engine_get_notifier(const struct engine *engine)
+{
+    assert(engine != NULL);
+
+    return engine->notifier;
+}
+
+const WAVEFORMATEX *engine_get_sys_format(const struct engine *engine)
+{
+    assert(engine != NULL);
+
+    /*  If the engine thread died instead, the default format is as good as
+        any. */
+
+    if (!engine_wait_started(engine)) {
+        trace("Engine failed to start, using the default format");
+    }
+
+    return &engine->sys_wfx;
+}
+
+HRESULT engine_set_mix_format(
+        struct engine *engine,
+        const WAVEFORMATEX *wfx)
+{
+    HANDLE handles[2];
+    unsigned int rate;
+    uint32_t wait;
+    HRESULT hr;
+
+    assert(engine != NULL);
+    assert(wfx != NULL);
+
+    if (!engine_wait_started(engine)) {
+        return S_FALSE;
+    }
+
+    rate = wfx->nSamplesPerSec;
+    AcquireSRWLockExclusive(&engine->format_lock);
+
+    if (rate == engine->sys_wfx.nSamplesPerSec) {
+        hr = S_OK;
+    } else if (engine->nbuffers > 0) {
+        trace(  "Not switching to %u Hz, %u sound buffers already exist",
+                rate,
+                engine->nbuffers);
+        hr = S_FALSE;
+    } else {
+        trace("Asking the device for %u Hz", rate);
+
+        /*  Kick the engine thread in case it is idle. If the device turns
+            the rate down, we mix at it anyway and resample on the way out,
+            so this only fails if the engine does. */
+
+        atomic_store(&engine->rate_request, rate);
+        SetEvent(engine->resume);
+
+        handles[0] = engine->rate_done;
+        handles[1] = engine->thread;
+        wait = WaitForMultipleObjects(
+                lengthof(handles),
+                handles,
+                FALSE,
+                INFINITE);
+
+        if (wait != WAIT_OBJECT_0) {
+            trace("Engine thread exited during a change of rate");
+            hr = E_FAIL;
+        } else if (FAILED(engine->rate_hr)) {
+            hr = engine->rate_hr;
+        } else {
+            hr = engine->sys_wfx.nSamplesPerSec == rate ? S_OK : S_FALSE;
+            trace("Now mixing at %u Hz", engine->sys_wfx.nSamplesPerSec);
+        }
+    }
+
+    ReleaseSRWLockExclusive(&engine->format_lock);
+
+    return hr;
+}
+
+void engine_add_buffer(struct engine *engine)
+{
+    assert(engine != NULL);
+
+    AcquireSRWLockExclusive(&engine->format_lock);
+    engine->nbuffers++;
+    ReleaseSRWLockExclusive(&engine->format_lock);
+}
+
+void engine_remove_buffer(struct engine *engine)
+{
+    assert(engine != NULL);
+
+    AcquireSRWLockExclusive(&engine->format_lock);
+    assert(engine->nbuffers > 0);
+    engine->nbuffers--;
+    ReleaseSRWLockExclusive(&engine->format_lock);
+}
+
+struct snd_primary *engine_get_primary(const struct engine *engine)
+{
+    assert(engine != NULL);
+
+    if (!engine_wait_started(engine)) {
+        return NULL;
+    }
+
+    return engine->primary;
+}
+
+static bool engine_wait_started(const struct engine *engine)
+{
+    HANDLE handles[2];
+    uint32_t wait;
+
+    /*  Whatever depends on the device, such as the mix rate, has to wait
+        for startup to finish. */
+
+    handles[0] = engine->started;
+    handles[1] = engine->thread;
+    wait = WaitForMultipleObjects(
+            lengthof(handles),
+            handles,
+            FALSE,
+            INFINITE);
+
+    return wait == WAIT_OBJECT_0;
+}
+
+static HRESULT engine_stop(struct engine *engine)
+{
+    uint32_t wait;
+    HRESULT hr;
+    BOOL ok;
+
+    assert(engine != NULL);
+
+    if (engine->thread == NULL) {
+        /*  Startup may have got as far as the tracers and the notifier */
+
+        if (engine->notifier != NULL) {
+            notifier_stop(engine->notifier);
+        }
+
+        rt_trace_stop();
+        apiprof_stop();
+        apicap_stop();
+
+        return S_FALSE;
+    }
+
+    ok = SetEvent(engine->stop);
+
+    if (!ok) {
+        hr = hr_from_win32();
+        hr_trace("SetEvent(engine->stop)", hr);
+
+        goto end;
+    }
+
+    wait = WaitForSingleObject(engine->thread, INFINITE);
+
+    if (wait != WAIT_OBJECT_0) {
+        hr = hr_from_win32();
+        hr_trace("WaitForSingleObject(engine->thread)", hr);
+
+        goto end;
+    }
+
+    CloseHandle(engine->thread);
+    engine->thread = NULL;
+
+    /*  Nothing posts notices any more, so the last of them can be handled */
+
+    notifier_stop(engine->notifier);
+    rt_trace_stop();
+    apiprof_stop();
+    apicap_stop();
+    hr = S_OK;
+
+end:
+    return hr;
+}
+
+static unsigned int __stdcall engine_thread_main(void *ctx)
+{
+    struct engine *engine;
+    struct backend *be;
+    struct snd_mixer *mixer;
+    struct snd_cost *cost;
+    LARGE_INTEGER freq;
+    LARGE_INTEGER t_live;
+    LARGE_INTEGER t_wake;
+    LARGE_INTEGER t_intake;
+    LARGE_INTEGER t_mix;
+    LARGE_INTEGER t_mixed;
+    LARGE_INTEGER t_done;
+    int64_t t_prev;
+    int64_t t_window;
+    uint64_t period_ticks;
+    unsigned int load_pct;
+    unsigned int level;
+    uint64_t idle_nframes;
+    unsigned int idle_msec;
+    unsigned int cost_interval;
+    unsigned int rate;
+    uint64_t idle;
+    size_t lookahead;
+    size_t nblocks;
+    size_t nframes;
+    size_t nwant;
+    size_t nearly;
+    bool glitch;
+    HANDLE task;
+    DWORD task_index;
+    BOOL ok;
+    HRESULT hr;
+    int r;
+
+    trace("Engine thread starting up");
+
+    engine = ctx;
+    be = NULL;
+    mixer = NULL;
+    cost = NULL;
+    task = NULL;
+
+    hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    if (FAILED(hr)) {
+        hr_trace("CoInitializeEx", hr);
+
+        goto end;
+    }
+
+    hr = backend_alloc(&be, &engine_default_wfx);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    /*  The mixer hands off one period at a time, and must be able to hold
+        a full device buffer's worth on top of however far ahead it runs. */
+
+    lookahead = config_get_uint("LOOKAHEAD", ENGINE_DEFAULT_LOOKAHEAD);
+    nblocks = be->nframes / be->period + lookahead;
+
+    if (nblocks > SND_MIXER_MAX_BLOCKS) {
+        nblocks = SND_MIXER_MAX_BLOCKS;
+        lookahead = nblocks - be->nframes / be->period;
+        trace("Lookahead clamped to %u periods", (unsigned int) lookahead);
+    }
+
+    /*  The mixer writes straight into the backend's native format, so there
+        is no further conversion or resampling downstream of us. */
+
+    rate = engine_get_mix_rate(be);
+    r = snd_mixer_alloc(&mixer, be->max_period, be->nchannels, be->format);
+
+    if (r >= 0) {
+        snd_mixer_set_notices(mixer, snd_service_get_notices(engine->svc));
+        r = snd_mixer_set_rates(mixer, rate, be->rate);
+    }
+
+    if (r >= 0) {
+        r = engine_configure(be, mixer, lookahead, &nblocks);
+    }
+
+    /*  The primary buffer must hold at least as much as we might ever take
+        from it in one go, whatever latency level we end up at. */
+
+    if (r >= 0) {
+        r = snd_primary_alloc(
+                &engine->primary,
+                be->max_period * SND_MIXER_MAX_BLOCKS);
+    }
+
+    if (r < 0) {
+        trace("Mixer setup failed: r = %i", r);
+        hr = hr_from_errno(r);
+
+        goto end;
+    }
+
+    /*  What each voice costs to mix is only published with the rest of the
+        counters, so there is no point measuring it otherwise. */
+
+    cost_interval = config_get_uint(
+            "VOICE_COST",
+            ENGINE_DEFAULT_COST_INTERVAL);
+
+    if (engine->perfstat != NULL && cost_interval > 0) {
+        r = snd_cost_alloc(&cost, ENGINE_COST_NENTRIES);
+
+        if (r < 0) {
+            trace("snd_cost_alloc failed: r = %i", r);
+        } else {
+            snd_mixer_set_cost(mixer, cost, engine_clock, cost_interval);
+        }
+    }
+
+    /*  With adaptation turned off the controller still counts glitches, it
+        just has nowhere to go. */
+
+    engine->adaptive = config_get_uint("ADAPTIVE_LATENCY", 1) != 0;
+    idle_msec = config_get_uint("IDLE_SUSPEND", ENGINE_DEFAULT_IDLE_MSEC);
+    idle_nframes = (uint64_t) be->rate * idle_msec / 1000;
+    idle = 0;
+    latency_ctl_init(&engine->latency, be->level, be->nlevels, be->rate);
+
+    if (!engine->adaptive) {
+        latency_ctl_pin(&engine->latency);
+    }
+
+    if (rate != be->rate) {
+        trace("Mixing at %u Hz, resampled to %u Hz", rate, be->rate);
+    }
+
+    engine->sys_wfx.nSamplesPerSec = rate;
+    engine->sys_wfx.nAvgBytesPerSec = rate * engine->sys_wfx.nBlockAlign;
+    engine_set_guard(engine, be, nblocks);
+    engine_set_notify_period(engine, be);
+    ok = SetEvent(engine->started);
+
+    if (!ok) {
+        hr = hr_from_win32();
+        hr_trace("SetEvent(engine->started)", hr);
+
+        goto end;
+    }
+
+    trace("About to boost engine thread and cease trace output");
+    rt_trace(RT_TRACE_SET_RATE, rate, be->rate);
+
+    task_index = 0;
+    task = AvSetMmThreadCharacteristicsW(L"Pro Audio", &task_index);
+
+    if (task == NULL) {
+        hr = hr_from_win32();
+        hr_trace("AvSetMmThreadCharacteristicsW", hr);
+
+        goto end;
+    }
+
+    /* Anything the render loop allocates from here on is a bug */
+
+    memstat_enter(MEMSTAT_SITE_AUDIO_THREAD);
+    QueryPerformanceFrequency(&freq);
+    t_prev = 0;
+
+    hr = backend_start(be);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    QueryPerformanceCounter(&t_live);
+    engine->t_live = t_live.QuadPart;
+    t_window = t_live.QuadPart;
+
+    for (;;) {
+        hr = backend_wait(be, engine->stop);
+
+        if (hr != S_OK) {
+            /* Either we were commanded to stop or something went wrong */
+
+            break;
+        }
+
+        QueryPerformanceCounter(&t_wake);
+        hr = backend_get_avail(be, &nframes);
+
+        if (FAILED(hr)) {
+            break;
+        }
+
+        /*  A device that wants a whole buffer every period can only tell us
+            it went hungry by waking us late. One with a deeper buffer that
+            has run completely dry has certainly glitched. */
+
+        period_ticks = (uint64_t) be->period * freq.QuadPart / be->rate;
+
+        if (be->nframes > be->period) {
+            glitch = nframes >= be->nframes;
+        } else {
+            glitch = t_prev != 0
+                    && (uint64_t) (t_wake.QuadPart - t_prev) * 2
+                            > period_ticks * 3;
+        }
+
+        /*  Whatever was rendered ahead last cycle goes out before we even
+            look at the command queue, so the device is fed as early in the
+            cycle as possible. Commands then apply from the next block that
+            has not gone out yet, which throws away any blocks rendered past
+            it and renders them again. */
+
+        nwant = nframes / be->period;
+
+        if (nwant > nblocks) {
+            nwant = nblocks;
+        }
+
+        nearly = snd_mixer_nready(mixer);
+
+        if (nearly > nwant) {
+            nearly = nwant;
+        }
+
+        hr = engine_write(be, mixer, nearly);
+
+        if (FAILED(hr)) {
+            break;
+        }
+
+        /* --- BEGIN APPLICATION LOGIC --- */
+
+        QueryPerformanceCounter(&t_intake);
+        snd_service_intake(engine->svc, mixer);
+        QueryPerformanceCounter(&t_mix);
+        snd_mixer_render(mixer, nwant - nearly + lookahead);
+        QueryPerformanceCounter(&t_mixed);
+
+        /* --- END APPLICATION LOGIC --- */
+
+        hr = engine_write(be, mixer, nwant - nearly);
+
+        if (FAILED(hr)) {
+            break;
+        }
+
+        snd_service_exhaust(engine->svc);
+
+        QueryPerformanceCounter(&t_done);
+
+        if (engine->t_audible == 0 && !snd_mixer_is_idle(mixer)) {
+            engine->t_audible = t_done.QuadPart;
+        }
+
+        load_pct = (unsigned int) (
+                (uint64_t) (t_done.QuadPart - t_wake.QuadPart) * 100
+                / (period_ticks * (nwant > 0 ? nwant : 1)));
+        glitch = glitch || load_pct >= 100;
+        t_prev = t_wake.QuadPart;
+        rt_trace(
+                glitch ? RT_TRACE_GLITCH : RT_TRACE_CYCLE,
+                (uint32_t) nframes,
+                load_pct);
+
+        level = latency_ctl_update(
+                &engine->latency,
+                nwant * be->period,
+                glitch,
+                load_pct);
+        engine_publish(
+                engine,
+                be,
+                mixer,
+                t_mix.QuadPart - t_intake.QuadPart,
+                t_mixed.QuadPart - t_mix.QuadPart,
+                freq.QuadPart,
+                load_pct);
+
+        if (cost != NULL && t_done.QuadPart - t_window >= freq.QuadPart) {
+            engine_publish_costs(
+                    engine,
+                    cost,
+                    cost_interval,
+                    t_done.QuadPart - t_window,
+                    freq.QuadPart);
+            t_window = t_done.QuadPart;
+        }
+
+        if (level != be->level) {
+            rt_trace(RT_TRACE_SET_LEVEL, be->level, level);
+            hr = engine_set_level(
+                    engine,
+                    be,
+                    mixer,
+                    level,
+                    lookahead,
+                    &nblocks);
+
+            if (FAILED(hr)) {
+                break;
+            }
+
+            t_prev = 0;
+        }
+
+        rate = atomic_exchange(&engine->rate_request, 0);
+
+        if (rate != 0) {
+            hr = engine_set_rate(
+                    engine,
+                    be,
+                    mixer,
+                    rate,
+                    lookahead,
+                    &nblocks);
+            engine->rate_hr = hr;
+            SetEvent(engine->rate_done);
+
+            if (FAILED(hr)) {
+                break;
+            }
+
+            rt_trace(RT_TRACE_SET_RATE, rate, be->rate);
+
+            idle_nframes = (uint64_t) be->rate * idle_msec / 1000;
+            idle = 0;
+            t_prev = 0;
+
+            continue;
+        }
+
+        /*  Once nothing has been playing for long enough, and whatever last
+            played has drained out of the device, go quiet. */
+
+        if (idle_nframes == 0 || !snd_mixer_is_idle(mixer)) {
+            idle = 0;
+
+            continue;
+        }
+
+        idle += nwant * be->period;
+
+        if (idle >= idle_nframes && idle >= be->nframes + be->period) {
+            hr = engine_suspend(engine, be, mixer, lookahead, nblocks);
+
+            if (hr != S_OK) {
+                break;
+            }
+
+            idle = 0;
+            t_prev = 0;
+        }
+    }
+
+    backend_stop(be);
+
+end:
+    if (task != NULL) {
+        AvRevertMmThreadCharacteristics(task);
+        trace("De-boosted engine thread");
+    }
+
+    snd_mixer_free(mixer);
+    snd_cost_free(cost);
+    backend_free(be);
+    CoUninitialize();
+
+    trace("Engine thread is exiting. hr = %08x", hr);
+
+    return hr;
+}
+
+static unsigned int engine_get_mix_rate(const struct backend *be)
+{
+    unsigned int rate;
+
+    /*  Zero means whatever the device runs at */
+
+    rate = config_get_uint("MIX_RATE", 0);
+
+    if (rate == 0) {
+        return be->rate;
+    }
+
+    if (rate < DSBFREQUENCY_MIN || rate > DSBFREQUENCY_MAX) {
+        trace("Mix rate of %u Hz is out of range, ignoring", rate);
+
+        return be->rate;
+    }
+
+    return rate;
+}
+
+static void engine_set_guard(
+        struct engine *engine,
+        const struct backend *be,
+        size_t nblocks)
+{
+    uint64_t nframes;
+
+    /*  The guard is in frames of the primary buffer, which is at the mix
+        rate, while the mixer runs ahead in device periods. */
+
+    nframes = (uint64_t) nblocks * be->period;
+    nframes = (nframes * engine->sys_wfx.nSamplesPerSec + be->rate - 1)
+            / be->rate;
+    snd_primary_set_guard(engine->primary, (size_t) nframes);
+}
+
+static void engine_set_notify_period(
+        struct engine *engine,
+        const struct backend *be)
+{
+    uint64_t msec;
+
+    /*  Notices only turn up once per device period, so there is no point
+        looking for them more often than that. */
+
+    msec = ((uint64_t) be->period * 1000 + be->rate - 1) / be->rate;
+    notifier_set_period(engine->notifier, (DWORD) msec);
+}
+
+static void engine_publish(
+        struct engine *engine,
+        const struct backend *be,
+        const struct snd_mixer *mixer,
+        int64_t intake_ticks,
+        int64_t mix_ticks,
+        int64_t freq,
+        unsigned int load_pct)
+{
+    struct snd_service_stats svc_stats;
+    struct converter_stats conv_stats;
+    struct perfstat_block *block;
+
+    if (engine->perfstat == NULL) {
+        return;
+    }
+
+    /*  Everything gathered here is a plain or atomic load, so this is safe
+        to do once per cycle. */
+
+    snd_service_get_stats(engine->svc, &svc_stats);
+    converter_get_stats(&conv_stats);
+
+    block = perfstat_begin(engine->perfstat);
+    block->ncycles++;
+    block->mix_rate = engine->sys_wfx.nSamplesPerSec;
+    block->device_rate = be->rate;
+    block->period = (uint32_t) be->period;
+    block->level = be->level;
+    block->load_pct = load_pct;
+    block->nvoices = (uint32_t) snd_mixer_nvoices(mixer);
+    block->cmd_backlog = (uint32_t) svc_stats.backlog;
+    block->ncmds_total = svc_stats.ncmds;
+    block->intake_ns = (uint64_t) (intake_ticks * (1e9 / freq));
+    block->intake_ns_total += block->intake_ns;
+    block->mix_ns = (uint64_t) (mix_ticks * (1e9 / freq));
+    block->mix_ns_total += block->mix_ns;
+    block->nunderruns_total = engine->latency.stats.nglitches;
+    block->reaper_backlog = reaper_get_backlog(engine->reaper);
+    block->sample_nbytes = snd_buffer_total_nbytes();
+    block->nconversions_total = conv_stats.nconversions;
+    block->convert_ns_total = conv_stats.ns;
+    perfstat_end(engine->perfstat);
+}
+
+static void engine_publish_suspended(struct engine *engine, bool value)
+{
+    struct perfstat_block *block;
+
+    if (engine->perfstat == NULL) {
+        return;
+    }
+
+    block = perfstat_begin(engine->perfstat);
+    block->suspended = value;
+    block->nvoices = 0;
+    perfstat_end(engine->perfstat);
+}
+
+static void engine_publish_costs(
+        struct engine *engine,
+        struct snd_cost *cost,
+        unsigned int interval,
+        int64_t window_ticks,
+        int64_t freq)
+{
+    struct snd_cost_entry top[PERFSTAT_NCOSTS];
+    struct perfstat_voice_cost *out;
+    struct perfstat_block *block;
+    size_t n;
+    size_t i;
+
+    /*  Only one block in every interval was timed, so scale up to estimate
+        the whole window. */
+
+    n = snd_cost_top(cost, top, lengthof(top));
+    snd_cost_reset(cost);
+
+    block = perfstat_begin(engine->perfstat);
+    block->cost_nwindows++;
+    block->cost_window_ms = (uint32_t) (window_ticks * 1000 / freq);
+    block->cost_interval = interval;
+    block->ncosts = (uint32_t) n;
+
+    for (i = 0 ; i < n ; i++) {
+        out = &block->costs[i];
+        out->tag = top[i].tag;
+        out->ns = (uint64_t) (top[i].cost * interval * (1e9 / freq));
+        out->nframes = top[i].nframes * interval;
+        out->nvoices_max = top[i].nvoices_max;
+    }
+
+    perfstat_end(engine->perfstat);
+}
+
+static uint64_t engine_clock(void)
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+
+    return now.QuadPart;
+}
+
+static int engine_configure(
+        const struct backend *be,
+        struct snd_mixer *mixer,
+        size_t lookahead,
+        size_t *nblocks_out)
+{
+    size_t nblocks;
+    int r;
+
+    nblocks = be->nframes / be->period + lookahead;
+
+    if (nblocks > SND_MIXER_MAX_BLOCKS) {
+        nblocks = SND_MIXER_MAX_BLOCKS;
+    }
+
+    r = snd_mixer_configure(mixer, be->period, nblocks);
+
+    if (r < 0) {
+        return r;
+    }
+
+    *nblocks_out = nblocks;
+
+    return 0;
+}
+
+static HRESULT engine_set_level(
+        struct engine *engine,
+        struct backend *be,
+        struct snd_mixer *mixer,
+        unsigned int level,
+        size_t lookahead,
+        size_t *nblocks)
+{
+    size_t period;
+    HRESULT hr;
+    int r;
+
+    /*  The stream has to be stopped and rebuilt, which loses whatever was
+        still queued in the device. The voices themselves carry on from the
+        end of the last block handed off, re-cut to the new period. */
+
+    period = be->period;
+    backend_stop(be);
+    hr = backend_set_level(be, level);
+
+    if (SUCCEEDED(hr)) {
+        r = engine_configure(be, mixer, lookahead, nblocks);
+        hr = hr_from_errno(r);
+    }
+
+    if (SUCCEEDED(hr)) {
+        latency_ctl_commit(&engine->latency, period, be->period);
+    } else {
+        latency_ctl_reject(&engine->latency);
+        hr = backend_set_level(be, engine->latency.level);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        r = engine_configure(be, mixer, lookahead, nblocks);
+
+        if (r < 0) {
+            return hr_from_errno(r);
+        }
+    }
+
+    engine_set_guard(engine, be, *nblocks);
+    engine_set_notify_period(engine, be);
+
+    return engine_prefill(be, mixer, lookahead, *nblocks);
+}
+
+static HRESULT engine_set_rate(
+        struct engine *engine,
+        struct backend *be,
+        struct snd_mixer *mixer,
+        unsigned int rate,
+        size_t lookahead,
+        size_t *nblocks)
+{
+    enum memstat_site site;
+    unsigned int rate_prev;
+    HRESULT hr;
+    int r;
+
+    /*  Like a change of latency level. The device gets asked first, and if
+        it turns us down the mixer resamples to the rate it already has.
+        Only a device that tore its stream down trying has to be asked for
+        that rate again; failing that, it is gone. */
+
+    rate_prev = be->rate;
+    backend_stop(be);
+    hr = rate == rate_prev ? S_OK : backend_set_rate(be, rate);
+
+    if (hr == S_OK) {
+        engine->nrate_changes++;
+    } else if (hr == S_FALSE) {
+        engine->nrate_resampled++;
+    } else {
+        engine->nrate_resampled++;
+        hr = backend_set_rate(be, rate_prev);
+
+        if (FAILED(hr)) {
+            hr_trace("backend_set_rate", hr);
+
+            return hr;
+        }
+    }
+
+    /*  A higher rate means longer periods in frames, and a resampler needs
+        its filter building. Renegotiating the device is not part of the
+        render loop proper, so the mixer is let off allocating for it. */
+
+    site = memstat_enter(MEMSTAT_SITE_OTHER);
+    r = snd_mixer_reserve(mixer, be->max_period);
+
+    if (r >= 0) {
+        r = snd_mixer_set_rates(mixer, rate, be->rate);
+    }
+
+    memstat_leave(site);
+
+    if (r >= 0) {
+        r = engine_configure(be, mixer, lookahead, nblocks);
+    }
+
+    if (r < 0) {
+        return hr_from_errno(r);
+    }
+
+    latency_ctl_reset(&engine->latency, be->level, be->nlevels, be->rate);
+
+    if (!engine->adaptive) {
+        latency_ctl_pin(&engine->latency);
+    }
+    engine->sys_wfx.nSamplesPerSec = rate;
+    engine->sys_wfx.nAvgBytesPerSec = rate * engine->sys_wfx.nBlockAlign;
+    engine_set_guard(engine, be, *nblocks);
+    engine_set_notify_period(engine, be);
+
+    return engine_prefill(be, mixer, lookahead, *nblocks);
+}
+
+static HRESULT engine_suspend(
+        struct engine *engine,
+        struct backend *be,
+        struct snd_mixer *mixer,
+        size_t lookahead,
+        size_t nblocks)
+{
+    LARGE_INTEGER t_started;
+    LARGE_INTEGER freq;
+    HANDLE handles[2];
+    DWORD period_msec;
+    DWORD timeout;
+    uint32_t wait;
+    int64_t t_resume;
+    int64_t ticks;
+    unsigned int nticks;
+    HRESULT hr;
+
+    backend_stop(be);
+    engine->nsuspends++;
+    rt_trace(RT_TRACE_SUSPEND, 0, 0);
+    engine_publish_suspended(engine, true);
+
+    handles[0] = engine->stop;
+    handles[1] = engine->resume;
+    period_msec = (DWORD) ((be->period * 1000 + be->rate - 1) / be->rate);
+    atomic_store(&engine->t_resume, 0);
+    nticks = 0;
+
+    /*  Commands that do not start anything are dealt with without waking
+        the device. */
+
+    for (;;) {
+        if (nticks > 0) {
+            nticks--;
+            timeout = period_msec;
+        } else if (snd_service_park(engine->svc)) {
+            timeout = INFINITE;
+        } else {
+            timeout = 0;
+        }
+
+        wait = WaitForMultipleObjects(
+                lengthof(handles),
+                handles,
+                FALSE,
+                timeout);
+
+        if (wait == WAIT_OBJECT_0) {
+            return S_FALSE;
+        } else if (wait != WAIT_OBJECT_0 + 1 && wait != WAIT_TIMEOUT) {
+            hr = hr_from_win32();
+            hr_trace("WaitForMultipleObjects", hr);
+
+            return hr;
+        }
+
+        snd_service_intake(engine->svc, mixer);
+
+        /*  A new mix rate is dealt with back in the main loop */
+
+        if (    !snd_mixer_is_idle(mixer) ||
+                atomic_load(&engine->rate_request) != 0) {
+            break;
+        }
+
+        snd_service_exhaust(engine->svc);
+        atomic_store(&engine->t_resume, 0);
+
+        if (timeout != period_msec) {
+            nticks = ENGINE_IDLE_NTICKS;
+        }
+    }
+
+    hr = engine_prefill(be, mixer, lookahead, nblocks);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    snd_service_exhaust(engine->svc);
+    engine_publish_suspended(engine, false);
+
+    /*  Measure from the submission that woke us to the device running */
+
+    QueryPerformanceCounter(&t_started);
+    t_resume = atomic_load(&engine->t_resume);
+
+    if (engine->t_audible == 0 && !snd_mixer_is_idle(mixer)) {
+        engine->t_audible = t_started.QuadPart;
+    }
+
+    if (t_resume != 0) {
+        QueryPerformanceFrequency(&freq);
+        ticks = t_started.QuadPart - t_resume;
+        rt_trace(
+                RT_TRACE_RESUME,
+                (uint32_t) (ticks * 1000000 / freq.QuadPart),
+                0);
+        engine->nresumes++;
+        engine->resume_ticks_total += ticks;
+
+        if (ticks > engine->resume_ticks_max) {
+            engine->resume_ticks_max = ticks;
+        }
+    }
+
+    return S_OK;
+}
+
+static HRESULT engine_prefill(
+        struct backend *be,
+        struct snd_mixer *mixer,
+        size_t lookahead,
+        size_t nblocks)
+{
+    size_t nframes;
+    size_t nwant;
+    HRESULT hr;
+
+    /*  Fill the whole buffer before starting, as exclusive mode requires */
+
+    hr = backend_get_avail(be, &nframes);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    nwant = nframes / be->period;
+
+    if (nwant > nblocks) {
+        nwant = nblocks;
+    }
+
+    snd_mixer_render(mixer, nwant + lookahead);
+    hr = engine_write(be, mixer, nwant);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    return backend_start(be);
+}
+
+static HRESULT engine_write(
+        struct backend *be,
+        struct snd_mixer *mixer,
+        size_t nblocks)
+{
+    struct snd_primary *primary;
+    uint8_t *frames;
+    size_t nbytes;
+    size_t i;
+    HRESULT hr;
+
+    if (nblocks == 0) {
+        return S_OK;
+    }
+
+    hr = backend_get_buffer(be, (void **) &frames, nblocks * be->period);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    /*  An application writing the primary buffer itself gets it copied
+        straight into the device's buffer, without going near the mixer,
+        unless it has to be resampled. */
+
+    primary = snd_mixer_get_direct(mixer);
+
+    if (primary != NULL) {
+        snd_primary_read(
+                primary,
+                frames,
+                be->format,
+                be->nchannels,
+                nblocks * be->period);
+
+        return backend_release_buffer(be);
+    }
+
+    nbytes = snd_mixer_block_size(mixer);
+
+    for (i = 0 ; i < nblocks ; i++) {
+        snd_mixer_pop(mixer, frames + i * nbytes);
+    }
+
+    return backend_release_buffer(be);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <winerror.h>
+#include <mmreg.h>
+
+#include "notifier.h"
+#include "reaper.h"
+#include "snd-primary.h"
+#include "snd-service.h"
+
+struct engine;
+
+/*  Get a reference to the process-wide engine, starting it if this is the
+    first, and give it back again. */
+
+HRESULT engine_acquire(struct engine **out);
+void engine_release(struct engine *engine);
+HRESULT engine_snd_client_alloc(
+        struct engine *engine,
+        struct snd_client **out);
+struct reaper *engine_get_reaper(const struct engine *engine);
+struct notifier *engine_get_notifier(const struct engine *engine);
+
+/*  The engine starts without waiting for the device. These wait for the
+    device to come up, since the mix format and the size of the primary
+    buffer depend on it. */
+
+const WAVEFORMATEX *engine_get_sys_format(const struct engine *engine);
+struct snd_primary *engine_get_primary(const struct engine *engine);
+
+/*  The primary buffer's format sets the mix rate, if nothing has been
+    converted to the current one yet. The device is asked to switch to it
+    too, and the mix is resampled if it will not. Returns S_FALSE if the
+    rate stays as it was. Sound buffers must be counted in and out for this
+    to know. */
+
+HRESULT engine_set_mix_format(
+        struct engine *engine,
+        const WAVEFORMATEX *wfx);
+void engine_add_buffer(struct engine *engine);
+void engine_remove_buffer(struct engine *engine);
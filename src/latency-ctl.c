@@ -0,0 +1,214 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "latency-ctl.h"
+
+/*  Glitches (or near misses) it takes within one window to step up */
+
+#define LATENCY_CTL_NGLITCHES 3
+#define LATENCY_CTL_WINDOW_MSEC 2000
+
+/*  How long things must stay quiet, with every cycle finishing inside
+    LATENCY_CTL_LOAD_LOW percent of its period, before stepping down. A
+    cycle that takes LATENCY_CTL_LOAD_HIGH percent or more of its period
+    counts as a near miss. */
+
+#define LATENCY_CTL_STABLE_MSEC 10000
+#define LATENCY_CTL_LOAD_LOW 50
+#define LATENCY_CTL_LOAD_HIGH 90
+#define LATENCY_CTL_MAX_BACKOFF 8
+
+void latency_ctl_init(
+        struct latency_ctl *ctl,
+        unsigned int level,
+        unsigned int nlevels,
+        unsigned int rate)
+{
+    assert(ctl != NULL);
+    assert(level < nlevels);
+
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->level = level;
+    ctl->target = level;
+    ctl->min_level = 0;
+    ctl->max_level = nlevels - 1;
+    ctl->window_nframes = (uint64_t) rate * LATENCY_CTL_WINDOW_MSEC / 1000;
+    ctl->stable_nframes = (uint64_t) rate * LATENCY_CTL_STABLE_MSEC / 1000;
+    ctl->backoff = 1;
+    ctl->stats.level = level;
+}
+
+void latency_ctl_reset(
+        struct latency_ctl *ctl,
+        unsigned int level,
+        unsigned int nlevels,
+        unsigned int rate)
+{
+    struct latency_ctl_stats stats;
+    uint64_t frame;
+
+    assert(ctl != NULL);
+
+    stats = ctl->stats;
+    frame = ctl->frame;
+    latency_ctl_init(ctl, level, nlevels, rate);
+    ctl->stats = stats;
+    ctl->stats.level = level;
+    ctl->frame = frame;
+    ctl->window_start = frame;
+    ctl->quiet_start = frame;
+}
+
+void latency_ctl_pin(struct latency_ctl *ctl)
+{
+    assert(ctl != NULL);
+
+    ctl->min_level = ctl->level;
+    ctl->max_level = ctl->level;
+}
+
+unsigned int latency_ctl_update(
+        struct latency_ctl *ctl,
+        size_t nframes,
+        bool glitch,
+        unsigned int load_pct)
+{
+    bool near_miss;
+
+    assert(ctl != NULL);
+
+    ctl->frame += nframes;
+    near_miss = load_pct >= LATENCY_CTL_LOAD_HIGH;
+
+    if (load_pct > ctl->stats.load_max) {
+        ctl->stats.load_max = load_pct;
+    }
+
+    if (glitch) {
+        ctl->stats.nglitches++;
+    } else if (near_miss) {
+        ctl->stats.nnear_misses++;
+    }
+
+    if (glitch || near_miss) {
+        if (ctl->frame - ctl->window_start > ctl->window_nframes) {
+            ctl->window_start = ctl->frame;
+            ctl->nbad = 0;
+        }
+
+        ctl->nbad++;
+        ctl->quiet_start = ctl->frame;
+
+        if (    ctl->nbad < LATENCY_CTL_NGLITCHES ||
+                ctl->level >= ctl->max_level) {
+            return ctl->level;
+        }
+
+        /*  A step down that did not hold for long was a mistake: wait
+            longer before trying that again. */
+
+        if (    ctl->stepped_down &&
+                ctl->frame - ctl->last_step_down < ctl->stable_nframes &&
+                ctl->backoff < LATENCY_CTL_MAX_BACKOFF) {
+            ctl->backoff *= 2;
+        }
+
+        ctl->target = ctl->level + 1;
+        ctl->reason = LATENCY_CTL_GLITCHES;
+
+        return ctl->target;
+    }
+
+    if (load_pct >= LATENCY_CTL_LOAD_LOW) {
+        ctl->quiet_start = ctl->frame;
+
+        return ctl->level;
+    }
+
+    if (    ctl->level > ctl->min_level &&
+            ctl->frame - ctl->quiet_start
+                    >= ctl->stable_nframes * ctl->backoff) {
+        ctl->target = ctl->level - 1;
+        ctl->reason = LATENCY_CTL_STABLE;
+
+        return ctl->target;
+    }
+
+    return ctl->level;
+}
+
+void latency_ctl_commit(
+        struct latency_ctl *ctl,
+        size_t period_from,
+        size_t period_to)
+{
+    struct latency_ctl_transition *t;
+
+    assert(ctl != NULL);
+    assert(ctl->target != ctl->level);
+
+    t = &ctl->stats.log[ctl->stats.ntransitions % LATENCY_CTL_NLOG];
+    t->frame = ctl->frame;
+    t->period_from = period_from;
+    t->period_to = period_to;
+    t->reason = ctl->reason;
+
+    if (ctl->target > ctl->level) {
+        ctl->stats.nsteps_up++;
+        ctl->stepped_down = false;
+    } else {
+        ctl->stats.nsteps_down++;
+        ctl->stepped_down = true;
+        ctl->last_step_down = ctl->frame;
+    }
+
+    ctl->stats.ntransitions++;
+    ctl->stats.level = ctl->target;
+    ctl->level = ctl->target;
+    ctl->window_start = ctl->frame;
+    ctl->quiet_start = ctl->frame;
+    ctl->nbad = 0;
+}
+
+void latency_ctl_reject(struct latency_ctl *ctl)
+{
+    assert(ctl != NULL);
+    assert(ctl->target != ctl->level);
+
+    /*  Whatever stopped the backend from switching is unlikely to go away,
+        so stop asking for that level. */
+
+    if (ctl->target > ctl->level) {
+        ctl->max_level = ctl->level;
+    } else {
+        ctl->min_level = ctl->level;
+    }
+
+    ctl->stats.nrejected++;
+    ctl->target = ctl->level;
+    ctl->window_start = ctl->frame;
+    ctl->quiet_start = ctl->frame;
+    ctl->nbad = 0;
+}
+
+void latency_ctl_get_stats(
+        const struct latency_ctl *ctl,
+        struct latency_ctl_stats *out)
+{
+    assert(ctl != NULL);
+    assert(out != NULL);
+
+    *out = ctl->stats;
+}
+
+const char *latency_ctl_reason_name(enum latency_ctl_reason reason)
+{
+    switch (reason) {
+    case LATENCY_CTL_GLITCHES:  return "glitches";
+    case LATENCY_CTL_STABLE:    return "stable";
+    default:                    return "?";
+    }
+}
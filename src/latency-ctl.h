@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*  Picks the output latency level from what the audio thread observes. A
+    level is an index into the backend's ladder of device periods, smallest
+    first. Repeated glitches within a short window push the level up; a long
+    enough run without any, and with plenty of headroom left in each cycle,
+    brings it back down one step at a time. Every step down that ends in a
+    quick step back up doubles the quiet spell needed before the next one.
+
+    All times are measured in frames of audio handed to the device, so that
+    the controller keeps the same sense of time at every period. */
+
+#define LATENCY_CTL_NLOG 16
+
+enum latency_ctl_reason {
+    LATENCY_CTL_GLITCHES,
+    LATENCY_CTL_STABLE,
+};
+
+struct latency_ctl_transition {
+    uint64_t frame;
+    size_t period_from;
+    size_t period_to;
+    enum latency_ctl_reason reason;
+};
+
+/*  Statistics. Counters are free-running. The log holds the most recent
+    transitions, ntransitions % LATENCY_CTL_NLOG being the next to go. */
+
+struct latency_ctl_stats {
+    unsigned int nglitches;
+    unsigned int nnear_misses;
+    unsigned int nsteps_up;
+    unsigned int nsteps_down;
+    unsigned int nrejected;
+    unsigned int ntransitions;
+    unsigned int level;
+    unsigned int load_max;
+    struct latency_ctl_transition log[LATENCY_CTL_NLOG];
+};
+
+struct latency_ctl {
+    unsigned int level;
+    unsigned int min_level;
+    unsigned int max_level;
+    unsigned int target;
+    enum latency_ctl_reason reason;
+    uint64_t frame;
+    uint64_t window_start;
+    uint64_t quiet_start;
+    uint64_t last_step_down;
+    uint64_t window_nframes;
+    uint64_t stable_nframes;
+    unsigned int backoff;
+    unsigned int nbad;
+    bool stepped_down;
+    struct latency_ctl_stats stats;
+};
+
+void latency_ctl_init(
+        struct latency_ctl *ctl,
+        unsigned int level,
+        unsigned int nlevels,
+        unsigned int rate);
+
+/*  Start over on a new ladder, after the rate has changed. The statistics
+    and the frame count carry on from where they were. */
+
+void latency_ctl_reset(
+        struct latency_ctl *ctl,
+        unsigned int level,
+        unsigned int nlevels,
+        unsigned int rate);
+/*  Stay at the current level for good. Glitches are still counted. */
+
+void latency_ctl_pin(struct latency_ctl *ctl);
+unsigned int latency_ctl_update(
+        struct latency_ctl *ctl,
+        size_t nframes,
+        bool glitch,
+        unsigned int load_pct);
+void latency_ctl_commit(
+        struct latency_ctl *ctl,
+        size_t period_from,
+        size_t period_to);
+void latency_ctl_reject(struct latency_ctl *ctl);
+void latency_ctl_get_stats(
+        const struct latency_ctl *ctl,
+        struct latency_ctl_stats *out);
+const char *latency_ctl_reason_name(enum latency_ctl_reason reason);
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 
 #include "list.h"
+#include "memstat.h"
 
 struct list {
     struct list_node *head;
@@ -38,7 +39,7 @@ int list_alloc(struct list **out)
 {
     assert(out != NULL);
 
-    *out = calloc(sizeof(**out), 1);
+    *out = memstat_calloc(sizeof(**out), 1);
 
     if (*out == NULL) {
         return -ENOMEM;
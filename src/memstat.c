@@ -0,0 +1,87 @@
+#include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "memstat.h"
+#include "trace.h"
+
+#ifdef HYPERSONIK_MEMSTAT
+_Thread_local enum memstat_site memstat_site_;
+
+static atomic_ullong memstat_nallocs[MEMSTAT_NSITES];
+static atomic_ullong memstat_nbytes[MEMSTAT_NSITES];
+#endif
+
+static const char *memstat_site_names[MEMSTAT_NSITES] = {
+    [MEMSTAT_SITE_OTHER]        = "other",
+    [MEMSTAT_SITE_PLAY]         = "Play",
+    [MEMSTAT_SITE_STOP]         = "Stop",
+    [MEMSTAT_SITE_SET_VOLUME]   = "SetVolume",
+    [MEMSTAT_SITE_SET_PAN]      = "SetPan",
+    [MEMSTAT_SITE_AUDIO_THREAD] = "audio thread",
+};
+
+extern inline enum memstat_site memstat_enter(enum memstat_site site);
+extern inline void memstat_leave(enum memstat_site prev);
+extern inline void memstat_record(size_t nbytes);
+extern inline void *memstat_malloc(size_t nbytes);
+extern inline void *memstat_calloc(size_t nelems, size_t elem_nbytes);
+
+void memstat_record_(size_t nbytes)
+{
+#ifdef HYPERSONIK_MEMSTAT
+    enum memstat_site site;
+
+    site = memstat_site_;
+
+    assert(site < MEMSTAT_NSITES);
+
+    atomic_fetch_add_explicit(&memstat_nallocs[site], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(
+            &memstat_nbytes[site],
+            nbytes,
+            memory_order_relaxed);
+#endif
+}
+
+void memstat_read(enum memstat_site site, struct memstat_counter *out)
+{
+    assert(site < MEMSTAT_NSITES);
+    assert(out != NULL);
+
+    memset(out, 0, sizeof(*out));
+
+#ifdef HYPERSONIK_MEMSTAT
+    out->nallocs = atomic_load_explicit(
+            &memstat_nallocs[site],
+            memory_order_relaxed);
+    out->nbytes = atomic_load_explicit(
+            &memstat_nbytes[site],
+            memory_order_relaxed);
+#endif
+}
+
+const char *memstat_site_name(enum memstat_site site)
+{
+    assert(site < MEMSTAT_NSITES);
+
+    return memstat_site_names[site];
+}
+
+void memstat_trace(void)
+{
+#ifdef HYPERSONIK_MEMSTAT
+    struct memstat_counter ctr;
+    enum memstat_site site;
+
+    for (site = 0 ; site < MEMSTAT_NSITES ; site++) {
+        memstat_read(site, &ctr);
+        trace(  "memstat: %-12s %8llu allocs %10llu bytes",
+                memstat_site_name(site),
+                (unsigned long long) ctr.nallocs,
+                (unsigned long long) ctr.nbytes);
+    }
+#endif
+}
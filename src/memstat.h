@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*  Heap allocation accounting. Each thread carries a "current site" tag which
+    the API entry points and the audio thread set on entry; allocations made
+    while a site is active are charged to it, and everything else is charged
+    to "other". The engine allocates through memstat_malloc() and
+    memstat_calloc() so that nothing it does escapes the count; memory that
+    Windows allocates on our behalf is not seen. All of this compiles down to
+    plain malloc() and calloc() unless HYPERSONIK_MEMSTAT is defined. */
+
+enum memstat_site {
+    MEMSTAT_SITE_OTHER,
+    MEMSTAT_SITE_PLAY,
+    MEMSTAT_SITE_STOP,
+    MEMSTAT_SITE_SET_VOLUME,
+    MEMSTAT_SITE_SET_PAN,
+    MEMSTAT_SITE_AUDIO_THREAD,
+    MEMSTAT_NSITES,
+};
+
+struct memstat_counter {
+    uint64_t nallocs;
+    uint64_t nbytes;
+};
+
+#ifdef HYPERSONIK_MEMSTAT
+extern _Thread_local enum memstat_site memstat_site_;
+#endif
+
+void memstat_record_(size_t nbytes);
+void memstat_read(enum memstat_site site, struct memstat_counter *out);
+const char *memstat_site_name(enum memstat_site site);
+void memstat_trace(void);
+
+inline enum memstat_site memstat_enter(enum memstat_site site)
+{
+#ifdef HYPERSONIK_MEMSTAT
+    enum memstat_site prev;
+
+    prev = memstat_site_;
+    memstat_site_ = site;
+
+    return prev;
+#else
+    return site;
+#endif
+}
+
+inline void memstat_leave(enum memstat_site prev)
+{
+#ifdef HYPERSONIK_MEMSTAT
+    memstat_site_ = prev;
+#endif
+}
+
+inline void memstat_record(size_t nbytes)
+{
+#ifdef HYPERSONIK_MEMSTAT
+    memstat_record_(nbytes);
+#endif
+}
+
+inline void *memstat_malloc(size_t nbytes)
+{
+    memstat_record(nbytes);
+
+    return malloc(nbytes);
+}
+
+inline void *memstat_calloc(size_t nelems, size_t elem_nbytes)
+{
+    memstat_record(nelems * elem_nbytes);
+
+    return calloc(nelems, elem_nbytes);
+}
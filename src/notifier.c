@@ -0,0 +1,208 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <process.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hr.h"
+#include "memstat.h"
+#include "notifier.h"
+#include "snd-service.h"
+#include "trace.h"
+
+/*  Runs stream notice handlers on behalf of the audio thread, which must
+    not run arbitrary code or make syscalls. The audio thread never signals
+    us either: while any stream has a handler we check the ring once per
+    device period, and otherwise we sleep until one gets one. */
+
+struct notifier {
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE cond;
+    HANDLE thread;
+    struct snd_service *svc;
+    DWORD period_msec;
+    unsigned int narmed;
+    bool stop;
+};
+
+static unsigned int __stdcall notifier_thread_main(void *ctx);
+
+HRESULT notifier_alloc(
+        struct notifier **out,
+        struct snd_service *svc,
+        DWORD period_msec)
+{
+    struct notifier *notifier;
+
+    assert(out != NULL);
+    assert(svc != NULL);
+
+    *out = NULL;
+
+    notifier = memstat_calloc(1, sizeof(*notifier));
+
+    if (notifier == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    InitializeCriticalSection(&notifier->lock);
+    InitializeConditionVariable(&notifier->cond);
+    notifier->svc = svc;
+    notifier->period_msec = period_msec > 0 ? period_msec : 1;
+
+    *out = notifier;
+
+    return S_OK;
+}
+
+void notifier_free(struct notifier *notifier)
+{
+    if (notifier == NULL) {
+        return;
+    }
+
+    notifier_stop(notifier);
+    assert(notifier->narmed == 0);
+
+    DeleteCriticalSection(&notifier->lock);
+    free(notifier);
+}
+
+HRESULT notifier_start(struct notifier *notifier)
+{
+    HRESULT hr;
+
+    assert(notifier != NULL);
+    assert(notifier->thread == NULL);
+
+    trace("Starting notifier thread");
+
+    notifier->stop = false;
+    notifier->thread = (HANDLE) _beginthreadex(
+            NULL,
+            0,
+            notifier_thread_main,
+            notifier,
+            0,
+            NULL);
+
+    if (notifier->thread == NULL) {
+        hr = hr_from_win32();
+        hr_trace("_beginthreadex", hr);
+
+        return hr;
+    }
+
+    return S_OK;
+}
+
+void notifier_stop(struct notifier *notifier)
+{
+    DWORD result;
+    HRESULT hr;
+
+    assert(notifier != NULL);
+
+    if (notifier->thread == NULL) {
+        return;
+    }
+
+    trace("Stopping notifier thread");
+
+    EnterCriticalSection(&notifier->lock);
+    notifier->stop = true;
+    WakeConditionVariable(&notifier->cond);
+    LeaveCriticalSection(&notifier->lock);
+
+    result = WaitForSingleObject(notifier->thread, INFINITE);
+
+    if (result != WAIT_OBJECT_0) {
+        hr = hr_from_win32();
+        hr_trace("WaitForSingleObject", hr);
+        abort();
+    }
+
+    CloseHandle(notifier->thread);
+    notifier->thread = NULL;
+
+    trace("Notifier thread stopped");
+}
+
+void notifier_set_period(struct notifier *notifier, DWORD period_msec)
+{
+    assert(notifier != NULL);
+
+    EnterCriticalSection(&notifier->lock);
+    notifier->period_msec = period_msec > 0 ? period_msec : 1;
+    LeaveCriticalSection(&notifier->lock);
+}
+
+void notifier_arm(struct notifier *notifier)
+{
+    assert(notifier != NULL);
+
+    EnterCriticalSection(&notifier->lock);
+
+    if (notifier->narmed++ == 0) {
+        WakeConditionVariable(&notifier->cond);
+    }
+
+    LeaveCriticalSection(&notifier->lock);
+}
+
+void notifier_disarm(struct notifier *notifier)
+{
+    assert(notifier != NULL);
+
+    EnterCriticalSection(&notifier->lock);
+    assert(notifier->narmed > 0);
+    notifier->narmed--;
+    LeaveCriticalSection(&notifier->lock);
+}
+
+static unsigned int __stdcall notifier_thread_main(void *ctx)
+{
+    struct notifier *notifier;
+    DWORD timeout;
+    bool stop;
+    BOOL ok;
+
+    trace("Started notifier thread");
+
+    notifier = ctx;
+
+    for (;;) {
+        EnterCriticalSection(&notifier->lock);
+
+        if (!notifier->stop) {
+            timeout = notifier->narmed > 0 ? notifier->period_msec
+                                           : INFINITE;
+            ok = SleepConditionVariableCS(
+                    &notifier->cond,
+                    &notifier->lock,
+                    timeout);
+
+            if (!ok && GetLastError() != ERROR_TIMEOUT) {
+                hr_trace("SleepConditionVariableCS", hr_from_win32());
+                abort();
+            }
+        }
+
+        stop = notifier->stop;
+
+        LeaveCriticalSection(&notifier->lock);
+
+        /*  Handlers run outside the lock, so they may arm and disarm */
+
+        snd_service_dispatch(notifier->svc);
+
+        if (stop) {
+            break;
+        }
+    }
+
+    trace("Notifier thread is exiting");
+
+    return 0;
+}
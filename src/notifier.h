@@ -0,0 +1,27 @@
+#pragma once
+
+#include <windows.h>
+
+#include "snd-service.h"
+
+struct notifier;
+
+HRESULT notifier_alloc(
+        struct notifier **out,
+        struct snd_service *svc,
+        DWORD period_msec);
+void notifier_free(struct notifier *notifier);
+HRESULT notifier_start(struct notifier *notifier);
+
+/*  Only once the mixer has stopped: whatever it posted last is handled on
+    the way out. */
+
+void notifier_stop(struct notifier *notifier);
+void notifier_set_period(struct notifier *notifier, DWORD period_msec);
+
+/*  The notifier only checks for notices while anybody is expecting them.
+    Each stream given a notice handler is counted in until that handler is
+    finished with. */
+
+void notifier_arm(struct notifier *notifier);
+void notifier_disarm(struct notifier *notifier);
@@ -0,0 +1,121 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hr.h"
+#include "perfstat.h"
+#include "trace.h"
+
+struct perfstat {
+    HANDLE section;
+    struct perfstat_block *block;
+};
+
+HRESULT perfstat_alloc(struct perfstat **out)
+{
+    struct perfstat *ps;
+    char name[64];
+    HRESULT hr;
+
+    assert(out != NULL);
+
+    *out = NULL;
+    ps = calloc(1, sizeof(*ps));
+
+    if (ps == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    _snprintf_s(
+            name,
+            sizeof(name),
+            sizeof(name) - 1,
+            PERFSTAT_NAME_FORMAT,
+            (unsigned long) GetCurrentProcessId());
+
+    ps->section = CreateFileMappingA(
+            INVALID_HANDLE_VALUE,
+            NULL,
+            PAGE_READWRITE,
+            0,
+            sizeof(*ps->block),
+            name);
+
+    if (ps->section == NULL) {
+        hr = hr_from_win32();
+        hr_trace("CreateFileMappingA", hr);
+
+        goto end;
+    }
+
+    ps->block = MapViewOfFile(
+            ps->section,
+            FILE_MAP_WRITE,
+            0,
+            0,
+            sizeof(*ps->block));
+
+    if (ps->block == NULL) {
+        hr = hr_from_win32();
+        hr_trace("MapViewOfFile", hr);
+
+        goto end;
+    }
+
+    /*  The section comes zeroed. Readers ignore it until the magic is in. */
+
+    ps->block->version = PERFSTAT_VERSION;
+    ps->block->size = sizeof(*ps->block);
+    atomic_thread_fence(memory_order_release);
+    ps->block->magic = PERFSTAT_MAGIC;
+
+    trace("Publishing performance counters as %s", name);
+
+    *out = ps;
+    ps = NULL;
+    hr = S_OK;
+
+end:
+    perfstat_free(ps);
+
+    return hr;
+}
+
+void perfstat_free(struct perfstat *ps)
+{
+    if (ps == NULL) {
+        return;
+    }
+
+    if (ps->block != NULL) {
+        UnmapViewOfFile(ps->block);
+    }
+
+    if (ps->section != NULL) {
+        CloseHandle(ps->section);
+    }
+
+    free(ps);
+}
+
+struct perfstat_block *perfstat_begin(struct perfstat *ps)
+{
+    assert(ps != NULL);
+
+    atomic_fetch_add_explicit(&ps->block->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    return ps->block;
+}
+
+void perfstat_end(struct perfstat *ps)
+{
+    assert(ps != NULL);
+
+    atomic_fetch_add_explicit(&ps->block->seq, 1, memory_order_release);
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*  Live performance counters, published in a named shared memory section so
+    that they can be watched from outside the process. This header is all a
+    reader needs. The engine thread rewrites the block once per cycle; seq is
+    odd while it does, so a reader copies the block out and retries until
+    seq was even and unchanged across the copy.
+
+    Readers should check magic and version, and only rely on the first size
+    bytes: later versions only ever add fields at the end. Counters marked
+    total are free-running, for the reader to take differences of. Times are
+    in nanoseconds. */
+
+#define PERFSTAT_MAGIC 0x46505348 /* "HSPF" */
+#define PERFSTAT_VERSION 2
+#define PERFSTAT_NAME_FORMAT "Local\\hypersonik-perf-%lu"
+#define PERFSTAT_NCOSTS 8
+
+/*  Mixing cost of the voices created at one call site: the return address
+    of the CreateSoundBuffer call, which duplicates inherit, or zero for
+    everything that did not fit in the tally. Estimated from a sample of
+    mixer blocks, so nframes is approximate too. */
+
+struct perfstat_voice_cost {
+    uint64_t tag;
+    uint64_t ns;
+    uint64_t nframes;
+    uint32_t nvoices_max;
+    uint32_t reserved;
+};
+
+struct perfstat_block {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    atomic_uint seq;
+
+    /*  Engine state */
+
+    uint64_t ncycles;
+    uint32_t suspended;
+    uint32_t mix_rate;
+    uint32_t device_rate;
+    uint32_t period;
+    uint32_t level;
+    uint32_t load_pct;
+
+    /*  Audio thread, per cycle and totals */
+
+    uint32_t nvoices;
+    uint32_t cmd_backlog;
+    uint64_t ncmds_total;
+    uint64_t intake_ns;
+    uint64_t intake_ns_total;
+    uint64_t mix_ns;
+    uint64_t mix_ns_total;
+    uint64_t nunderruns_total;
+
+    /*  Everything else */
+
+    uint32_t reaper_backlog;
+    uint32_t reserved;
+    uint64_t sample_nbytes;
+    uint64_t nconversions_total;
+    uint64_t convert_ns_total;
+
+    /*  Version 2: the call sites whose voices cost the most to mix over the
+        last window, most costly first. cost_nwindows counts windows, so a
+        reader can tell when a new one is in. Each voice is timed in one of
+        every cost_interval mixer blocks. */
+
+    uint32_t cost_nwindows;
+    uint32_t cost_window_ms;
+    uint32_t cost_interval;
+    uint32_t ncosts;
+    struct perfstat_voice_cost costs[PERFSTAT_NCOSTS];
+};
+
+struct perfstat;
+
+/*  Creates the section for the calling process. Writing is for the engine
+    thread only. */
+
+HRESULT perfstat_alloc(struct perfstat **out);
+void perfstat_free(struct perfstat *ps);
+struct perfstat_block *perfstat_begin(struct perfstat *ps);
+void perfstat_end(struct perfstat *ps);
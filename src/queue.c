@@ -5,11 +5,13 @@
 #include <stddef.h>
 #include <stdlib.h>
 
+#include "memstat.h"
 #include "queue.h"
 
 struct queue_private {
     /* Elements are stored in the correct order */
     struct qitem *head;
+    struct qitem *tail;
 };
 
 struct queue_shared {
@@ -86,7 +88,7 @@ int queue_private_alloc(struct queue_private **out)
 {
     assert(out != NULL);
 
-    *out = calloc(sizeof(**out), 1);
+    *out = memstat_calloc(sizeof(**out), 1);
 
     if (*out == NULL) {
         return -ENOMEM;
@@ -105,21 +107,30 @@ void queue_private_free(struct queue_private *qp, queue_dtor_t dtor)
     free(qp);
 }
 
-void queue_private_move_from_shared(
+unsigned int queue_private_move_from_shared(
         struct queue_private *qp,
         struct queue_shared *qs)
 {
     struct qitem *tail;
+    unsigned int nretries;
 
     assert(qp != NULL);
     assert(qp->head == NULL); /* Sufficient for our purposes */
     assert(qs != NULL);
 
-    do {
-        tail = qs->tail;
-    } while (!atomic_compare_exchange_weak(&qs->tail, &tail, NULL));
+    nretries = 0;
+    tail = qs->tail;
+
+    while (!atomic_compare_exchange_weak(&qs->tail, &tail, NULL)) {
+        nretries++;
+    }
+
+    /* The most recently pushed item ends up at the end of the queue */
 
     qp->head = qitem_chain_reverse(tail);
+    qp->tail = tail;
+
+    return nretries;
 }
 
 bool queue_private_is_empty(const struct queue_private *qp)
@@ -129,6 +140,105 @@ bool queue_private_is_empty(const struct queue_private *qp)
     return qp->head == NULL;
 }
 
+void queue_private_push(struct queue_private *qp, struct qitem *qi)
+{
+    assert(qp != NULL);
+    assert(qi != NULL);
+    assert(!qitem_is_queued(qi));
+
+    qi->next = qp->head;
+    qp->head = qi;
+
+    if (qp->tail == NULL) {
+        qp->tail = qi;
+    }
+}
+
+void queue_private_enqueue(struct queue_private *qp, struct qitem *qi)
+{
+    assert(qp != NULL);
+    assert(qi != NULL);
+    assert(!qitem_is_queued(qi));
+
+    qi->next = NULL;
+
+    if (qp->tail != NULL) {
+        qp->tail->next = qi;
+    } else {
+        qp->head = qi;
+    }
+
+    qp->tail = qi;
+}
+
+void queue_private_splice(
+        struct queue_private *dest,
+        struct queue_private *src)
+{
+    assert(dest != NULL);
+    assert(src != NULL);
+
+    if (src->head == NULL) {
+        return;
+    }
+
+    if (dest->tail != NULL) {
+        dest->tail->next = src->head;
+    } else {
+        dest->head = src->head;
+    }
+
+    dest->tail = src->tail;
+    src->head = NULL;
+    src->tail = NULL;
+}
+
+size_t queue_private_extract(
+        struct queue_private *qp,
+        struct queue_private *dest,
+        queue_pred_t pred,
+        void *ctx)
+{
+    struct qitem *prev;
+    struct qitem *qi;
+    struct qitem *next;
+    size_t n;
+
+    assert(qp != NULL);
+    assert(dest != NULL);
+    assert(pred != NULL);
+
+    prev = NULL;
+    qi = qp->head;
+    n = 0;
+
+    while (qi != NULL) {
+        next = qi->next;
+
+        if (pred(qi, ctx)) {
+            if (prev != NULL) {
+                prev->next = next;
+            } else {
+                qp->head = next;
+            }
+
+            if (qp->tail == qi) {
+                qp->tail = prev;
+            }
+
+            qi->next = qi;
+            queue_private_enqueue(dest, qi);
+            n++;
+        } else {
+            prev = qi;
+        }
+
+        qi = next;
+    }
+
+    return n;
+}
+
 struct qitem *queue_private_pop(struct queue_private *qp)
 {
     struct qitem *qi;
@@ -140,11 +250,53 @@ struct qitem *queue_private_pop(struct queue_private *qp)
     if (qi != NULL) {
         qp->head = qi->next;
         qi->next = qi;
+
+        if (qp->head == NULL) {
+            qp->tail = NULL;
+        }
     }
 
     return qi;
 }
 
+size_t queue_private_truncate(
+        struct queue_private *qp,
+        size_t n,
+        struct queue_shared *qs)
+{
+    struct queue_private excess;
+    struct qitem *qi;
+    size_t nkept;
+
+    assert(qp != NULL);
+    assert(qs != NULL);
+
+    if (n == 0) {
+        queue_shared_move_from_private(qs, qp);
+
+        return 0;
+    }
+
+    /* Walk at most n items, then hand whatever follows over in one CAS */
+
+    qi = qp->head;
+    nkept = 0;
+
+    while (qi != NULL && ++nkept < n) {
+        qi = qi->next;
+    }
+
+    if (qi != NULL && qi->next != NULL) {
+        excess.head = qi->next;
+        excess.tail = qp->tail;
+        qi->next = NULL;
+        qp->tail = qi;
+        queue_shared_move_from_private(qs, &excess);
+    }
+
+    return nkept;
+}
+
 void queue_private_iter_init(
         struct queue_private_iter *i,
         struct queue_private *qp)
@@ -181,7 +333,7 @@ int queue_shared_alloc(struct queue_shared **out)
 {
     assert(out != NULL);
 
-    *out = calloc(sizeof(**out), 1);
+    *out = memstat_calloc(sizeof(**out), 1);
 
     if (*out == NULL) {
         return -ENOMEM;
@@ -200,19 +352,20 @@ void queue_shared_free(struct queue_shared *qs, queue_dtor_t dtor)
     free(qs);
 }
 
-void queue_shared_move_from_private(
+unsigned int queue_shared_move_from_private(
         struct queue_shared *qs,
         struct queue_private *qp)
 {
     struct qitem *rev_tail;
     struct qitem *rev_head;
     struct qitem *tmp;
+    unsigned int nretries;
 
     assert(qs != NULL);
     assert(qp != NULL);
 
     if (qp->head == NULL) {
-        return;
+        return 0;
     }
 
     rev_tail = qp->head;
@@ -220,23 +373,44 @@ void queue_shared_move_from_private(
 
     assert(rev_tail->next == NULL);
 
-    do {
-        tmp = qs->tail;
+    nretries = 0;
+    tmp = qs->tail;
+    rev_tail->next = tmp;
+
+    while (!atomic_compare_exchange_weak(&qs->tail, &tmp, rev_head)) {
         rev_tail->next = tmp;
-    } while (!atomic_compare_exchange_weak(&qs->tail, &tmp, rev_head));
+        nretries++;
+    }
 
     qp->head = NULL;
+    qp->tail = NULL;
+
+    return nretries;
+}
+
+bool queue_shared_is_empty(const struct queue_shared *qs)
+{
+    assert(qs != NULL);
+
+    return qs->tail == NULL;
 }
 
-void queue_shared_push(struct queue_shared *qs, struct qitem *qi)
+unsigned int queue_shared_push(struct queue_shared *qs, struct qitem *qi)
 {
     struct qitem *tail;
+    unsigned int nretries;
 
     assert(qs != NULL);
     assert(qi != NULL);
 
-    do {
-        tail = qs->tail;
+    nretries = 0;
+    tail = qs->tail;
+    qi->next = tail;
+
+    while (!atomic_compare_exchange_weak(&qs->tail, &tail, qi)) {
         qi->next = tail;
-    } while (!atomic_compare_exchange_weak(&qs->tail, &tail, qi));
+        nretries++;
+    }
+
+    return nretries;
 }
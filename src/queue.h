@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct queue_private;
 struct queue_shared;
@@ -14,6 +15,7 @@ struct queue_private_iter {
 };
 
 typedef void (*queue_dtor_t)(struct qitem *item);
+typedef bool (*queue_pred_t)(struct qitem *item, void *ctx);
 
 void qitem_init(struct qitem *qi);
 void qitem_fini(struct qitem *qi);
@@ -21,11 +23,30 @@ bool qitem_is_queued(const struct qitem *qi);
 
 int queue_private_alloc(struct queue_private **out);
 void queue_private_free(struct queue_private *qp, queue_dtor_t dtor);
-void queue_private_move_from_shared(
+
+/*  The moves between private and shared queues, and pushes onto shared
+    ones, return how many times they had to try again because another
+    thread changed the shared queue under them. */
+
+unsigned int queue_private_move_from_shared(
         struct queue_private *qp,
         struct queue_shared *qs);
 bool queue_private_is_empty(const struct queue_private *qp);
+void queue_private_push(struct queue_private *qp, struct qitem *qi);
+void queue_private_enqueue(struct queue_private *qp, struct qitem *qi);
+void queue_private_splice(
+        struct queue_private *dest,
+        struct queue_private *src);
+size_t queue_private_extract(
+        struct queue_private *qp,
+        struct queue_private *dest,
+        queue_pred_t pred,
+        void *ctx);
 struct qitem *queue_private_pop(struct queue_private *qp);
+size_t queue_private_truncate(
+        struct queue_private *qp,
+        size_t n,
+        struct queue_shared *qs);
 
 void queue_private_iter_init(
         struct queue_private_iter *i,
@@ -36,7 +57,8 @@ struct qitem *queue_private_iter_deref(const struct queue_private_iter *i);
 
 int queue_shared_alloc(struct queue_shared **out);
 void queue_shared_free(struct queue_shared *qs, queue_dtor_t dtor);
-void queue_shared_move_from_private(
+unsigned int queue_shared_move_from_private(
         struct queue_shared *qs,
         struct queue_private *qp);
-void queue_shared_push(struct queue_shared *qs, struct qitem *qi);
+bool queue_shared_is_empty(const struct queue_shared *qs);
+unsigned int queue_shared_push(struct queue_shared *qs, struct qitem *qi);
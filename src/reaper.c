@@ -2,25 +2,44 @@
 
 #include <assert.h>
 #include <process.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
 #include "defs.h"
 #include "hr.h"
+#include "memstat.h"
 #include "reaper.h"
 #include "snd-buffer.h"
 #include "snd-service.h"
 #include "snd-stream.h"
 #include "trace.h"
 
+/*  The mixer may still be touching a retired stream until it has finished
+    the cycle in which the corresponding stop command was taken in. A stop that
+    is submitted while the mixer is on epoch N might just miss cycle N's
+    intake, but it is guaranteed to be applied by the end of cycle N + 1, i.e.
+    once the published epoch reaches N + 2.
+
+    Commands that spill over into later cycles may also still refer to the
+    stream, so the comparison is made against the service's reclaim epoch,
+    which holds back while older commands are waiting in the backlog. */
+
+#define REAPER_EPOCH_LAG 2
+
+/* How often to check the epoch while retired tasks are outstanding */
+
+#define REAPER_POLL_MSEC 10
+
 struct reaper {
     CRITICAL_SECTION lock;
     CONDITION_VARIABLE cond;
-    HANDLE fence;
     HANDLE thread;
     struct snd_client *cli;
     struct list *tasks;
+    struct list *tasks_batch;
     struct list *tasks_pending;
+    atomic_uint backlog;
     bool stop;
 };
 
@@ -29,12 +48,17 @@ struct reaper_task {
     struct snd_command *cmd;
     struct snd_stream *stm;
     struct snd_buffer *buf;
+    dtor_notify_t dtor;
+    void *dtor_ctx;
+    unsigned int epoch;
 };
 
 static unsigned int __stdcall reaper_thread_main(void *ctx);
 static void reaper_thread_submit_commands(struct reaper *reaper);
-static void reaper_thread_destroy_resources(struct list_node *node);
-static void reaper_signal_fence(void *ctx);
+static void reaper_thread_reclaim(struct reaper *reaper);
+static void reaper_thread_destroy_resources(
+        struct reaper *reaper,
+        struct list_node *node);
 
 HRESULT reaper_alloc(
         struct reaper **out,
@@ -49,7 +73,7 @@ HRESULT reaper_alloc(
 
     *out = NULL;
 
-    reaper = calloc(1, sizeof(*reaper));
+    reaper = memstat_calloc(1, sizeof(*reaper));
 
     if (reaper == NULL) {
         hr = E_OUTOFMEMORY;
@@ -60,16 +84,15 @@ HRESULT reaper_alloc(
     InitializeCriticalSection(&reaper->lock);
     InitializeConditionVariable(&reaper->cond);
 
-    reaper->fence = CreateEventW(NULL, TRUE, FALSE, NULL);
+    r = list_alloc(&reaper->tasks);
 
-    if (reaper->fence == NULL) {
-        hr = hr_from_win32();
-        hr_trace("CreateEventW", hr);
+    if (r < 0) {
+        hr = hr_from_errno(r);
 
         goto end;
     }
 
-    r = list_alloc(&reaper->tasks);
+    r = list_alloc(&reaper->tasks_batch);
 
     if (r < 0) {
         hr = hr_from_errno(r);
@@ -99,6 +122,8 @@ end:
 
 void reaper_free(struct reaper *reaper)
 {
+    struct list_node *node;
+    struct list_iter iter;
     DWORD result;
     HRESULT hr;
 
@@ -127,16 +152,26 @@ void reaper_free(struct reaper *reaper)
         trace("Reaper thread stopped");
     }
 
-    if (reaper->fence != NULL) {
-        CloseHandle(reaper->fence);
+    /*  Nothing reads these streams any more, so there is no epoch to wait
+        for, and none would come anyway. */
+
+    while (reaper->tasks != NULL && !list_is_empty(reaper->tasks)) {
+        list_iter_init(&iter, reaper->tasks);
+        node = list_iter_deref(&iter);
+        list_remove(reaper->tasks, node);
+        reaper_thread_destroy_resources(reaper, node);
     }
 
     assert( reaper->tasks == NULL || list_is_empty(reaper->tasks));
+    assert( reaper->tasks_batch == NULL ||
+            list_is_empty(reaper->tasks_batch));
     assert( reaper->tasks_pending == NULL ||
             list_is_empty(reaper->tasks_pending));
 
     list_free(reaper->tasks, NULL);
+    list_free(reaper->tasks_batch, NULL);
     list_free(reaper->tasks_pending, NULL);
+    snd_client_free(reaper->cli);
 
     /* Apparently win32 condition variables do not need to be destroyed */
     DeleteCriticalSection(&reaper->lock);
@@ -173,6 +208,7 @@ HRESULT reaper_start(struct reaper *reaper)
 HRESULT reaper_alloc_task(
         struct reaper *reaper,
         struct reaper_task **out,
+        struct snd_client *cli,
         struct snd_stream *stm,
         struct snd_buffer *buf)
 {
@@ -182,11 +218,12 @@ HRESULT reaper_alloc_task(
 
     assert(reaper != NULL);
     assert(out != NULL);
+    assert(cli != NULL);
     assert(stm != NULL);
     /* buf can be NULL */
 
     *out = NULL;
-    task = calloc(1, sizeof(*task));
+    task = memstat_calloc(1, sizeof(*task));
 
     if (task == NULL) {
         hr = E_OUTOFMEMORY;
@@ -194,7 +231,10 @@ HRESULT reaper_alloc_task(
         goto end;
     }
 
-    r = snd_client_cmd_alloc(reaper->cli, &task->cmd);
+    /*  Take the command from the caller's client: ours is only ever touched
+        by the reaper thread, and clients are not thread-safe. */
+
+    r = snd_client_cmd_alloc(cli, &task->cmd);
 
     if (r < 0) {
         hr = hr_from_errno(r);
@@ -216,6 +256,19 @@ end:
     return hr;
 }
 
+void reaper_task_set_dtor(
+        struct reaper_task *task,
+        dtor_notify_t dtor,
+        void *ctx)
+{
+    assert(task != NULL);
+    assert(task->dtor == NULL);
+    assert(dtor != NULL);
+
+    task->dtor = dtor;
+    task->dtor_ctx = ctx;
+}
+
 void reaper_submit_task(
         struct reaper *reaper,
         struct reaper_task *task)
@@ -226,6 +279,7 @@ void reaper_submit_task(
     assert(task != NULL);
     assert(!list_node_is_inserted(&task->node));
 
+    atomic_fetch_add_explicit(&reaper->backlog, 1, memory_order_relaxed);
     EnterCriticalSection(&reaper->lock);
 
     transition = list_is_empty(reaper->tasks_pending);
@@ -241,6 +295,7 @@ void reaper_submit_task(
 static unsigned int __stdcall reaper_thread_main(void *ctx)
 {
     struct reaper *reaper;
+    DWORD timeout;
     bool stop;
     BOOL ok;
 
@@ -254,39 +309,50 @@ static unsigned int __stdcall reaper_thread_main(void *ctx)
         hr_trace("SetThreadPriority", hr_from_win32());
     }
 
-    do {
+    for (;;) {
         EnterCriticalSection(&reaper->lock);
 
-        if (!reaper->stop && list_is_empty(reaper->tasks_pending)) {
+        /*  Sleep until there is new work. While retired tasks are still
+            waiting for the mixer to move on we only doze, since the audio
+            thread never signals us. */
+
+        if (list_is_empty(reaper->tasks_pending) && !reaper->stop) {
+            timeout = list_is_empty(reaper->tasks) ? INFINITE
+                                                   : REAPER_POLL_MSEC;
             ok = SleepConditionVariableCS(
                     &reaper->cond,
                     &reaper->lock,
-                    INFINITE);
+                    timeout);
 
-            if (!ok) {
+            if (!ok && GetLastError() != ERROR_TIMEOUT) {
                 hr_trace("SleepConditionVariableCS", hr_from_win32());
                 abort();
             }
         }
 
         stop = reaper->stop;
-        list_move(reaper->tasks, reaper->tasks_pending);
+        list_move(reaper->tasks_batch, reaper->tasks_pending);
 
         LeaveCriticalSection(&reaper->lock);
 
-        /* Send a batch of stop commands */
+        /* Send a batch of stop commands and tag it with the current epoch */
 
         reaper_thread_submit_commands(reaper);
 
-        /* We can now safely release this batch of resources */
+        /* Release everything that the mixer can no longer be looking at */
 
-        list_clear(reaper->tasks, reaper_thread_destroy_resources);
+        reaper_thread_reclaim(reaper);
 
-        /* If we were told to stop then stop here, in order to ensure that all
-           queued deletions have been processed. No new tasks could have come in
-           since the stop flag was raised, since the last reference to the
-           reaper is currently being held by the destructor. */
-    } while (!stop);
+        /*  If we were told to stop then stop here, once every queued task
+            has been moved onto the retired list. No new tasks could have
+            come in since the stop flag was raised, since the last reference
+            to the reaper is currently being held by the destructor, which
+            frees whatever is still retired. */
+
+        if (stop) {
+            break;
+        }
+    }
 
     trace("Reaper thread is exiting");
 
@@ -296,61 +362,79 @@ static unsigned int __stdcall reaper_thread_main(void *ctx)
 static void reaper_thread_submit_commands(struct reaper *reaper)
 {
     struct reaper_task *task;
-    struct reaper_task *task_prev;
     struct list_node *node;
     struct list_iter iter;
-    DWORD result;
-    BOOL ok;
+    unsigned int epoch;
 
-    task_prev = NULL;
+    if (list_is_empty(reaper->tasks_batch)) {
+        return;
+    }
 
-    for (   list_iter_init(&iter, reaper->tasks) ;
+    for (   list_iter_init(&iter, reaper->tasks_batch) ;
             list_iter_is_valid(&iter) ;
             list_iter_next(&iter)) {
-        if (task_prev != NULL) {
-            snd_client_cmd_submit(reaper->cli, task_prev->cmd);
-            task_prev->cmd = NULL;
-        }
-
         node = list_iter_deref(&iter);
         task = containerof(node, struct reaper_task, node);
 
         snd_command_stop(task->cmd, task->stm);
-
-        task_prev = task;
+        snd_client_cmd_submit(reaper->cli, task->cmd);
+        task->cmd = NULL;
     }
 
-    if (task_prev == NULL) {
-        return;
+    /*  The epoch must be sampled after the last submission. Tasks are retired
+        in order, so the retired list stays sorted by epoch. */
+
+    epoch = snd_client_get_epoch(reaper->cli);
+
+    while (!list_is_empty(reaper->tasks_batch)) {
+        list_iter_init(&iter, reaper->tasks_batch);
+        node = list_iter_deref(&iter);
+        task = containerof(node, struct reaper_task, node);
+
+        task->epoch = epoch;
+        list_remove(reaper->tasks_batch, node);
+        list_append(reaper->tasks, node);
     }
+}
+
+static void reaper_thread_reclaim(struct reaper *reaper)
+{
+    struct reaper_task *task;
+    struct list_node *node;
+    struct list_iter iter;
+    unsigned int epoch;
+    unsigned int dispatch_epoch;
 
-    /* The final command needs to signal our fence object once it has been
-       processed so that we know it is safe to proceed */
+    epoch = snd_client_get_reclaim_epoch(reaper->cli);
+    dispatch_epoch = snd_client_get_dispatch_epoch(reaper->cli);
 
-    snd_command_set_callback(task_prev->cmd, reaper_signal_fence, reaper);
-    snd_client_cmd_submit(reaper->cli, task_prev->cmd);
-    task_prev->cmd = NULL;
+    while (!list_is_empty(reaper->tasks)) {
+        list_iter_init(&iter, reaper->tasks);
+        node = list_iter_deref(&iter);
+        task = containerof(node, struct reaper_task, node);
 
-    /* Wait for the final command to finish executing. The entire reaper
-       mechanism exists so that we can eat this multi-millisecond delay on a
-       dedicated thread instead of blocking the application. */
+        /*  The reclaim epoch can trail the epoch the task was tagged with, so
+            take the wrapped difference as signed. */
 
-    result = WaitForSingleObject(reaper->fence, INFINITE);
+        if ((int) (epoch - task->epoch) < REAPER_EPOCH_LAG) {
+            break;
+        }
 
-    if (result != WAIT_OBJECT_0) {
-        hr_trace("WaitForSingleObject", hr_from_win32());
-        abort();
-    }
+        /*  The dispatch epoch trails the reclaim epoch by up to a period */
 
-    ok = ResetEvent(reaper->fence);
+        if (    task->dtor != NULL &&
+                (int) (dispatch_epoch - task->epoch) < REAPER_EPOCH_LAG) {
+            break;
+        }
 
-    if (!ok) {
-        hr_trace("ResetEvent", hr_from_win32());
-        abort();
+        list_remove(reaper->tasks, node);
+        reaper_thread_destroy_resources(reaper, node);
     }
 }
 
-static void reaper_thread_destroy_resources(struct list_node *node)
+static void reaper_thread_destroy_resources(
+        struct reaper *reaper,
+        struct list_node *node)
 {
     struct reaper_task *task;
 
@@ -358,21 +442,13 @@ static void reaper_thread_destroy_resources(struct list_node *node)
 
     snd_stream_free(task->stm);
     snd_buffer_free(task->buf);
-    free(task);
-}
 
-static void reaper_signal_fence(void *ctx)
-{
-    struct reaper *reaper;
-    BOOL ok;
-
-    reaper = ctx;
-    ok = SetEvent(reaper->fence);
-
-    if (!ok) {
-        hr_trace("SetEvent", hr_from_win32());
-        abort();
+    if (task->dtor != NULL) {
+        task->dtor(task->dtor_ctx);
     }
+
+    free(task);
+    atomic_fetch_sub_explicit(&reaper->backlog, 1, memory_order_relaxed);
 }
 
 void reaper_task_discard(struct reaper_task *task)
@@ -383,5 +459,17 @@ void reaper_task_discard(struct reaper_task *task)
 
     snd_command_free(task->cmd);
     list_node_fini(&task->node);
+
+    if (task->dtor != NULL) {
+        task->dtor(task->dtor_ctx);
+    }
+
     free(task);
 }
+
+unsigned int reaper_get_backlog(const struct reaper *reaper)
+{
+    assert(reaper != NULL);
+
+    return atomic_load_explicit(&reaper->backlog, memory_order_relaxed);
+}
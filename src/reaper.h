@@ -2,6 +2,7 @@
 
 #include <windows.h>
 
+#include "refcount.h"
 #include "snd-buffer.h"
 #include "snd-service.h"
 #include "snd-stream.h"
@@ -13,6 +14,9 @@ HRESULT reaper_alloc(
         struct reaper **reaper,
         struct snd_client *cli);
 
+/*  Only once the mixer is gone: tasks still waiting for it to move on are
+    freed straight away. */
+
 void reaper_free(struct reaper *reaper);
 
 HRESULT reaper_start(struct reaper *reaper);
@@ -20,9 +24,22 @@ HRESULT reaper_start(struct reaper *reaper);
 HRESULT reaper_alloc_task(
         struct reaper *reaper,
         struct reaper_task **task,
+        struct snd_client *cli,
         struct snd_stream *stm,
         struct snd_buffer *buf);
 
+/*  Have the task also call dtor once the stream is gone. The stream has a
+    notice handler that dtor takes down, so the task then also waits for the
+    notifier to have handled everything posted for the stream. */
+
+void reaper_task_set_dtor(
+        struct reaper_task *task,
+        dtor_notify_t dtor,
+        void *ctx);
 void reaper_submit_task(struct reaper *reaper, struct reaper_task *task);
 
 void reaper_task_discard(struct reaper_task *task);
+
+/*  Tasks submitted whose resources have not been released yet */
+
+unsigned int reaper_get_backlog(const struct reaper *reaper);
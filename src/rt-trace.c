@@ -0,0 +1,460 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <process.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "hr.h"
+#include "rt-trace.h"
+#include "trace.h"
+
+/*  At one cycle event per millisecond, the ring holds a minute or so. */
+
+#define RT_TRACE_NRECORDS 65536
+#define RT_TRACE_DRAIN_MSEC 100
+
+/*  seq is odd while a record is being written and 2 * (index + 1) once it
+    is complete, so the reader can tell a record it got to in time from one
+    that is still being written or has since been overwritten. */
+
+struct rt_trace_record {
+    atomic_ullong seq;
+    int64_t t;
+    uint32_t event;
+    uint32_t a;
+    uint32_t b;
+};
+
+struct rt_trace {
+    struct rt_trace_record *records;
+    atomic_ullong head;
+    atomic_ullong trigger;
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE cond;
+    HANDLE thread;
+    FILE *f;
+    int64_t t0;
+    int64_t freq;
+    uint64_t tail;
+    uint64_t nlost;
+    unsigned int flight_msec;
+    bool stop;
+};
+
+enum rt_trace_read_result {
+    RT_TRACE_READ_OK,
+    RT_TRACE_READ_PENDING,
+    RT_TRACE_READ_LOST,
+};
+
+atomic_uint rt_trace_mask_;
+
+static struct rt_trace rt_trace_instance;
+
+static const char *rt_trace_formats[RT_TRACE_NEVENTS] = {
+    [RT_TRACE_CYCLE]        = "cycle: %u frames free, load %u%%",
+    [RT_TRACE_GLITCH]       = "GLITCH: %u frames free, load %u%%",
+    [RT_TRACE_SET_LEVEL]    = "latency level %u -> %u",
+    [RT_TRACE_SET_RATE]     = "mixing at %u Hz, device at %u Hz",
+    [RT_TRACE_SUSPEND]      = "suspended",
+    [RT_TRACE_RESUME]       = "resumed, %u us after the first Play",
+};
+
+extern inline void rt_trace(
+        enum rt_trace_event event,
+        uint32_t a,
+        uint32_t b);
+
+static unsigned int __stdcall rt_trace_thread_main(void *ctx);
+static enum rt_trace_read_result rt_trace_read(
+        const struct rt_trace *rt,
+        uint64_t i,
+        struct rt_trace_record *out);
+static void rt_trace_drain(struct rt_trace *rt);
+static void rt_trace_dump(struct rt_trace *rt, uint64_t first, uint64_t end);
+static void rt_trace_write(
+        const struct rt_trace *rt,
+        const struct rt_trace_record *rec);
+
+HRESULT rt_trace_start(void)
+{
+    struct rt_trace *rt;
+    LARGE_INTEGER now;
+    LARGE_INTEGER freq;
+    unsigned int verbosity;
+    char path[MAX_PATH];
+    HRESULT hr;
+
+    rt = &rt_trace_instance;
+
+    assert(rt->thread == NULL);
+
+    verbosity = config_get_uint("RT_TRACE", RT_TRACE_OFF);
+
+    if (verbosity == RT_TRACE_OFF) {
+        return S_FALSE;
+    }
+
+    rt->records = calloc(RT_TRACE_NRECORDS, sizeof(*rt->records));
+
+    if (rt->records == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    /*  Without a file the records go to the debugger, like trace() does */
+
+    if (config_get_string("RT_TRACE_PATH", path, sizeof(path))) {
+        if (fopen_s(&rt->f, path, "w") != 0) {
+            trace("Could not open %s, tracing to the debugger", path);
+            rt->f = NULL;
+        }
+    }
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    InitializeCriticalSection(&rt->lock);
+    InitializeConditionVariable(&rt->cond);
+    atomic_store(&rt->head, 0);
+    atomic_store(&rt->trigger, 0);
+    rt->t0 = now.QuadPart;
+    rt->freq = freq.QuadPart;
+    rt->tail = 0;
+    rt->nlost = 0;
+    rt->flight_msec = config_get_uint("RT_TRACE_FLIGHT", 0) * 1000;
+    rt->stop = false;
+
+    rt->thread = (HANDLE) _beginthreadex(
+            NULL,
+            0,
+            rt_trace_thread_main,
+            rt,
+            0,
+            NULL);
+
+    if (rt->thread == NULL) {
+        hr = hr_from_win32();
+        hr_trace("_beginthreadex", hr);
+        DeleteCriticalSection(&rt->lock);
+
+        if (rt->f != NULL) {
+            fclose(rt->f);
+            rt->f = NULL;
+        }
+
+        free(rt->records);
+        rt->records = NULL;
+
+        return hr;
+    }
+
+    rt_trace_set_verbosity(verbosity);
+
+    return S_OK;
+}
+
+void rt_trace_stop(void)
+{
+    struct rt_trace *rt;
+    DWORD result;
+
+    rt = &rt_trace_instance;
+
+    if (rt->thread == NULL) {
+        return;
+    }
+
+    /*  Whoever was recording has stopped by now, so nothing more can come
+        in once the mask is cleared. */
+
+    atomic_store(&rt_trace_mask_, 0);
+
+    EnterCriticalSection(&rt->lock);
+    rt->stop = true;
+    WakeConditionVariable(&rt->cond);
+    LeaveCriticalSection(&rt->lock);
+
+    result = WaitForSingleObject(rt->thread, INFINITE);
+
+    if (result != WAIT_OBJECT_0) {
+        hr_trace("WaitForSingleObject", hr_from_win32());
+        abort();
+    }
+
+    CloseHandle(rt->thread);
+    rt->thread = NULL;
+
+    trace(  "RT trace: %u records, %u lost",
+            (unsigned int) atomic_load(&rt->head),
+            (unsigned int) rt->nlost);
+
+    if (rt->f != NULL) {
+        fclose(rt->f);
+        rt->f = NULL;
+    }
+
+    DeleteCriticalSection(&rt->lock);
+    free(rt->records);
+    rt->records = NULL;
+}
+
+void rt_trace_set_verbosity(enum rt_trace_verbosity verbosity)
+{
+    unsigned int mask;
+
+    /*  There is nowhere to put anything if tracing was off at start */
+
+    if (rt_trace_instance.records == NULL) {
+        return;
+    }
+
+    switch (verbosity) {
+    case RT_TRACE_OFF:
+        mask = 0;
+
+        break;
+
+    case RT_TRACE_EVENTS:
+        mask = ((1u << RT_TRACE_NEVENTS) - 1) & ~(1u << RT_TRACE_CYCLE);
+
+        break;
+
+    default:
+        mask = (1u << RT_TRACE_NEVENTS) - 1;
+
+        break;
+    }
+
+    atomic_store_explicit(&rt_trace_mask_, mask, memory_order_relaxed);
+}
+
+void rt_trace_record_(enum rt_trace_event event, uint32_t a, uint32_t b)
+{
+    struct rt_trace_record *rec;
+    struct rt_trace *rt;
+    LARGE_INTEGER now;
+    uint64_t i;
+
+    assert(event < RT_TRACE_NEVENTS);
+
+    rt = &rt_trace_instance;
+    QueryPerformanceCounter(&now);
+
+    /*  The oldest record gets overwritten if the drain thread has fallen
+        behind. Writers never wait for it. */
+
+    i = atomic_fetch_add_explicit(&rt->head, 1, memory_order_relaxed);
+    rec = &rt->records[i % RT_TRACE_NRECORDS];
+
+    atomic_store_explicit(&rec->seq, 2 * i + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    rec->t = now.QuadPart;
+    rec->event = event;
+    rec->a = a;
+    rec->b = b;
+    atomic_store_explicit(&rec->seq, 2 * i + 2, memory_order_release);
+
+    if (event == RT_TRACE_GLITCH) {
+        atomic_store_explicit(&rt->trigger, i + 1, memory_order_relaxed);
+    }
+}
+
+static unsigned int __stdcall rt_trace_thread_main(void *ctx)
+{
+    struct rt_trace *rt;
+    bool stop;
+    BOOL ok;
+
+    rt = ctx;
+
+    for (;;) {
+        EnterCriticalSection(&rt->lock);
+
+        if (!rt->stop) {
+            ok = SleepConditionVariableCS(
+                    &rt->cond,
+                    &rt->lock,
+                    RT_TRACE_DRAIN_MSEC);
+
+            if (!ok && GetLastError() != ERROR_TIMEOUT) {
+                hr_trace("SleepConditionVariableCS", hr_from_win32());
+                abort();
+            }
+        }
+
+        stop = rt->stop;
+
+        LeaveCriticalSection(&rt->lock);
+
+        rt_trace_drain(rt);
+
+        if (stop) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static enum rt_trace_read_result rt_trace_read(
+        const struct rt_trace *rt,
+        uint64_t i,
+        struct rt_trace_record *out)
+{
+    struct rt_trace_record *rec;
+    uint64_t seq;
+
+    rec = &rt->records[i % RT_TRACE_NRECORDS];
+    seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+
+    if (seq < 2 * i + 2) {
+        return RT_TRACE_READ_PENDING;
+    } else if (seq > 2 * i + 2) {
+        return RT_TRACE_READ_LOST;
+    }
+
+    out->t = rec->t;
+    out->event = rec->event;
+    out->a = rec->a;
+    out->b = rec->b;
+
+    /*  If it changed under us while we copied, it was overwritten */
+
+    atomic_thread_fence(memory_order_acquire);
+
+    if (atomic_load_explicit(&rec->seq, memory_order_relaxed) != seq) {
+        return RT_TRACE_READ_LOST;
+    }
+
+    return RT_TRACE_READ_OK;
+}
+
+static void rt_trace_drain(struct rt_trace *rt)
+{
+    struct rt_trace_record rec;
+    uint64_t trigger;
+    uint64_t first;
+    uint64_t head;
+    int64_t t_start;
+
+    head = atomic_load_explicit(&rt->head, memory_order_relaxed);
+    first = head > RT_TRACE_NRECORDS ? head - RT_TRACE_NRECORDS : 0;
+
+    if (first < rt->tail) {
+        first = rt->tail;
+    }
+
+    if (rt->flight_msec == 0) {
+        rt->nlost += first - rt->tail;
+        rt_trace_dump(rt, first, head);
+
+        return;
+    }
+
+    /*  In flight recorder mode, only a glitch gets anything written out:
+        whatever is still in the ring from the window before it, and
+        anything since that has not been written out already. */
+
+    trigger = atomic_exchange_explicit(&rt->trigger, 0, memory_order_relaxed);
+
+    if (trigger == 0) {
+        return;
+    }
+
+    if (rt_trace_read(rt, trigger - 1, &rec) == RT_TRACE_READ_OK) {
+        t_start = rec.t - (int64_t) rt->flight_msec * rt->freq / 1000;
+
+        while (first < head) {
+            if (    rt_trace_read(rt, first, &rec) == RT_TRACE_READ_OK &&
+                    rec.t >= t_start) {
+                break;
+            }
+
+            first++;
+        }
+    }
+
+    rt_trace_dump(rt, first, head);
+}
+
+static void rt_trace_dump(struct rt_trace *rt, uint64_t first, uint64_t end)
+{
+    struct rt_trace_record rec;
+    uint64_t i;
+
+    /*  Stop short at a record that is still being written, and pick up from
+        there next time. */
+
+    for (i = first ; i < end ; i++) {
+        switch (rt_trace_read(rt, i, &rec)) {
+        case RT_TRACE_READ_OK:
+            rt_trace_write(rt, &rec);
+
+            break;
+
+        case RT_TRACE_READ_LOST:
+            rt->nlost++;
+
+            break;
+
+        default:
+            goto end;
+        }
+    }
+
+end:
+    rt->tail = i;
+
+    if (rt->f != NULL) {
+        fflush(rt->f);
+    }
+}
+
+static void rt_trace_write(
+        const struct rt_trace *rt,
+        const struct rt_trace_record *rec)
+{
+    char msg[128];
+    char line[160];
+    double msec;
+    int r;
+
+    if (rec->event >= RT_TRACE_NEVENTS) {
+        return;
+    }
+
+    msec = (double) (rec->t - rt->t0) * 1000.0 / rt->freq;
+    r = _snprintf_s(
+            msg,
+            sizeof(msg),
+            sizeof(msg) - 1,
+            rt_trace_formats[rec->event],
+            rec->a,
+            rec->b);
+
+    if (r < 0) {
+        return;
+    }
+
+    r = _snprintf_s(
+            line,
+            sizeof(line),
+            sizeof(line) - 1,
+            "rt %12.3f ms: %s\n",
+            msec,
+            msg);
+
+    if (r < 0) {
+        return;
+    }
+
+    if (rt->f != NULL) {
+        fputs(line, rt->f);
+    } else {
+        OutputDebugStringA(line);
+    }
+}
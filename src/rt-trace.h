@@ -0,0 +1,50 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*  Binary trace for the audio thread, which must not format text or make
+    syscalls. Recording an event is a couple of atomics and a timestamp into
+    a fixed ring; a background thread turns the records into text later.
+    Unlike trace() this is a runtime setting, so it is there in release
+    builds too. In flight recorder mode nothing is written out until a
+    glitch, and then only the last few seconds leading up to it. */
+
+enum rt_trace_event {
+    RT_TRACE_CYCLE,
+    RT_TRACE_GLITCH,
+    RT_TRACE_SET_LEVEL,
+    RT_TRACE_SET_RATE,
+    RT_TRACE_SUSPEND,
+    RT_TRACE_RESUME,
+    RT_TRACE_NEVENTS,
+};
+
+/*  Each verbosity includes everything below it. CYCLES adds an event for
+    every engine cycle, EVENTS is everything else. */
+
+enum rt_trace_verbosity {
+    RT_TRACE_OFF,
+    RT_TRACE_EVENTS,
+    RT_TRACE_CYCLES,
+};
+
+extern atomic_uint rt_trace_mask_;
+
+/*  Start and stop the drain thread, as configured from the environment. If
+    tracing is off at start there is no ring, and it stays off. */
+
+HRESULT rt_trace_start(void);
+void rt_trace_stop(void);
+void rt_trace_set_verbosity(enum rt_trace_verbosity verbosity);
+void rt_trace_record_(enum rt_trace_event event, uint32_t a, uint32_t b);
+
+inline void rt_trace(enum rt_trace_event event, uint32_t a, uint32_t b)
+{
+    if (atomic_load_explicit(&rt_trace_mask_, memory_order_relaxed)
+            & (1u << event)) {
+        rt_trace_record_(event, a, b);
+    }
+}
@@ -1,9 +1,11 @@
 #include <assert.h>
 #include <errno.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "memstat.h"
 #include "snd-buffer.h"
 
 struct snd_buffer {
@@ -11,6 +13,8 @@ struct snd_buffer {
     size_t nsamples;
 };
 
+static atomic_ullong snd_buffer_total;
+
 int snd_buffer_alloc(struct snd_buffer **out, size_t nsamples)
 {
     struct snd_buffer *buf;
@@ -28,7 +32,7 @@ int snd_buffer_alloc(struct snd_buffer **out, size_t nsamples)
         goto end;
     }
 
-    buf = calloc(sizeof(*buf), 1);
+    buf = memstat_calloc(sizeof(*buf), 1);
 
     if (buf == NULL) {
         r = -ENOMEM;
@@ -37,7 +41,7 @@ int snd_buffer_alloc(struct snd_buffer **out, size_t nsamples)
     }
 
     buf->nsamples = nsamples;
-    buf->samples = calloc(nsamples, sizeof(int16_t));
+    buf->samples = memstat_calloc(nsamples, sizeof(int16_t));
 
     if (buf->samples == NULL) {
         r = -ENOMEM;
@@ -45,6 +49,11 @@ int snd_buffer_alloc(struct snd_buffer **out, size_t nsamples)
         goto end;
     }
 
+    atomic_fetch_add_explicit(
+            &snd_buffer_total,
+            nsamples * sizeof(int16_t),
+            memory_order_relaxed);
+
     *out = buf;
     buf = NULL;
     r = 0;
@@ -61,6 +70,13 @@ void snd_buffer_free(struct snd_buffer *buf)
         return;
     }
 
+    if (buf->samples != NULL) {
+        atomic_fetch_sub_explicit(
+                &snd_buffer_total,
+                buf->nsamples * sizeof(int16_t),
+                memory_order_relaxed);
+    }
+
     free(buf->samples);
     free(buf);
 }
@@ -92,3 +108,8 @@ size_t snd_buffer_nbytes(const struct snd_buffer *buf)
 
     return buf->nsamples * 2;
 }
+
+uint64_t snd_buffer_total_nbytes(void)
+{
+    return atomic_load_explicit(&snd_buffer_total, memory_order_relaxed);
+}
@@ -11,3 +11,7 @@ const int16_t *snd_buffer_samples_ro(const struct snd_buffer *buf);
 int16_t *snd_buffer_samples_rw(struct snd_buffer *buf);
 size_t snd_buffer_nsamples(const struct snd_buffer *buf);
 size_t snd_buffer_nbytes(const struct snd_buffer *buf);
+
+/*  Sample memory held by every buffer there is, for statistics */
+
+uint64_t snd_buffer_total_nbytes(void);
@@ -0,0 +1,216 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memstat.h"
+#include "snd-cost.h"
+
+/*  Open addressing with linear probing, kept at most half full so that
+    probe sequences stay short. */
+
+struct snd_cost_slot {
+    struct snd_cost_entry e;
+    uint32_t block;
+    uint32_t nvoices;
+    bool used;
+};
+
+struct snd_cost {
+    struct snd_cost_slot *slots;
+    struct snd_cost_slot other;
+    size_t mask;
+    size_t nused;
+    size_t max_nused;
+    uint32_t block;
+};
+
+static struct snd_cost_slot *snd_cost_find(struct snd_cost *c, uintptr_t tag);
+static void snd_cost_insert_top(
+        struct snd_cost_entry *out,
+        size_t n,
+        size_t *count,
+        const struct snd_cost_entry *e);
+
+int snd_cost_alloc(struct snd_cost **out, size_t nentries)
+{
+    struct snd_cost *c;
+    size_t nslots;
+
+    assert(out != NULL);
+    assert(nentries > 0);
+
+    *out = NULL;
+
+    for (nslots = 2 ; nslots < nentries * 2 ; nslots *= 2);
+
+    c = memstat_calloc(sizeof(*c), 1);
+
+    if (c == NULL) {
+        return -ENOMEM;
+    }
+
+    c->slots = memstat_calloc(sizeof(*c->slots), nslots);
+
+    if (c->slots == NULL) {
+        free(c);
+
+        return -ENOMEM;
+    }
+
+    c->mask = nslots - 1;
+    c->max_nused = nentries;
+    *out = c;
+
+    return 0;
+}
+
+void snd_cost_free(struct snd_cost *c)
+{
+    if (c == NULL) {
+        return;
+    }
+
+    free(c->slots);
+    free(c);
+}
+
+void snd_cost_begin_block(struct snd_cost *c)
+{
+    assert(c != NULL);
+
+    c->block++;
+}
+
+void snd_cost_add(
+        struct snd_cost *c,
+        uintptr_t tag,
+        uint64_t cost,
+        size_t nframes)
+{
+    struct snd_cost_slot *slot;
+
+    assert(c != NULL);
+
+    slot = snd_cost_find(c, tag);
+
+    if (slot->block != c->block) {
+        slot->block = c->block;
+        slot->nvoices = 0;
+    }
+
+    slot->nvoices++;
+
+    if (slot->e.nvoices_max < slot->nvoices) {
+        slot->e.nvoices_max = slot->nvoices;
+    }
+
+    slot->e.cost += cost;
+    slot->e.nframes += nframes;
+}
+
+static struct snd_cost_slot *snd_cost_find(struct snd_cost *c, uintptr_t tag)
+{
+    struct snd_cost_slot *slot;
+    size_t i;
+
+    if (tag == 0) {
+        return &c->other;
+    }
+
+    /*  Fibonacci hashing: tags are mostly code addresses, which share their
+        low and high bits, so mix everything into the top before taking it. */
+
+    i = (size_t) (((uint64_t) tag * UINT64_C(0x9e3779b97f4a7c15)) >> 32);
+
+    for (;;) {
+        slot = &c->slots[i & c->mask];
+
+        if (!slot->used) {
+            break;
+        }
+
+        if (slot->e.tag == tag) {
+            return slot;
+        }
+
+        i++;
+    }
+
+    if (c->nused == c->max_nused) {
+        return &c->other;
+    }
+
+    slot->used = true;
+    slot->e.tag = tag;
+    c->nused++;
+
+    return slot;
+}
+
+size_t snd_cost_top(
+        const struct snd_cost *c,
+        struct snd_cost_entry *out,
+        size_t n)
+{
+    size_t count;
+    size_t i;
+
+    assert(c != NULL);
+    assert(out != NULL || n == 0);
+
+    count = 0;
+
+    for (i = 0 ; i <= c->mask ; i++) {
+        if (c->slots[i].used) {
+            snd_cost_insert_top(out, n, &count, &c->slots[i].e);
+        }
+    }
+
+    if (c->other.e.nframes > 0) {
+        snd_cost_insert_top(out, n, &count, &c->other.e);
+    }
+
+    return count;
+}
+
+static void snd_cost_insert_top(
+        struct snd_cost_entry *out,
+        size_t n,
+        size_t *count,
+        const struct snd_cost_entry *e)
+{
+    size_t i;
+
+    /*  n is a handful, so keeping the list sorted by insertion is fine */
+
+    i = *count;
+
+    if (i == n) {
+        if (n == 0 || out[n - 1].cost >= e->cost) {
+            return;
+        }
+
+        i--;
+    } else {
+        (*count)++;
+    }
+
+    for ( ; i > 0 && out[i - 1].cost < e->cost ; i--) {
+        out[i] = out[i - 1];
+    }
+
+    out[i] = *e;
+}
+
+void snd_cost_reset(struct snd_cost *c)
+{
+    assert(c != NULL);
+
+    memset(c->slots, 0, (c->mask + 1) * sizeof(*c->slots));
+    memset(&c->other, 0, sizeof(c->other));
+    c->nused = 0;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*  Tally of what voices cost to mix, keyed by an opaque tag that says where
+    each voice came from. The table is sized up front, so that the audio
+    thread can add to it without allocating; once it is full, voices with
+    tags that have not been seen yet are lumped together under tag zero.
+    Cost is in whatever units the caller measures time in. */
+
+struct snd_cost;
+
+typedef uint64_t (*snd_cost_clock_t)(void);
+
+struct snd_cost_entry {
+    uintptr_t tag;
+    uint64_t cost;
+    uint64_t nframes;
+    uint32_t nvoices_max;
+};
+
+int snd_cost_alloc(struct snd_cost **out, size_t nentries);
+void snd_cost_free(struct snd_cost *c);
+
+/*  A sample is one voice rendering nframes frames. Samples taken in one
+    block, between begin_block calls, count towards nvoices_max together. */
+
+void snd_cost_begin_block(struct snd_cost *c);
+void snd_cost_add(
+        struct snd_cost *c,
+        uintptr_t tag,
+        uint64_t cost,
+        size_t nframes);
+
+/*  Copy out up to n of the most costly entries, most costly first, and
+    return how many there were. reset starts a new window. */
+
+size_t snd_cost_top(
+        const struct snd_cost *c,
+        struct snd_cost_entry *out,
+        size_t n);
+void snd_cost_reset(struct snd_cost *c);
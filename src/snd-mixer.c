@@ -1,39 +1,116 @@
 #include <assert.h>
 #include <errno.h>
-#include <limits.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "list.h"
+#include "memstat.h"
+#include "snd-cost.h"
 #include "snd-mixer.h"
+#include "snd-notice.h"
+#include "snd-primary.h"
+#include "snd-resampler.h"
 #include "snd-stream.h"
 
+/*  The work buffer holds 16-bit samples scaled by 8-bit volumes, which gives
+    us 24 bits to play with before the output stage. */
+
+#define SND_MIXER_WORK_MIN (-0x800000)
+#define SND_MIXER_WORK_MAX 0x7fffff
+
 struct snd_mixer {
     struct list *streams;
-    int32_t *work;
-    size_t nsamples;
+    size_t nstreams;
+    struct snd_primary *primary;
+    struct snd_resampler *rs;
+    int32_t *ring;
+    int32_t *in;
+    size_t period;
+    size_t max_period;
+    size_t nblocks;
+    size_t nchannels_out;
+    enum snd_format format;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t frame;
+    size_t primary_pos;
+    size_t primary_checkpoints[SND_STREAM_NCHECKPOINTS];
+    struct snd_cost *cost;
+    snd_cost_clock_t clock;
+    unsigned int cost_interval;
+    unsigned int cost_countdown;
+    struct snd_notices *notices;
+    bool dirty;
 };
 
-int snd_mixer_alloc(struct snd_mixer **out, size_t nframes, size_t nchannels)
+static size_t snd_mixer_checkpoint_slot(
+        const struct snd_mixer *m,
+        uint32_t block);
+static int32_t *snd_mixer_block(const struct snd_mixer *m, uint32_t block);
+static void snd_mixer_rewind(struct snd_mixer *m);
+static void snd_mixer_render_block(struct snd_mixer *m);
+static void snd_mixer_mix(
+        struct snd_mixer *m,
+        int32_t *work,
+        size_t nframes,
+        size_t slot);
+static void snd_mixer_checkpoint(struct snd_mixer *m, size_t slot);
+static int32_t snd_mixer_clamp(int32_t sample);
+static void snd_mixer_output(
+        const struct snd_mixer *m,
+        const int32_t *work,
+        void *samples);
+
+size_t snd_format_sample_size(enum snd_format format)
+{
+    switch (format) {
+    case SND_FORMAT_S16:    return sizeof(int16_t);
+    case SND_FORMAT_S24_32: return sizeof(int32_t);
+    case SND_FORMAT_S32:    return sizeof(int32_t);
+    case SND_FORMAT_F32:    return sizeof(float);
+    default:                abort();
+    }
+}
+
+const char *snd_format_name(enum snd_format format)
+{
+    switch (format) {
+    case SND_FORMAT_S16:    return "s16";
+    case SND_FORMAT_S24_32: return "s24-in-32";
+    case SND_FORMAT_S32:    return "s32";
+    case SND_FORMAT_F32:    return "f32";
+    default:                return "?";
+    }
+}
+
+int snd_mixer_alloc(
+        struct snd_mixer **out,
+        size_t max_period,
+        size_t nchannels,
+        enum snd_format format)
 {
     struct snd_mixer *m;
     int r;
 
     assert(out != NULL);
-    assert(nframes > 0);
+    assert(max_period > 0);
 
     *out = NULL;
     m = NULL;
 
-    if (nchannels != 2) {
+    /*  We mix in stereo. Devices with more channels than that get the mix on
+        their first two and silence on the rest. */
+
+    if (nchannels < 2) {
         r = -ENOTSUP;
 
         goto end;
     }
 
-    m = calloc(sizeof(*m), 1);
+    m = memstat_calloc(sizeof(*m), 1);
 
     if (m == NULL) {
         r = -ENOMEM;
@@ -47,10 +124,15 @@ int snd_mixer_alloc(struct snd_mixer **out, size_t nframes, size_t nchannels)
         goto end;
     }
 
-    m->nsamples = nframes * nchannels;
-    m->work = malloc(m->nsamples * sizeof(int32_t));
+    m->period = max_period;
+    m->max_period = max_period;
+    m->nblocks = 1;
+    m->nchannels_out = nchannels;
+    m->format = format;
+    m->ring = memstat_malloc(
+            SND_MIXER_MAX_BLOCKS * max_period * 2 * sizeof(int32_t));
 
-    if (m->work == NULL) {
+    if (m->ring == NULL) {
         r = -ENOMEM;
 
         goto end;
@@ -72,10 +154,173 @@ void snd_mixer_free(struct snd_mixer *m)
     }
 
     list_free(m->streams, NULL);
-    free(m->work);
+    snd_resampler_free(m->rs);
+    free(m->ring);
+    free(m->in);
     free(m);
 }
 
+int snd_mixer_configure(struct snd_mixer *m, size_t period, size_t nblocks)
+{
+    size_t slot;
+
+    assert(m != NULL);
+
+    if (    period == 0 ||
+            period > m->max_period ||
+            nblocks == 0 ||
+            nblocks > SND_MIXER_MAX_BLOCKS) {
+        return -EINVAL;
+    }
+
+    /*  Anything rendered ahead was cut to the old period, so put the
+        streams back to where the next block due out would have started,
+        then carry that position over to the new ring layout. */
+
+    snd_mixer_rewind(m);
+    m->period = period;
+    m->nblocks = nblocks;
+    slot = snd_mixer_checkpoint_slot(m, m->head);
+    snd_mixer_checkpoint(m, slot);
+
+    if (m->rs != NULL) {
+        snd_resampler_checkpoint(m->rs, slot);
+    }
+
+    return 0;
+}
+
+int snd_mixer_reserve(struct snd_mixer *m, size_t max_period)
+{
+    int32_t *ring;
+
+    assert(m != NULL);
+
+    if (max_period <= m->max_period) {
+        return 0;
+    }
+
+    /*  Nothing in the ring survives the next configure anyway */
+
+    ring = memstat_malloc(
+            SND_MIXER_MAX_BLOCKS * max_period * 2 * sizeof(int32_t));
+
+    if (ring == NULL) {
+        return -ENOMEM;
+    }
+
+    free(m->ring);
+    m->ring = ring;
+    m->max_period = max_period;
+    m->dirty = true;
+
+    return 0;
+}
+
+int snd_mixer_set_rates(
+        struct snd_mixer *m,
+        unsigned int mix_rate,
+        unsigned int device_rate)
+{
+    struct snd_resampler *rs;
+    int32_t *in;
+    size_t nframes;
+    size_t slot;
+    int r;
+
+    assert(m != NULL);
+    assert(mix_rate > 0);
+    assert(device_rate > 0);
+
+    rs = NULL;
+    in = NULL;
+
+    if (mix_rate != device_rate) {
+        r = snd_resampler_alloc(&rs, mix_rate, device_rate, m->max_period);
+
+        if (r < 0) {
+            goto end;
+        }
+
+        nframes = snd_resampler_nframes_in(rs, m->max_period) + 1;
+        in = memstat_malloc(nframes * 2 * sizeof(int32_t));
+
+        if (in == NULL) {
+            r = -ENOMEM;
+
+            goto end;
+        }
+    }
+
+    /*  The old resampler's history is at the old rate, so the new one
+        starts from silence, from wherever the next block due out was going
+        to start. Any speculative blocks went through the old one. */
+
+    snd_mixer_rewind(m);
+
+    snd_resampler_free(m->rs);
+    free(m->in);
+    m->rs = rs;
+    m->in = in;
+    rs = NULL;
+    in = NULL;
+
+    slot = snd_mixer_checkpoint_slot(m, m->head);
+
+    if (m->rs != NULL) {
+        snd_resampler_checkpoint(m->rs, slot);
+    }
+
+    if (m->primary != NULL) {
+        m->primary_checkpoints[slot] = snd_primary_get_position(m->primary);
+    }
+
+    r = 0;
+
+end:
+    snd_resampler_free(rs);
+    free(in);
+
+    return r;
+}
+
+static size_t snd_mixer_checkpoint_slot(
+        const struct snd_mixer *m,
+        uint32_t block)
+{
+    /*  Blocks head to tail inclusive need a checkpoint each: one for the
+        start of every rendered block, plus one for the end of the last. */
+
+    return block % (m->nblocks + 1);
+}
+
+static int32_t *snd_mixer_block(const struct snd_mixer *m, uint32_t block)
+{
+    return &m->ring[(block % m->nblocks) * m->period * 2];
+}
+
+void snd_mixer_set_cost(
+        struct snd_mixer *m,
+        struct snd_cost *cost,
+        snd_cost_clock_t clock,
+        unsigned int interval)
+{
+    assert(m != NULL);
+    assert(cost == NULL || (clock != NULL && interval > 0));
+
+    m->cost = cost;
+    m->clock = clock;
+    m->cost_interval = interval;
+    m->cost_countdown = interval;
+}
+
+void snd_mixer_set_notices(struct snd_mixer *m, struct snd_notices *ns)
+{
+    assert(m != NULL);
+
+    m->notices = ns;
+}
+
 void snd_mixer_play(struct snd_mixer *m, struct snd_stream *stm)
 {
     struct list_node *node;
@@ -84,11 +329,16 @@ void snd_mixer_play(struct snd_mixer *m, struct snd_stream *stm)
     assert(stm != NULL);
 
     snd_stream_rewind(stm);
+    snd_stream_checkpoint(stm, snd_mixer_checkpoint_slot(m, m->head));
     node = snd_stream_list_upcast(stm);
 
     if (!list_node_is_inserted(node)) {
         list_append(m->streams, node);
+        m->nstreams++;
     }
+
+    snd_stream_publish(stm, true, m->frame);
+    m->dirty = true;
 }
 
 void snd_mixer_stop(struct snd_mixer *m, struct snd_stream *stm)
@@ -100,48 +350,342 @@ void snd_mixer_stop(struct snd_mixer *m, struct snd_stream *stm)
 
     node = snd_stream_list_upcast(stm);
 
+    /*  Whatever was rendered ahead of the last block handed off is never
+        heard, so the stop notice does not take the stream any further. */
+
     if (list_node_is_inserted(node)) {
         list_remove(m->streams, node);
+        m->nstreams--;
+        snd_stream_post_notice(stm, m->notices, true);
     }
+
+    snd_stream_publish(stm, false, m->frame);
+    m->dirty = true;
+}
+
+void snd_mixer_invalidate(struct snd_mixer *m)
+{
+    assert(m != NULL);
+
+    m->dirty = true;
+}
+
+void snd_mixer_set_primary(struct snd_mixer *m, struct snd_primary *p)
+{
+    assert(m != NULL);
+
+    /*  Either way, whatever was rendered ahead is no use any more. The
+        position the primary buffer resumes from is the one it was left at,
+        rather than anything rendered past that. */
+
+    m->primary = p;
+    m->dirty = true;
+
+    if (p != NULL) {
+        m->primary_checkpoints[snd_mixer_checkpoint_slot(m, m->head)] =
+                snd_primary_get_position(p);
+    }
+}
+
+struct snd_primary *snd_mixer_get_direct(const struct snd_mixer *m)
+{
+    assert(m != NULL);
+
+    return m->rs == NULL ? m->primary : NULL;
 }
 
-void snd_mixer_mix(struct snd_mixer *m, int16_t *samples)
+bool snd_mixer_is_idle(const struct snd_mixer *m)
+{
+    assert(m != NULL);
+
+    return m->primary == NULL && list_is_empty(m->streams);
+}
+
+size_t snd_mixer_nvoices(const struct snd_mixer *m)
+{
+    assert(m != NULL);
+
+    return m->nstreams;
+}
+
+size_t snd_mixer_nready(const struct snd_mixer *m)
+{
+    assert(m != NULL);
+
+    return m->dirty || snd_mixer_get_direct(m) != NULL
+            ? 0
+            : m->tail - m->head;
+}
+
+void snd_mixer_render(struct snd_mixer *m, size_t nready)
+{
+    assert(m != NULL);
+
+    if (snd_mixer_get_direct(m) != NULL) {
+        return;
+    }
+
+    if (nready > m->nblocks) {
+        nready = m->nblocks;
+    }
+
+    if (m->dirty) {
+        snd_mixer_rewind(m);
+    }
+
+    while (m->tail - m->head < nready) {
+        snd_mixer_render_block(m);
+    }
+}
+
+static void snd_mixer_rewind(struct snd_mixer *m)
+{
+    struct list_iter i;
+    size_t slot;
+
+    /*  Something changed under blocks that we rendered speculatively, so
+        throw them away and put every stream back where it was at the start
+        of the next block due out. Streams that were (re)started since have
+        had their checkpoint for that block reset by snd_mixer_play. */
+
+    slot = snd_mixer_checkpoint_slot(m, m->head);
+
+    for (   list_iter_init(&i, m->streams) ;
+            list_iter_is_valid(&i) ;
+            list_iter_next(&i)) {
+        snd_stream_restore(
+                snd_stream_list_downcast(list_iter_deref(&i)),
+                slot);
+    }
+
+    if (m->rs != NULL) {
+        snd_resampler_restore(m->rs, slot);
+    }
+
+    if (m->primary != NULL) {
+        m->primary_pos = m->primary_checkpoints[slot];
+    }
+
+    m->tail = m->head;
+    m->dirty = false;
+}
+
+static void snd_mixer_render_block(struct snd_mixer *m)
+{
+    int32_t *work;
+    size_t nframes;
+    size_t slot;
+
+    work = snd_mixer_block(m, m->tail);
+    slot = snd_mixer_checkpoint_slot(m, m->tail + 1);
+
+    if (m->rs == NULL) {
+        snd_mixer_mix(m, work, m->period, slot);
+    } else {
+        nframes = snd_resampler_nframes_in(m->rs, m->period);
+        snd_mixer_mix(m, m->in, nframes, slot);
+        snd_resampler_process(m->rs, m->in, nframes, work, m->period);
+        snd_resampler_checkpoint(m->rs, slot);
+    }
+
+    m->tail++;
+}
+
+static void snd_mixer_mix(
+        struct snd_mixer *m,
+        int32_t *work,
+        size_t nframes,
+        size_t slot)
+{
+    struct snd_stream *stm;
+    struct list_iter i;
+    uint64_t t_prev;
+    uint64_t t;
+    bool sample;
+
+    memset(work, 0, nframes * 2 * sizeof(int32_t));
+
+    if (m->primary != NULL) {
+        m->primary_pos = snd_primary_render(
+                m->primary,
+                m->primary_pos,
+                work,
+                nframes);
+        snd_mixer_checkpoint(m, slot);
+
+        return;
+    }
+
+    /*  Only some blocks are timed, so that reading the clock between every
+        pair of streams costs next to nothing overall. */
+
+    sample = false;
+    t_prev = 0;
+
+    if (m->cost != NULL && --m->cost_countdown == 0) {
+        m->cost_countdown = m->cost_interval;
+        sample = true;
+        snd_cost_begin_block(m->cost);
+        t_prev = m->clock();
+    }
+
+    /*  Streams that run out part way through stay on the list, silently,
+        until the block in which they finished has been handed off. */
+
+    for (   list_iter_init(&i, m->streams) ;
+            list_iter_is_valid(&i) ;
+            list_iter_next(&i)) {
+        stm = snd_stream_list_downcast(list_iter_deref(&i));
+        snd_stream_render(stm, work, nframes * 2);
+        snd_stream_checkpoint(stm, slot);
+
+        if (sample) {
+            t = m->clock();
+            snd_cost_add(
+                    m->cost,
+                    snd_stream_get_tag(stm),
+                    t - t_prev,
+                    nframes);
+            t_prev = t;
+        }
+    }
+}
+
+static void snd_mixer_checkpoint(struct snd_mixer *m, size_t slot)
+{
+    struct list_iter i;
+
+    /*  Not the resampler's, since it only runs once the mix is done */
+
+    for (   list_iter_init(&i, m->streams) ;
+            list_iter_is_valid(&i) ;
+            list_iter_next(&i)) {
+        snd_stream_checkpoint(
+                snd_stream_list_downcast(list_iter_deref(&i)),
+                slot);
+    }
+
+    if (m->primary != NULL) {
+        m->primary_checkpoints[slot] = m->primary_pos;
+    }
+}
+
+void snd_mixer_pop(struct snd_mixer *m, void *samples)
 {
     struct snd_stream *stm;
     struct list_node *node;
     struct list_iter i;
-    bool samples_remain;
-    int32_t sample;
-    size_t j;
+    size_t slot;
+    bool playing;
 
     assert(m != NULL);
     assert(samples != NULL);
+    assert(!m->dirty);
+    assert(m->tail != m->head);
 
-    memset(m->work, 0, m->nsamples * sizeof(uint32_t));
+    snd_mixer_output(m, snd_mixer_block(m, m->head), samples);
 
+    /*  Publish where each stream will be once this block has been heard, and
+        let go of the ones that will have finished by then. */
+
+    m->head++;
+    m->frame += m->period;
+    slot = snd_mixer_checkpoint_slot(m, m->head);
     list_iter_init(&i, m->streams);
 
+    if (m->primary != NULL) {
+        snd_primary_set_position(m->primary, m->primary_checkpoints[slot]);
+    }
+
     while (list_iter_is_valid(&i)) {
         node = list_iter_deref(&i);
         stm = snd_stream_list_downcast(node);
 
         list_iter_next(&i);
-        samples_remain = snd_stream_render(stm, m->work, m->nsamples);
+        playing = snd_stream_publish_checkpoint(stm, slot, m->frame);
+        snd_stream_post_notice(stm, m->notices, !playing);
 
-        if (!samples_remain) {
+        if (!playing) {
             list_remove(m->streams, node);
+            m->nstreams--;
         }
     }
+}
+
+size_t snd_mixer_block_size(const struct snd_mixer *m)
+{
+    assert(m != NULL);
+
+    return m->period * m->nchannels_out * snd_format_sample_size(m->format);
+}
+
+static int32_t snd_mixer_clamp(int32_t sample)
+{
+    if (sample < SND_MIXER_WORK_MIN) {
+        return SND_MIXER_WORK_MIN;
+    } else if (sample > SND_MIXER_WORK_MAX) {
+        return SND_MIXER_WORK_MAX;
+    } else {
+        return sample;
+    }
+}
+
+static void snd_mixer_output(
+        const struct snd_mixer *m,
+        const int32_t *work,
+        void *samples)
+{
+    int16_t *s16;
+    int32_t *s32;
+    float *f32;
+    size_t nextra;
+    size_t j;
 
-    for (j = 0 ; j < m->nsamples ; j++) {
-        sample = m->work[j] >> 8;
+    /*  Device channels past the stereo pair are silenced. The wider formats
+        keep the eight bits of volume precision that s16 has to drop. */
 
-        if (sample < INT16_MIN) {
-            samples[j] = INT16_MIN;
-        } else if (sample > INT16_MAX) {
-            samples[j] = INT16_MAX;
-        } else {
-            samples[j] = sample;
+    nextra = m->nchannels_out - 2;
+
+    switch (m->format) {
+    case SND_FORMAT_S16:
+        s16 = samples;
+
+        for (j = 0 ; j < m->period * 2 ; j += 2) {
+            *s16++ = snd_mixer_clamp(work[j]) >> 8;
+            *s16++ = snd_mixer_clamp(work[j + 1]) >> 8;
+            memset(s16, 0, nextra * sizeof(*s16));
+            s16 += nextra;
+        }
+
+        break;
+
+    case SND_FORMAT_S24_32:
+    case SND_FORMAT_S32:
+        s32 = samples;
+
+        for (j = 0 ; j < m->period * 2 ; j += 2) {
+            *s32++ = (int32_t) ((uint32_t) snd_mixer_clamp(work[j]) << 8);
+            *s32++ = (int32_t) (
+                    (uint32_t) snd_mixer_clamp(work[j + 1]) << 8);
+            memset(s32, 0, nextra * sizeof(*s32));
+            s32 += nextra;
         }
+
+        break;
+
+    case SND_FORMAT_F32:
+        f32 = samples;
+
+        for (j = 0 ; j < m->period * 2 ; j += 2) {
+            *f32++ = snd_mixer_clamp(work[j]) * (1.0f / 0x800000);
+            *f32++ = snd_mixer_clamp(work[j + 1]) * (1.0f / 0x800000);
+            memset(f32, 0, nextra * sizeof(*f32));
+            f32 += nextra;
+        }
+
+        break;
+
+    default:
+        abort();
     }
 }
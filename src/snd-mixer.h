@@ -1,15 +1,92 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #include "list.h"
+#include "snd-cost.h"
+#include "snd-notice.h"
 #include "snd-stream.h"
 
+/*  The mixer renders into a ring of period-sized blocks, which lets it work
+    ahead of the device. A block that has been rendered but not yet handed
+    off is speculative: any change to the set of playing streams or their
+    parameters discards it and it gets rendered again. The period and the
+    depth of the ring can be changed at any time, up to the limits that the
+    mixer was allocated with, without disturbing the streams.
+
+    Streams are mixed at the mix rate and the blocks are at the device rate.
+    When the two differ, the whole mix goes through one resampler on its way
+    into the ring. */
+
+#define SND_MIXER_MAX_BLOCKS (SND_STREAM_NCHECKPOINTS - 1)
+
 struct snd_mixer;
+struct snd_primary;
+
+/*  Sample formats the mixer's output stage can produce. S24_32 is 24 valid
+    bits, left-justified in a 32-bit container. */
 
-int snd_mixer_alloc(struct snd_mixer **out, size_t nframes, size_t nchannels);
+enum snd_format {
+    SND_FORMAT_S16,
+    SND_FORMAT_S24_32,
+    SND_FORMAT_S32,
+    SND_FORMAT_F32,
+};
+
+size_t snd_format_sample_size(enum snd_format format);
+const char *snd_format_name(enum snd_format format);
+
+int snd_mixer_alloc(
+        struct snd_mixer **out,
+        size_t max_period,
+        size_t nchannels,
+        enum snd_format format);
 void snd_mixer_free(struct snd_mixer *m);
+int snd_mixer_configure(struct snd_mixer *m, size_t period, size_t nblocks);
+
+/*  Raise the period limit the mixer was allocated with. This allocates. */
+
+int snd_mixer_reserve(struct snd_mixer *m, size_t max_period);
+
+/*  Set the mix and device rates, which start out the same. This allocates
+    if they differ, to suit the current period limit, so it goes between any
+    reserve and the configure that follows it. */
+
+int snd_mixer_set_rates(
+        struct snd_mixer *m,
+        unsigned int mix_rate,
+        unsigned int device_rate);
+
+/*  Time each stream's render in every interval'th block with clock, and
+    tally it in cost under the stream's tag. A NULL cost stops sampling. */
+
+void snd_mixer_set_cost(
+        struct snd_mixer *m,
+        struct snd_cost *cost,
+        snd_cost_clock_t clock,
+        unsigned int interval);
+
+/*  Post streams' notices to ns: where each has got to as every block is
+    handed off, and when it stops. NULL posts none. */
+
+void snd_mixer_set_notices(struct snd_mixer *m, struct snd_notices *ns);
 void snd_mixer_play(struct snd_mixer *m, struct snd_stream *stm);
 void snd_mixer_stop(struct snd_mixer *m, struct snd_stream *stm);
-void snd_mixer_mix(struct snd_mixer *m, int16_t *samples);
+void snd_mixer_invalidate(struct snd_mixer *m);
+
+/*  While a primary buffer is attached it is all that gets heard, and the
+    streams stay where they were until it is detached again by setting NULL.
+    If it needs no resampling it does not go through the ring at all: the
+    mixer renders nothing and get_direct hands it over for copying straight
+    to the device. */
+
+void snd_mixer_set_primary(struct snd_mixer *m, struct snd_primary *p);
+struct snd_primary *snd_mixer_get_direct(const struct snd_mixer *m);
+bool snd_mixer_is_idle(const struct snd_mixer *m);
+size_t snd_mixer_nvoices(const struct snd_mixer *m);
+size_t snd_mixer_nready(const struct snd_mixer *m);
+void snd_mixer_render(struct snd_mixer *m, size_t nready);
+void snd_mixer_pop(struct snd_mixer *m, void *samples);
+size_t snd_mixer_block_size(const struct snd_mixer *m);
@@ -0,0 +1,108 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "memstat.h"
+#include "snd-notice.h"
+
+/*  head is only written by the poster and tail only by the drainer. Each
+    publishes with a release store what the other reads with an acquire
+    load, so a record is complete before it is seen and is not reused
+    before its handler has run. */
+
+struct snd_notices {
+    struct snd_notice *records;
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_uint ndropped;
+};
+
+int snd_notices_alloc(struct snd_notices **out)
+{
+    struct snd_notices *ns;
+
+    assert(out != NULL);
+
+    *out = NULL;
+    ns = memstat_calloc(1, sizeof(*ns));
+
+    if (ns == NULL) {
+        return -ENOMEM;
+    }
+
+    ns->records = memstat_calloc(SND_NOTICES_CAPACITY, sizeof(*ns->records));
+
+    if (ns->records == NULL) {
+        free(ns);
+
+        return -ENOMEM;
+    }
+
+    *out = ns;
+
+    return 0;
+}
+
+void snd_notices_free(struct snd_notices *ns)
+{
+    if (ns == NULL) {
+        return;
+    }
+
+    free(ns->records);
+    free(ns);
+}
+
+void snd_notices_post(struct snd_notices *ns, const struct snd_notice *n)
+{
+    unsigned int head;
+    unsigned int tail;
+
+    assert(ns != NULL);
+    assert(n != NULL);
+    assert(n->fn != NULL);
+
+    head = atomic_load_explicit(&ns->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ns->tail, memory_order_acquire);
+
+    if (head - tail >= SND_NOTICES_CAPACITY) {
+        atomic_fetch_add_explicit(&ns->ndropped, 1, memory_order_relaxed);
+
+        return;
+    }
+
+    ns->records[head % SND_NOTICES_CAPACITY] = *n;
+    atomic_store_explicit(&ns->head, head + 1, memory_order_release);
+}
+
+size_t snd_notices_drain(struct snd_notices *ns)
+{
+    const struct snd_notice *n;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int i;
+
+    assert(ns != NULL);
+
+    head = atomic_load_explicit(&ns->head, memory_order_acquire);
+    tail = atomic_load_explicit(&ns->tail, memory_order_relaxed);
+
+    for (i = tail ; i != head ; i++) {
+        n = &ns->records[i % SND_NOTICES_CAPACITY];
+        n->fn(n->ctx, n);
+    }
+
+    atomic_store_explicit(&ns->tail, head, memory_order_release);
+
+    return head - tail;
+}
+
+unsigned int snd_notices_get_ndropped(const struct snd_notices *ns)
+{
+    assert(ns != NULL);
+
+    return atomic_load_explicit(&ns->ndropped, memory_order_relaxed);
+}
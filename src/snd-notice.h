@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*  Notices from the audio thread about where streams have got to, for
+    another thread to act on. The audio thread must not run arbitrary code
+    or make syscalls, so all it does is append a record to a fixed ring; if
+    the ring is full the notice is dropped and counted. One thread posts and
+    one thread drains, and the drainer runs each notice's handler. */
+
+#define SND_NOTICE_STOPPED 0x01
+#define SND_NOTICE_WRAPPED 0x02
+
+/*  Must be a power of two */
+
+#define SND_NOTICES_CAPACITY 4096
+
+struct snd_notice;
+struct snd_notices;
+
+typedef void (*snd_notice_fn_t)(void *ctx, const struct snd_notice *n);
+
+/*  The stream played from frame from up to (not including) frame to, going
+    round the end of the buffer first if WRAPPED is set. STOPPED means it is
+    not playing any more, whether it ran out or was told to stop. */
+
+struct snd_notice {
+    snd_notice_fn_t fn;
+    void *ctx;
+    uint32_t from;
+    uint32_t to;
+    unsigned int flags;
+};
+
+int snd_notices_alloc(struct snd_notices **out);
+void snd_notices_free(struct snd_notices *ns);
+void snd_notices_post(struct snd_notices *ns, const struct snd_notice *n);
+size_t snd_notices_drain(struct snd_notices *ns);
+unsigned int snd_notices_get_ndropped(const struct snd_notices *ns);
@@ -0,0 +1,266 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memstat.h"
+#include "snd-mixer.h"
+#include "snd-primary.h"
+
+struct snd_primary {
+    int16_t *samples;
+    size_t nframes;
+    atomic_uint pos;
+    atomic_uint guard;
+    atomic_uint ncommits;
+};
+
+static void snd_primary_output(
+        const int16_t *in,
+        void *out,
+        enum snd_format format,
+        size_t nchannels,
+        size_t nframes);
+
+int snd_primary_alloc(struct snd_primary **out, size_t nframes)
+{
+    struct snd_primary *p;
+    int r;
+
+    assert(out != NULL);
+    assert(nframes > 0);
+
+    *out = NULL;
+    p = memstat_calloc(sizeof(*p), 1);
+
+    if (p == NULL) {
+        r = -ENOMEM;
+
+        goto end;
+    }
+
+    p->nframes = nframes;
+    p->samples = memstat_calloc(nframes * 2, sizeof(int16_t));
+
+    if (p->samples == NULL) {
+        r = -ENOMEM;
+
+        goto end;
+    }
+
+    *out = p;
+    p = NULL;
+    r = 0;
+
+end:
+    snd_primary_free(p);
+
+    return r;
+}
+
+void snd_primary_free(struct snd_primary *p)
+{
+    if (p == NULL) {
+        return;
+    }
+
+    free(p->samples);
+    free(p);
+}
+
+int16_t *snd_primary_samples_rw(struct snd_primary *p)
+{
+    assert(p != NULL);
+
+    return p->samples;
+}
+
+size_t snd_primary_nframes(const struct snd_primary *p)
+{
+    assert(p != NULL);
+
+    return p->nframes;
+}
+
+size_t snd_primary_get_position(const struct snd_primary *p)
+{
+    assert(p != NULL);
+
+    return atomic_load_explicit(&p->pos, memory_order_relaxed);
+}
+
+size_t snd_primary_get_guard(const struct snd_primary *p)
+{
+    assert(p != NULL);
+
+    return atomic_load_explicit(&p->guard, memory_order_relaxed);
+}
+
+void snd_primary_set_position(struct snd_primary *p, size_t pos)
+{
+    assert(p != NULL);
+    assert(pos < p->nframes);
+
+    atomic_store_explicit(&p->pos, pos, memory_order_relaxed);
+}
+
+void snd_primary_set_guard(struct snd_primary *p, size_t nframes)
+{
+    assert(p != NULL);
+
+    if (nframes > p->nframes) {
+        nframes = p->nframes;
+    }
+
+    atomic_store_explicit(&p->guard, nframes, memory_order_relaxed);
+}
+
+void snd_primary_commit(struct snd_primary *p)
+{
+    assert(p != NULL);
+
+    atomic_fetch_add_explicit(&p->ncommits, 1, memory_order_release);
+}
+
+void snd_primary_read(
+        struct snd_primary *p,
+        void *out,
+        enum snd_format format,
+        size_t nchannels,
+        size_t nframes)
+{
+    uint8_t *bytes;
+    size_t frame_size;
+    size_t pos;
+    size_t n;
+
+    assert(p != NULL);
+    assert(out != NULL);
+    assert(nchannels >= 2);
+
+    atomic_load_explicit(&p->ncommits, memory_order_acquire);
+
+    bytes = out;
+    frame_size = nchannels * snd_format_sample_size(format);
+    pos = atomic_load_explicit(&p->pos, memory_order_relaxed);
+
+    /*  Nothing stops the device from wanting more than the whole ring in
+        one go, in which case it just goes round again. */
+
+    while (nframes > 0) {
+        n = p->nframes - pos;
+
+        if (n > nframes) {
+            n = nframes;
+        }
+
+        snd_primary_output(
+                &p->samples[pos * 2],
+                bytes,
+                format,
+                nchannels,
+                n);
+
+        bytes += n * frame_size;
+        nframes -= n;
+        pos = (pos + n) % p->nframes;
+    }
+
+    atomic_store_explicit(&p->pos, pos, memory_order_relaxed);
+}
+
+size_t snd_primary_render(
+        const struct snd_primary *p,
+        size_t pos,
+        int32_t *work,
+        size_t nframes)
+{
+    size_t j;
+
+    assert(p != NULL);
+    assert(work != NULL);
+    assert(pos < p->nframes);
+
+    atomic_load_explicit(&p->ncommits, memory_order_acquire);
+
+    /*  Work samples carry eight bits of volume below the 16 of the sample */
+
+    for (j = 0 ; j < nframes ; j++) {
+        *work++ += p->samples[pos * 2] * 0x100;
+        *work++ += p->samples[pos * 2 + 1] * 0x100;
+        pos = (pos + 1) % p->nframes;
+    }
+
+    return pos;
+}
+
+static void snd_primary_output(
+        const int16_t *in,
+        void *out,
+        enum snd_format format,
+        size_t nchannels,
+        size_t nframes)
+{
+    int16_t *s16;
+    int32_t *s32;
+    float *f32;
+    size_t nextra;
+    size_t j;
+
+    /*  A device that takes exactly what the application writes gets a plain
+        copy. Otherwise this is the same output stage as the mixer's, minus
+        the clamping. */
+
+    nextra = nchannels - 2;
+
+    if (format == SND_FORMAT_S16 && nextra == 0) {
+        memcpy(out, in, nframes * 2 * sizeof(int16_t));
+
+        return;
+    }
+
+    switch (format) {
+    case SND_FORMAT_S16:
+        s16 = out;
+
+        for (j = 0 ; j < nframes * 2 ; j += 2) {
+            *s16++ = in[j];
+            *s16++ = in[j + 1];
+            memset(s16, 0, nextra * sizeof(*s16));
+            s16 += nextra;
+        }
+
+        break;
+
+    case SND_FORMAT_S24_32:
+    case SND_FORMAT_S32:
+        s32 = out;
+
+        for (j = 0 ; j < nframes * 2 ; j += 2) {
+            *s32++ = (int32_t) ((uint32_t) (uint16_t) in[j] << 16);
+            *s32++ = (int32_t) ((uint32_t) (uint16_t) in[j + 1] << 16);
+            memset(s32, 0, nextra * sizeof(*s32));
+            s32 += nextra;
+        }
+
+        break;
+
+    case SND_FORMAT_F32:
+        f32 = out;
+
+        for (j = 0 ; j < nframes * 2 ; j += 2) {
+            *f32++ = in[j] * (1.0f / 0x8000);
+            *f32++ = in[j + 1] * (1.0f / 0x8000);
+            memset(f32, 0, nextra * sizeof(*f32));
+            f32 += nextra;
+        }
+
+        break;
+
+    default:
+        abort();
+    }
+}
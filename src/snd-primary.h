@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "snd-mixer.h"
+
+/*  The primary buffer, for applications that do their own mixing. It is a
+    ring of 16-bit stereo frames at the mix rate, which the application
+    writes into directly. While it is attached to the mixer it goes out to
+    the device in place of the mix, converted to the device format on the
+    way if need be. There is only ever the one, shared by everybody. */
+
+struct snd_primary;
+
+int snd_primary_alloc(struct snd_primary **out, size_t nframes);
+void snd_primary_free(struct snd_primary *p);
+int16_t *snd_primary_samples_rw(struct snd_primary *p);
+size_t snd_primary_nframes(const struct snd_primary *p);
+
+/*  The play position is the next frame due out to the device. The guard is
+    how far past it the audio thread may read before it next publishes the
+    position, so anything written closer than that may be too late. */
+
+size_t snd_primary_get_position(const struct snd_primary *p);
+void snd_primary_set_position(struct snd_primary *p, size_t pos);
+size_t snd_primary_get_guard(const struct snd_primary *p);
+void snd_primary_set_guard(struct snd_primary *p, size_t nframes);
+
+/*  Make whatever the application wrote so far visible to the audio thread */
+
+void snd_primary_commit(struct snd_primary *p);
+
+/*  Audio thread only: hand nframes frames to the device, starting at the
+    play position, and advance it. */
+
+void snd_primary_read(
+        struct snd_primary *p,
+        void *out,
+        enum snd_format format,
+        size_t nchannels,
+        size_t nframes);
+
+/*  Audio thread only: add nframes frames starting at pos to a block of mixer
+    work samples, for when they need resampling on the way out. Returns the
+    position after them; the play position is left for the mixer to publish
+    once the block has been handed off. */
+
+size_t snd_primary_render(
+        const struct snd_primary *p,
+        size_t pos,
+        int32_t *work,
+        size_t nframes);
@@ -0,0 +1,289 @@
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memstat.h"
+#include "snd-resampler.h"
+#include "snd-stream.h"
+
+/*  Filter length in input frames, and how many fractional positions per
+    input frame the filter is tabulated for. Positions in between get their
+    coefficients interpolated linearly from the two nearest. */
+
+#define SND_RESAMPLER_NTAPS 32
+#define SND_RESAMPLER_PHASE_BITS 8
+#define SND_RESAMPLER_NPHASES (1 << SND_RESAMPLER_PHASE_BITS)
+
+/*  Kaiser window shape, for about 80 dB of stopband, and where the passband
+    ends relative to the lower of the two Nyquist frequencies. */
+
+#define SND_RESAMPLER_BETA 8.0
+#define SND_RESAMPLER_CUTOFF 0.9
+
+struct snd_resampler_state {
+    uint32_t frac;
+    float history[SND_RESAMPLER_NTAPS * 2];
+};
+
+struct snd_resampler {
+    float *coef;
+    float *delta;
+    float *x;
+    uint64_t step;
+    size_t max_nframes_in;
+    uint32_t frac;
+    struct snd_resampler_state checkpoints[SND_STREAM_NCHECKPOINTS];
+};
+
+static double snd_resampler_bessel_i0(double x);
+static void snd_resampler_design(
+        struct snd_resampler *rs,
+        unsigned int rate_in,
+        unsigned int rate_out);
+
+int snd_resampler_alloc(
+        struct snd_resampler **out,
+        unsigned int rate_in,
+        unsigned int rate_out,
+        size_t max_nframes_out)
+{
+    struct snd_resampler *rs;
+    size_t ncoefs;
+    size_t nsamples;
+    int r;
+
+    assert(out != NULL);
+    assert(rate_in > 0);
+    assert(rate_out > 0);
+    assert(max_nframes_out > 0);
+
+    *out = NULL;
+    rs = memstat_calloc(sizeof(*rs), 1);
+
+    if (rs == NULL) {
+        r = -ENOMEM;
+
+        goto end;
+    }
+
+    /*  Input position advances by step per output frame, in 32.32 fixed
+        point. The fraction carried over from one call to the next can push
+        a block over by one more input frame than the product suggests. */
+
+    rs->step = ((uint64_t) rate_in << 32) / rate_out;
+    rs->max_nframes_in = ((max_nframes_out * rs->step) >> 32) + 1;
+    ncoefs = SND_RESAMPLER_NPHASES * SND_RESAMPLER_NTAPS;
+    nsamples = (SND_RESAMPLER_NTAPS + rs->max_nframes_in) * 2;
+    rs->coef = memstat_malloc(ncoefs * sizeof(float));
+    rs->delta = memstat_malloc(ncoefs * sizeof(float));
+    rs->x = memstat_calloc(nsamples, sizeof(float));
+
+    if (rs->coef == NULL || rs->delta == NULL || rs->x == NULL) {
+        r = -ENOMEM;
+
+        goto end;
+    }
+
+    snd_resampler_design(rs, rate_in, rate_out);
+
+    *out = rs;
+    rs = NULL;
+    r = 0;
+
+end:
+    snd_resampler_free(rs);
+
+    return r;
+}
+
+void snd_resampler_free(struct snd_resampler *rs)
+{
+    if (rs == NULL) {
+        return;
+    }
+
+    free(rs->coef);
+    free(rs->delta);
+    free(rs->x);
+    free(rs);
+}
+
+static double snd_resampler_bessel_i0(double x)
+{
+    double sum;
+    double term;
+    unsigned int k;
+
+    sum = 1.0;
+    term = 1.0;
+
+    for (k = 1 ; term > sum * 1e-12 ; k++) {
+        term *= (x * x) / (4.0 * k * k);
+        sum += term;
+    }
+
+    return sum;
+}
+
+static void snd_resampler_design(
+        struct snd_resampler *rs,
+        unsigned int rate_in,
+        unsigned int rate_out)
+{
+    double row[SND_RESAMPLER_NTAPS];
+    double next[SND_RESAMPLER_NTAPS];
+    double cutoff;
+    double norm;
+    double sum;
+    double d;
+    double u;
+    size_t ph;
+    size_t j;
+
+    /*  Row ph is the filter for an output frame that falls ph / NPHASES of
+        the way from tap NTAPS / 2 - 1 to the one after. Each row is scaled
+        to unity gain at DC, so that the rows agree on a constant signal. */
+
+    cutoff = SND_RESAMPLER_CUTOFF;
+
+    if (rate_out < rate_in) {
+        cutoff *= (double) rate_out / rate_in;
+    }
+
+    norm = snd_resampler_bessel_i0(SND_RESAMPLER_BETA);
+
+    for (ph = 0 ; ph <= SND_RESAMPLER_NPHASES ; ph++) {
+        sum = 0.0;
+
+        for (j = 0 ; j < SND_RESAMPLER_NTAPS ; j++) {
+            d = (double) j - (SND_RESAMPLER_NTAPS / 2 - 1)
+                    - (double) ph / SND_RESAMPLER_NPHASES;
+            u = d / (SND_RESAMPLER_NTAPS / 2);
+
+            next[j] = d == 0.0
+                    ? cutoff
+                    : sin(M_PI * cutoff * d) / (M_PI * d);
+            next[j] *= snd_resampler_bessel_i0(
+                    SND_RESAMPLER_BETA * sqrt(fmax(0.0, 1.0 - u * u)))
+                    / norm;
+            sum += next[j];
+        }
+
+        for (j = 0 ; j < SND_RESAMPLER_NTAPS ; j++) {
+            next[j] /= sum;
+        }
+
+        if (ph > 0) {
+            for (j = 0 ; j < SND_RESAMPLER_NTAPS ; j++) {
+                rs->coef[(ph - 1) * SND_RESAMPLER_NTAPS + j] = row[j];
+                rs->delta[(ph - 1) * SND_RESAMPLER_NTAPS + j] =
+                        next[j] - row[j];
+            }
+        }
+
+        memcpy(row, next, sizeof(row));
+    }
+}
+
+size_t snd_resampler_nframes_in(
+        const struct snd_resampler *rs,
+        size_t nframes_out)
+{
+    assert(rs != NULL);
+
+    return (rs->frac + nframes_out * rs->step) >> 32;
+}
+
+void snd_resampler_process(
+        struct snd_resampler *rs,
+        const int32_t *in,
+        size_t nframes_in,
+        int32_t *out,
+        size_t nframes_out)
+{
+    const float *coef;
+    const float *delta;
+    const float *x;
+    uint64_t pos;
+    float left;
+    float right;
+    float c;
+    float t;
+    size_t j;
+    size_t k;
+
+    assert(rs != NULL);
+    assert(in != NULL);
+    assert(out != NULL);
+    assert(nframes_in == snd_resampler_nframes_in(rs, nframes_out));
+    assert(nframes_in <= rs->max_nframes_in);
+
+    /*  The input goes in after the last NTAPS frames of the previous call,
+        so that the filter never has to look outside of one buffer. */
+
+    for (j = 0 ; j < nframes_in * 2 ; j++) {
+        rs->x[SND_RESAMPLER_NTAPS * 2 + j] = in[j];
+    }
+
+    pos = rs->frac;
+
+    for (k = 0 ; k < nframes_out ; k++) {
+        j = (uint32_t) pos >> (32 - SND_RESAMPLER_PHASE_BITS);
+        t = ((uint32_t) pos << SND_RESAMPLER_PHASE_BITS)
+                * (1.0f / 4294967296.0f);
+        coef = &rs->coef[j * SND_RESAMPLER_NTAPS];
+        delta = &rs->delta[j * SND_RESAMPLER_NTAPS];
+        x = &rs->x[(pos >> 32) * 2];
+        left = 0.0f;
+        right = 0.0f;
+
+        for (j = 0 ; j < SND_RESAMPLER_NTAPS ; j++) {
+            c = coef[j] + t * delta[j];
+            left += x[j * 2] * c;
+            right += x[j * 2 + 1] * c;
+        }
+
+        /*  Ringing can overshoot, but not by enough to matter to anything
+            short of the int32 limits, which the output stage clamps well
+            inside of anyway. */
+
+        out[k * 2] = lrintf(fmaxf(fminf(left, 2.0e9f), -2.0e9f));
+        out[k * 2 + 1] = lrintf(fmaxf(fminf(right, 2.0e9f), -2.0e9f));
+        pos += rs->step;
+    }
+
+    assert((pos >> 32) == nframes_in);
+
+    memmove(rs->x,
+            &rs->x[nframes_in * 2],
+            SND_RESAMPLER_NTAPS * 2 * sizeof(float));
+    rs->frac = (uint32_t) pos;
+}
+
+void snd_resampler_checkpoint(struct snd_resampler *rs, size_t slot)
+{
+    struct snd_resampler_state *state;
+
+    assert(rs != NULL);
+    assert(slot < SND_STREAM_NCHECKPOINTS);
+
+    state = &rs->checkpoints[slot];
+    state->frac = rs->frac;
+    memcpy(state->history, rs->x, sizeof(state->history));
+}
+
+void snd_resampler_restore(struct snd_resampler *rs, size_t slot)
+{
+    const struct snd_resampler_state *state;
+
+    assert(rs != NULL);
+    assert(slot < SND_STREAM_NCHECKPOINTS);
+
+    state = &rs->checkpoints[slot];
+    rs->frac = state->frac;
+    memcpy(rs->x, state->history, sizeof(state->history));
+}
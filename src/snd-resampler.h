@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*  Streaming sample rate converter for the mixer's output: stereo work
+    samples in, stereo work samples out, through a windowed-sinc filter.
+    Like a stream, it remembers its state at the start of every block the
+    mixer rendered ahead, so that it can be rewound along with them. */
+
+struct snd_resampler;
+
+int snd_resampler_alloc(
+        struct snd_resampler **out,
+        unsigned int rate_in,
+        unsigned int rate_out,
+        size_t max_nframes_out);
+void snd_resampler_free(struct snd_resampler *rs);
+
+/*  How many input frames the next nframes_out output frames will consume.
+    This depends on where the previous call left off. */
+
+size_t snd_resampler_nframes_in(
+        const struct snd_resampler *rs,
+        size_t nframes_out);
+void snd_resampler_process(
+        struct snd_resampler *rs,
+        const int32_t *in,
+        size_t nframes_in,
+        int32_t *out,
+        size_t nframes_out);
+void snd_resampler_checkpoint(struct snd_resampler *rs, size_t slot);
+void snd_resampler_restore(struct snd_resampler *rs, size_t slot);
@@ -8,8 +8,10 @@
 #include <string.h>
 
 #include "defs.h"
+#include "memstat.h"
 #include "queue.h"
 #include "snd-mixer.h"
+#include "snd-notice.h"
 #include "snd-service.h"
 #include "snd-stream.h"
 #include "trace.h"
@@ -19,6 +21,8 @@ enum snd_command_type {
     SND_COMMAND_PLAY,
     SND_COMMAND_STOP,
     SND_COMMAND_SET_VOLUME,
+    SND_COMMAND_PLAY_PRIMARY,
+    SND_COMMAND_STOP_PRIMARY,
 };
 
 struct snd_command {
@@ -28,22 +32,50 @@ struct snd_command {
     union {
         uint16_t volumes[2];
         bool loop;
+        struct snd_primary *primary;
     };
 
-    snd_callback_t callback;
-    void *callback_ctx;
+    uint64_t seq;
+    unsigned int cycle;
+    unsigned int serial;
     enum snd_command_type type;
 };
 
 struct snd_service {
     struct queue_shared *cmds_intake;
+    struct queue_private *cmds_arrivals;
+    struct queue_private *cmds_backlog;
+    struct queue_private *cmds_priority;
     struct queue_private *cmds_chamber;
     struct queue_shared *cmds_exhaust;
+    atomic_bool parked;
+    snd_callback_t resume;
+    void *resume_ctx;
+    atomic_uint epoch;
+    atomic_uint reclaim_epoch;
+    struct snd_notices *notices;
+    atomic_uint dispatch_epoch;
+    uint64_t seq;
+    size_t nbacklog;
+    size_t intake_budget;
+    size_t pool_nprealloc;
+    size_t pool_hwm;
+
+    /* Statistics, written by the audio thread only */
+    atomic_uint stat_ncmds;
+    atomic_uint stat_ncmds_priority;
+    atomic_uint stat_ncmds_spilled;
+    atomic_uint stat_ncycles_spilled;
+    atomic_uint stat_backlog;
+    atomic_uint stat_backlog_max;
+    atomic_uint stat_nretries;
 };
 
 struct snd_client {
     struct snd_service *svc;
     struct queue_private *cmd_pool;
+    size_t npool;
+    unsigned int nretries;
 };
 
 static int snd_command_alloc(struct snd_command **out);
@@ -51,7 +83,12 @@ static struct snd_command *snd_command_downcast(struct qitem *qi);
 static struct qitem *snd_command_upcast(struct snd_command *cmd);
 static void snd_command_clear(struct snd_command *cmd);
 
+static bool snd_command_is_priority(struct qitem *qi, void *ctx);
+
 static void snd_service_cmd_dtor(struct qitem *qi);
+static void snd_service_apply(struct snd_mixer *m, struct snd_command *cmd);
+
+static void snd_client_pool_refill(struct snd_client *cli);
 
 static int snd_command_alloc(struct snd_command **out)
 {
@@ -60,7 +97,7 @@ static int snd_command_alloc(struct snd_command **out)
     assert(out != NULL);
 
     *out = NULL;
-    cmd = calloc(sizeof(*cmd), 1);
+    cmd = memstat_calloc(sizeof(*cmd), 1);
 
     if (cmd == NULL) {
         return -ENOMEM;
@@ -132,7 +169,7 @@ void snd_command_set_volume(
         struct snd_command *cmd,
         struct snd_stream *stm,
         size_t channel_no,
-        uint8_t value)
+        uint16_t value)
 {
     assert(cmd != NULL);
 
@@ -141,15 +178,43 @@ void snd_command_set_volume(
     cmd->volumes[channel_no] = value;
 }
 
-void snd_command_set_callback(
+void snd_command_play_primary(
         struct snd_command *cmd,
-        snd_callback_t callback,
-        void *ctx)
+        struct snd_primary *p)
 {
     assert(cmd != NULL);
+    assert(p != NULL);
 
-    cmd->callback = callback;
-    cmd->callback_ctx = ctx;
+    cmd->type = SND_COMMAND_PLAY_PRIMARY;
+    cmd->primary = p;
+}
+
+void snd_command_stop_primary(struct snd_command *cmd)
+{
+    assert(cmd != NULL);
+
+    cmd->type = SND_COMMAND_STOP_PRIMARY;
+}
+
+static bool snd_command_is_priority(struct qitem *qi, void *ctx)
+{
+    const struct snd_command *cmd;
+
+    (void) ctx;
+
+    cmd = snd_command_downcast(qi);
+
+    /*  Stops are what free up voices (the reaper retires streams with them),
+        so they are allowed to overtake a backlog. */
+
+    return cmd->type == SND_COMMAND_STOP;
+}
+
+void snd_command_set_serial(struct snd_command *cmd, unsigned int serial)
+{
+    assert(cmd != NULL);
+
+    cmd->serial = serial;
 }
 
 int snd_service_alloc(struct snd_service **out)
@@ -161,7 +226,7 @@ int snd_service_alloc(struct snd_service **out)
     assert(out != NULL);
 
     *out = NULL;
-    svc = calloc(sizeof(*svc), 1);
+    svc = memstat_calloc(sizeof(*svc), 1);
 
     if (svc == NULL) {
         r = -ENOMEM;
@@ -175,6 +240,24 @@ int snd_service_alloc(struct snd_service **out)
         goto end;
     }
 
+    r = queue_private_alloc(&svc->cmds_arrivals);
+
+    if (r < 0) {
+        goto end;
+    }
+
+    r = queue_private_alloc(&svc->cmds_backlog);
+
+    if (r < 0) {
+        goto end;
+    }
+
+    r = queue_private_alloc(&svc->cmds_priority);
+
+    if (r < 0) {
+        goto end;
+    }
+
     r = queue_private_alloc(&svc->cmds_chamber);
 
     if (r < 0) {
@@ -187,6 +270,16 @@ int snd_service_alloc(struct snd_service **out)
         goto end;
     }
 
+    r = snd_notices_alloc(&svc->notices);
+
+    if (r < 0) {
+        goto end;
+    }
+
+    svc->intake_budget = SND_SERVICE_INTAKE_BUDGET;
+    svc->pool_nprealloc = SND_CLIENT_POOL_NPREALLOC;
+    svc->pool_hwm = SND_CLIENT_POOL_HWM;
+
     *out = svc;
     svc = NULL;
 
@@ -204,11 +297,76 @@ void snd_service_free(struct snd_service *svc)
     }
 
     queue_shared_free(svc->cmds_intake, snd_service_cmd_dtor);
+    queue_private_free(svc->cmds_arrivals, snd_service_cmd_dtor);
+    queue_private_free(svc->cmds_backlog, snd_service_cmd_dtor);
+    queue_private_free(svc->cmds_priority, snd_service_cmd_dtor);
     queue_private_free(svc->cmds_chamber, snd_service_cmd_dtor);
     queue_shared_free(svc->cmds_exhaust, snd_service_cmd_dtor);
+    snd_notices_free(svc->notices);
     free(svc);
 }
 
+void snd_service_set_pool_limits(
+        struct snd_service *svc,
+        size_t nprealloc,
+        size_t hwm)
+{
+    assert(svc != NULL);
+
+    if (hwm < nprealloc) {
+        trace(  "Raising command pool high-water mark %u to match "
+                "pre-allocation %u",
+                (unsigned int) hwm,
+                (unsigned int) nprealloc);
+
+        hwm = nprealloc;
+    }
+
+    svc->pool_nprealloc = nprealloc;
+    svc->pool_hwm = hwm;
+}
+
+void snd_service_set_resume_hook(
+        struct snd_service *svc,
+        snd_callback_t resume,
+        void *ctx)
+{
+    assert(svc != NULL);
+
+    svc->resume = resume;
+    svc->resume_ctx = ctx;
+}
+
+bool snd_service_park(struct snd_service *svc)
+{
+    assert(svc != NULL);
+
+    /*  Either a submitter sees the flag and calls the resume hook, or we see
+        its command here and stay awake. Both sides fence between their
+        write and their read, so they cannot both miss. */
+
+    atomic_store(&svc->parked, true);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (svc->nbacklog == 0 && queue_shared_is_empty(svc->cmds_intake)) {
+        return true;
+    }
+
+    /*  Somebody may have claimed the flag already, in which case the hook
+        fires regardless and our caller will have a spurious wakeup. */
+
+    atomic_store(&svc->parked, false);
+
+    return false;
+}
+
+void snd_service_set_intake_budget(struct snd_service *svc, size_t ncmds)
+{
+    assert(svc != NULL);
+
+    svc->intake_budget = ncmds;
+}
+
 static void snd_service_cmd_dtor(struct qitem *qi)
 {
     assert(qi != NULL);
@@ -218,65 +376,282 @@ static void snd_service_cmd_dtor(struct qitem *qi)
 
 void snd_service_intake(struct snd_service *svc, struct snd_mixer *m)
 {
-    const struct snd_command *cmd;
+    struct snd_command *cmd;
     struct queue_private_iter i;
+    struct qitem *qi;
+    unsigned int cycle;
+    size_t napplied;
+    size_t npriority;
+    unsigned int nretries;
 
     assert(svc != NULL);
     assert(m != NULL);
 
-    queue_private_move_from_shared(svc->cmds_chamber, svc->cmds_intake);
+    /*  Stamp new arrivals with their order and the cycle in which we took them
+        in, then queue them up behind anything that was carried over. */
+
+    nretries = queue_private_move_from_shared(
+            svc->cmds_arrivals,
+            svc->cmds_intake);
+    cycle = atomic_load_explicit(&svc->epoch, memory_order_relaxed);
 
-    for (   queue_private_iter_init(&i, svc->cmds_chamber) ;
+    for (   queue_private_iter_init(&i, svc->cmds_arrivals) ;
             queue_private_iter_is_valid(&i) ;
             queue_private_iter_next(&i)) {
         cmd = snd_command_downcast(queue_private_iter_deref(&i));
+        cmd->seq = ++svc->seq;
+        cmd->cycle = cycle;
+        svc->nbacklog++;
+    }
 
-        switch (cmd->type) {
-        case SND_COMMAND_PLAY:
-            snd_stream_set_looping(cmd->stm, cmd->loop);
-            snd_mixer_play(m, cmd->stm);
+    queue_private_splice(svc->cmds_backlog, svc->cmds_arrivals);
 
-            break;
+    /* Apply commands in order until this cycle's budget runs out */
+
+    napplied = 0;
 
-        case SND_COMMAND_STOP:
-            snd_mixer_stop(m, cmd->stm);
+    while (svc->intake_budget == 0 || napplied < svc->intake_budget) {
+        qi = queue_private_pop(svc->cmds_backlog);
 
+        if (qi == NULL) {
             break;
+        }
 
-        case SND_COMMAND_SET_VOLUME:
-            snd_stream_set_volume(cmd->stm, 0, cmd->volumes[0]);
-            snd_stream_set_volume(cmd->stm, 1, cmd->volumes[1]);
+        snd_service_apply(m, snd_command_downcast(qi));
+        queue_private_enqueue(svc->cmds_chamber, qi);
+        napplied++;
+    }
 
-            break;
+    svc->nbacklog -= napplied;
+    npriority = 0;
+
+    /*  Whatever is left carries over to the next cycle, apart from stops,
+        which must never be starved. */
+
+    if (svc->nbacklog > 0) {
+        npriority = queue_private_extract(
+                svc->cmds_backlog,
+                svc->cmds_priority,
+                snd_command_is_priority,
+                NULL);
+
+        while ((qi = queue_private_pop(svc->cmds_priority)) != NULL) {
+            snd_service_apply(m, snd_command_downcast(qi));
+            queue_private_enqueue(svc->cmds_chamber, qi);
+        }
+
+        svc->nbacklog -= npriority;
+    }
 
-        default:
-            abort();
+    atomic_fetch_add_explicit(
+            &svc->stat_ncmds,
+            napplied + npriority,
+            memory_order_relaxed);
+    atomic_fetch_add_explicit(
+            &svc->stat_ncmds_priority,
+            npriority,
+            memory_order_relaxed);
+    atomic_store_explicit(
+            &svc->stat_backlog,
+            svc->nbacklog,
+            memory_order_relaxed);
+    atomic_fetch_add_explicit(
+            &svc->stat_nretries,
+            nretries,
+            memory_order_relaxed);
+
+    if (svc->nbacklog > 0) {
+        atomic_fetch_add_explicit(
+                &svc->stat_ncmds_spilled,
+                svc->nbacklog,
+                memory_order_relaxed);
+        atomic_fetch_add_explicit(
+                &svc->stat_ncycles_spilled,
+                1,
+                memory_order_relaxed);
+
+        if (svc->nbacklog > atomic_load_explicit(
+                    &svc->stat_backlog_max,
+                    memory_order_relaxed)) {
+            atomic_store_explicit(
+                    &svc->stat_backlog_max,
+                    svc->nbacklog,
+                    memory_order_relaxed);
         }
     }
 }
 
+static void snd_service_apply(struct snd_mixer *m, struct snd_command *cmd)
+{
+    assert(m != NULL);
+    assert(cmd != NULL);
+
+    switch (cmd->type) {
+    case SND_COMMAND_PLAY:
+        /* A stop that was fast-tracked past this play supersedes it */
+
+        if (cmd->seq < snd_stream_get_stop_seq(cmd->stm)) {
+            break;
+        }
+
+        snd_stream_set_looping(cmd->stm, cmd->loop);
+        snd_stream_set_serial(cmd->stm, cmd->serial);
+        snd_mixer_play(m, cmd->stm);
+
+        break;
+
+    case SND_COMMAND_STOP:
+        snd_stream_set_stop_seq(cmd->stm, cmd->seq);
+        snd_stream_set_serial(cmd->stm, cmd->serial);
+        snd_mixer_stop(m, cmd->stm);
+
+        break;
+
+    case SND_COMMAND_SET_VOLUME:
+        snd_stream_set_volume(cmd->stm, 0, cmd->volumes[0]);
+        snd_stream_set_volume(cmd->stm, 1, cmd->volumes[1]);
+        snd_mixer_invalidate(m);
+
+        break;
+
+    case SND_COMMAND_PLAY_PRIMARY:
+        snd_mixer_set_primary(m, cmd->primary);
+
+        break;
+
+    case SND_COMMAND_STOP_PRIMARY:
+        snd_mixer_set_primary(m, NULL);
+
+        break;
+
+    default:
+        abort();
+    }
+}
+
 void snd_service_exhaust(struct snd_service *svc)
 {
     const struct snd_command *cmd;
     struct queue_private_iter i;
+    unsigned int epoch;
+    unsigned int reclaim_epoch;
+    unsigned int nretries;
 
     assert(svc != NULL);
 
-    for (   queue_private_iter_init(&i, svc->cmds_chamber) ;
-            queue_private_iter_is_valid(&i) ;
-            queue_private_iter_next(&i)) {
-        cmd = snd_command_downcast(queue_private_iter_deref(&i));
+    nretries = queue_shared_move_from_private(
+            svc->cmds_exhaust,
+            svc->cmds_chamber);
+    atomic_fetch_add_explicit(
+            &svc->stat_nretries,
+            nretries,
+            memory_order_relaxed);
 
-        if (cmd->callback != NULL) {
-            cmd->callback(cmd->callback_ctx);
-        }
+    /*  Publish the end of this cycle. Nothing that was unlinked from the mixer
+        during the cycle can still be referenced by it once this is visible.
+
+        Commands that were carried over still point at their streams, so the
+        reclaim frontier cannot move past the cycle in which the oldest of
+        them was taken in. */
+
+    epoch = atomic_load_explicit(&svc->epoch, memory_order_relaxed) + 1;
+    reclaim_epoch = epoch;
+
+    if (!queue_private_is_empty(svc->cmds_backlog)) {
+        queue_private_iter_init(&i, svc->cmds_backlog);
+        cmd = snd_command_downcast(queue_private_iter_deref(&i));
+        reclaim_epoch = cmd->cycle;
     }
 
-    queue_shared_move_from_private(svc->cmds_exhaust, svc->cmds_chamber);
+    atomic_store_explicit(&svc->epoch, epoch, memory_order_release);
+    atomic_store_explicit(
+            &svc->reclaim_epoch,
+            reclaim_epoch,
+            memory_order_release);
+}
+
+unsigned int snd_service_get_epoch(const struct snd_service *svc)
+{
+    assert(svc != NULL);
+
+    return atomic_load_explicit(&svc->epoch, memory_order_acquire);
+}
+
+unsigned int snd_service_get_reclaim_epoch(const struct snd_service *svc)
+{
+    assert(svc != NULL);
+
+    return atomic_load_explicit(&svc->reclaim_epoch, memory_order_acquire);
+}
+
+struct snd_notices *snd_service_get_notices(const struct snd_service *svc)
+{
+    assert(svc != NULL);
+
+    return svc->notices;
+}
+
+size_t snd_service_dispatch(struct snd_service *svc)
+{
+    unsigned int epoch;
+    size_t n;
+
+    assert(svc != NULL);
+
+    /*  Every notice posted for a stream goes into the ring before the end
+        of the cycle in which the mixer let go of it, which is before the
+        reclaim epoch moves past that cycle. So sample the epoch first: once
+        this drain is done, everything the mixer had let go of by then is
+        finished with. */
+
+    epoch = snd_service_get_reclaim_epoch(svc);
+    n = snd_notices_drain(svc->notices);
+    atomic_store_explicit(&svc->dispatch_epoch, epoch, memory_order_release);
+
+    return n;
+}
+
+unsigned int snd_service_get_dispatch_epoch(const struct snd_service *svc)
+{
+    assert(svc != NULL);
+
+    return atomic_load_explicit(&svc->dispatch_epoch, memory_order_acquire);
+}
+
+void snd_service_get_stats(
+        const struct snd_service *svc,
+        struct snd_service_stats *out)
+{
+    assert(svc != NULL);
+    assert(out != NULL);
+
+    out->ncmds = atomic_load_explicit(
+            &svc->stat_ncmds,
+            memory_order_relaxed);
+    out->ncmds_priority = atomic_load_explicit(
+            &svc->stat_ncmds_priority,
+            memory_order_relaxed);
+    out->ncmds_spilled = atomic_load_explicit(
+            &svc->stat_ncmds_spilled,
+            memory_order_relaxed);
+    out->ncycles_spilled = atomic_load_explicit(
+            &svc->stat_ncycles_spilled,
+            memory_order_relaxed);
+    out->backlog = atomic_load_explicit(
+            &svc->stat_backlog,
+            memory_order_relaxed);
+    out->backlog_max = atomic_load_explicit(
+            &svc->stat_backlog_max,
+            memory_order_relaxed);
+    out->nretries = atomic_load_explicit(
+            &svc->stat_nretries,
+            memory_order_relaxed);
+    out->nnotices_dropped = snd_notices_get_ndropped(svc->notices);
 }
 
 int snd_client_alloc(struct snd_client **out, struct snd_service *svc)
 {
+    struct snd_command *cmd;
     struct snd_client *cli;
     int r;
 
@@ -284,7 +659,7 @@ int snd_client_alloc(struct snd_client **out, struct snd_service *svc)
     assert(svc != NULL);
 
     *out = NULL;
-    cli = calloc(sizeof(*cli), 1);
+    cli = memstat_calloc(sizeof(*cli), 1);
 
     if (cli == NULL) {
         r = -ENOMEM;
@@ -292,13 +667,30 @@ int snd_client_alloc(struct snd_client **out, struct snd_service *svc)
         goto end;
     }
 
+    cli->svc = svc;
     r = queue_private_alloc(&cli->cmd_pool);
 
     if (r < 0) {
         goto end;
     }
 
-    cli->svc = svc;
+    /*  Pre-size the pool here, at buffer creation time, so that the API hot
+        paths never have to touch the heap. Recycled commands are preferred
+        over fresh ones. */
+
+    snd_client_pool_refill(cli);
+
+    while (cli->npool < svc->pool_nprealloc) {
+        r = snd_command_alloc(&cmd);
+
+        if (r < 0) {
+            goto end;
+        }
+
+        queue_private_push(cli->cmd_pool, snd_command_upcast(cmd));
+        cli->npool++;
+    }
+
     *out = cli;
     cli = NULL;
 
@@ -314,10 +706,33 @@ void snd_client_free(struct snd_client *cli)
         return;
     }
 
+    /* Return our pool to the service so that the next client can use it */
+
+    if (cli->cmd_pool != NULL) {
+        queue_shared_move_from_private(cli->svc->cmds_exhaust, cli->cmd_pool);
+    }
+
     queue_private_free(cli->cmd_pool, snd_service_cmd_dtor);
     free(cli);
 }
 
+static void snd_client_pool_refill(struct snd_client *cli)
+{
+    assert(cli != NULL);
+    assert(queue_private_is_empty(cli->cmd_pool));
+
+    /*  Don't hoard: the exhaust stack is shared between every client, so keep
+        no more than the high-water mark and hand the rest straight back. */
+
+    cli->nretries += queue_private_move_from_shared(
+            cli->cmd_pool,
+            cli->svc->cmds_exhaust);
+    cli->npool = queue_private_truncate(
+            cli->cmd_pool,
+            cli->svc->pool_hwm,
+            cli->svc->cmds_exhaust);
+}
+
 int snd_client_cmd_alloc(struct snd_client *cli, struct snd_command **out)
 {
     struct snd_command *cmd;
@@ -342,9 +757,7 @@ int snd_client_cmd_alloc(struct snd_client *cli, struct snd_command **out)
     *out = NULL;
 
     if (queue_private_is_empty(cli->cmd_pool)) {
-        queue_private_move_from_shared(
-                cli->cmd_pool,
-                cli->svc->cmds_exhaust);
+        snd_client_pool_refill(cli);
     }
 
     qi = queue_private_pop(cli->cmd_pool);
@@ -353,6 +766,7 @@ int snd_client_cmd_alloc(struct snd_client *cli, struct snd_command **out)
         return snd_command_alloc(out);
     }
 
+    cli->npool--;
     cmd = snd_command_downcast(qi);
     snd_command_clear(cmd);
     *out = cmd;
@@ -362,8 +776,52 @@ int snd_client_cmd_alloc(struct snd_client *cli, struct snd_command **out)
 
 void snd_client_cmd_submit(struct snd_client *cli, struct snd_command *cmd)
 {
+    struct snd_service *svc;
+
     assert(cli != NULL);
     assert(cmd != NULL);
 
-    queue_shared_push(cli->svc->cmds_intake, snd_command_upcast(cmd));
+    svc = cli->svc;
+    cli->nretries += queue_shared_push(
+            svc->cmds_intake,
+            snd_command_upcast(cmd));
+
+    /*  Wake the audio thread if it has gone idle. This runs on the
+        submitting thread, which is allowed to make syscalls. */
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (    atomic_load_explicit(&svc->parked, memory_order_relaxed) &&
+            atomic_exchange(&svc->parked, false) &&
+            svc->resume != NULL) {
+        svc->resume(svc->resume_ctx);
+    }
+}
+
+unsigned int snd_client_get_epoch(const struct snd_client *cli)
+{
+    assert(cli != NULL);
+
+    return snd_service_get_epoch(cli->svc);
+}
+
+unsigned int snd_client_get_reclaim_epoch(const struct snd_client *cli)
+{
+    assert(cli != NULL);
+
+    return snd_service_get_reclaim_epoch(cli->svc);
+}
+
+unsigned int snd_client_get_dispatch_epoch(const struct snd_client *cli)
+{
+    assert(cli != NULL);
+
+    return snd_service_get_dispatch_epoch(cli->svc);
+}
+
+unsigned int snd_client_get_nretries(const struct snd_client *cli)
+{
+    assert(cli != NULL);
+
+    return cli->nretries;
 }
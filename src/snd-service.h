@@ -5,14 +5,46 @@
 #include <stdint.h>
 
 #include "snd-mixer.h"
+#include "snd-notice.h"
+#include "snd-primary.h"
 #include "snd-stream.h"
 
+/*  Default number of commands each client pre-allocates, and the most that
+    any one client will keep in its private pool after recycling. Keep the
+    latter small: a client that refills takes everything recycled so far, up
+    to the limit, and a generous one lets the first few clients to refill
+    starve the rest into allocating. */
+
+#define SND_CLIENT_POOL_NPREALLOC 4
+#define SND_CLIENT_POOL_HWM 8
+
+/*  Default number of commands the audio thread applies per cycle. Anything
+    beyond that carries over to the next cycle. Zero means unlimited. */
+
+#define SND_SERVICE_INTAKE_BUDGET 512
+
 struct snd_client;
 struct snd_command;
 struct snd_service;
 
 typedef void (*snd_callback_t)(void *ctx);
 
+/*  Command intake statistics. All counters are free-running and wrap.
+    nretries counts the audio thread's retried updates of the queues it
+    shares with clients, which only happen under contention, and
+    nnotices_dropped the stream notices that found the ring full. */
+
+struct snd_service_stats {
+    unsigned int ncmds;
+    unsigned int ncmds_priority;
+    unsigned int ncmds_spilled;
+    unsigned int ncycles_spilled;
+    unsigned int backlog;
+    unsigned int backlog_max;
+    unsigned int nretries;
+    unsigned int nnotices_dropped;
+};
+
 void snd_command_free(struct snd_command *cmd);
 void snd_command_play(
         struct snd_command *cmd,
@@ -23,18 +55,57 @@ void snd_command_set_volume(
         struct snd_command *cmd,
         struct snd_stream *stm,
         size_t channel_no,
-        uint8_t value);
-void snd_command_set_callback(
+        uint16_t value);
+void snd_command_play_primary(
         struct snd_command *cmd,
-        snd_callback_t callback,
-        void *ctx);
+        struct snd_primary *p);
+void snd_command_stop_primary(struct snd_command *cmd);
+void snd_command_set_serial(struct snd_command *cmd, unsigned int serial);
 
 int snd_service_alloc(struct snd_service **out);
 void snd_service_free(struct snd_service *svc);
+void snd_service_set_pool_limits(
+        struct snd_service *svc,
+        size_t nprealloc,
+        size_t hwm);
+void snd_service_set_intake_budget(struct snd_service *svc, size_t ncmds);
+
+/*  Submitters read the resume hook without synchronisation, so it must be
+    set before the first client is allocated. */
+
+void snd_service_set_resume_hook(
+        struct snd_service *svc,
+        snd_callback_t resume,
+        void *ctx);
+bool snd_service_park(struct snd_service *svc);
 void snd_service_intake(struct snd_service *svc, struct snd_mixer *m);
 void snd_service_exhaust(struct snd_service *svc);
+unsigned int snd_service_get_epoch(const struct snd_service *svc);
+unsigned int snd_service_get_reclaim_epoch(const struct snd_service *svc);
+
+/*  The ring that the mixer posts stream notices to, and the consumer's side
+    of it. Dispatching runs the handlers of everything posted so far, on the
+    calling thread, and returns how many there were. The dispatch epoch is
+    the reclaim epoch as of the start of the last dispatch: anything that
+    the mixer had let go of by then has no notices left to handle. */
+
+struct snd_notices *snd_service_get_notices(const struct snd_service *svc);
+size_t snd_service_dispatch(struct snd_service *svc);
+unsigned int snd_service_get_dispatch_epoch(const struct snd_service *svc);
+void snd_service_get_stats(
+        const struct snd_service *svc,
+        struct snd_service_stats *out);
 
 int snd_client_alloc(struct snd_client **out, struct snd_service *svc);
 void snd_client_free(struct snd_client *cli);
 int snd_client_cmd_alloc(struct snd_client *cli, struct snd_command **out);
 void snd_client_cmd_submit(struct snd_client *cli, struct snd_command *cmd);
+unsigned int snd_client_get_epoch(const struct snd_client *cli);
+unsigned int snd_client_get_reclaim_epoch(const struct snd_client *cli);
+unsigned int snd_client_get_dispatch_epoch(const struct snd_client *cli);
+
+/*  How often this client's submissions and pool refills had to retry
+    because another thread got to a shared queue first. Like the rest of
+    a client, only to be used by the thread that owns it. */
+
+unsigned int snd_client_get_nretries(const struct snd_client *cli);
@@ -8,16 +8,51 @@
 
 #include "defs.h"
 #include "list.h"
+#include "memstat.h"
 #include "snd-buffer.h"
+#include "snd-stream.h"
+
+/*  Seqlock-protected copy of the stream state. Only the audio thread writes
+    it; any number of API threads may poll it without taking locks. */
+
+struct snd_stream_snapshot {
+    atomic_uint seq;
+    atomic_uint flags;
+    atomic_uint serial;
+    atomic_uint pos;
+    atomic_uint last_mixed_frame;
+};
 
 struct snd_stream {
+    /* Render state, private to the audio thread */
     struct list_node node;
     const struct snd_buffer *buf;
-    atomic_uint pos;
+    size_t pos;
     uint16_t volumes[2];
-    atomic_bool looping;
+    unsigned int serial;
+    uint64_t stop_seq;
+    uintptr_t tag;
+    bool looping;
+    size_t checkpoints[SND_STREAM_NCHECKPOINTS];
+    size_t pos_published;
+    size_t pos_noticed;
+    snd_notice_fn_t notify_fn;
+    _Atomic(void *) notify_ctx;
+
+    /*  Published state. Heap blocks are not cache-line aligned, so pad both
+        sides by a full line to keep polling threads off the lines that the
+        render loop writes. */
+    uint8_t pad_before[CACHE_LINE_SIZE];
+    struct snd_stream_snapshot snap;
+    uint8_t pad_after[CACHE_LINE_SIZE];
 };
 
+static void snd_stream_publish_pos(
+        struct snd_stream *stm,
+        bool playing,
+        size_t pos,
+        uint32_t frame);
+
 int snd_stream_alloc(struct snd_stream **out, const struct snd_buffer *buf)
 {
     struct snd_stream *stm;
@@ -26,7 +61,7 @@ int snd_stream_alloc(struct snd_stream **out, const struct snd_buffer *buf)
     assert(buf != NULL);
 
     *out = NULL;
-    stm = calloc(sizeof(*stm), 1);
+    stm = memstat_calloc(sizeof(*stm), 1);
 
     if (stm == NULL) {
         return -ENOMEM;
@@ -56,7 +91,60 @@ void snd_stream_set_looping(struct snd_stream *stm, bool value)
 {
     assert(stm != NULL);
 
-    atomic_store(&stm->looping, value);
+    stm->looping = value;
+}
+
+void snd_stream_set_serial(struct snd_stream *stm, unsigned int serial)
+{
+    assert(stm != NULL);
+
+    stm->serial = serial;
+}
+
+void snd_stream_set_stop_seq(struct snd_stream *stm, uint64_t seq)
+{
+    assert(stm != NULL);
+
+    stm->stop_seq = seq;
+}
+
+uint64_t snd_stream_get_stop_seq(const struct snd_stream *stm)
+{
+    assert(stm != NULL);
+
+    return stm->stop_seq;
+}
+
+void snd_stream_set_tag(struct snd_stream *stm, uintptr_t tag)
+{
+    assert(stm != NULL);
+
+    stm->tag = tag;
+}
+
+uintptr_t snd_stream_get_tag(const struct snd_stream *stm)
+{
+    assert(stm != NULL);
+
+    return stm->tag;
+}
+
+void snd_stream_set_notify(
+        struct snd_stream *stm,
+        snd_notice_fn_t fn,
+        void *ctx)
+{
+    assert(stm != NULL);
+    assert(fn != NULL);
+    assert(ctx != NULL);
+    assert(atomic_load_explicit(&stm->notify_ctx, memory_order_relaxed)
+            == NULL);
+
+    /*  The audio thread may be mixing the stream already. It only looks at
+        fn once it has seen ctx, which is published last. */
+
+    stm->notify_fn = fn;
+    atomic_store_explicit(&stm->notify_ctx, ctx, memory_order_release);
 }
 
 void snd_stream_set_volume(
@@ -116,7 +204,7 @@ bool snd_stream_render(
         pos = 0;
     }
 
-    atomic_store(&stm->pos, pos);
+    stm->pos = pos;
 
     return pos < buf_nsamples;
 }
@@ -124,24 +212,165 @@ bool snd_stream_render(
 void snd_stream_rewind(struct snd_stream *stm)
 {
     assert(stm != NULL);
-    atomic_store(&stm->pos, 0);
+
+    stm->pos = 0;
+    stm->pos_noticed = 0;
+}
+
+void snd_stream_checkpoint(struct snd_stream *stm, size_t slot)
+{
+    assert(stm != NULL);
+    assert(slot < lengthof(stm->checkpoints));
+
+    stm->checkpoints[slot] = stm->pos;
 }
 
-bool snd_stream_is_finished(const struct snd_stream *stm)
+void snd_stream_restore(struct snd_stream *stm, size_t slot)
 {
     assert(stm != NULL);
+    assert(slot < lengthof(stm->checkpoints));
 
-    return  atomic_load(&stm->looping) == false &&
-            atomic_load(&stm->pos) >= snd_buffer_nsamples(stm->buf);
+    stm->pos = stm->checkpoints[slot];
 }
 
-size_t snd_stream_peek_position(const struct snd_stream *stm)
+void snd_stream_publish(struct snd_stream *stm, bool playing, uint32_t frame)
 {
     assert(stm != NULL);
 
-    /* Convert result from samples (not very meaningful) to frames */
+    snd_stream_publish_pos(stm, playing, stm->pos, frame);
+}
+
+bool snd_stream_publish_checkpoint(
+        struct snd_stream *stm,
+        size_t slot,
+        uint32_t frame)
+{
+    size_t pos;
+    bool playing;
+
+    assert(stm != NULL);
+    assert(slot < lengthof(stm->checkpoints));
+
+    pos = stm->checkpoints[slot];
+    playing = stm->looping || pos < snd_buffer_nsamples(stm->buf);
+    snd_stream_publish_pos(stm, playing, pos, frame);
+
+    return playing;
+}
+
+static void snd_stream_publish_pos(
+        struct snd_stream *stm,
+        bool playing,
+        size_t pos,
+        uint32_t frame)
+{
+    struct snd_stream_snapshot *snap;
+    unsigned int flags;
+    unsigned int seq;
+
+    snap = &stm->snap;
+    flags = 0;
+    stm->pos_published = pos;
+
+    if (playing) {
+        flags |= SND_STREAM_PLAYING;
+
+        if (stm->looping) {
+            flags |= SND_STREAM_LOOPING;
+        }
+    }
+
+    seq = atomic_load_explicit(&snap->seq, memory_order_relaxed);
+    atomic_store_explicit(&snap->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&snap->flags, flags, memory_order_relaxed);
+    atomic_store_explicit(&snap->serial, stm->serial, memory_order_relaxed);
+    atomic_store_explicit(&snap->pos, pos, memory_order_relaxed);
+    atomic_store_explicit(
+            &snap->last_mixed_frame,
+            frame,
+            memory_order_relaxed);
+
+    atomic_store_explicit(&snap->seq, seq + 2, memory_order_release);
+}
+
+void snd_stream_post_notice(
+        struct snd_stream *stm,
+        struct snd_notices *ns,
+        bool stopped)
+{
+    struct snd_notice n;
+
+    assert(stm != NULL);
+
+    n.ctx = atomic_load_explicit(&stm->notify_ctx, memory_order_acquire);
+
+    if (ns == NULL || n.ctx == NULL) {
+        stm->pos_noticed = stm->pos_published;
+
+        return;
+    }
+
+    /*  A looping stream that has gone all the way round since last time
+        looks as if it had hardly moved. Its period would have to be longer
+        than its buffer for that, though. */
+
+    n.fn = stm->notify_fn;
+    n.from = stm->pos_noticed / 2;
+    n.to = stm->pos_published / 2;
+    n.flags = 0;
+
+    if (stopped) {
+        n.flags |= SND_NOTICE_STOPPED;
+    }
+
+    if (n.to < n.from) {
+        n.flags |= SND_NOTICE_WRAPPED;
+    }
+
+    stm->pos_noticed = stm->pos_published;
+
+    if (n.from != n.to || n.flags != 0) {
+        snd_notices_post(ns, &n);
+    }
+}
+
+void snd_stream_read_state(
+        const struct snd_stream *stm,
+        struct snd_stream_state *out)
+{
+    const struct snd_stream_snapshot *snap;
+    unsigned int seq_begin;
+    unsigned int seq_end;
+
+    assert(stm != NULL);
+    assert(out != NULL);
+
+    snap = &stm->snap;
+
+    /*  Retry if we raced with the audio thread. It publishes once per stream
+        per cycle, so in practice this almost never loops. */
+
+    do {
+        seq_begin = atomic_load_explicit(&snap->seq, memory_order_acquire);
+
+        out->flags = atomic_load_explicit(&snap->flags, memory_order_relaxed);
+        out->serial = atomic_load_explicit(
+                &snap->serial,
+                memory_order_relaxed);
+        out->pos = atomic_load_explicit(&snap->pos, memory_order_relaxed);
+        out->last_mixed_frame = atomic_load_explicit(
+                &snap->last_mixed_frame,
+                memory_order_relaxed);
+
+        atomic_thread_fence(memory_order_acquire);
+        seq_end = atomic_load_explicit(&snap->seq, memory_order_relaxed);
+    } while (seq_begin != seq_end || (seq_begin & 1) != 0);
+
+    /* Convert position from samples (not very meaningful) to frames */
 
-    return atomic_load(&stm->pos) / 2;
+    out->pos /= 2;
 }
 
 struct list_node *snd_stream_list_upcast(struct snd_stream *stm)
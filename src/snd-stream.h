@@ -6,12 +6,49 @@
 
 #include "list.h"
 #include "snd-buffer.h"
+#include "snd-notice.h"
+
+#define SND_STREAM_PLAYING 0x01
+#define SND_STREAM_LOOPING 0x02
+
+/*  Number of render positions a stream remembers, so that the mixer can
+    rewind it to the start of any block it has rendered ahead. */
+
+#define SND_STREAM_NCHECKPOINTS 17
 
 struct snd_stream;
 
+/*  What the mixer last did with a stream, as published by the audio thread.
+    serial is the serial number of the last play or stop command applied. */
+
+struct snd_stream_state {
+    unsigned int flags;
+    unsigned int serial;
+    size_t pos;
+    uint32_t last_mixed_frame;
+};
+
 int snd_stream_alloc(struct snd_stream **out, const struct snd_buffer *buf);
 void snd_stream_free(struct snd_stream *stm);
 void snd_stream_set_looping(struct snd_stream *stm, bool value);
+void snd_stream_set_serial(struct snd_stream *stm, unsigned int serial);
+void snd_stream_set_stop_seq(struct snd_stream *stm, uint64_t seq);
+uint64_t snd_stream_get_stop_seq(const struct snd_stream *stm);
+
+/*  What the stream's mixing cost is attributed to. Set it before the stream
+    is first handed to the audio thread. */
+
+void snd_stream_set_tag(struct snd_stream *stm, uintptr_t tag);
+uintptr_t snd_stream_get_tag(const struct snd_stream *stm);
+
+/*  Have notices posted for the stream. This can be done once, from any
+    thread, at any time; fn and ctx must stay valid until the stream has
+    been freed and every notice posted for it has been handled. */
+
+void snd_stream_set_notify(
+        struct snd_stream *stm,
+        snd_notice_fn_t fn,
+        void *ctx);
 void snd_stream_set_volume(
         struct snd_stream *stm,
         size_t channel,
@@ -21,7 +58,23 @@ bool snd_stream_render(
         int32_t *dest_samples,
         size_t dest_nsamples);
 void snd_stream_rewind(struct snd_stream *stm);
-bool snd_stream_is_finished(const struct snd_stream *stm);
-size_t snd_stream_peek_position(const struct snd_stream *stm);
+void snd_stream_checkpoint(struct snd_stream *stm, size_t slot);
+void snd_stream_restore(struct snd_stream *stm, size_t slot);
+void snd_stream_publish(struct snd_stream *stm, bool playing, uint32_t frame);
+bool snd_stream_publish_checkpoint(
+        struct snd_stream *stm,
+        size_t slot,
+        uint32_t frame);
+
+/*  Post a notice covering what has been published since the last one, if
+    the stream has a handler. ns can be NULL, in which case nothing is. */
+
+void snd_stream_post_notice(
+        struct snd_stream *stm,
+        struct snd_notices *ns,
+        bool stopped);
+void snd_stream_read_state(
+        const struct snd_stream *stm,
+        struct snd_stream_state *out);
 struct list_node *snd_stream_list_upcast(struct snd_stream *node);
 struct snd_stream *snd_stream_list_downcast(struct list_node *node);
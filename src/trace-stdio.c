@@ -0,0 +1,24 @@
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "trace.h"
+
+/*  Trace output for builds of the portable core that run outside Windows,
+    where there is no debugger to send it to. */
+
+void trace_(const char *file, int line, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    tracev_(file, line, fmt, ap);
+    va_end(ap);
+}
+
+void tracev_(const char *file, int line_no, const char *fmt, va_list ap)
+{
+    char msg[512];
+
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    fprintf(stderr, "%s:%i: %s\n", file, line_no, msg);
+}
@@ -0,0 +1,871 @@
+/*  Measure what firing one-shot sounds costs, end to end.
+
+    Usage: churnbench [-c] [-d DLL] [-i MSEC] [-l MSEC] [-n THREADS]
+                      [-r RATE] [-t SEC]
+
+    Does what games do for every one-shot: DuplicateSoundBuffer, Play, and
+    Release once the sound has had MSEC milliseconds to play (default 50, or
+    0 to release it straight after Play). THREADS threads (default 4) share
+    RATE of these cycles per second between them (default 2000, or 0 for as
+    many as they can manage) for SEC seconds (default 10), all duplicating
+    the same source buffer. Calls go through the DirectSoundCreate8 of DLL,
+    by default dsound.dll. Unless HYPERSONIK_BACKEND says otherwise, the
+    engine uses the null backend, so this runs under Wine or on a machine
+    without a sound card.
+
+    Every MSEC milliseconds (-i, default 1000) prints the cycles completed,
+    the voices playing and the reaper's backlog, from the engine's
+    performance counters, and the process's private and working set memory.
+    -c prints comma-separated values instead. Afterwards, once the reaper
+    has caught up, prints how long each kind of call took, how the reaper's
+    backlog grew, and the memory high-water marks. */
+
+#include <windows.h>
+#include <dsound.h>
+#include <process.h>
+#include <psapi.h>
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "perfstat.h"
+
+#define CHURNBENCH_MAX_THREADS 64
+#define CHURNBENCH_MAX_LIVE 1024
+#define CHURNBENCH_NRETRIES 1000
+#define CHURNBENCH_DRAIN_MSEC 10000
+#define CHURNBENCH_RATE 44100
+#define CHURNBENCH_SOURCE_MSEC 250
+
+/*  Latency histogram buckets, as in the API profile: bucket 0 is anything
+    under 128 ns, and each one after that is twice as wide as the last. */
+
+#define CHURNBENCH_NBUCKETS 24
+#define CHURNBENCH_BUCKET0_NS 128
+
+typedef HRESULT (WINAPI *churnbench_create_t)(
+        const GUID *driver_id,
+        IDirectSound8 **out,
+        IUnknown *outer);
+
+enum churnbench_call {
+    CHURNBENCH_DUPLICATE,
+    CHURNBENCH_PLAY,
+    CHURNBENCH_RELEASE,
+    CHURNBENCH_NCALLS,
+};
+
+/*  A histogram rather than every sample, so that measuring does not add to
+    the memory being measured */
+
+struct churnbench_stat {
+    uint64_t ncalls;
+    uint64_t nfailed;
+    uint64_t ticks;
+    uint64_t ticks_max;
+    uint64_t hist[CHURNBENCH_NBUCKETS];
+};
+
+/*  Voices waiting to be released, oldest first, in a ring */
+
+struct churnbench_thread {
+    struct churnbench *cb;
+    HANDLE handle;
+    IDirectSoundBuffer *live[CHURNBENCH_MAX_LIVE];
+    int64_t release_at[CHURNBENCH_MAX_LIVE];
+    size_t live_head;
+    size_t nlive;
+    struct churnbench_stat stats[CHURNBENCH_NCALLS];
+    atomic_ullong ncycles;
+    HRESULT hr;
+};
+
+struct churnbench {
+    IDirectSound8 *ds;
+    IDirectSoundBuffer *source;
+    struct churnbench_thread threads[CHURNBENCH_MAX_THREADS];
+    size_t nthreads;
+    int64_t freq;
+    int64_t interval_ticks;
+    int64_t lifetime_ticks;
+    atomic_bool stop;
+    HANDLE section;
+    const struct perfstat_block *shared;
+};
+
+struct churnbench_sample {
+    uint64_t ncycles;
+    uint32_t nvoices;
+    uint32_t reaper_backlog;
+    size_t private_nbytes;
+    size_t peak_private_nbytes;
+    size_t working_set_nbytes;
+    size_t peak_working_set_nbytes;
+};
+
+static const char *churnbench_call_names[CHURNBENCH_NCALLS] = {
+    [CHURNBENCH_DUPLICATE]  = "DuplicateSoundBuffer",
+    [CHURNBENCH_PLAY]       = "Play",
+    [CHURNBENCH_RELEASE]    = "Release",
+};
+
+static void churnbench_usage(void);
+static HRESULT churnbench_make_source(struct churnbench *cb);
+static unsigned int __stdcall churnbench_thread_main(void *ctx);
+static bool churnbench_cycle(struct churnbench_thread *t, int64_t now);
+static void churnbench_release_oldest(struct churnbench_thread *t);
+static void churnbench_record(
+        struct churnbench_thread *t,
+        enum churnbench_call call,
+        int64_t t_start,
+        HRESULT hr);
+static void churnbench_sample(
+        struct churnbench *cb,
+        struct churnbench_sample *out);
+static bool churnbench_snapshot(
+        struct churnbench *cb,
+        struct perfstat_block *out);
+static void churnbench_report(
+        const struct churnbench *cb,
+        const struct churnbench_sample *start,
+        const struct churnbench_sample *end,
+        uint32_t backlog_max,
+        uint64_t run_ms,
+        uint64_t drain_ms,
+        bool drained);
+static double churnbench_percentile(
+        const struct churnbench_stat *stat,
+        unsigned int pct);
+static int64_t churnbench_now(void);
+
+int main(int argc, char **argv)
+{
+    churnbench_create_t create;
+    struct churnbench_sample start;
+    struct churnbench_sample prev;
+    struct churnbench_sample cur;
+    struct churnbench_thread *t;
+    struct churnbench *cb;
+    const char *dll_path;
+    unsigned long nthreads;
+    unsigned long rate;
+    unsigned long lifetime;
+    unsigned long secs;
+    unsigned long interval;
+    uint64_t t_start;
+    uint64_t t_prev;
+    uint64_t t_now;
+    uint64_t t_drain;
+    uint32_t backlog_max;
+    size_t i;
+    double rate_now;
+    LARGE_INTEGER freq;
+    HMODULE dll;
+    HRESULT hr;
+    bool drained;
+    bool csv;
+    int argi;
+
+    csv = false;
+    dll_path = "dsound.dll";
+    nthreads = 4;
+    rate = 2000;
+    lifetime = 50;
+    secs = 10;
+    interval = 1000;
+
+    for (argi = 1 ; argi < argc && argv[argi][0] == '-' ; argi++) {
+        if (strcmp(argv[argi], "-c") == 0) {
+            csv = true;
+        } else if (strcmp(argv[argi], "-d") == 0 && argi + 1 < argc) {
+            dll_path = argv[++argi];
+        } else if (strcmp(argv[argi], "-i") == 0 && argi + 1 < argc) {
+            interval = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-l") == 0 && argi + 1 < argc) {
+            lifetime = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-n") == 0 && argi + 1 < argc) {
+            nthreads = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-r") == 0 && argi + 1 < argc) {
+            rate = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc) {
+            secs = strtoul(argv[++argi], NULL, 10);
+        } else {
+            churnbench_usage();
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (    argi != argc ||
+            nthreads == 0 ||
+            nthreads > CHURNBENCH_MAX_THREADS ||
+            secs == 0 ||
+            interval == 0) {
+        churnbench_usage();
+
+        return EXIT_FAILURE;
+    }
+
+    /*  The engine reads its configuration when it starts, which is after
+        this, so this is the same as having it set beforehand. */
+
+    if (GetEnvironmentVariableA("HYPERSONIK_BACKEND", NULL, 0) == 0) {
+        SetEnvironmentVariableA("HYPERSONIK_BACKEND", "null");
+    }
+
+    dll = LoadLibraryA(dll_path);
+
+    if (dll == NULL) {
+        fprintf(stderr,
+                "Could not load %s: %lu\n",
+                dll_path,
+                (unsigned long) GetLastError());
+
+        return EXIT_FAILURE;
+    }
+
+    create = (churnbench_create_t) GetProcAddress(dll, "DirectSoundCreate8");
+
+    if (create == NULL) {
+        fprintf(stderr, "%s has no DirectSoundCreate8\n", dll_path);
+
+        return EXIT_FAILURE;
+    }
+
+    /*  Too big for the stack with all of its threads' rings */
+
+    cb = calloc(1, sizeof(*cb));
+
+    if (cb == NULL) {
+        fprintf(stderr, "Out of memory\n");
+
+        return EXIT_FAILURE;
+    }
+
+    hr = create(NULL, &cb->ds, NULL);
+
+    if (FAILED(hr)) {
+        fprintf(stderr,
+                "DirectSoundCreate8 failed: %08lx\n",
+                (unsigned long) hr);
+
+        return EXIT_FAILURE;
+    }
+
+    hr = IDirectSound8_SetCooperativeLevel(
+            cb->ds,
+            GetDesktopWindow(),
+            DSSCL_PRIORITY);
+
+    if (FAILED(hr)) {
+        fprintf(stderr,
+                "SetCooperativeLevel failed: %08lx\n",
+                (unsigned long) hr);
+
+        return EXIT_FAILURE;
+    }
+
+    hr = churnbench_make_source(cb);
+
+    if (FAILED(hr)) {
+        fprintf(stderr,
+                "Could not create the source buffer: %08lx\n",
+                (unsigned long) hr);
+
+        return EXIT_FAILURE;
+    }
+
+    QueryPerformanceFrequency(&freq);
+    cb->nthreads = nthreads;
+    cb->freq = freq.QuadPart;
+    cb->interval_ticks = rate > 0 ? cb->freq * nthreads / rate : 0;
+    cb->lifetime_ticks = cb->freq * lifetime / 1000;
+
+    churnbench_sample(cb, &start);
+    prev = start;
+    backlog_max = start.reaper_backlog;
+
+    for (i = 0 ; i < nthreads ; i++) {
+        t = &cb->threads[i];
+        t->cb = cb;
+        t->handle = (HANDLE) _beginthreadex(
+                NULL,
+                0,
+                churnbench_thread_main,
+                t,
+                0,
+                NULL);
+
+        if (t->handle == NULL) {
+            fprintf(stderr,
+                    "_beginthreadex failed: %lu\n",
+                    (unsigned long) GetLastError());
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (csv) {
+        printf( "t_ms,cycles_per_sec,voices,reaper_backlog,private_bytes,"
+                "working_set_bytes\n");
+    } else {
+        printf( "%9s %9s %6s %6s %11s %11s\n",
+                "time (s)",
+                "cycles/s",
+                "voices",
+                "reaper",
+                "private MB",
+                "working MB");
+    }
+
+    t_start = GetTickCount64();
+    t_prev = t_start;
+    t_now = t_start;
+
+    while (t_now - t_start < (uint64_t) secs * 1000) {
+        Sleep(interval);
+        churnbench_sample(cb, &cur);
+        t_now = GetTickCount64();
+
+        if (cur.reaper_backlog > backlog_max) {
+            backlog_max = cur.reaper_backlog;
+        }
+
+        rate_now = (cur.ncycles - prev.ncycles) * 1000.0 /
+                (t_now > t_prev ? t_now - t_prev : 1);
+
+        if (csv) {
+            printf( "%llu,%.0f,%u,%u,%llu,%llu\n",
+                    (unsigned long long) (t_now - t_start),
+                    rate_now,
+                    cur.nvoices,
+                    cur.reaper_backlog,
+                    (unsigned long long) cur.private_nbytes,
+                    (unsigned long long) cur.working_set_nbytes);
+        } else {
+            printf( "%9.1f %9.0f %6u %6u %11.1f %11.1f\n",
+                    (t_now - t_start) / 1000.0,
+                    rate_now,
+                    cur.nvoices,
+                    cur.reaper_backlog,
+                    cur.private_nbytes / 1048576.0,
+                    cur.working_set_nbytes / 1048576.0);
+        }
+
+        fflush(stdout);
+        prev = cur;
+        t_prev = t_now;
+    }
+
+    atomic_store(&cb->stop, true);
+
+    for (i = 0 ; i < nthreads ; i++) {
+        t = &cb->threads[i];
+        WaitForSingleObject(t->handle, INFINITE);
+        CloseHandle(t->handle);
+
+        if (FAILED(t->hr)) {
+            fprintf(stderr,
+                    "Thread %u stopped early: %08lx\n",
+                    (unsigned int) i,
+                    (unsigned long) t->hr);
+        }
+    }
+
+    /*  Everything has been released by now; see how long the reaper takes
+        to finish with it */
+
+    churnbench_sample(cb, &cur);
+    t_now = GetTickCount64();
+    t_drain = t_now;
+    drained = cur.reaper_backlog == 0;
+
+    while (!drained && t_now - t_drain < CHURNBENCH_DRAIN_MSEC) {
+        Sleep(10);
+        churnbench_sample(cb, &prev);
+        t_now = GetTickCount64();
+        drained = prev.reaper_backlog == 0;
+    }
+
+    churnbench_report(
+            cb,
+            &start,
+            &cur,
+            backlog_max,
+            t_drain - t_start,
+            t_now - t_drain,
+            drained);
+
+    if (cb->shared != NULL) {
+        UnmapViewOfFile(cb->shared);
+        CloseHandle(cb->section);
+    }
+
+    IDirectSoundBuffer_Release(cb->source);
+    IDirectSound8_Release(cb->ds);
+    free(cb);
+
+    return drained ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void churnbench_usage(void)
+{
+    fprintf(stderr,
+            "Usage: churnbench [-c] [-d DLL] [-i MSEC] [-l MSEC] "
+            "[-n THREADS]\n"
+            "                  [-r RATE] [-t SEC]\n");
+}
+
+static HRESULT churnbench_make_source(struct churnbench *cb)
+{
+    WAVEFORMATEX wfx;
+    DSBUFFERDESC desc;
+    int16_t *samples;
+    void *ptr[2];
+    DWORD nbytes[2];
+    uint32_t x;
+    size_t nsamples;
+    size_t i;
+    HRESULT hr;
+
+    /*  Noise, with the controls a game's one-shots usually ask for */
+
+    memset(&wfx, 0, sizeof(wfx));
+    wfx.wFormatTag = WAVE_FORMAT_PCM;
+    wfx.nChannels = 2;
+    wfx.nSamplesPerSec = CHURNBENCH_RATE;
+    wfx.wBitsPerSample = 16;
+    wfx.nBlockAlign = 4;
+    wfx.nAvgBytesPerSec = CHURNBENCH_RATE * 4;
+
+    memset(&desc, 0, sizeof(desc));
+    desc.dwSize = sizeof(desc);
+    desc.dwFlags =
+            DSBCAPS_CTRLVOLUME |
+            DSBCAPS_CTRLPAN |
+            DSBCAPS_CTRLFREQUENCY |
+            DSBCAPS_GETCURRENTPOSITION2;
+    desc.dwBufferBytes =
+            CHURNBENCH_RATE * CHURNBENCH_SOURCE_MSEC / 1000 * 4;
+    desc.lpwfxFormat = &wfx;
+
+    hr = IDirectSound8_CreateSoundBuffer(cb->ds, &desc, &cb->source, NULL);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    hr = IDirectSoundBuffer_Lock(
+            cb->source,
+            0,
+            desc.dwBufferBytes,
+            &ptr[0],
+            &nbytes[0],
+            &ptr[1],
+            &nbytes[1],
+            0);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    samples = ptr[0];
+    nsamples = nbytes[0] / sizeof(*samples);
+    x = 2654435761u;
+
+    for (i = 0 ; i < nsamples ; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        samples[i] = (int16_t) (x >> 16) / 4;
+    }
+
+    return IDirectSoundBuffer_Unlock(
+            cb->source,
+            ptr[0],
+            nbytes[0],
+            ptr[1],
+            nbytes[1]);
+}
+
+static unsigned int __stdcall churnbench_thread_main(void *ctx)
+{
+    struct churnbench_thread *t;
+    struct churnbench *cb;
+    int64_t next;
+    int64_t now;
+    bool busy;
+
+    t = ctx;
+    cb = t->cb;
+    next = churnbench_now();
+
+    while (!atomic_load_explicit(&cb->stop, memory_order_relaxed)) {
+        now = churnbench_now();
+        busy = false;
+
+        while (t->nlive > 0 && t->release_at[t->live_head] <= now) {
+            churnbench_release_oldest(t);
+            busy = true;
+        }
+
+        /*  Catch up on cycles that are due, but not on ones missed while
+            the whole process was held up for longer than a second */
+
+        if (next < now - cb->freq) {
+            next = now;
+        }
+
+        if (cb->interval_ticks == 0 || next <= now) {
+            if (!churnbench_cycle(t, now)) {
+                break;
+            }
+
+            next += cb->interval_ticks;
+            busy = true;
+        }
+
+        if (!busy) {
+            Sleep(1);
+        }
+    }
+
+    while (t->nlive > 0) {
+        churnbench_release_oldest(t);
+    }
+
+    return 0;
+}
+
+static bool churnbench_cycle(struct churnbench_thread *t, int64_t now)
+{
+    IDirectSoundBuffer *buf;
+    struct churnbench *cb;
+    int64_t t_start;
+    size_t i;
+    HRESULT hr;
+
+    cb = t->cb;
+
+    /*  A ring that is full means voices are outliving their welcome, and
+        the oldest has to go early */
+
+    if (t->nlive == CHURNBENCH_MAX_LIVE) {
+        churnbench_release_oldest(t);
+    }
+
+    t_start = churnbench_now();
+    hr = IDirectSound8_DuplicateSoundBuffer(cb->ds, cb->source, &buf);
+    churnbench_record(t, CHURNBENCH_DUPLICATE, t_start, hr);
+
+    if (FAILED(hr)) {
+        t->hr = hr;
+
+        return false;
+    }
+
+    t_start = churnbench_now();
+    hr = IDirectSoundBuffer_Play(buf, 0, 0, 0);
+    churnbench_record(t, CHURNBENCH_PLAY, t_start, hr);
+    atomic_fetch_add_explicit(&t->ncycles, 1, memory_order_relaxed);
+
+    if (cb->lifetime_ticks == 0) {
+        t_start = churnbench_now();
+        IDirectSoundBuffer_Release(buf);
+        churnbench_record(t, CHURNBENCH_RELEASE, t_start, S_OK);
+
+        return true;
+    }
+
+    i = (t->live_head + t->nlive) % CHURNBENCH_MAX_LIVE;
+    t->live[i] = buf;
+    t->release_at[i] = now + cb->lifetime_ticks;
+    t->nlive++;
+
+    return true;
+}
+
+static void churnbench_release_oldest(struct churnbench_thread *t)
+{
+    int64_t t_start;
+
+    assert(t->nlive > 0);
+
+    t_start = churnbench_now();
+    IDirectSoundBuffer_Release(t->live[t->live_head]);
+    churnbench_record(t, CHURNBENCH_RELEASE, t_start, S_OK);
+    t->live_head = (t->live_head + 1) % CHURNBENCH_MAX_LIVE;
+    t->nlive--;
+}
+
+static void churnbench_record(
+        struct churnbench_thread *t,
+        enum churnbench_call call,
+        int64_t t_start,
+        HRESULT hr)
+{
+    struct churnbench_stat *stat;
+    uint64_t ticks;
+    uint64_t ns;
+    size_t bucket;
+
+    ticks = churnbench_now() - t_start;
+    ns = (uint64_t) (ticks * (1e9 / t->cb->freq));
+    stat = &t->stats[call];
+    bucket = 0;
+
+    while (bucket < CHURNBENCH_NBUCKETS - 1 &&
+            ns >= ((uint64_t) CHURNBENCH_BUCKET0_NS << bucket)) {
+        bucket++;
+    }
+
+    stat->ncalls++;
+    stat->ticks += ticks;
+    stat->hist[bucket]++;
+
+    if (FAILED(hr)) {
+        stat->nfailed++;
+    }
+
+    if (ticks > stat->ticks_max) {
+        stat->ticks_max = ticks;
+    }
+}
+
+static void churnbench_sample(
+        struct churnbench *cb,
+        struct churnbench_sample *out)
+{
+    PROCESS_MEMORY_COUNTERS_EX mem;
+    struct perfstat_block block;
+    size_t i;
+
+    memset(out, 0, sizeof(*out));
+
+    for (i = 0 ; i < cb->nthreads ; i++) {
+        out->ncycles += atomic_load_explicit(
+                &cb->threads[i].ncycles,
+                memory_order_relaxed);
+    }
+
+    if (churnbench_snapshot(cb, &block)) {
+        out->nvoices = block.nvoices;
+        out->reaper_backlog = block.reaper_backlog;
+    }
+
+    memset(&mem, 0, sizeof(mem));
+    mem.cb = sizeof(mem);
+
+    if (GetProcessMemoryInfo(
+            GetCurrentProcess(),
+            (PROCESS_MEMORY_COUNTERS *) &mem,
+            sizeof(mem))) {
+        out->private_nbytes = mem.PrivateUsage;
+        out->peak_private_nbytes = mem.PeakPagefileUsage;
+        out->working_set_nbytes = mem.WorkingSetSize;
+        out->peak_working_set_nbytes = mem.PeakWorkingSetSize;
+    }
+}
+
+static bool churnbench_snapshot(
+        struct churnbench *cb,
+        struct perfstat_block *out)
+{
+    const struct perfstat_block *shared;
+    char name[64];
+    unsigned int seq;
+    unsigned int i;
+
+    /*  The engine publishes its counters once it is running, which may be
+        a little after it was created */
+
+    if (cb->shared == NULL) {
+        snprintf(
+                name,
+                sizeof(name),
+                PERFSTAT_NAME_FORMAT,
+                (unsigned long) GetCurrentProcessId());
+        cb->section = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+
+        if (cb->section == NULL) {
+            return false;
+        }
+
+        shared = MapViewOfFile(cb->section, FILE_MAP_READ, 0, 0, 0);
+
+        if (    shared == NULL ||
+                shared->magic != PERFSTAT_MAGIC ||
+                shared->version < PERFSTAT_VERSION ||
+                shared->size < sizeof(*shared)) {
+            if (shared != NULL) {
+                UnmapViewOfFile(shared);
+            }
+
+            CloseHandle(cb->section);
+            cb->section = NULL;
+
+            return false;
+        }
+
+        cb->shared = shared;
+    }
+
+    shared = cb->shared;
+
+    for (i = 0 ; i < CHURNBENCH_NRETRIES ; i++) {
+        seq = atomic_load_explicit(
+                (atomic_uint *) &shared->seq,
+                memory_order_acquire);
+
+        if (seq % 2 == 0) {
+            memcpy(out, shared, sizeof(*out));
+            atomic_thread_fence(memory_order_acquire);
+
+            if (atomic_load_explicit(
+                    (atomic_uint *) &shared->seq,
+                    memory_order_relaxed) == seq) {
+                return true;
+            }
+        }
+
+        Sleep(0);
+    }
+
+    return false;
+}
+
+static void churnbench_report(
+        const struct churnbench *cb,
+        const struct churnbench_sample *start,
+        const struct churnbench_sample *end,
+        uint32_t backlog_max,
+        uint64_t run_ms,
+        uint64_t drain_ms,
+        bool drained)
+{
+    struct churnbench_stat totals[CHURNBENCH_NCALLS];
+    const struct churnbench_stat *stat;
+    struct churnbench_sample last;
+    size_t i;
+    size_t j;
+    size_t k;
+
+    memset(totals, 0, sizeof(totals));
+
+    for (i = 0 ; i < cb->nthreads ; i++) {
+        for (j = 0 ; j < CHURNBENCH_NCALLS ; j++) {
+            stat = &cb->threads[i].stats[j];
+            totals[j].ncalls += stat->ncalls;
+            totals[j].nfailed += stat->nfailed;
+            totals[j].ticks += stat->ticks;
+
+            if (stat->ticks_max > totals[j].ticks_max) {
+                totals[j].ticks_max = stat->ticks_max;
+            }
+
+            for (k = 0 ; k < CHURNBENCH_NBUCKETS ; k++) {
+                totals[j].hist[k] += stat->hist[k];
+            }
+        }
+    }
+
+    /*  The percentiles are the upper edges of histogram buckets, so they
+        are upper bounds to within a factor of two */
+
+    printf( "\n%-20s %9s %7s %9s %9s %9s %9s\n",
+            "call",
+            "count",
+            "failed",
+            "mean us",
+            "p50 us",
+            "p99 us",
+            "max us");
+
+    for (j = 0 ; j < CHURNBENCH_NCALLS ; j++) {
+        stat = &totals[j];
+        printf( "%-20s %9llu %7llu %9.1f %9.1f %9.1f %9.1f\n",
+                churnbench_call_names[j],
+                (unsigned long long) stat->ncalls,
+                (unsigned long long) stat->nfailed,
+                stat->ncalls > 0
+                    ? stat->ticks * 1e6 / cb->freq / stat->ncalls
+                    : 0,
+                churnbench_percentile(stat, 50),
+                churnbench_percentile(stat, 99),
+                stat->ticks_max * 1e6 / cb->freq);
+    }
+
+    printf( "\n%llu cycles in %.1f s, %.0f per second\n",
+            (unsigned long long) end->ncycles,
+            run_ms / 1000.0,
+            end->ncycles * 1000.0 / (run_ms > 0 ? run_ms : 1));
+    printf( "Reaper backlog: %u at start, %u at most, %u at end "
+            "(%+.1f per second)\n",
+            start->reaper_backlog,
+            backlog_max,
+            end->reaper_backlog,
+            ((double) end->reaper_backlog - start->reaper_backlog) *
+                1000.0 / (run_ms > 0 ? run_ms : 1));
+
+    if (cb->shared == NULL) {
+        printf( "No performance counters from the engine; is "
+                "HYPERSONIK_PERFSTAT off?\n");
+    } else if (drained) {
+        printf( "Reaper caught up %llu ms after the last release\n",
+                (unsigned long long) drain_ms);
+    } else {
+        printf( "Reaper had not caught up %llu ms after the last release\n",
+                (unsigned long long) drain_ms);
+    }
+
+    /*  Taken again now that the reaper has had its chance to free
+        everything, to show what did not come back */
+
+    churnbench_sample((struct churnbench *) cb, &last);
+
+    printf( "Private memory: %.1f MB at start, %.1f MB peak, "
+            "%.1f MB at end\n",
+            start->private_nbytes / 1048576.0,
+            last.peak_private_nbytes / 1048576.0,
+            last.private_nbytes / 1048576.0);
+    printf( "Working set: %.1f MB at start, %.1f MB peak, %.1f MB at end\n",
+            start->working_set_nbytes / 1048576.0,
+            last.peak_working_set_nbytes / 1048576.0,
+            last.working_set_nbytes / 1048576.0);
+}
+
+static double churnbench_percentile(
+        const struct churnbench_stat *stat,
+        unsigned int pct)
+{
+    uint64_t target;
+    uint64_t n;
+    size_t i;
+
+    target = (stat->ncalls * pct + 99) / 100;
+    n = 0;
+
+    for (i = 0 ; i < CHURNBENCH_NBUCKETS - 1 ; i++) {
+        n += stat->hist[i];
+
+        if (n >= target) {
+            break;
+        }
+    }
+
+    return ((uint64_t) CHURNBENCH_BUCKET0_NS << i) / 1000.0;
+}
+
+static int64_t churnbench_now(void)
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+
+    return now.QuadPart;
+}
@@ -0,0 +1,1001 @@
+/*  Measure how the command queues hold up with many threads submitting.
+
+    Usage: cmdbench [-c] [-b BURST] [-d DESIGN] [-n THREADS] [-p PERIOD]
+                    [-r RATE] [-t MSEC]
+
+    THREADS producers (default: a sweep of 1, 2, 4, 8 and 16) each submit
+    BURST commands (default 32) at the start of every period, while a
+    consumer takes them in and hands them back for reuse once per period of
+    PERIOD frames at RATE Hz (default 480 at 48000), as the audio thread
+    does. Each point runs for MSEC milliseconds (default 1000). -c prints
+    comma-separated values instead.
+
+    DESIGN is the queue under test. "service" is the real thing: a client
+    and a stream per producer, volume changes through snd_client_cmd_alloc
+    and snd_client_cmd_submit, and snd_service_intake and _exhaust on the
+    consumer side. "mutex" is the same traffic through a list under a lock,
+    for comparison. The default is to run both. Another design only needs
+    another entry in cmdbench_designs.
+
+    Reported are the rate at which commands went in while producers were
+    bursting, how many retries that took per thousand commands on either
+    side (failed CAS attempts, or for "mutex", lock attempts that found the
+    lock taken), the time each producer spent allocating and submitting one
+    command, and the time the consumer spent draining the queue each
+    period. */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "defs.h"
+#include "snd-buffer.h"
+#include "snd-mixer.h"
+#include "snd-service.h"
+#include "snd-stream.h"
+
+#define CMDBENCH_MAX_PRODUCERS 64
+#define CMDBENCH_SOUND_NFRAMES 4800
+#define CMDBENCH_NWARMUP 10
+
+struct cmdbench;
+struct cmdbench_producer;
+
+/*  An item in the "mutex" design's queues, standing in for a command */
+
+struct cmdbench_item {
+    struct cmdbench_item *next;
+    struct snd_stream *stm;
+    uint16_t value;
+};
+
+struct cmdbench_design {
+    const char *name;
+    int (*init)(struct cmdbench *b);
+    void (*fini)(struct cmdbench *b);
+    int (*producer_init)(struct cmdbench *b, struct cmdbench_producer *p);
+    void (*producer_fini)(struct cmdbench_producer *p);
+    int (*submit)(struct cmdbench_producer *p, uint16_t value);
+    void (*drain)(struct cmdbench *b);
+    unsigned int (*producer_nretries)(const struct cmdbench_producer *p);
+    unsigned int (*consumer_nretries)(const struct cmdbench *b);
+};
+
+struct cmdbench_producer {
+    struct cmdbench *b;
+    pthread_t thread;
+    bool started;
+    struct snd_client *cli;
+    struct snd_stream *stm;
+    unsigned int mq_nretries;
+    unsigned int nretries;
+    uint64_t *submit_ns;
+    size_t nsamples;
+    size_t max_samples;
+    uint64_t *burst_start;
+    uint64_t *burst_end;
+    size_t ncycles;
+    size_t ncmds;
+    int r;
+};
+
+struct cmdbench {
+    const struct cmdbench_design *design;
+    struct cmdbench_producer producers[CMDBENCH_MAX_PRODUCERS];
+    size_t nproducers;
+    size_t burst;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int cycle;
+    bool stop;
+
+    /* "service" */
+    struct snd_service *svc;
+    struct snd_mixer *mixer;
+    struct snd_buffer *sound;
+
+    /* "mutex" */
+    pthread_mutex_t mq_lock;
+    struct cmdbench_item *mq_pending;
+    struct cmdbench_item *mq_free;
+    unsigned int mq_nretries;
+    size_t mq_napplied;
+    unsigned int mq_sink;
+};
+
+static void cmdbench_usage(void);
+static int cmdbench_point(
+        const struct cmdbench_design *design,
+        size_t nproducers,
+        size_t burst,
+        size_t period,
+        unsigned int rate,
+        uint64_t run_ns,
+        bool csv);
+static void *cmdbench_producer_main(void *ctx);
+static void cmdbench_report(
+        const struct cmdbench *b,
+        uint64_t *drain_ns,
+        size_t ncycles,
+        unsigned int consumer_nretries,
+        bool csv);
+static uint64_t cmdbench_percentile(
+        const uint64_t *sorted,
+        size_t n,
+        unsigned int pct);
+static int cmdbench_compare(const void *a, const void *b);
+static void cmdbench_sleep_until(uint64_t deadline);
+static uint64_t cmdbench_now(void);
+
+static int cmdbench_service_init(struct cmdbench *b);
+static void cmdbench_service_fini(struct cmdbench *b);
+static int cmdbench_service_producer_init(
+        struct cmdbench *b,
+        struct cmdbench_producer *p);
+static void cmdbench_service_producer_fini(struct cmdbench_producer *p);
+static int cmdbench_service_submit(
+        struct cmdbench_producer *p,
+        uint16_t value);
+static void cmdbench_service_drain(struct cmdbench *b);
+static unsigned int cmdbench_service_producer_nretries(
+        const struct cmdbench_producer *p);
+static unsigned int cmdbench_service_consumer_nretries(
+        const struct cmdbench *b);
+
+static int cmdbench_mutex_init(struct cmdbench *b);
+static void cmdbench_mutex_fini(struct cmdbench *b);
+static int cmdbench_mutex_producer_init(
+        struct cmdbench *b,
+        struct cmdbench_producer *p);
+static void cmdbench_mutex_producer_fini(struct cmdbench_producer *p);
+static int cmdbench_mutex_submit(struct cmdbench_producer *p, uint16_t value);
+static void cmdbench_mutex_drain(struct cmdbench *b);
+static unsigned int cmdbench_mutex_producer_nretries(
+        const struct cmdbench_producer *p);
+static unsigned int cmdbench_mutex_consumer_nretries(
+        const struct cmdbench *b);
+static void cmdbench_mutex_lock(pthread_mutex_t *lock, unsigned int *nretries);
+
+static const struct cmdbench_design cmdbench_designs[] = {
+    {
+        .name = "service",
+        .init = cmdbench_service_init,
+        .fini = cmdbench_service_fini,
+        .producer_init = cmdbench_service_producer_init,
+        .producer_fini = cmdbench_service_producer_fini,
+        .submit = cmdbench_service_submit,
+        .drain = cmdbench_service_drain,
+        .producer_nretries = cmdbench_service_producer_nretries,
+        .consumer_nretries = cmdbench_service_consumer_nretries,
+    },
+    {
+        .name = "mutex",
+        .init = cmdbench_mutex_init,
+        .fini = cmdbench_mutex_fini,
+        .producer_init = cmdbench_mutex_producer_init,
+        .producer_fini = cmdbench_mutex_producer_fini,
+        .submit = cmdbench_mutex_submit,
+        .drain = cmdbench_mutex_drain,
+        .producer_nretries = cmdbench_mutex_producer_nretries,
+        .consumer_nretries = cmdbench_mutex_consumer_nretries,
+    },
+};
+
+static const size_t cmdbench_nproducers[] = {
+    1, 2, 4, 8, 16,
+};
+
+int main(int argc, char **argv)
+{
+    const struct cmdbench_design *design;
+    const char *design_name;
+    unsigned long nproducers;
+    unsigned long burst;
+    unsigned long period;
+    unsigned long rate;
+    unsigned long msec;
+    size_t i;
+    size_t j;
+    bool found;
+    bool csv;
+    int argi;
+    int r;
+
+    csv = false;
+    design_name = NULL;
+    nproducers = 0;
+    burst = 32;
+    period = 480;
+    rate = 48000;
+    msec = 1000;
+
+    for (argi = 1 ; argi < argc && argv[argi][0] == '-' ; argi++) {
+        if (strcmp(argv[argi], "-c") == 0) {
+            csv = true;
+        } else if (strcmp(argv[argi], "-b") == 0 && argi + 1 < argc) {
+            burst = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-d") == 0 && argi + 1 < argc) {
+            design_name = argv[++argi];
+        } else if (strcmp(argv[argi], "-n") == 0 && argi + 1 < argc) {
+            nproducers = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-p") == 0 && argi + 1 < argc) {
+            period = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-r") == 0 && argi + 1 < argc) {
+            rate = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc) {
+            msec = strtoul(argv[++argi], NULL, 10);
+        } else {
+            cmdbench_usage();
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (    argi != argc ||
+            burst == 0 ||
+            period == 0 ||
+            rate == 0 ||
+            msec == 0 ||
+            nproducers > CMDBENCH_MAX_PRODUCERS) {
+        cmdbench_usage();
+
+        return EXIT_FAILURE;
+    }
+
+    found = false;
+
+    for (i = 0 ; i < lengthof(cmdbench_designs) ; i++) {
+        if (    design_name != NULL &&
+                strcmp(design_name, cmdbench_designs[i].name) == 0) {
+            found = true;
+        }
+    }
+
+    if (design_name != NULL && !found) {
+        fprintf(stderr, "Unknown queue design \"%s\"\n", design_name);
+
+        return EXIT_FAILURE;
+    }
+
+    if (csv) {
+        printf( "design,producers,burst,cmds,mcmds_per_s,"
+                "producer_retries_per_kcmd,consumer_retries_per_kcmd,"
+                "submit_p50_ns,submit_p99_ns,submit_max_ns,"
+                "drain_mean_us,drain_p99_us,drain_max_us\n");
+    } else {
+        printf( "%-8s %4s %9s %8s %9s %9s %7s %7s %8s %8s %8s %8s\n",
+                "design",
+                "thrd",
+                "cmds",
+                "Mcmd/s",
+                "retry/k",
+                "c-retry/k",
+                "p50 ns",
+                "p99 ns",
+                "max ns",
+                "drain us",
+                "p99 us",
+                "max us");
+    }
+
+    for (i = 0 ; i < lengthof(cmdbench_designs) ; i++) {
+        design = &cmdbench_designs[i];
+
+        if (design_name != NULL && strcmp(design_name, design->name) != 0) {
+            continue;
+        }
+
+        for (j = 0 ; j < lengthof(cmdbench_nproducers) ; j++) {
+            r = cmdbench_point(
+                    design,
+                    nproducers > 0 ? nproducers : cmdbench_nproducers[j],
+                    burst,
+                    period,
+                    (unsigned int) rate,
+                    (uint64_t) msec * 1000000,
+                    csv);
+
+            if (r < 0) {
+                fprintf(stderr, "Benchmark failed: %s\n", strerror(-r));
+
+                return EXIT_FAILURE;
+            }
+
+            if (nproducers > 0) {
+                break;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void cmdbench_usage(void)
+{
+    fprintf(stderr,
+            "Usage: cmdbench [-c] [-b BURST] [-d DESIGN] [-n THREADS] "
+            "[-p PERIOD]\n"
+            "                [-r RATE] [-t MSEC]\n");
+}
+
+static int cmdbench_point(
+        const struct cmdbench_design *design,
+        size_t nproducers,
+        size_t burst,
+        size_t period,
+        unsigned int rate,
+        uint64_t run_ns,
+        bool csv)
+{
+    struct cmdbench_producer *p;
+    struct cmdbench *b;
+    uint64_t *drain_ns;
+    uint64_t period_ns;
+    uint64_t deadline;
+    uint64_t t;
+    unsigned int consumer_nretries;
+    size_t ncycles;
+    size_t cycle;
+    size_t i;
+    bool initialized;
+    int r;
+
+    assert(design != NULL);
+    assert(nproducers > 0 && nproducers <= CMDBENCH_MAX_PRODUCERS);
+
+    drain_ns = NULL;
+    consumer_nretries = 0;
+    initialized = false;
+    period_ns = (uint64_t) period * 1000000000 / rate;
+    ncycles = run_ns / period_ns + 1;
+    b = calloc(1, sizeof(*b));
+
+    if (b == NULL) {
+        r = -ENOMEM;
+
+        goto end;
+    }
+
+    b->design = design;
+    b->nproducers = nproducers;
+    b->burst = burst;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    drain_ns = calloc(ncycles, sizeof(*drain_ns));
+
+    if (drain_ns == NULL) {
+        r = -ENOMEM;
+
+        goto end;
+    }
+
+    initialized = true;
+    r = design->init(b);
+
+    if (r < 0) {
+        goto end;
+    }
+
+    for (i = 0 ; i < nproducers ; i++) {
+        p = &b->producers[i];
+        p->b = b;
+        p->max_samples = ncycles * burst;
+        p->ncycles = ncycles;
+        p->submit_ns = calloc(p->max_samples, sizeof(*p->submit_ns));
+        p->burst_start = calloc(ncycles, sizeof(*p->burst_start));
+        p->burst_end = calloc(ncycles, sizeof(*p->burst_end));
+
+        if (    p->submit_ns == NULL ||
+                p->burst_start == NULL ||
+                p->burst_end == NULL) {
+            r = -ENOMEM;
+
+            goto end;
+        }
+
+        r = design->producer_init(b, p);
+
+        if (r < 0) {
+            goto end;
+        }
+    }
+
+    for (i = 0 ; i < nproducers ; i++) {
+        p = &b->producers[i];
+
+        if (pthread_create(&p->thread, NULL, cmdbench_producer_main, p)) {
+            r = -EAGAIN;
+
+            goto end;
+        }
+
+        p->started = true;
+    }
+
+    /*  Let the pools and the caches settle before anything is counted. The
+        producers start recording at the same cycle. */
+
+    deadline = cmdbench_now();
+
+    for (cycle = 0 ; cycle < CMDBENCH_NWARMUP + ncycles ; cycle++) {
+        deadline += period_ns;
+        cmdbench_sleep_until(deadline);
+
+        if (cycle == CMDBENCH_NWARMUP) {
+            consumer_nretries = design->consumer_nretries(b);
+        }
+
+        pthread_mutex_lock(&b->lock);
+        b->cycle++;
+        pthread_cond_broadcast(&b->cond);
+        pthread_mutex_unlock(&b->lock);
+
+        t = cmdbench_now();
+        design->drain(b);
+
+        if (cycle >= CMDBENCH_NWARMUP) {
+            drain_ns[cycle - CMDBENCH_NWARMUP] = cmdbench_now() - t;
+        }
+    }
+
+    consumer_nretries = design->consumer_nretries(b) - consumer_nretries;
+
+end:
+    if (b != NULL) {
+        pthread_mutex_lock(&b->lock);
+        b->stop = true;
+        pthread_cond_broadcast(&b->cond);
+        pthread_mutex_unlock(&b->lock);
+
+        for (i = 0 ; i < nproducers ; i++) {
+            p = &b->producers[i];
+
+            if (p->started) {
+                pthread_join(p->thread, NULL);
+
+                if (r == 0 && p->r < 0) {
+                    r = p->r;
+                }
+            }
+        }
+
+        if (r == 0) {
+            /*  Take in the last burst, so that the rest of the commands
+                are back in the pool when the producers let go of it */
+
+            design->drain(b);
+            cmdbench_report(b, drain_ns, ncycles, consumer_nretries, csv);
+        }
+
+        for (i = 0 ; i < nproducers ; i++) {
+            p = &b->producers[i];
+
+            if (initialized) {
+                design->producer_fini(p);
+            }
+
+            free(p->submit_ns);
+            free(p->burst_start);
+            free(p->burst_end);
+        }
+
+        if (initialized) {
+            design->fini(b);
+        }
+
+        pthread_cond_destroy(&b->cond);
+        pthread_mutex_destroy(&b->lock);
+    }
+
+    free(drain_ns);
+    free(b);
+
+    return r;
+}
+
+static void *cmdbench_producer_main(void *ctx)
+{
+    struct cmdbench_producer *p;
+    struct cmdbench *b;
+    unsigned int cycle;
+    unsigned int nretries;
+    uint64_t t_burst;
+    uint64_t t;
+    uint64_t dt;
+    size_t k;
+    size_t i;
+    int r;
+
+    p = ctx;
+    b = p->b;
+    cycle = 0;
+    nretries = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+
+        while (!b->stop && b->cycle == cycle) {
+            pthread_cond_wait(&b->cond, &b->lock);
+        }
+
+        /* Finish the last cycle before stopping */
+
+        if (b->cycle == cycle) {
+            pthread_mutex_unlock(&b->lock);
+
+            break;
+        }
+
+        cycle = b->cycle;
+        pthread_mutex_unlock(&b->lock);
+
+        if (cycle == CMDBENCH_NWARMUP + 1) {
+            nretries = b->design->producer_nretries(p);
+        }
+
+        t_burst = cmdbench_now();
+
+        for (i = 0 ; i < b->burst ; i++) {
+            t = cmdbench_now();
+            r = b->design->submit(p, (uint16_t) ((cycle + i) & 0xff));
+            dt = cmdbench_now() - t;
+
+            if (r < 0) {
+                p->r = r;
+
+                return NULL;
+            }
+
+            if (cycle > CMDBENCH_NWARMUP && p->nsamples < p->max_samples) {
+                p->submit_ns[p->nsamples++] = dt;
+            }
+        }
+
+        /*  A producer that falls behind skips cycles rather than
+            bursting twice in one */
+
+        if (cycle > CMDBENCH_NWARMUP) {
+            k = cycle - CMDBENCH_NWARMUP - 1;
+            assert(k < p->ncycles);
+            p->burst_start[k] = t_burst;
+            p->burst_end[k] = cmdbench_now();
+            p->ncmds += b->burst;
+        }
+    }
+
+    p->nretries = b->design->producer_nretries(p) - nretries;
+
+    return NULL;
+}
+
+static void cmdbench_report(
+        const struct cmdbench *b,
+        uint64_t *drain_ns,
+        size_t ncycles,
+        unsigned int consumer_nretries,
+        bool csv)
+{
+    const struct cmdbench_producer *p;
+    uint64_t *submit_ns;
+    uint64_t burst_ns;
+    uint64_t start;
+    uint64_t end;
+    uint64_t drain_total;
+    uint64_t nretries;
+    double mcmds_per_s;
+    double retries_per_kcmd;
+    double consumer_retries_per_kcmd;
+    size_t nsamples;
+    size_t ncmds;
+    size_t i;
+    size_t k;
+
+    /*  Pool every producer's samples to get the percentiles */
+
+    nsamples = 0;
+    ncmds = 0;
+    nretries = 0;
+
+    for (i = 0 ; i < b->nproducers ; i++) {
+        p = &b->producers[i];
+        nsamples += p->nsamples;
+        ncmds += p->ncmds;
+        nretries += p->nretries;
+    }
+
+    /*  Commands went in while any producer was bursting, which in each
+        cycle is from the first burst starting to the last one ending */
+
+    burst_ns = 0;
+
+    for (k = 0 ; k < ncycles ; k++) {
+        start = UINT64_MAX;
+        end = 0;
+
+        for (i = 0 ; i < b->nproducers ; i++) {
+            p = &b->producers[i];
+
+            if (p->burst_end[k] == 0) {
+                continue;
+            }
+
+            if (p->burst_start[k] < start) {
+                start = p->burst_start[k];
+            }
+
+            if (p->burst_end[k] > end) {
+                end = p->burst_end[k];
+            }
+        }
+
+        if (end > 0) {
+            burst_ns += end - start;
+        }
+    }
+
+    submit_ns = malloc((nsamples > 0 ? nsamples : 1) * sizeof(*submit_ns));
+
+    if (submit_ns == NULL) {
+        fprintf(stderr, "Out of memory for the report\n");
+
+        return;
+    }
+
+    nsamples = 0;
+
+    for (i = 0 ; i < b->nproducers ; i++) {
+        p = &b->producers[i];
+        memcpy(&submit_ns[nsamples],
+                p->submit_ns,
+                p->nsamples * sizeof(*submit_ns));
+        nsamples += p->nsamples;
+    }
+
+    qsort(submit_ns, nsamples, sizeof(*submit_ns), cmdbench_compare);
+
+    drain_total = 0;
+
+    for (i = 0 ; i < ncycles ; i++) {
+        drain_total += drain_ns[i];
+    }
+
+    qsort(drain_ns, ncycles, sizeof(*drain_ns), cmdbench_compare);
+
+    mcmds_per_s = burst_ns > 0 ? ncmds * 1e3 / burst_ns : 0;
+    retries_per_kcmd = ncmds > 0 ? nretries * 1e3 / ncmds : 0;
+    consumer_retries_per_kcmd = ncmds > 0
+            ? consumer_nretries * 1e3 / ncmds
+            : 0;
+
+    if (csv) {
+        printf( "%s,%u,%u,%u,",
+                b->design->name,
+                (unsigned int) b->nproducers,
+                (unsigned int) b->burst,
+                (unsigned int) ncmds);
+    } else {
+        printf( "%-8s %4u %9u ",
+                b->design->name,
+                (unsigned int) b->nproducers,
+                (unsigned int) ncmds);
+    }
+
+    printf( csv
+                ? "%.2f,%.2f,%.2f,%llu,%llu,%llu,%.1f,%.1f,%.1f\n"
+                : "%8.2f %9.2f %9.2f %7llu %7llu %8llu %8.1f %8.1f %8.1f\n",
+            mcmds_per_s,
+            retries_per_kcmd,
+            consumer_retries_per_kcmd,
+            (unsigned long long) cmdbench_percentile(submit_ns, nsamples, 50),
+            (unsigned long long) cmdbench_percentile(submit_ns, nsamples, 99),
+            (unsigned long long) cmdbench_percentile(submit_ns, nsamples, 100),
+            drain_total / 1e3 / ncycles,
+            cmdbench_percentile(drain_ns, ncycles, 99) / 1e3,
+            cmdbench_percentile(drain_ns, ncycles, 100) / 1e3);
+
+    free(submit_ns);
+}
+
+static uint64_t cmdbench_percentile(
+        const uint64_t *sorted,
+        size_t n,
+        unsigned int pct)
+{
+    size_t i;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    i = (n * pct + 99) / 100;
+
+    return sorted[i > 0 ? i - 1 : 0];
+}
+
+static int cmdbench_compare(const void *a, const void *b)
+{
+    uint64_t x;
+    uint64_t y;
+
+    x = *(const uint64_t *) a;
+    y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void cmdbench_sleep_until(uint64_t deadline)
+{
+#ifdef _WIN32
+    uint64_t now;
+
+    now = cmdbench_now();
+
+    if (deadline > now) {
+        Sleep((DWORD) ((deadline - now) / 1000000));
+    }
+#else
+    struct timespec ts;
+
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+            EINTR);
+#endif
+}
+
+static uint64_t cmdbench_now(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+
+    QueryPerformanceCounter(&now);
+
+    return (uint64_t) (now.QuadPart * (1e9 / freq.QuadPart));
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+static int cmdbench_service_init(struct cmdbench *b)
+{
+    int r;
+
+    r = snd_service_alloc(&b->svc);
+
+    if (r < 0) {
+        return r;
+    }
+
+    /*  Enough recycled commands for each producer to burst from, and no
+        limit on how many the consumer takes in per period, so that neither
+        gets in the way of measuring the queues themselves. */
+
+    snd_service_set_pool_limits(b->svc, b->burst, 2 * b->burst);
+    snd_service_set_intake_budget(b->svc, 0);
+
+    r = snd_mixer_alloc(&b->mixer, 256, 2, SND_FORMAT_S16);
+
+    if (r < 0) {
+        return r;
+    }
+
+    r = snd_mixer_configure(b->mixer, 256, 1);
+
+    if (r < 0) {
+        return r;
+    }
+
+    return snd_buffer_alloc(&b->sound, CMDBENCH_SOUND_NFRAMES * 2);
+}
+
+static void cmdbench_service_fini(struct cmdbench *b)
+{
+    snd_buffer_free(b->sound);
+    snd_mixer_free(b->mixer);
+    snd_service_free(b->svc);
+}
+
+static int cmdbench_service_producer_init(
+        struct cmdbench *b,
+        struct cmdbench_producer *p)
+{
+    int r;
+
+    r = snd_client_alloc(&p->cli, b->svc);
+
+    if (r < 0) {
+        return r;
+    }
+
+    return snd_stream_alloc(&p->stm, b->sound);
+}
+
+static void cmdbench_service_producer_fini(struct cmdbench_producer *p)
+{
+    if (p->stm != NULL) {
+        snd_mixer_stop(p->b->mixer, p->stm);
+        snd_stream_free(p->stm);
+    }
+
+    snd_client_free(p->cli);
+}
+
+static int cmdbench_service_submit(
+        struct cmdbench_producer *p,
+        uint16_t value)
+{
+    struct snd_command *cmd;
+    int r;
+
+    r = snd_client_cmd_alloc(p->cli, &cmd);
+
+    if (r < 0) {
+        return r;
+    }
+
+    snd_command_set_volume(cmd, p->stm, value & 1, value);
+    snd_client_cmd_submit(p->cli, cmd);
+
+    return 0;
+}
+
+static void cmdbench_service_drain(struct cmdbench *b)
+{
+    snd_service_intake(b->svc, b->mixer);
+    snd_service_exhaust(b->svc);
+}
+
+static unsigned int cmdbench_service_producer_nretries(
+        const struct cmdbench_producer *p)
+{
+    return snd_client_get_nretries(p->cli);
+}
+
+static unsigned int cmdbench_service_consumer_nretries(
+        const struct cmdbench *b)
+{
+    struct snd_service_stats stats;
+
+    snd_service_get_stats(b->svc, &stats);
+
+    return stats.nretries;
+}
+
+static int cmdbench_mutex_init(struct cmdbench *b)
+{
+    pthread_mutex_init(&b->mq_lock, NULL);
+
+    return 0;
+}
+
+static void cmdbench_mutex_fini(struct cmdbench *b)
+{
+    struct cmdbench_item *item;
+
+    while (b->mq_free != NULL) {
+        item = b->mq_free;
+        b->mq_free = item->next;
+        free(item);
+    }
+
+    pthread_mutex_destroy(&b->mq_lock);
+}
+
+static int cmdbench_mutex_producer_init(
+        struct cmdbench *b,
+        struct cmdbench_producer *p)
+{
+    return 0;
+}
+
+static void cmdbench_mutex_producer_fini(struct cmdbench_producer *p)
+{
+}
+
+static int cmdbench_mutex_submit(struct cmdbench_producer *p, uint16_t value)
+{
+    struct cmdbench_item *item;
+    struct cmdbench *b;
+
+    /*  Take an item from the free list, or make one, as with a command */
+
+    b = p->b;
+    cmdbench_mutex_lock(&b->mq_lock, &p->mq_nretries);
+    item = b->mq_free;
+
+    if (item != NULL) {
+        b->mq_free = item->next;
+    }
+
+    pthread_mutex_unlock(&b->mq_lock);
+
+    if (item == NULL) {
+        item = malloc(sizeof(*item));
+
+        if (item == NULL) {
+            return -ENOMEM;
+        }
+    }
+
+    item->stm = p->stm;
+    item->value = value;
+
+    cmdbench_mutex_lock(&b->mq_lock, &p->mq_nretries);
+    item->next = b->mq_pending;
+    b->mq_pending = item;
+    pthread_mutex_unlock(&b->mq_lock);
+
+    return 0;
+}
+
+static void cmdbench_mutex_drain(struct cmdbench *b)
+{
+    struct cmdbench_item *pending;
+    struct cmdbench_item *last;
+    struct cmdbench_item *item;
+
+    cmdbench_mutex_lock(&b->mq_lock, &b->mq_nretries);
+    pending = b->mq_pending;
+    b->mq_pending = NULL;
+    pthread_mutex_unlock(&b->mq_lock);
+
+    if (pending == NULL) {
+        return;
+    }
+
+    /*  Touch every item, as applying a command would */
+
+    last = NULL;
+
+    for (item = pending ; item != NULL ; item = item->next) {
+        b->mq_sink += item->value;
+        b->mq_napplied++;
+        last = item;
+    }
+
+    cmdbench_mutex_lock(&b->mq_lock, &b->mq_nretries);
+    last->next = b->mq_free;
+    b->mq_free = pending;
+    pthread_mutex_unlock(&b->mq_lock);
+}
+
+static unsigned int cmdbench_mutex_producer_nretries(
+        const struct cmdbench_producer *p)
+{
+    return p->mq_nretries;
+}
+
+static unsigned int cmdbench_mutex_consumer_nretries(const struct cmdbench *b)
+{
+    return b->mq_nretries;
+}
+
+static void cmdbench_mutex_lock(pthread_mutex_t *lock, unsigned int *nretries)
+{
+    if (pthread_mutex_trylock(lock) != 0) {
+        (*nretries)++;
+        pthread_mutex_lock(lock);
+    }
+}
@@ -0,0 +1,306 @@
+/*  Watch the performance counters of a running Hypersonik instance.
+
+    Usage: hsperf [-c] [-v] [-i MSEC] [-n COUNT] PID
+
+    Samples the counters of process PID every MSEC milliseconds (default
+    1000), COUNT times or until interrupted, and prints one line per sample.
+    -c prints comma-separated values instead, for logging to a file. -v also
+    lists the call sites whose voices cost the most to mix, whenever the
+    engine has published a new tally of them. */
+
+#include <windows.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "perfstat.h"
+
+#define HSPERF_NRETRIES 1000
+
+static void hsperf_usage(void);
+static bool hsperf_snapshot(
+        const struct perfstat_block *shared,
+        struct perfstat_block *out);
+static void hsperf_print(
+        const struct perfstat_block *prev,
+        const struct perfstat_block *cur,
+        uint64_t t,
+        uint64_t dt,
+        bool csv);
+static void hsperf_print_costs(const struct perfstat_block *cur);
+
+int main(int argc, char **argv)
+{
+    const struct perfstat_block *shared;
+    struct perfstat_block prev;
+    struct perfstat_block cur;
+    unsigned long pid;
+    unsigned long interval;
+    unsigned long count;
+    unsigned long i;
+    uint64_t t_start;
+    uint64_t t_prev;
+    uint64_t t;
+    HANDLE section;
+    char name[64];
+    bool csv;
+    bool verbose;
+    int argi;
+
+    csv = false;
+    verbose = false;
+    interval = 1000;
+    count = 0;
+
+    for (argi = 1 ; argi < argc && argv[argi][0] == '-' ; argi++) {
+        if (strcmp(argv[argi], "-c") == 0) {
+            csv = true;
+        } else if (strcmp(argv[argi], "-v") == 0) {
+            verbose = true;
+        } else if (strcmp(argv[argi], "-i") == 0 && argi + 1 < argc) {
+            interval = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-n") == 0 && argi + 1 < argc) {
+            count = strtoul(argv[++argi], NULL, 10);
+        } else {
+            hsperf_usage();
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argi + 1 != argc || interval == 0) {
+        hsperf_usage();
+
+        return EXIT_FAILURE;
+    }
+
+    pid = strtoul(argv[argi], NULL, 10);
+    snprintf(name, sizeof(name), PERFSTAT_NAME_FORMAT, pid);
+    section = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+
+    if (section == NULL) {
+        fprintf(stderr,
+                "No counters for process %lu (error %lu); is it running "
+                "Hypersonik with HYPERSONIK_PERFSTAT enabled?\n",
+                pid,
+                (unsigned long) GetLastError());
+
+        return EXIT_FAILURE;
+    }
+
+    shared = MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0);
+
+    if (shared == NULL) {
+        fprintf(stderr,
+                "MapViewOfFile failed: %lu\n",
+                (unsigned long) GetLastError());
+
+        return EXIT_FAILURE;
+    }
+
+    /*  Anything newer than us still starts with what we know about */
+
+    if (    shared->magic != PERFSTAT_MAGIC ||
+            shared->version < PERFSTAT_VERSION ||
+            shared->size < sizeof(*shared)) {
+        fprintf(stderr,
+                "%s is not a version %u counter block\n",
+                name,
+                PERFSTAT_VERSION);
+
+        return EXIT_FAILURE;
+    }
+
+    if (!hsperf_snapshot(shared, &prev)) {
+        fprintf(stderr, "Counters are not settling\n");
+
+        return EXIT_FAILURE;
+    }
+
+    t_start = GetTickCount64();
+    t_prev = t_start;
+
+    if (csv) {
+        printf( "t_ms,suspended,mix_rate,device_rate,period,level,"
+                "load_pct,voices,cmds_per_sec,cmd_backlog,intake_us,"
+                "mix_us,underruns,reaper_backlog,sample_bytes,"
+                "convert_ms_per_sec\n");
+    } else {
+        printf( "%9s %5s %4s %6s %8s %7s %9s %9s %6s %6s %9s %8s\n",
+                "time (s)",
+                "state",
+                "load",
+                "voices",
+                "cmds/s",
+                "backlog",
+                "intake us",
+                "mix us",
+                "xruns",
+                "reaper",
+                "samples",
+                "conv ms/s");
+    }
+
+    for (i = 0 ; count == 0 || i < count ; i++) {
+        Sleep(interval);
+
+        if (!hsperf_snapshot(shared, &cur)) {
+            fprintf(stderr, "Counters are not settling\n");
+
+            return EXIT_FAILURE;
+        }
+
+        t = GetTickCount64();
+        hsperf_print(&prev, &cur, t - t_start, t - t_prev, csv);
+
+        if (verbose && !csv && cur.cost_nwindows != prev.cost_nwindows) {
+            hsperf_print_costs(&cur);
+        }
+
+        fflush(stdout);
+        prev = cur;
+        t_prev = t;
+    }
+
+    UnmapViewOfFile(shared);
+    CloseHandle(section);
+
+    return EXIT_SUCCESS;
+}
+
+static void hsperf_usage(void)
+{
+    fprintf(stderr,
+            "Usage: hsperf [-c] [-v] [-i MSEC] [-n COUNT] PID\n");
+}
+
+static bool hsperf_snapshot(
+        const struct perfstat_block *shared,
+        struct perfstat_block *out)
+{
+    unsigned int seq;
+    unsigned int i;
+
+    /*  The engine thread never holds the block for long, so a handful of
+        retries is plenty unless it died half way through an update. */
+
+    for (i = 0 ; i < HSPERF_NRETRIES ; i++) {
+        seq = atomic_load_explicit(
+                (atomic_uint *) &shared->seq,
+                memory_order_acquire);
+
+        if (seq % 2 == 0) {
+            memcpy(out, shared, sizeof(*out));
+            atomic_thread_fence(memory_order_acquire);
+
+            if (atomic_load_explicit(
+                    (atomic_uint *) &shared->seq,
+                    memory_order_relaxed) == seq) {
+                return true;
+            }
+        }
+
+        Sleep(0);
+    }
+
+    return false;
+}
+
+static void hsperf_print(
+        const struct perfstat_block *prev,
+        const struct perfstat_block *cur,
+        uint64_t t,
+        uint64_t dt,
+        bool csv)
+{
+    uint64_t ncycles;
+    uint32_t ncmds;
+    double cmds_per_sec;
+    double intake_us;
+    double mix_us;
+    double convert_ms;
+
+    /*  The command count is only 32 bits wide at the source */
+
+    ncycles = cur->ncycles - prev->ncycles;
+    ncmds = (uint32_t) cur->ncmds_total - (uint32_t) prev->ncmds_total;
+    cmds_per_sec = dt > 0 ? ncmds * 1000.0 / dt : 0.0;
+    intake_us = ncycles > 0
+            ? (cur->intake_ns_total - prev->intake_ns_total) / 1e3 / ncycles
+            : 0.0;
+    mix_us = ncycles > 0
+            ? (cur->mix_ns_total - prev->mix_ns_total) / 1e3 / ncycles
+            : 0.0;
+    convert_ms = dt > 0
+            ? (cur->convert_ns_total - prev->convert_ns_total) / 1e6
+                    * 1000.0 / dt
+            : 0.0;
+
+    if (csv) {
+        printf( "%llu,%u,%u,%u,%u,%u,%u,%u,%.1f,%u,%.2f,%.2f,%llu,%u,"
+                "%llu,%.3f\n",
+                (unsigned long long) t,
+                cur->suspended,
+                cur->mix_rate,
+                cur->device_rate,
+                cur->period,
+                cur->level,
+                cur->load_pct,
+                cur->nvoices,
+                cmds_per_sec,
+                cur->cmd_backlog,
+                intake_us,
+                mix_us,
+                (unsigned long long) cur->nunderruns_total,
+                cur->reaper_backlog,
+                (unsigned long long) cur->sample_nbytes,
+                convert_ms);
+    } else {
+        printf( "%9.1f %5s %3u%% %6u %8.0f %7u %9.2f %9.2f %6llu %6u "
+                "%8.1fM %8.3f\n",
+                t / 1000.0,
+                cur->suspended ? "idle" : "run",
+                cur->load_pct,
+                cur->nvoices,
+                cmds_per_sec,
+                cur->cmd_backlog,
+                intake_us,
+                mix_us,
+                (unsigned long long) cur->nunderruns_total,
+                cur->reaper_backlog,
+                cur->sample_nbytes / 1048576.0,
+                convert_ms);
+    }
+}
+
+static void hsperf_print_costs(const struct perfstat_block *cur)
+{
+    const struct perfstat_voice_cost *c;
+    double window_ns;
+    uint32_t i;
+
+    window_ns = cur->cost_window_ms * 1e6;
+
+    if (window_ns <= 0) {
+        return;
+    }
+
+    for (i = 0 ; i < cur->ncosts && i < PERFSTAT_NCOSTS ; i++) {
+        c = &cur->costs[i];
+
+        if (c->tag != 0) {
+            printf("  %#18llx", (unsigned long long) c->tag);
+        } else {
+            printf("  %18s", "(other)");
+        }
+
+        printf( " %8.3f ms/s %9.0f frames/s %4u at once\n",
+                c->ns / window_ns * 1e3,
+                c->nframes / window_ns * 1e9,
+                c->nvoices_max);
+    }
+}
@@ -0,0 +1,997 @@
+/*  Render a scripted scene through the mixer offline, as fast as it will go.
+
+    Usage: hsrender [-t TIMING.csv] SCRIPT OUT.wav
+
+    Drives the command service and the mixer one period at a time, the way
+    the engine thread does, but without a device: each cycle starts as soon
+    as the last one is done. The mix goes to OUT.wav as 16-bit stereo, and
+    -t writes how long each cycle took to TIMING.csv. Given the same script
+    and build, the output is the same bit for bit; the checksum printed at
+    the end makes that easy to compare.
+
+    The script is one directive per line. # starts a comment. Times are
+    frames at the mix rate, or milliseconds with an ms suffix.
+
+        rate HZ                     Mix rate (default 44100)
+        device-rate HZ              Resample the mix to this rate for output
+                                    (default: the mix rate)
+        period FRAMES               Frames per cycle at the device rate
+                                    (default 441)
+        sound NAME FILE             Load a PCM WAV file, 8 or 16-bit, mono or
+                                    stereo, at the mix rate
+        voice NAME SOUND            Create a sound buffer that plays SOUND,
+                                    with its own command client
+        at TIME play VOICE [loop]
+        at TIME stop VOICE
+        at TIME volume VOICE L R    Linear gain, 0 to 256 for unity
+        end TIME                    Stop rendering at TIME
+
+    Commands take effect from the first cycle that starts at or after their
+    time. Without an end, rendering stops once every command has been
+    applied and nothing is playing, so a script that leaves a voice looping
+    needs one. */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "snd-buffer.h"
+#include "snd-mixer.h"
+#include "snd-service.h"
+#include "snd-stream.h"
+
+#define HSRENDER_NAME_MAX 64
+#define HSRENDER_LINE_MAX 1024
+#define HSRENDER_WAV_HEADER_SIZE 44
+
+/*  A script that never goes quiet still has to end somewhere: an hour */
+
+#define HSRENDER_MAX_MSEC (60 * 60 * 1000)
+
+enum hsrender_op {
+    HSRENDER_PLAY,
+    HSRENDER_PLAY_LOOP,
+    HSRENDER_STOP,
+    HSRENDER_VOLUME,
+};
+
+struct hsrender_sound {
+    char name[HSRENDER_NAME_MAX];
+    struct snd_buffer *buf;
+};
+
+struct hsrender_voice {
+    char name[HSRENDER_NAME_MAX];
+    struct snd_client *cli;
+    struct snd_stream *stm;
+};
+
+struct hsrender_event {
+    uint64_t frame;
+    size_t line;
+    size_t voice;
+    enum hsrender_op op;
+    uint16_t volumes[2];
+};
+
+struct hsrender_script {
+    struct hsrender_sound *sounds;
+    size_t nsounds;
+    struct hsrender_voice *voices;
+    size_t nvoices;
+    struct hsrender_event *events;
+    size_t nevents;
+    unsigned int rate;
+    unsigned int device_rate;
+    size_t period;
+    uint64_t end;
+    bool has_end;
+};
+
+static void hsrender_usage(void);
+static int hsrender_load_script(
+        struct hsrender_script *s,
+        struct snd_service *svc,
+        const char *path);
+static int hsrender_parse_line(
+        struct hsrender_script *s,
+        struct snd_service *svc,
+        char *line,
+        size_t line_no);
+static int hsrender_parse_time(
+        const struct hsrender_script *s,
+        const char *str,
+        uint64_t *out);
+static int hsrender_find_sound(
+        const struct hsrender_script *s,
+        const char *name,
+        size_t *out);
+static int hsrender_find_voice(
+        const struct hsrender_script *s,
+        const char *name,
+        size_t *out);
+static int hsrender_compare_events(const void *a, const void *b);
+static void hsrender_free_script(struct hsrender_script *s);
+static int hsrender_submit(
+        const struct hsrender_script *s,
+        const struct hsrender_event *ev);
+static int hsrender_load_wav(
+        struct snd_buffer **out,
+        const char *path,
+        unsigned int rate);
+static void hsrender_write_header(
+        uint8_t *bytes,
+        unsigned int rate,
+        uint32_t nbytes_data);
+static uint16_t hsrender_get_u16(const uint8_t *bytes);
+static uint32_t hsrender_get_u32(const uint8_t *bytes);
+static void hsrender_put_u16(uint8_t *bytes, uint16_t val);
+static void hsrender_put_u32(uint8_t *bytes, uint32_t val);
+static uint64_t hsrender_now(void);
+
+int main(int argc, char **argv)
+{
+    struct hsrender_script script;
+    struct snd_service *svc;
+    struct snd_mixer *mixer;
+    uint8_t header[HSRENDER_WAV_HEADER_SIZE];
+    const char *timing_path;
+    FILE *timing;
+    FILE *out;
+    uint8_t *block;
+    uint64_t checksum;
+    uint64_t max_frames;
+    uint64_t nbytes_data;
+    uint64_t t_start;
+    uint64_t t_intake;
+    uint64_t t_mix;
+    uint64_t t_mixed;
+    uint64_t frame;
+    uint64_t cycle;
+    size_t block_nbytes;
+    size_t next;
+    size_t ncmds;
+    size_t i;
+    double elapsed;
+    int argi;
+    int r;
+
+    timing_path = NULL;
+
+    for (argi = 1 ; argi < argc && argv[argi][0] == '-' ; argi++) {
+        if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc) {
+            timing_path = argv[++argi];
+        } else {
+            hsrender_usage();
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argi + 2 != argc) {
+        hsrender_usage();
+
+        return EXIT_FAILURE;
+    }
+
+    memset(&script, 0, sizeof(script));
+    svc = NULL;
+    mixer = NULL;
+    timing = NULL;
+    out = NULL;
+    block = NULL;
+
+    r = snd_service_alloc(&svc);
+
+    if (r < 0) {
+        goto end;
+    }
+
+    r = hsrender_load_script(&script, svc, argv[argi]);
+
+    if (r < 0) {
+        goto end;
+    }
+
+    r = snd_mixer_alloc(&mixer, script.period, 2, SND_FORMAT_S16);
+
+    if (r >= 0) {
+        r = snd_mixer_set_rates(mixer, script.rate, script.device_rate);
+    }
+
+    if (r >= 0) {
+        r = snd_mixer_configure(mixer, script.period, 1);
+    }
+
+    if (r < 0) {
+        fprintf(stderr, "Mixer setup failed: %s\n", strerror(-r));
+
+        goto end;
+    }
+
+    block_nbytes = snd_mixer_block_size(mixer);
+    block = malloc(block_nbytes);
+
+    if (block == NULL) {
+        r = -ENOMEM;
+
+        goto end;
+    }
+
+    out = fopen(argv[argi + 1], "wb");
+
+    if (out == NULL) {
+        r = -errno;
+        fprintf(stderr, "%s: %s\n", argv[argi + 1], strerror(errno));
+
+        goto end;
+    }
+
+    /*  Sizes are patched in once we know them */
+
+    memset(header, 0, sizeof(header));
+    fwrite(header, sizeof(header), 1, out);
+
+    if (timing_path != NULL) {
+        timing = fopen(timing_path, "w");
+
+        if (timing == NULL) {
+            r = -errno;
+            fprintf(stderr, "%s: %s\n", timing_path, strerror(errno));
+
+            goto end;
+        }
+
+        fprintf(timing, "cycle,frame,voices,commands,intake_ns,mix_ns\n");
+    }
+
+    /*  Cycles are counted in device frames and events in mix frames, so
+        compare the two scaled up to a common rate. */
+
+    max_frames = (uint64_t) script.device_rate * HSRENDER_MAX_MSEC / 1000;
+    checksum = UINT64_C(0xcbf29ce484222325);
+    nbytes_data = 0;
+    next = 0;
+    frame = 0;
+    t_start = hsrender_now();
+
+    for (cycle = 0 ; ; cycle++, frame += script.period) {
+        if (    script.has_end &&
+                frame * script.rate >= script.end * script.device_rate) {
+            break;
+        }
+
+        if (frame >= max_frames) {
+            fprintf(stderr, "Still playing after an hour, giving up\n");
+            r = -ETIMEDOUT;
+
+            goto end;
+        }
+
+        for (   ncmds = 0 ;
+                next < script.nevents &&
+                script.events[next].frame * script.device_rate
+                        <= frame * script.rate ;
+                next++, ncmds++) {
+            r = hsrender_submit(&script, &script.events[next]);
+
+            if (r < 0) {
+                goto end;
+            }
+        }
+
+        t_intake = hsrender_now();
+        snd_service_intake(svc, mixer);
+
+        if (    !script.has_end &&
+                next == script.nevents &&
+                snd_mixer_is_idle(mixer)) {
+            break;
+        }
+
+        t_mix = hsrender_now();
+        snd_mixer_render(mixer, 1);
+        snd_mixer_pop(mixer, block);
+        t_mixed = hsrender_now();
+        snd_service_exhaust(svc);
+
+        if (fwrite(block, block_nbytes, 1, out) != 1) {
+            r = -EIO;
+            fprintf(stderr, "%s: write failed\n", argv[argi + 1]);
+
+            goto end;
+        }
+
+        for (i = 0 ; i < block_nbytes ; i++) {
+            checksum = (checksum ^ block[i]) * UINT64_C(0x100000001b3);
+        }
+
+        nbytes_data += block_nbytes;
+
+        if (timing != NULL) {
+            fprintf(timing,
+                    "%llu,%llu,%u,%u,%llu,%llu\n",
+                    (unsigned long long) cycle,
+                    (unsigned long long) frame,
+                    (unsigned int) snd_mixer_nvoices(mixer),
+                    (unsigned int) ncmds,
+                    (unsigned long long) (t_mix - t_intake),
+                    (unsigned long long) (t_mixed - t_mix));
+        }
+    }
+
+    elapsed = (hsrender_now() - t_start) / 1e9;
+
+    if (nbytes_data > UINT32_MAX - HSRENDER_WAV_HEADER_SIZE) {
+        fprintf(stderr, "Too long for a WAV file\n");
+        r = -EFBIG;
+
+        goto end;
+    }
+
+    hsrender_write_header(header, script.device_rate, (uint32_t) nbytes_data);
+
+    if (    fseek(out, 0, SEEK_SET) != 0 ||
+            fwrite(header, sizeof(header), 1, out) != 1) {
+        r = -EIO;
+        fprintf(stderr, "%s: write failed\n", argv[argi + 1]);
+
+        goto end;
+    }
+
+    printf( "%llu frames in %llu cycles, %.3f s, %.1fx real time\n"
+            "checksum %016llx\n",
+            (unsigned long long) frame,
+            (unsigned long long) cycle,
+            elapsed,
+            elapsed > 0 ? frame / (double) script.device_rate / elapsed : 0,
+            (unsigned long long) checksum);
+    r = 0;
+
+end:
+    if (out != NULL && fclose(out) != 0 && r == 0) {
+        r = -EIO;
+    }
+
+    if (timing != NULL && fclose(timing) != 0 && r == 0) {
+        r = -EIO;
+    }
+
+    free(block);
+
+    /*  Voices still on the mixer's list have to come off it first */
+
+    for (i = 0 ; i < script.nvoices && mixer != NULL ; i++) {
+        snd_mixer_stop(mixer, script.voices[i].stm);
+    }
+
+    snd_mixer_free(mixer);
+    hsrender_free_script(&script);
+    snd_service_free(svc);
+
+    return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void hsrender_usage(void)
+{
+    fprintf(stderr, "Usage: hsrender [-t TIMING.csv] SCRIPT OUT.wav\n");
+}
+
+static int hsrender_load_script(
+        struct hsrender_script *s,
+        struct snd_service *svc,
+        const char *path)
+{
+    char line[HSRENDER_LINE_MAX];
+    size_t line_no;
+    FILE *f;
+    int r;
+
+    s->rate = 44100;
+    s->period = 441;
+
+    f = fopen(path, "r");
+
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+
+        return -errno;
+    }
+
+    r = 0;
+
+    for (line_no = 1 ; fgets(line, sizeof(line), f) != NULL ; line_no++) {
+        r = hsrender_parse_line(s, svc, line, line_no);
+
+        if (r < 0) {
+            fprintf(stderr, "%s:%u: %s\n",
+                    path,
+                    (unsigned int) line_no,
+                    r == -EINVAL ? "syntax error" : strerror(-r));
+
+            break;
+        }
+    }
+
+    fclose(f);
+
+    if (r < 0) {
+        return r;
+    }
+
+    if (s->device_rate == 0) {
+        s->device_rate = s->rate;
+    }
+
+    /*  Events at the same time keep the order they were written in */
+
+    qsort(s->events, s->nevents, sizeof(*s->events), hsrender_compare_events);
+
+    return 0;
+}
+
+static int hsrender_parse_line(
+        struct hsrender_script *s,
+        struct snd_service *svc,
+        char *line,
+        size_t line_no)
+{
+    struct hsrender_event ev;
+    struct hsrender_voice *voice;
+    struct hsrender_sound *sound;
+    const char *delims;
+    char *args[6];
+    char *hash;
+    unsigned long val;
+    size_t nargs;
+    size_t i;
+    void *p;
+    int r;
+
+    hash = strchr(line, '#');
+
+    if (hash != NULL) {
+        *hash = '\0';
+    }
+
+    delims = " \t\r\n";
+
+    for (nargs = 0 ; nargs < 6 ; nargs++) {
+        args[nargs] = strtok(nargs == 0 ? line : NULL, delims);
+
+        if (args[nargs] == NULL) {
+            break;
+        }
+    }
+
+    if (nargs == 0) {
+        return 0;
+    }
+
+    if (strcmp(args[0], "rate") == 0 || strcmp(args[0], "device-rate") == 0
+            || strcmp(args[0], "period") == 0) {
+        if (nargs != 2) {
+            return -EINVAL;
+        }
+
+        val = strtoul(args[1], NULL, 10);
+
+        if (val == 0) {
+            return -EINVAL;
+        }
+
+        /*  Everything is timed against the mix rate, so fix it first */
+
+        if (strcmp(args[0], "rate") == 0) {
+            if (s->nsounds > 0 || s->nevents > 0) {
+                return -EINVAL;
+            }
+
+            s->rate = (unsigned int) val;
+        } else if (args[0][0] == 'd') {
+            s->device_rate = (unsigned int) val;
+        } else {
+            s->period = val;
+        }
+
+        return 0;
+    }
+
+    if (strcmp(args[0], "sound") == 0) {
+        if (nargs != 3 || strlen(args[1]) >= HSRENDER_NAME_MAX) {
+            return -EINVAL;
+        }
+
+        p = realloc(s->sounds, (s->nsounds + 1) * sizeof(*s->sounds));
+
+        if (p == NULL) {
+            return -ENOMEM;
+        }
+
+        s->sounds = p;
+        sound = &s->sounds[s->nsounds];
+        memset(sound, 0, sizeof(*sound));
+        strcpy(sound->name, args[1]);
+
+        r = hsrender_load_wav(&sound->buf, args[2], s->rate);
+
+        if (r < 0) {
+            return r;
+        }
+
+        s->nsounds++;
+
+        return 0;
+    }
+
+    if (strcmp(args[0], "voice") == 0) {
+        if (nargs != 3 || strlen(args[1]) >= HSRENDER_NAME_MAX) {
+            return -EINVAL;
+        }
+
+        r = hsrender_find_sound(s, args[2], &i);
+
+        if (r < 0) {
+            return r;
+        }
+
+        p = realloc(s->voices, (s->nvoices + 1) * sizeof(*s->voices));
+
+        if (p == NULL) {
+            return -ENOMEM;
+        }
+
+        s->voices = p;
+        voice = &s->voices[s->nvoices];
+        memset(voice, 0, sizeof(*voice));
+        strcpy(voice->name, args[1]);
+
+        r = snd_client_alloc(&voice->cli, svc);
+
+        if (r < 0) {
+            return r;
+        }
+
+        r = snd_stream_alloc(&voice->stm, s->sounds[i].buf);
+
+        if (r < 0) {
+            snd_client_free(voice->cli);
+
+            return r;
+        }
+
+        s->nvoices++;
+
+        return 0;
+    }
+
+    if (strcmp(args[0], "end") == 0) {
+        if (nargs != 2) {
+            return -EINVAL;
+        }
+
+        s->has_end = true;
+
+        return hsrender_parse_time(s, args[1], &s->end);
+    }
+
+    if (strcmp(args[0], "at") != 0 || nargs < 4) {
+        return -EINVAL;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.line = line_no;
+
+    r = hsrender_parse_time(s, args[1], &ev.frame);
+
+    if (r < 0) {
+        return r;
+    }
+
+    r = hsrender_find_voice(s, args[3], &ev.voice);
+
+    if (r < 0) {
+        return r;
+    }
+
+    if (strcmp(args[2], "play") == 0 && nargs == 4) {
+        ev.op = HSRENDER_PLAY;
+    } else if (strcmp(args[2], "play") == 0 && nargs == 5
+            && strcmp(args[4], "loop") == 0) {
+        ev.op = HSRENDER_PLAY_LOOP;
+    } else if (strcmp(args[2], "stop") == 0 && nargs == 4) {
+        ev.op = HSRENDER_STOP;
+    } else if (strcmp(args[2], "volume") == 0 && nargs == 6) {
+        ev.op = HSRENDER_VOLUME;
+
+        for (i = 0 ; i < 2 ; i++) {
+            val = strtoul(args[4 + i], NULL, 10);
+
+            if (val > 0x100) {
+                return -EINVAL;
+            }
+
+            ev.volumes[i] = (uint16_t) val;
+        }
+    } else {
+        return -EINVAL;
+    }
+
+    p = realloc(s->events, (s->nevents + 1) * sizeof(*s->events));
+
+    if (p == NULL) {
+        return -ENOMEM;
+    }
+
+    s->events = p;
+    s->events[s->nevents++] = ev;
+
+    return 0;
+}
+
+static int hsrender_parse_time(
+        const struct hsrender_script *s,
+        const char *str,
+        uint64_t *out)
+{
+    unsigned long long val;
+    char *end;
+
+    val = strtoull(str, &end, 10);
+
+    if (end == str) {
+        return -EINVAL;
+    }
+
+    if (strcmp(end, "ms") == 0) {
+        *out = val * s->rate / 1000;
+    } else if (*end == '\0') {
+        *out = val;
+    } else {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int hsrender_find_sound(
+        const struct hsrender_script *s,
+        const char *name,
+        size_t *out)
+{
+    size_t i;
+
+    for (i = 0 ; i < s->nsounds ; i++) {
+        if (strcmp(s->sounds[i].name, name) == 0) {
+            *out = i;
+
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "No sound called %s\n", name);
+
+    return -EINVAL;
+}
+
+static int hsrender_find_voice(
+        const struct hsrender_script *s,
+        const char *name,
+        size_t *out)
+{
+    size_t i;
+
+    for (i = 0 ; i < s->nvoices ; i++) {
+        if (strcmp(s->voices[i].name, name) == 0) {
+            *out = i;
+
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "No voice called %s\n", name);
+
+    return -EINVAL;
+}
+
+static int hsrender_compare_events(const void *a, const void *b)
+{
+    const struct hsrender_event *x;
+    const struct hsrender_event *y;
+
+    x = a;
+    y = b;
+
+    if (x->frame != y->frame) {
+        return x->frame < y->frame ? -1 : 1;
+    }
+
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+static void hsrender_free_script(struct hsrender_script *s)
+{
+    size_t i;
+
+    for (i = 0 ; i < s->nvoices ; i++) {
+        snd_stream_free(s->voices[i].stm);
+        snd_client_free(s->voices[i].cli);
+    }
+
+    for (i = 0 ; i < s->nsounds ; i++) {
+        snd_buffer_free(s->sounds[i].buf);
+    }
+
+    free(s->events);
+    free(s->voices);
+    free(s->sounds);
+}
+
+static int hsrender_submit(
+        const struct hsrender_script *s,
+        const struct hsrender_event *ev)
+{
+    const struct hsrender_voice *voice;
+    struct snd_command *cmd;
+    int r;
+
+    voice = &s->voices[ev->voice];
+    r = snd_client_cmd_alloc(voice->cli, &cmd);
+
+    if (r < 0) {
+        return r;
+    }
+
+    switch (ev->op) {
+    case HSRENDER_PLAY:
+    case HSRENDER_PLAY_LOOP:
+        snd_command_play(cmd, voice->stm, ev->op == HSRENDER_PLAY_LOOP);
+
+        break;
+
+    case HSRENDER_STOP:
+        snd_command_stop(cmd, voice->stm);
+
+        break;
+
+    case HSRENDER_VOLUME:
+        snd_command_set_volume(cmd, voice->stm, 0, ev->volumes[0]);
+        snd_command_set_volume(cmd, voice->stm, 1, ev->volumes[1]);
+
+        break;
+    }
+
+    snd_client_cmd_submit(voice->cli, cmd);
+
+    return 0;
+}
+
+static int hsrender_load_wav(
+        struct snd_buffer **out,
+        const char *path,
+        unsigned int rate)
+{
+    const uint8_t *fmt;
+    const uint8_t *data;
+    const uint8_t *chunk;
+    uint8_t *bytes;
+    int16_t *samples;
+    uint32_t chunk_nbytes;
+    uint32_t data_nbytes;
+    size_t nbytes;
+    size_t nframes;
+    size_t pos;
+    size_t i;
+    unsigned int nchannels;
+    unsigned int nbits;
+    long size;
+    FILE *f;
+    int r;
+
+    *out = NULL;
+    bytes = NULL;
+    fmt = NULL;
+    data = NULL;
+    data_nbytes = 0;
+    f = fopen(path, "rb");
+
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+
+        return -errno;
+    }
+
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0) {
+        r = -EIO;
+
+        goto end;
+    }
+
+    nbytes = (size_t) size;
+    bytes = malloc(nbytes > 0 ? nbytes : 1);
+
+    if (bytes == NULL) {
+        r = -ENOMEM;
+
+        goto end;
+    }
+
+    rewind(f);
+
+    if (fread(bytes, 1, nbytes, f) != nbytes) {
+        r = -EIO;
+
+        goto end;
+    }
+
+    /*  Walk the chunks for the format and the samples; skip anything else */
+
+    r = -EINVAL;
+
+    if (    nbytes < 12 ||
+            memcmp(bytes, "RIFF", 4) != 0 ||
+            memcmp(bytes + 8, "WAVE", 4) != 0) {
+        fprintf(stderr, "%s: not a WAV file\n", path);
+
+        goto end;
+    }
+
+    pos = 12;
+
+    while (pos + 8 <= nbytes) {
+        chunk = bytes + pos;
+        chunk_nbytes = hsrender_get_u32(chunk + 4);
+
+        if (chunk_nbytes > nbytes - pos - 8) {
+            break;
+        }
+
+        pos += 8 + chunk_nbytes + chunk_nbytes % 2;
+
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunk_nbytes >= 16) {
+            fmt = chunk + 8;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            data = chunk + 8;
+            data_nbytes = chunk_nbytes;
+        }
+    }
+
+    if (fmt == NULL || data == NULL) {
+        fprintf(stderr, "%s: no format or no samples\n", path);
+
+        goto end;
+    }
+
+    nchannels = hsrender_get_u16(fmt + 2);
+    nbits = hsrender_get_u16(fmt + 14);
+
+    if (    hsrender_get_u16(fmt) != 1 ||
+            (nchannels != 1 && nchannels != 2) ||
+            (nbits != 8 && nbits != 16)) {
+        fprintf(stderr, "%s: only 8 or 16-bit mono or stereo PCM\n", path);
+
+        goto end;
+    }
+
+    /*  There is no format converter outside the DLL */
+
+    if (hsrender_get_u32(fmt + 4) != rate) {
+        fprintf(stderr,
+                "%s: %u Hz, but the mix rate is %u Hz\n",
+                path,
+                (unsigned int) hsrender_get_u32(fmt + 4),
+                rate);
+
+        goto end;
+    }
+
+    nframes = data_nbytes / (nchannels * nbits / 8);
+    r = snd_buffer_alloc(out, nframes * 2);
+
+    if (r < 0) {
+        goto end;
+    }
+
+    samples = snd_buffer_samples_rw(*out);
+
+    for (i = 0 ; i < nframes * nchannels ; i++) {
+        if (nbits == 8) {
+            samples[i * 2 / nchannels] = (int16_t) ((data[i] - 0x80) << 8);
+        } else {
+            samples[i * 2 / nchannels] =
+                    (int16_t) hsrender_get_u16(data + i * 2);
+        }
+
+        if (nchannels == 1) {
+            samples[i * 2 + 1] = samples[i * 2];
+        }
+    }
+
+    r = 0;
+
+end:
+    free(bytes);
+    fclose(f);
+
+    return r;
+}
+
+static void hsrender_write_header(
+        uint8_t *bytes,
+        unsigned int rate,
+        uint32_t nbytes_data)
+{
+    memcpy(&bytes[0], "RIFF", 4);
+    hsrender_put_u32(&bytes[4], HSRENDER_WAV_HEADER_SIZE - 8 + nbytes_data);
+    memcpy(&bytes[8], "WAVE", 4);
+    memcpy(&bytes[12], "fmt ", 4);
+    hsrender_put_u32(&bytes[16], 16);
+    hsrender_put_u16(&bytes[20], 1);
+    hsrender_put_u16(&bytes[22], 2);
+    hsrender_put_u32(&bytes[24], rate);
+    hsrender_put_u32(&bytes[28], rate * 4);
+    hsrender_put_u16(&bytes[32], 4);
+    hsrender_put_u16(&bytes[34], 16);
+    memcpy(&bytes[36], "data", 4);
+    hsrender_put_u32(&bytes[40], nbytes_data);
+}
+
+static uint16_t hsrender_get_u16(const uint8_t *bytes)
+{
+    return (uint16_t) (bytes[0] | bytes[1] << 8);
+}
+
+static uint32_t hsrender_get_u32(const uint8_t *bytes)
+{
+    return (uint32_t) bytes[0]
+            | (uint32_t) bytes[1] << 8
+            | (uint32_t) bytes[2] << 16
+            | (uint32_t) bytes[3] << 24;
+}
+
+static void hsrender_put_u16(uint8_t *bytes, uint16_t val)
+{
+    bytes[0] = (uint8_t) val;
+    bytes[1] = (uint8_t) (val >> 8);
+}
+
+static void hsrender_put_u32(uint8_t *bytes, uint32_t val)
+{
+    bytes[0] = (uint8_t) val;
+    bytes[1] = (uint8_t) (val >> 8);
+    bytes[2] = (uint8_t) (val >> 16);
+    bytes[3] = (uint8_t) (val >> 24);
+}
+
+static uint64_t hsrender_now(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+
+    QueryPerformanceCounter(&now);
+
+    return (uint64_t) (now.QuadPart * (1e9 / freq.QuadPart));
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
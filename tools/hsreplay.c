@@ -0,0 +1,1085 @@
+/*  Replay a capture of DirectSound API calls.
+
+    Usage: hsreplay [-l] [-u] [-d DLL] CAPTURE
+
+    Reads a capture written by a process running Hypersonik with
+    HYPERSONIK_API_CAPTURE set, and makes the same calls again, through the
+    DirectSoundCreate8 of DLL (by default dsound.dll, which Windows looks
+    for next to hsreplay first). Calls are made one at a time from a single
+    thread, in the order the capture puts them in, and at the times they were
+    originally made, or as quickly as possible with -u. IDirectSound8
+    objects are created as they first turn up, since the capture only sees
+    them being used. Lock and Unlock hand over the captured data.
+
+    Afterwards prints how many calls were made, how many of them returned
+    something other than they did when captured, the time spent in them, and
+    how late the latest one was made. -l lists the calls instead. */
+
+#include <windows.h>
+#include <dsound.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apicap.h"
+#include "apiprof.h"
+
+#define HSREPLAY_MIN_NSLOTS 256
+#define HSREPLAY_SPIN_MSEC 2
+
+typedef HRESULT (WINAPI *hsreplay_create_t)(
+        const GUID *driver_id,
+        IDirectSound8 **out,
+        IUnknown *outer);
+
+/*  A COM object from the capture, keyed by the pointer the application had
+    for it, and what stands in for it now. com is NULL once it is gone. The
+    pointers from the last Lock are where Unlock puts the data. */
+
+struct hsreplay_entry {
+    uint64_t seq;
+    int64_t offset;
+};
+
+struct hsreplay_object {
+    uint64_t key;
+    void *com;
+    void *locked[2];
+    DWORD nlocked[2];
+};
+
+struct hsreplay_data {
+    uint64_t hash;
+    void *bytes;
+    uint32_t nbytes;
+};
+
+struct hsreplay {
+    hsreplay_create_t create;
+    struct hsreplay_entry *entries;
+    size_t nentries;
+    size_t nentries_max;
+    struct hsreplay_object *objects;
+    size_t nobject_slots;
+    size_t nobjects;
+    struct hsreplay_data *data;
+    size_t ndata_slots;
+    size_t ndata;
+    int64_t freq;
+    uint64_t ncalls;
+    uint64_t nmismatches;
+    uint64_t nskipped;
+    int64_t ticks;
+    int64_t ticks_late_max;
+};
+
+static void hsreplay_usage(void);
+static bool hsreplay_index(struct hsreplay *r, FILE *f);
+static int hsreplay_compare(const void *a, const void *b);
+static int64_t hsreplay_now(void);
+static void hsreplay_wait(struct hsreplay *r, int64_t t);
+static void hsreplay_list(
+        const struct apicap_header *header,
+        const struct apicap_record *rec);
+static size_t hsreplay_payload_nbytes(const struct apicap_record *rec);
+static bool hsreplay_call(
+        struct hsreplay *r,
+        const struct apicap_record *rec,
+        const uint8_t *payload,
+        uint32_t *result);
+static uint32_t hsreplay_call_api(
+        struct hsreplay *r,
+        IDirectSound8 *com,
+        const struct apicap_record *rec,
+        const uint8_t *payload);
+static uint32_t hsreplay_call_buffer(
+        struct hsreplay *r,
+        IDirectSoundBuffer *com,
+        const struct apicap_record *rec,
+        const uint8_t *payload);
+static const DSBUFFERDESC *hsreplay_desc(
+        const struct apicap_record *rec,
+        const uint8_t *payload,
+        DSBUFFERDESC *desc,
+        WAVEFORMATEXTENSIBLE *wfx);
+static const WAVEFORMATEX *hsreplay_format(
+        const void *bytes,
+        size_t nbytes,
+        WAVEFORMATEXTENSIBLE *wfx);
+static void hsreplay_unlock_part(
+        struct hsreplay *r,
+        void *dest,
+        DWORD nbytes,
+        uint64_t hash);
+static uint32_t hsreplay_min(uint32_t a, uint32_t b);
+static struct hsreplay_object *hsreplay_object(
+        struct hsreplay *r,
+        uint64_t key);
+static void *hsreplay_com(struct hsreplay *r, uint64_t key);
+static void hsreplay_set_com(struct hsreplay *r, uint64_t key, void *com);
+static bool hsreplay_add_data(
+        struct hsreplay *r,
+        uint64_t hash,
+        const void *bytes,
+        uint32_t nbytes);
+static const struct hsreplay_data *hsreplay_find_data(
+        const struct hsreplay *r,
+        uint64_t hash);
+
+int main(int argc, char **argv)
+{
+    struct hsreplay r;
+    struct apicap_header header;
+    struct apicap_record rec;
+    LARGE_INTEGER freq;
+    const char *dll_path;
+    uint8_t *payload;
+    size_t payload_max;
+    uint32_t result;
+    int64_t t_base;
+    int64_t t_call;
+    int64_t t_rec;
+    int64_t t;
+    HMODULE dll;
+    FILE *f;
+    size_t i;
+    bool first;
+    bool list;
+    bool paced;
+    bool ok;
+    int argi;
+
+    memset(&r, 0, sizeof(r));
+    dll_path = "dsound.dll";
+    list = false;
+    paced = true;
+
+    for (argi = 1 ; argi < argc && argv[argi][0] == '-' ; argi++) {
+        if (strcmp(argv[argi], "-l") == 0) {
+            list = true;
+        } else if (strcmp(argv[argi], "-u") == 0) {
+            paced = false;
+        } else if (strcmp(argv[argi], "-d") == 0 && argi + 1 < argc) {
+            dll_path = argv[++argi];
+        } else {
+            hsreplay_usage();
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argi + 1 != argc) {
+        hsreplay_usage();
+
+        return EXIT_FAILURE;
+    }
+
+    f = fopen(argv[argi], "rb");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", argv[argi]);
+
+        return EXIT_FAILURE;
+    }
+
+    if (    fread(&header, sizeof(header), 1, f) != 1 ||
+            header.magic != APICAP_MAGIC ||
+            header.version != APICAP_VERSION ||
+            header.freq == 0) {
+        fprintf(stderr,
+                "%s is not a version %u API capture\n",
+                argv[argi],
+                APICAP_VERSION);
+
+        return EXIT_FAILURE;
+    }
+
+    if (!list) {
+        dll = LoadLibraryA(dll_path);
+
+        if (dll == NULL) {
+            fprintf(stderr,
+                    "Could not load %s: %lu\n",
+                    dll_path,
+                    (unsigned long) GetLastError());
+
+            return EXIT_FAILURE;
+        }
+
+        r.create = (hsreplay_create_t) GetProcAddress(
+                dll,
+                "DirectSoundCreate8");
+
+        if (r.create == NULL) {
+            fprintf(stderr, "%s has no DirectSoundCreate8\n", dll_path);
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    QueryPerformanceFrequency(&freq);
+    r.freq = freq.QuadPart;
+    payload = NULL;
+    payload_max = 0;
+    t_base = 0;
+    first = true;
+
+    if (!hsreplay_index(&r, f)) {
+        fprintf(stderr, "Out of memory\n");
+
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0 ; i < r.nentries ; i++) {
+        if (    _fseeki64(f, r.entries[i].offset, SEEK_SET) != 0 ||
+                fread(&rec, sizeof(rec), 1, f) != 1) {
+            fprintf(stderr, "Could not read back a record\n");
+
+            break;
+        }
+
+        if (rec.nbytes > payload_max) {
+            free(payload);
+            payload_max = rec.nbytes;
+            payload = malloc(payload_max);
+
+            if (payload == NULL) {
+                fprintf(stderr, "Out of memory\n");
+
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (rec.nbytes > 0 && fread(payload, rec.nbytes, 1, f) != 1) {
+            fprintf(stderr, "Could not read back a record\n");
+
+            break;
+        }
+
+        if (list) {
+            hsreplay_list(&header, &rec);
+
+            continue;
+        }
+
+        if (rec.type == APICAP_TYPE_DATA) {
+            if (!hsreplay_add_data(&r, rec.object, payload, rec.nbytes)) {
+                fprintf(stderr, "Out of memory\n");
+
+                return EXIT_FAILURE;
+            }
+
+            continue;
+        }
+
+        if (    rec.type != APICAP_TYPE_CALL ||
+                rec.kind >= APIPROF_NKINDS ||
+                rec.method >= APIPROF_NMETHODS ||
+                rec.nbytes < hsreplay_payload_nbytes(&rec)) {
+            r.nskipped++;
+
+            continue;
+        }
+
+        /*  The first call sets the clock going */
+
+        t_rec = (int64_t) ((double) rec.t * r.freq / header.freq);
+
+        if (first) {
+            t_base = hsreplay_now() - t_rec;
+            first = false;
+        }
+
+        if (paced) {
+            hsreplay_wait(&r, t_base + t_rec);
+        }
+
+        t_call = hsreplay_now();
+        ok = hsreplay_call(&r, &rec, payload, &result);
+        t = hsreplay_now();
+
+        if (!ok) {
+            r.nskipped++;
+
+            continue;
+        }
+
+        r.ncalls++;
+        r.ticks += t - t_call;
+
+        if (result != rec.result) {
+            r.nmismatches++;
+        }
+    }
+
+    fclose(f);
+    free(payload);
+    free(r.entries);
+
+    if (list) {
+        return EXIT_SUCCESS;
+    }
+
+    printf( "%llu calls, %llu returned differently, %llu skipped\n"
+            "%.3f ms in calls",
+            (unsigned long long) r.ncalls,
+            (unsigned long long) r.nmismatches,
+            (unsigned long long) r.nskipped,
+            r.ticks * 1000.0 / r.freq);
+
+    if (paced) {
+        printf(", up to %.3f ms late", r.ticks_late_max * 1000.0 / r.freq);
+    }
+
+    printf("\n");
+
+    return EXIT_SUCCESS;
+}
+
+static void hsreplay_usage(void)
+{
+    fprintf(stderr, "Usage: hsreplay [-l] [-u] [-d DLL] CAPTURE\n");
+}
+
+static bool hsreplay_index(struct hsreplay *r, FILE *f)
+{
+    struct hsreplay_entry *entries;
+    struct apicap_record rec;
+    int64_t offset;
+    int64_t end;
+    size_t nmax;
+
+    /*  Records are written as calls return, so note where each one is and
+        then sort them into the order they are to be replayed in. A process
+        that did not shut down cleanly leaves a partial record at the end,
+        which is as good as the end of the capture. */
+
+    offset = _ftelli64(f);
+    _fseeki64(f, 0, SEEK_END);
+    end = _ftelli64(f);
+    _fseeki64(f, offset, SEEK_SET);
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (offset + (int64_t) sizeof(rec) + rec.nbytes > end) {
+            fprintf(stderr, "Capture ends part way through a record\n");
+
+            break;
+        }
+
+        if (r->nentries == r->nentries_max) {
+            nmax = r->nentries_max > 0
+                    ? r->nentries_max * 2
+                    : HSREPLAY_MIN_NSLOTS;
+            entries = realloc(r->entries, nmax * sizeof(*entries));
+
+            if (entries == NULL) {
+                return false;
+            }
+
+            r->entries = entries;
+            r->nentries_max = nmax;
+        }
+
+        r->entries[r->nentries].seq = rec.seq;
+        r->entries[r->nentries].offset = offset;
+        r->nentries++;
+
+        offset += sizeof(rec) + rec.nbytes;
+        _fseeki64(f, offset, SEEK_SET);
+    }
+
+    qsort(r->entries, r->nentries, sizeof(*r->entries), hsreplay_compare);
+
+    return true;
+}
+
+static int hsreplay_compare(const void *a, const void *b)
+{
+    const struct hsreplay_entry *x;
+    const struct hsreplay_entry *y;
+
+    x = a;
+    y = b;
+
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static int64_t hsreplay_now(void)
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+
+    return now.QuadPart;
+}
+
+static void hsreplay_wait(struct hsreplay *r, int64_t t)
+{
+    int64_t now;
+    int64_t msec;
+
+    /*  Sleep most of the way, which is only good to a millisecond or so,
+        and spin the rest */
+
+    now = hsreplay_now();
+
+    if (now > t) {
+        if (r->ticks_late_max < now - t) {
+            r->ticks_late_max = now - t;
+        }
+
+        return;
+    }
+
+    msec = (t - now) * 1000 / r->freq;
+
+    if (msec > HSREPLAY_SPIN_MSEC) {
+        Sleep(msec - HSREPLAY_SPIN_MSEC);
+    }
+
+    while (hsreplay_now() < t) {
+        YieldProcessor();
+    }
+}
+
+static void hsreplay_list(
+        const struct apicap_header *header,
+        const struct apicap_record *rec)
+{
+    double msec;
+
+    msec = rec->t * 1000.0 / header->freq;
+
+    if (rec->type == APICAP_TYPE_DATA) {
+        printf( "%12.3f %6s %-16s %-20s %016llx %u bytes\n",
+                msec,
+                "",
+                "data",
+                "",
+                (unsigned long long) rec->object,
+                rec->nbytes);
+
+        return;
+    }
+
+    if (    rec->type != APICAP_TYPE_CALL ||
+            rec->kind >= APIPROF_NKINDS ||
+            rec->method >= APIPROF_NMETHODS) {
+        printf("%12.3f unknown record\n", msec);
+
+        return;
+    }
+
+    printf( "%12.3f %6lu %-16s %-20s %016llx -> %08lx, %.1f us\n",
+            msec,
+            (unsigned long) rec->thread,
+            apiprof_kind_names[rec->kind],
+            apiprof_method_names[rec->method],
+            (unsigned long long) rec->object,
+            (unsigned long) rec->result,
+            rec->ticks * 1e6 / header->freq);
+}
+
+static size_t hsreplay_payload_nbytes(const struct apicap_record *rec)
+{
+    /*  The least payload each call needs to be made again */
+
+    switch (rec->method) {
+    case APIPROF_QUERY_INTERFACE:
+        return sizeof(struct apicap_query);
+
+    case APIPROF_CREATE_SOUND_BUFFER:
+        return sizeof(struct apicap_desc);
+
+    case APIPROF_DUPLICATE_SOUND_BUFFER:
+        return sizeof(struct apicap_duplicate);
+
+    case APIPROF_INITIALIZE:
+        return rec->kind == APIPROF_KIND_API ? 0 : sizeof(struct apicap_desc);
+
+    case APIPROF_LOCK:
+        return sizeof(struct apicap_lock);
+
+    case APIPROF_UNLOCK:
+        return sizeof(struct apicap_unlock);
+
+    case APIPROF_GET_CAPS:
+    case APIPROF_GET_FORMAT:
+    case APIPROF_PLAY:
+    case APIPROF_SET_COOPERATIVE_LEVEL:
+    case APIPROF_SET_CURRENT_POSITION:
+    case APIPROF_SET_FREQUENCY:
+    case APIPROF_SET_PAN:
+    case APIPROF_SET_SPEAKER_CONFIG:
+    case APIPROF_SET_VOLUME:
+        return sizeof(uint32_t);
+
+    default:
+        return 0;
+    }
+}
+
+static bool hsreplay_call(
+        struct hsreplay *r,
+        const struct apicap_record *rec,
+        const uint8_t *payload,
+        uint32_t *result)
+{
+    IDirectSound8 *api;
+    void *com;
+    HRESULT hr;
+
+    com = hsreplay_com(r, rec->object);
+
+    if (com == NULL && rec->kind == APIPROF_KIND_API) {
+        hr = r->create(NULL, &api, NULL);
+
+        if (FAILED(hr)) {
+            fprintf(stderr,
+                    "DirectSoundCreate8 failed: %08lx\n",
+                    (unsigned long) hr);
+
+            return false;
+        }
+
+        com = api;
+        hsreplay_set_com(r, rec->object, com);
+    }
+
+    /*  Calls on something that failed to be created this time round */
+
+    if (com == NULL) {
+        return false;
+    }
+
+    if (rec->kind == APIPROF_KIND_API) {
+        *result = hsreplay_call_api(r, com, rec, payload);
+    } else {
+        *result = hsreplay_call_buffer(r, com, rec, payload);
+    }
+
+    if (rec->method == APIPROF_RELEASE && *result == 0) {
+        hsreplay_set_com(r, rec->object, NULL);
+    }
+
+    return true;
+}
+
+static uint32_t hsreplay_call_api(
+        struct hsreplay *r,
+        IDirectSound8 *com,
+        const struct apicap_record *rec,
+        const uint8_t *payload)
+{
+    const struct apicap_duplicate *dup;
+    const struct apicap_query *query;
+    const struct apicap_desc *pdesc;
+    WAVEFORMATEXTENSIBLE wfx;
+    IDirectSoundBuffer *buf;
+    DSBUFFERDESC desc;
+    DSCAPS caps;
+    uint32_t value;
+    GUID driver_id;
+    DWORD out;
+    void *ptr;
+    HRESULT hr;
+
+    value = 0;
+
+    if (rec->nbytes >= sizeof(value)) {
+        memcpy(&value, payload, sizeof(value));
+    }
+
+    switch (rec->method) {
+    case APIPROF_QUERY_INTERFACE:
+        query = (const struct apicap_query *) payload;
+        hr = IDirectSound8_QueryInterface(com, &query->iid, &ptr);
+
+        if (SUCCEEDED(hr) && query->out != 0) {
+            hsreplay_set_com(r, query->out, ptr);
+        }
+
+        return hr;
+
+    case APIPROF_ADD_REF:
+        return IDirectSound8_AddRef(com);
+
+    case APIPROF_RELEASE:
+        return IDirectSound8_Release(com);
+
+    case APIPROF_COMPACT:
+        return IDirectSound8_Compact(com);
+
+    case APIPROF_CREATE_SOUND_BUFFER:
+        pdesc = (const struct apicap_desc *) payload;
+        hr = IDirectSound8_CreateSoundBuffer(
+                com,
+                hsreplay_desc(rec, payload, &desc, &wfx),
+                &buf,
+                NULL);
+
+        if (SUCCEEDED(hr) && pdesc->out != 0) {
+            hsreplay_set_com(r, pdesc->out, buf);
+        }
+
+        return hr;
+
+    case APIPROF_DUPLICATE_SOUND_BUFFER:
+        dup = (const struct apicap_duplicate *) payload;
+        hr = IDirectSound8_DuplicateSoundBuffer(
+                com,
+                hsreplay_com(r, dup->src),
+                &buf);
+
+        if (SUCCEEDED(hr) && dup->out != 0) {
+            hsreplay_set_com(r, dup->out, buf);
+        }
+
+        return hr;
+
+    case APIPROF_GET_CAPS:
+        memset(&caps, 0, sizeof(caps));
+        caps.dwSize = value;
+
+        return IDirectSound8_GetCaps(com, value != 0 ? &caps : NULL);
+
+    case APIPROF_GET_SPEAKER_CONFIG:
+        return IDirectSound8_GetSpeakerConfig(com, &out);
+
+    case APIPROF_INITIALIZE:
+        if (rec->nbytes < sizeof(driver_id)) {
+            return IDirectSound8_Initialize(com, NULL);
+        }
+
+        memcpy(&driver_id, payload, sizeof(driver_id));
+
+        return IDirectSound8_Initialize(com, &driver_id);
+
+    case APIPROF_SET_COOPERATIVE_LEVEL:
+        return IDirectSound8_SetCooperativeLevel(
+                com,
+                GetDesktopWindow(),
+                value);
+
+    case APIPROF_SET_SPEAKER_CONFIG:
+        return IDirectSound8_SetSpeakerConfig(com, value);
+
+    case APIPROF_VERIFY_CERTIFICATION:
+        return IDirectSound8_VerifyCertification(com, &out);
+
+    default:
+        return E_NOTIMPL;
+    }
+}
+
+static uint32_t hsreplay_call_buffer(
+        struct hsreplay *r,
+        IDirectSoundBuffer *com,
+        const struct apicap_record *rec,
+        const uint8_t *payload)
+{
+    const struct apicap_unlock *unlock;
+    const struct apicap_query *query;
+    const struct apicap_lock *lock;
+    const struct apicap_desc *pdesc;
+    struct hsreplay_object *obj;
+    WAVEFORMATEXTENSIBLE wfx;
+    DSBUFFERDESC desc;
+    DSBCAPS caps;
+    uint32_t value;
+    DWORD nbytes[2];
+    DWORD out;
+    DWORD out2;
+    LONG lout;
+    void *ptr[2];
+    HRESULT hr;
+
+    value = 0;
+
+    if (rec->nbytes >= sizeof(value)) {
+        memcpy(&value, payload, sizeof(value));
+    }
+
+    switch (rec->method) {
+    case APIPROF_QUERY_INTERFACE:
+        query = (const struct apicap_query *) payload;
+        hr = IDirectSoundBuffer_QueryInterface(com, &query->iid, &ptr[0]);
+
+        if (SUCCEEDED(hr) && query->out != 0) {
+            hsreplay_set_com(r, query->out, ptr[0]);
+        }
+
+        return hr;
+
+    case APIPROF_ADD_REF:
+        return IDirectSoundBuffer_AddRef(com);
+
+    case APIPROF_RELEASE:
+        return IDirectSoundBuffer_Release(com);
+
+    case APIPROF_GET_CAPS:
+        memset(&caps, 0, sizeof(caps));
+        caps.dwSize = value;
+
+        return IDirectSoundBuffer_GetCaps(com, value != 0 ? &caps : NULL);
+
+    case APIPROF_GET_CURRENT_POSITION:
+        return IDirectSoundBuffer_GetCurrentPosition(com, &out, &out2);
+
+    case APIPROF_GET_FORMAT:
+        if (value > sizeof(wfx)) {
+            value = sizeof(wfx);
+        }
+
+        return IDirectSoundBuffer_GetFormat(
+                com,
+                value != 0 ? &wfx.Format : NULL,
+                value,
+                &out);
+
+    case APIPROF_GET_FREQUENCY:
+        return IDirectSoundBuffer_GetFrequency(com, &out);
+
+    case APIPROF_GET_PAN:
+        return IDirectSoundBuffer_GetPan(com, &lout);
+
+    case APIPROF_GET_STATUS:
+        return IDirectSoundBuffer_GetStatus(com, &out);
+
+    case APIPROF_GET_VOLUME:
+        return IDirectSoundBuffer_GetVolume(com, &lout);
+
+    case APIPROF_INITIALIZE:
+        pdesc = (const struct apicap_desc *) payload;
+
+        return IDirectSoundBuffer_Initialize(
+                com,
+                hsreplay_com(r, pdesc->out),
+                hsreplay_desc(rec, payload, &desc, &wfx));
+
+    case APIPROF_LOCK:
+        lock = (const struct apicap_lock *) payload;
+        obj = hsreplay_object(r, rec->object);
+
+        if (obj == NULL) {
+            return E_OUTOFMEMORY;
+        }
+
+        hr = IDirectSoundBuffer_Lock(
+                com,
+                lock->pos,
+                lock->nbytes,
+                &obj->locked[0],
+                &obj->nlocked[0],
+                &obj->locked[1],
+                &obj->nlocked[1],
+                lock->flags);
+
+        if (FAILED(hr)) {
+            memset(obj->locked, 0, sizeof(obj->locked));
+            memset(obj->nlocked, 0, sizeof(obj->nlocked));
+        }
+
+        return hr;
+
+    case APIPROF_PLAY:
+        return IDirectSoundBuffer_Play(com, 0, 0, value);
+
+    case APIPROF_RESTORE:
+        return IDirectSoundBuffer_Restore(com);
+
+    case APIPROF_SET_CURRENT_POSITION:
+        return IDirectSoundBuffer_SetCurrentPosition(com, value);
+
+    case APIPROF_SET_FORMAT:
+        return IDirectSoundBuffer_SetFormat(
+                com,
+                hsreplay_format(payload, rec->nbytes, &wfx));
+
+    case APIPROF_SET_FREQUENCY:
+        return IDirectSoundBuffer_SetFrequency(com, value);
+
+    case APIPROF_SET_PAN:
+        return IDirectSoundBuffer_SetPan(com, (LONG) value);
+
+    case APIPROF_SET_VOLUME:
+        return IDirectSoundBuffer_SetVolume(com, (LONG) value);
+
+    case APIPROF_STOP:
+        return IDirectSoundBuffer_Stop(com);
+
+    case APIPROF_UNLOCK:
+        unlock = (const struct apicap_unlock *) payload;
+        obj = hsreplay_object(r, rec->object);
+
+        if (obj == NULL) {
+            return E_OUTOFMEMORY;
+        }
+
+        /*  Hand back no more than was captured, or than was locked this
+            time round, whichever is less */
+
+        ptr[0] = obj->locked[0];
+        ptr[1] = obj->locked[1];
+        nbytes[0] = hsreplay_min(obj->nlocked[0], unlock->nbytes[0]);
+        nbytes[1] = hsreplay_min(obj->nlocked[1], unlock->nbytes[1]);
+        memset(obj->locked, 0, sizeof(obj->locked));
+        memset(obj->nlocked, 0, sizeof(obj->nlocked));
+
+        hsreplay_unlock_part(r, ptr[0], nbytes[0], unlock->data[0]);
+        hsreplay_unlock_part(r, ptr[1], nbytes[1], unlock->data[1]);
+
+        return IDirectSoundBuffer_Unlock(
+                com,
+                ptr[0],
+                nbytes[0],
+                ptr[1],
+                nbytes[1]);
+
+    default:
+        return E_NOTIMPL;
+    }
+}
+
+static const DSBUFFERDESC *hsreplay_desc(
+        const struct apicap_record *rec,
+        const uint8_t *payload,
+        DSBUFFERDESC *desc,
+        WAVEFORMATEXTENSIBLE *wfx)
+{
+    const struct apicap_desc *pdesc;
+
+    /*  A size of zero is how the capture says there was no description, or
+        none that could be read */
+
+    pdesc = (const struct apicap_desc *) payload;
+
+    if (pdesc->size == 0) {
+        return NULL;
+    }
+
+    memset(desc, 0, sizeof(*desc));
+    desc->dwSize = pdesc->size;
+    desc->dwFlags = pdesc->flags;
+    desc->dwBufferBytes = pdesc->nbytes;
+    desc->guid3DAlgorithm = pdesc->algorithm;
+    desc->lpwfxFormat = (WAVEFORMATEX *) hsreplay_format(
+            payload + sizeof(*pdesc),
+            rec->nbytes - sizeof(*pdesc),
+            wfx);
+
+    return desc;
+}
+
+static const WAVEFORMATEX *hsreplay_format(
+        const void *bytes,
+        size_t nbytes,
+        WAVEFORMATEXTENSIBLE *wfx)
+{
+    if (nbytes < sizeof(WAVEFORMATEX)) {
+        return NULL;
+    }
+
+    memset(wfx, 0, sizeof(*wfx));
+    memcpy(wfx, bytes, hsreplay_min(nbytes, sizeof(*wfx)));
+
+    return &wfx->Format;
+}
+
+static void hsreplay_unlock_part(
+        struct hsreplay *r,
+        void *dest,
+        DWORD nbytes,
+        uint64_t hash)
+{
+    const struct hsreplay_data *data;
+
+    if (dest == NULL || hash == 0) {
+        return;
+    }
+
+    data = hsreplay_find_data(r, hash);
+
+    if (data == NULL) {
+        return;
+    }
+
+    memcpy(dest, data->bytes, hsreplay_min(nbytes, data->nbytes));
+}
+
+static uint32_t hsreplay_min(uint32_t a, uint32_t b)
+{
+    return a < b ? a : b;
+}
+
+static struct hsreplay_object *hsreplay_object(
+        struct hsreplay *r,
+        uint64_t key)
+{
+    struct hsreplay_object *objects;
+    size_t nslots;
+    size_t i;
+    size_t j;
+
+    /*  Open addressing on the captured pointer, which is never zero. Slots
+        are never emptied, only their com, so nothing ever needs moving but
+        when the table grows. */
+
+    if ((r->nobjects + 1) * 2 > r->nobject_slots) {
+        nslots = r->nobject_slots > 0
+                ? r->nobject_slots * 2
+                : HSREPLAY_MIN_NSLOTS;
+        objects = calloc(nslots, sizeof(*objects));
+
+        if (objects == NULL) {
+            return NULL;
+        }
+
+        for (i = 0 ; i < r->nobject_slots ; i++) {
+            if (r->objects[i].key == 0) {
+                continue;
+            }
+
+            j = (r->objects[i].key >> 4) & (nslots - 1);
+
+            while (objects[j].key != 0) {
+                j = (j + 1) & (nslots - 1);
+            }
+
+            objects[j] = r->objects[i];
+        }
+
+        free(r->objects);
+        r->objects = objects;
+        r->nobject_slots = nslots;
+    }
+
+    i = (key >> 4) & (r->nobject_slots - 1);
+
+    while (r->objects[i].key != 0 && r->objects[i].key != key) {
+        i = (i + 1) & (r->nobject_slots - 1);
+    }
+
+    if (r->objects[i].key == 0) {
+        r->objects[i].key = key;
+        r->nobjects++;
+    }
+
+    return &r->objects[i];
+}
+
+static void *hsreplay_com(struct hsreplay *r, uint64_t key)
+{
+    struct hsreplay_object *obj;
+
+    if (key == 0) {
+        return NULL;
+    }
+
+    obj = hsreplay_object(r, key);
+
+    return obj != NULL ? obj->com : NULL;
+}
+
+static void hsreplay_set_com(struct hsreplay *r, uint64_t key, void *com)
+{
+    struct hsreplay_object *obj;
+
+    obj = hsreplay_object(r, key);
+
+    if (obj == NULL) {
+        return;
+    }
+
+    obj->com = com;
+    memset(obj->locked, 0, sizeof(obj->locked));
+    memset(obj->nlocked, 0, sizeof(obj->nlocked));
+}
+
+static bool hsreplay_add_data(
+        struct hsreplay *r,
+        uint64_t hash,
+        const void *bytes,
+        uint32_t nbytes)
+{
+    struct hsreplay_data *data;
+    size_t nslots;
+    size_t i;
+    size_t j;
+
+    if (hash == 0 || hsreplay_find_data(r, hash) != NULL) {
+        return true;
+    }
+
+    if ((r->ndata + 1) * 2 > r->ndata_slots) {
+        nslots = r->ndata_slots > 0 ? r->ndata_slots * 2 : HSREPLAY_MIN_NSLOTS;
+        data = calloc(nslots, sizeof(*data));
+
+        if (data == NULL) {
+            return false;
+        }
+
+        for (i = 0 ; i < r->ndata_slots ; i++) {
+            if (r->data[i].hash == 0) {
+                continue;
+            }
+
+            j = r->data[i].hash & (nslots - 1);
+
+            while (data[j].hash != 0) {
+                j = (j + 1) & (nslots - 1);
+            }
+
+            data[j] = r->data[i];
+        }
+
+        free(r->data);
+        r->data = data;
+        r->ndata_slots = nslots;
+    }
+
+    i = hash & (r->ndata_slots - 1);
+
+    while (r->data[i].hash != 0) {
+        i = (i + 1) & (r->ndata_slots - 1);
+    }
+
+    r->data[i].bytes = malloc(nbytes);
+
+    if (r->data[i].bytes == NULL) {
+        return false;
+    }
+
+    memcpy(r->data[i].bytes, bytes, nbytes);
+    r->data[i].hash = hash;
+    r->data[i].nbytes = nbytes;
+    r->ndata++;
+
+    return true;
+}
+
+static const struct hsreplay_data *hsreplay_find_data(
+        const struct hsreplay *r,
+        uint64_t hash)
+{
+    size_t i;
+
+    if (r->ndata_slots == 0) {
+        return NULL;
+    }
+
+    i = hash & (r->ndata_slots - 1);
+
+    while (r->data[i].hash != 0) {
+        if (r->data[i].hash == hash) {
+            return &r->data[i];
+        }
+
+        i = (i + 1) & (r->ndata_slots - 1);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,722 @@
+/*  Measure how fast the mixer is, on any machine the portable core builds on.
+
+    Usage: mixbench [-c] [-q] [-r RATE] [-t MSEC]
+
+    Sweeps the number of voices from 1 to 4096 at a range of period sizes,
+    with looping and one-shot sounds, at unity, half and zero gain. Each
+    point is rendered for at least MSEC milliseconds (default 100) and
+    reported in nanoseconds per block and per voice-frame. After each sweep
+    comes the number of voices that would fit in one period's worth of time
+    at RATE Hz (default 48000). -c prints comma-separated values instead,
+    and -q sweeps a single period size at unity gain only.
+
+    Where the linker can wrap malloc, every allocation made while the mixer
+    is being timed is counted, and so is every one made by command traffic
+    through the service once it has warmed up. Either being non-zero is a
+    bug, and makes mixbench exit with failure. */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "defs.h"
+#include "snd-buffer.h"
+#include "snd-mixer.h"
+#include "snd-service.h"
+#include "snd-stream.h"
+
+/*  Voices are spread across this many distinct sounds, so that they do not
+    all read the same cache lines. Looping sounds are short and not a whole
+    number of periods, so they wrap part way through blocks; one-shot sounds
+    last exactly one segment, which is about a second. */
+
+#define MIXBENCH_NSOUNDS 16
+#define MIXBENCH_LOOP_NFRAMES 4801
+#define MIXBENCH_MAX_VOICES 4096
+
+/*  Command traffic for the steady state allocation check */
+
+#define MIXBENCH_TRAFFIC_NVOICES 64
+#define MIXBENCH_TRAFFIC_PERIOD 256
+#define MIXBENCH_TRAFFIC_NWARMUP 100
+#define MIXBENCH_TRAFFIC_NCYCLES 1000
+
+struct mixbench_gain {
+    const char *name;
+    uint16_t value;
+};
+
+struct mixbench_point {
+    size_t nvoices;
+    double ns_per_block;
+};
+
+struct mixbench_run {
+    struct snd_mixer *mixer;
+    struct snd_buffer *sounds[MIXBENCH_NSOUNDS];
+    struct snd_stream *voices[MIXBENCH_MAX_VOICES];
+    void *out;
+    size_t period;
+    size_t nvoices;
+    size_t nblocks;
+    bool looping;
+};
+
+static const size_t mixbench_nvoices[] = {
+    1, 4, 16, 64, 256, 1024, 4096,
+};
+
+static const size_t mixbench_periods[] = {
+    64, 128, 256, 512, 1024,
+};
+
+static const struct mixbench_gain mixbench_gains[] = {
+    { "unity", 0x100 },
+    { "half", 0x80 },
+    { "mute", 0 },
+};
+
+static size_t mixbench_nallocs;
+
+static void mixbench_usage(void);
+static int mixbench_sweep(
+        size_t period,
+        bool looping,
+        const struct mixbench_gain *gain,
+        unsigned int rate,
+        uint64_t min_ns,
+        bool csv);
+static int mixbench_measure(
+        size_t period,
+        size_t nvoices,
+        bool looping,
+        uint16_t gain,
+        uint64_t min_ns,
+        double *ns_per_block);
+static int mixbench_run_init(
+        struct mixbench_run *run,
+        size_t period,
+        size_t nvoices,
+        bool looping,
+        uint16_t gain);
+static void mixbench_run_fini(struct mixbench_run *run);
+static void mixbench_run_segment(struct mixbench_run *run);
+static double mixbench_max_voices(
+        const struct mixbench_point *points,
+        size_t npoints,
+        double budget_ns);
+static int mixbench_traffic(size_t *nallocs);
+static void mixbench_fill(struct snd_buffer *buf, uint32_t seed);
+static uint64_t mixbench_now(void);
+
+int main(int argc, char **argv)
+{
+    const struct mixbench_gain *gain;
+    unsigned long rate;
+    unsigned long msec;
+    size_t nallocs;
+    size_t nperiods;
+    size_t ngains;
+    size_t i;
+    size_t j;
+    size_t k;
+    bool quick;
+    bool csv;
+    bool ok;
+    int argi;
+    int r;
+
+    csv = false;
+    quick = false;
+    rate = 48000;
+    msec = 100;
+
+    for (argi = 1 ; argi < argc && argv[argi][0] == '-' ; argi++) {
+        if (strcmp(argv[argi], "-c") == 0) {
+            csv = true;
+        } else if (strcmp(argv[argi], "-q") == 0) {
+            quick = true;
+        } else if (strcmp(argv[argi], "-r") == 0 && argi + 1 < argc) {
+            rate = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc) {
+            msec = strtoul(argv[++argi], NULL, 10);
+        } else {
+            mixbench_usage();
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argi != argc || rate == 0 || msec == 0) {
+        mixbench_usage();
+
+        return EXIT_FAILURE;
+    }
+
+    nperiods = quick ? 1 : lengthof(mixbench_periods);
+    ngains = quick ? 1 : lengthof(mixbench_gains);
+    ok = true;
+
+    if (csv) {
+        printf( "mode,gain,period,voices,ns_per_block,ns_per_voice_frame,"
+                "max_voices\n");
+    } else {
+        printf( "%-8s %-5s %6s %6s %12s %14s\n",
+                "mode",
+                "gain",
+                "period",
+                "voices",
+                "ns/block",
+                "ns/voice-frame");
+    }
+
+    for (i = 0 ; i < 2 ; i++) {
+        for (j = 0 ; j < ngains ; j++) {
+            for (k = 0 ; k < nperiods ; k++) {
+                gain = &mixbench_gains[j];
+                r = mixbench_sweep(
+                        quick ? 256 : mixbench_periods[k],
+                        i == 0,
+                        gain,
+                        (unsigned int) rate,
+                        (uint64_t) msec * 1000000,
+                        csv);
+
+                if (r == -EBUSY) {
+                    ok = false;
+                } else if (r < 0) {
+                    fprintf(stderr, "Benchmark failed: %s\n", strerror(-r));
+
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    r = mixbench_traffic(&nallocs);
+
+    if (r < 0) {
+        fprintf(stderr, "Traffic check failed: %s\n", strerror(-r));
+
+        return EXIT_FAILURE;
+    }
+
+#ifdef MIXBENCH_COUNT_ALLOCS
+    if (!csv) {
+        printf( "Steady state command traffic: %u allocations\n",
+                (unsigned int) nallocs);
+    }
+
+    if (nallocs > 0) {
+        fprintf(stderr, "Command traffic allocated in steady state\n");
+        ok = false;
+    }
+#else
+    fprintf(stderr, "Allocations were not counted in this build\n");
+#endif
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void mixbench_usage(void)
+{
+    fprintf(stderr, "Usage: mixbench [-c] [-q] [-r RATE] [-t MSEC]\n");
+}
+
+static int mixbench_sweep(
+        size_t period,
+        bool looping,
+        const struct mixbench_gain *gain,
+        unsigned int rate,
+        uint64_t min_ns,
+        bool csv)
+{
+    struct mixbench_point points[lengthof(mixbench_nvoices)];
+    const char *mode;
+    double max_voices;
+    size_t nleaky;
+    size_t i;
+    int r;
+
+    mode = looping ? "looping" : "one-shot";
+    nleaky = 0;
+
+    for (i = 0 ; i < lengthof(points) ; i++) {
+        points[i].nvoices = mixbench_nvoices[i];
+        r = mixbench_measure(
+                period,
+                points[i].nvoices,
+                looping,
+                gain->value,
+                min_ns,
+                &points[i].ns_per_block);
+
+        if (r < 0 && r != -EBUSY) {
+            return r;
+        }
+
+        if (r == -EBUSY) {
+            nleaky++;
+        }
+    }
+
+    /*  The time it takes to mix a period has to fit in the period */
+
+    max_voices = mixbench_max_voices(
+            points,
+            lengthof(points),
+            period * 1e9 / rate);
+
+    for (i = 0 ; i < lengthof(points) ; i++) {
+        if (csv) {
+            printf( "%s,%s,%u,%u,%.1f,%.4f,%.0f\n",
+                    mode,
+                    gain->name,
+                    (unsigned int) period,
+                    (unsigned int) points[i].nvoices,
+                    points[i].ns_per_block,
+                    points[i].ns_per_block / period / points[i].nvoices,
+                    max_voices);
+        } else {
+            printf( "%-8s %-5s %6u %6u %12.1f %14.4f\n",
+                    mode,
+                    gain->name,
+                    (unsigned int) period,
+                    (unsigned int) points[i].nvoices,
+                    points[i].ns_per_block,
+                    points[i].ns_per_block / period / points[i].nvoices);
+        }
+    }
+
+    if (!csv) {
+        printf( "%-8s %-5s %6u max %.0f voices per period at %u Hz\n\n",
+                mode,
+                gain->name,
+                (unsigned int) period,
+                max_voices,
+                rate);
+    }
+
+    fflush(stdout);
+
+    if (nleaky > 0) {
+        fprintf(stderr,
+                "The mixer allocated while being timed, %s %s at %u\n",
+                mode,
+                gain->name,
+                (unsigned int) period);
+
+        return -EBUSY;
+    }
+
+    return 0;
+}
+
+static int mixbench_measure(
+        size_t period,
+        size_t nvoices,
+        bool looping,
+        uint16_t gain,
+        uint64_t min_ns,
+        double *ns_per_block)
+{
+    struct mixbench_run run;
+    uint64_t nblocks;
+    uint64_t t_total;
+    uint64_t t;
+    size_t nallocs;
+    int r;
+
+    r = mixbench_run_init(&run, period, nvoices, looping, gain);
+
+    if (r < 0) {
+        goto end;
+    }
+
+    /*  One segment to warm the caches and let the mixer settle, then as
+        many as it takes. Restarting the voices between segments is not
+        timed. */
+
+    mixbench_run_segment(&run);
+    nallocs = mixbench_nallocs;
+    nblocks = 0;
+    t_total = 0;
+
+    while (t_total < min_ns) {
+        t = mixbench_now();
+        mixbench_run_segment(&run);
+        t_total += mixbench_now() - t;
+        nblocks += run.nblocks;
+    }
+
+    *ns_per_block = (double) t_total / nblocks;
+    r = mixbench_nallocs == nallocs ? 0 : -EBUSY;
+
+end:
+    mixbench_run_fini(&run);
+
+    return r;
+}
+
+static int mixbench_run_init(
+        struct mixbench_run *run,
+        size_t period,
+        size_t nvoices,
+        bool looping,
+        uint16_t gain)
+{
+    size_t nframes;
+    size_t i;
+    int r;
+
+    assert(nvoices <= MIXBENCH_MAX_VOICES);
+
+    memset(run, 0, sizeof(*run));
+    run->period = period;
+    run->nvoices = nvoices;
+    run->looping = looping;
+    run->nblocks = (48000 + period - 1) / period;
+    nframes = looping ? MIXBENCH_LOOP_NFRAMES : run->nblocks * period;
+
+    r = snd_mixer_alloc(&run->mixer, period, 2, SND_FORMAT_S16);
+
+    if (r < 0) {
+        return r;
+    }
+
+    r = snd_mixer_configure(run->mixer, period, 1);
+
+    if (r < 0) {
+        return r;
+    }
+
+    run->out = malloc(snd_mixer_block_size(run->mixer));
+
+    if (run->out == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0 ; i < MIXBENCH_NSOUNDS ; i++) {
+        r = snd_buffer_alloc(&run->sounds[i], nframes * 2);
+
+        if (r < 0) {
+            return r;
+        }
+
+        mixbench_fill(run->sounds[i], (uint32_t) i + 1);
+    }
+
+    for (i = 0 ; i < nvoices ; i++) {
+        r = snd_stream_alloc(
+                &run->voices[i],
+                run->sounds[i % MIXBENCH_NSOUNDS]);
+
+        if (r < 0) {
+            return r;
+        }
+
+        snd_stream_set_looping(run->voices[i], looping);
+        snd_stream_set_volume(run->voices[i], 0, gain);
+        snd_stream_set_volume(run->voices[i], 1, gain);
+    }
+
+    return 0;
+}
+
+static void mixbench_run_fini(struct mixbench_run *run)
+{
+    size_t i;
+
+    /*  Stop everything first, since the mixer's list runs through them */
+
+    for (i = 0 ; i < run->nvoices ; i++) {
+        if (run->voices[i] != NULL) {
+            snd_mixer_stop(run->mixer, run->voices[i]);
+            snd_stream_free(run->voices[i]);
+        }
+    }
+
+    for (i = 0 ; i < MIXBENCH_NSOUNDS ; i++) {
+        snd_buffer_free(run->sounds[i]);
+    }
+
+    free(run->out);
+    snd_mixer_free(run->mixer);
+}
+
+static void mixbench_run_segment(struct mixbench_run *run)
+{
+    size_t i;
+
+    /*  One-shot voices have just finished and dropped off the mixer, and
+        looping ones go back to the start, so every segment is the same. */
+
+    for (i = 0 ; i < run->nvoices ; i++) {
+        snd_mixer_play(run->mixer, run->voices[i]);
+    }
+
+    for (i = 0 ; i < run->nblocks ; i++) {
+        snd_mixer_render(run->mixer, 1);
+        snd_mixer_pop(run->mixer, run->out);
+    }
+}
+
+static double mixbench_max_voices(
+        const struct mixbench_point *points,
+        size_t npoints,
+        double budget_ns)
+{
+    const struct mixbench_point *a;
+    const struct mixbench_point *b;
+    double slope;
+    size_t i;
+
+    assert(npoints >= 2);
+
+    if (points[0].ns_per_block > budget_ns) {
+        return 0;
+    }
+
+    /*  Interpolate between the points either side of the budget, or carry
+        on from the last two if even the most voices fit. */
+
+    for (i = 1 ; i < npoints - 1 ; i++) {
+        if (points[i].ns_per_block > budget_ns) {
+            break;
+        }
+    }
+
+    a = &points[i - 1];
+    b = &points[i];
+    slope = (b->ns_per_block - a->ns_per_block)
+            / (double) (b->nvoices - a->nvoices);
+
+    if (slope <= 0) {
+        return (double) b->nvoices;
+    }
+
+    return (double) (size_t) (
+            a->nvoices + (budget_ns - a->ns_per_block) / slope);
+}
+
+static int mixbench_traffic(size_t *nallocs)
+{
+    struct snd_client *clients[MIXBENCH_TRAFFIC_NVOICES];
+    struct snd_stream *voices[MIXBENCH_TRAFFIC_NVOICES];
+    struct snd_service *svc;
+    struct snd_mixer *mixer;
+    struct snd_buffer *sound;
+    struct snd_command *cmd;
+    size_t nallocs_start;
+    void *out;
+    size_t cycle;
+    size_t i;
+    int r;
+
+    /*  Play, stop and volume changes from one client per voice, as each
+        sound buffer has, with the mixer doing its part in between. */
+
+    memset(clients, 0, sizeof(clients));
+    memset(voices, 0, sizeof(voices));
+    svc = NULL;
+    mixer = NULL;
+    sound = NULL;
+    out = NULL;
+    nallocs_start = 0;
+
+    r = snd_service_alloc(&svc);
+
+    if (r < 0) {
+        goto end;
+    }
+
+    r = snd_mixer_alloc(&mixer, MIXBENCH_TRAFFIC_PERIOD, 2, SND_FORMAT_S16);
+
+    if (r < 0) {
+        goto end;
+    }
+
+    r = snd_mixer_configure(mixer, MIXBENCH_TRAFFIC_PERIOD, 1);
+
+    if (r < 0) {
+        goto end;
+    }
+
+    r = snd_buffer_alloc(&sound, MIXBENCH_LOOP_NFRAMES * 2);
+
+    if (r < 0) {
+        goto end;
+    }
+
+    mixbench_fill(sound, 1);
+    out = malloc(snd_mixer_block_size(mixer));
+
+    if (out == NULL) {
+        r = -ENOMEM;
+
+        goto end;
+    }
+
+    for (i = 0 ; i < lengthof(voices) ; i++) {
+        r = snd_client_alloc(&clients[i], svc);
+
+        if (r < 0) {
+            goto end;
+        }
+
+        r = snd_stream_alloc(&voices[i], sound);
+
+        if (r < 0) {
+            goto end;
+        }
+    }
+
+    for (   cycle = 0 ;
+            cycle < MIXBENCH_TRAFFIC_NWARMUP + MIXBENCH_TRAFFIC_NCYCLES ;
+            cycle++) {
+        if (cycle == MIXBENCH_TRAFFIC_NWARMUP) {
+            nallocs_start = mixbench_nallocs;
+        }
+
+        for (i = 0 ; i < lengthof(voices) ; i++) {
+            r = snd_client_cmd_alloc(clients[i], &cmd);
+
+            if (r < 0) {
+                goto end;
+            }
+
+            snd_command_set_volume(
+                    cmd,
+                    voices[i],
+                    cycle % 2,
+                    (uint16_t) ((cycle * 7) & 0xff));
+            snd_client_cmd_submit(clients[i], cmd);
+
+            if ((cycle + i) % 8 != 0) {
+                continue;
+            }
+
+            r = snd_client_cmd_alloc(clients[i], &cmd);
+
+            if (r < 0) {
+                goto end;
+            }
+
+            if ((cycle + i) % 16 == 0) {
+                snd_command_play(cmd, voices[i], true);
+            } else {
+                snd_command_stop(cmd, voices[i]);
+            }
+
+            snd_client_cmd_submit(clients[i], cmd);
+        }
+
+        snd_service_intake(svc, mixer);
+        snd_mixer_render(mixer, 1);
+        snd_mixer_pop(mixer, out);
+        snd_service_exhaust(svc);
+    }
+
+    *nallocs = mixbench_nallocs - nallocs_start;
+
+end:
+    for (i = 0 ; i < lengthof(voices) ; i++) {
+        if (voices[i] != NULL) {
+            snd_mixer_stop(mixer, voices[i]);
+            snd_stream_free(voices[i]);
+        }
+
+        snd_client_free(clients[i]);
+    }
+
+    free(out);
+    snd_buffer_free(sound);
+    snd_mixer_free(mixer);
+    snd_service_free(svc);
+
+    return r;
+}
+
+static void mixbench_fill(struct snd_buffer *buf, uint32_t seed)
+{
+    int16_t *samples;
+    size_t nsamples;
+    uint32_t x;
+    size_t i;
+
+    /*  Noise, so that nothing can take a short cut on silence */
+
+    samples = snd_buffer_samples_rw(buf);
+    nsamples = snd_buffer_nsamples(buf);
+    x = seed * 2654435761u;
+
+    for (i = 0 ; i < nsamples ; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        samples[i] = (int16_t) (x >> 16) / 4;
+    }
+}
+
+static uint64_t mixbench_now(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+
+    QueryPerformanceCounter(&now);
+
+    return (uint64_t) (now.QuadPart * (1e9 / freq.QuadPart));
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+/*  The linker sends the whole program's allocations through here, core
+    library included, when it is asked to wrap them. */
+
+#ifdef MIXBENCH_COUNT_ALLOCS
+void *__real_malloc(size_t nbytes);
+void *__real_calloc(size_t n, size_t nbytes);
+void *__real_realloc(void *ptr, size_t nbytes);
+
+void *__wrap_malloc(size_t nbytes)
+{
+    mixbench_nallocs++;
+
+    return __real_malloc(nbytes);
+}
+
+void *__wrap_calloc(size_t n, size_t nbytes)
+{
+    mixbench_nallocs++;
+
+    return __real_calloc(n, nbytes);
+}
+
+void *__wrap_realloc(void *ptr, size_t nbytes)
+{
+    mixbench_nallocs++;
+
+    return __real_realloc(ptr, nbytes);
+}
+#endif